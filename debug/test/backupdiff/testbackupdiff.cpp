@@ -0,0 +1,1064 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    testbackupdiff.cpp
+//		Purpose: Test diffing routines for backup store files
+//		Created: 12/1/04
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Test.h"
+#include "BackupClientCryptoKeys.h"
+#include "BackupStoreFile.h"
+#include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFilenameClear.h"
+#include "FileStream.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
+#include "BackupStoreFileCryptVar.h"
+#include "BackupStoreException.h"
+#include "CollectInBufferStream.h"
+#include "ContentDefinedChunker.h"
+#include "MemoryMappedFile.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+using namespace BackupStoreFileCryptVar;
+
+
+// from another file
+void create_test_files();
+
+bool files_identical(const char *file1, const char *file2)
+{
+	FileStream f1(file1);
+	FileStream f2(file2);
+	
+	if(f1.BytesLeftToRead() != f2.BytesLeftToRead())
+	{
+		return false;
+	}
+	
+	while(f1.StreamDataLeft())
+	{
+		char buffer1[2048];
+		char buffer2[2048];
+		int s = f1.Read(buffer1, sizeof(buffer1));
+		if(f2.Read(buffer2, s) != s)
+		{
+			return false;
+		}
+		if(::memcmp(buffer1, buffer2, s) != 0)
+		{
+			return false;
+		}
+	}
+	
+	if(f2.StreamDataLeft())
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+bool make_file_of_zeros(const char *filename, size_t size)
+{
+	#ifdef WIN32
+	HANDLE handle = openfile(filename, O_WRONLY | O_CREAT | O_EXCL, 0);
+	TEST_THAT(handle != INVALID_HANDLE_VALUE);
+	TEST_THAT(SetFilePointer(handle, size, NULL, FILE_BEGIN)
+		!= INVALID_SET_FILE_POINTER);
+	TEST_THAT(GetLastError() == NO_ERROR);
+	BOOL result = SetEndOfFile(handle);
+	if (result != TRUE)
+	{
+		BOX_ERROR("Failed to create large file " << filename <<
+			" (" << (size >> 20) << " MB): " <<
+			GetErrorMessage(GetLastError()));
+	}
+	TEST_THAT(result == TRUE);
+	TEST_THAT(CloseHandle(handle) == TRUE);
+	#else
+	int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) perror(filename);
+	TEST_THAT(fd >= 0);
+	TEST_THAT(ftruncate(fd, size) == 0);
+	TEST_THAT(close(fd) == 0);
+	#endif
+
+	bool correct_size = ((size_t)TestGetFileSize(filename) == size);
+	TEST_THAT(correct_size);
+	if (!correct_size)
+	{
+		BOX_ERROR("Failed to create large file " << filename <<
+			" (" << (size >> 20) << " MB): " <<
+			"got " << (TestGetFileSize(filename) >> 20) <<
+			" MB instead");
+	}
+	return correct_size;
+}
+
+
+void check_encoded_file(const char *filename, int64_t OtherFileID, int new_blocks_expected, int old_blocks_expected)
+{
+	FileStream enc(filename);
+	
+	// Use the interface verify routine
+	int64_t otherIDFromFile = 0;
+	TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(enc, &otherIDFromFile));
+	TEST_THAT(otherIDFromFile == OtherFileID);
+	
+	// Now do our own reading
+	enc.Seek(0, IOStream::SeekType_Absolute);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	// Read in header to check magic value is as expected
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	TEST_THAT(hdr.mMagicValue == (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1));
+	TEST_THAT((uint64_t)box_ntoh64(hdr.mOtherFileID) == (uint64_t)OtherFileID);
+	// number of blocks
+	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
+	BOX_TRACE("Reading index from '" << filename << "', has " <<
+		nblocks << " blocks");
+	BOX_TRACE("======== ===== ========== ======== ========");
+	BOX_TRACE("   Index Where  EncSz/Idx     Size  WChcksm");
+	// Read them all in
+	int64_t nnew = 0, nold = 0;
+	for(int64_t b = 0; b < nblocks; ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		int64_t s = box_ntoh64(en.mEncodedSize);
+
+		// Decode the rest
+		uint64_t iv = box_ntoh64(hdr.mEntryIVBase);
+		iv += b;
+		sBlowfishDecryptBlockEntry.SetIV(&iv);
+		file_BlockIndexEntryEnc entryEnc;
+		sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc,
+			sizeof(entryEnc), en.mEnEnc, sizeof(en.mEnEnc));
+
+
+		if(s > 0)
+		{
+			nnew++;
+			BOX_TRACE(std::setw(8) << b << " this  s=" << 
+				std::setw(8) << s << " " <<
+				std::setw(8) << ntohl(entryEnc.mSize) << " " <<
+				std::setw(8) << std::setfill('0') <<
+				std::hex << ntohl(entryEnc.mWeakChecksum));
+		}
+		else
+		{
+			nold++;
+			BOX_TRACE(std::setw(8) << b << " other i=" << 
+				std::setw(8) << (0-s) << " " <<
+				std::setw(8) << ntohl(entryEnc.mSize) << " " <<
+				std::setw(8) << std::setfill('0') <<
+				std::hex << ntohl(entryEnc.mWeakChecksum));
+		}
+	}
+	BOX_TRACE("======== ===== ========== ======== ========");
+	TEST_THAT(new_blocks_expected == nnew);
+	TEST_THAT(old_blocks_expected == nold);
+}
+
+void test_diff(int from, int to, int new_blocks_expected, int old_blocks_expected, bool expect_completely_different = false)
+{
+	// First, get the block index of the thing it's comparing against
+	char from_encoded[256];
+	sprintf(from_encoded, "testfiles/f%d.encoded", from);
+	FileStream blockindex(from_encoded);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+
+	// make filenames
+	char from_orig[256];
+	sprintf(from_orig, "testfiles/f%d", from);
+	char to_encoded[256];
+	sprintf(to_encoded, "testfiles/f%d.encoded", to);
+	char to_diff[256];
+	sprintf(to_diff, "testfiles/f%d.diff", to);
+	char to_orig[256];
+	sprintf(to_orig, "testfiles/f%d", to);
+	char rev_diff[256];
+	sprintf(rev_diff, "testfiles/f%d.revdiff", to);
+	char from_rebuild[256];
+	sprintf(from_rebuild, "testfiles/f%d.rebuilt", to);
+	char from_rebuild_dec[256];
+	sprintf(from_rebuild_dec, "testfiles/f%d.rebuilt_dec", to);
+	
+	// Then call the encode varient for diffing files
+	bool completelyDifferent = !expect_completely_different;	// oposite of what we want
+	{
+		BackupStoreFilenameClear f1name("filename");
+		FileStream out(to_diff, O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff(
+				to_orig, 
+				1 /* dir ID */, 
+				f1name,
+				1000 + from /* object ID of the file diffing from */, 
+				blockindex, 
+				IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0, 
+				&completelyDifferent));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_THAT(completelyDifferent == expect_completely_different);
+	
+	// Test that the number of blocks in the file match what's expected
+	check_encoded_file(to_diff, expect_completely_different?(0):(1000 + from), new_blocks_expected, old_blocks_expected);
+
+	// filename
+	char to_testdec[256];
+	sprintf(to_testdec, "testfiles/f%d.testdec", to);
+	
+	if(!completelyDifferent)
+	{
+		// Then produce a combined file
+		{
+			FileStream diff(to_diff);
+			FileStream diff2(to_diff);
+			FileStream from(from_encoded);
+			FileStream out(to_encoded, O_WRONLY | O_CREAT | O_EXCL);
+			BackupStoreFile::CombineFile(diff, diff2, from, out);
+		}
+		
+		// And check it
+		check_encoded_file(to_encoded, 0, new_blocks_expected + old_blocks_expected, 0);
+	}
+	else
+	{
+#ifdef WIN32
+		// Emulate the above stage!
+		char src[256], dst[256];
+		sprintf(src, "testfiles\\f%d.diff", to);
+		sprintf(dst, "testfiles\\f%d.encoded", to);
+		TEST_THAT(CopyFile(src, dst, FALSE) != 0)
+#else
+		// Emulate the above stage!
+		char cmd[256];
+		sprintf(cmd, "cp testfiles/f%d.diff testfiles/f%d.encoded", to, to);
+		::system(cmd);
+#endif
+	}
+
+	// Decode it
+	{
+		FileStream enc(to_encoded);
+		BackupStoreFile::DecodeFile(enc, to_testdec, IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(to_orig, to_testdec));
+	}
+	
+	// Then do some comparisons against the block index
+	{
+		FileStream index(to_encoded);
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex(to_orig, index, IOStream::TimeOutInfinite) == true);
+	}
+	{
+		char from_orig[256];
+		sprintf(from_orig, "testfiles/f%d", from);
+		FileStream index(to_encoded);
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex(from_orig, index, IOStream::TimeOutInfinite) == files_identical(from_orig, to_orig));
+	}
+	
+	// Check that combined index creation works as expected
+	{
+		// Load a combined index into memory
+		FileStream diff(to_diff);
+		FileStream from(from_encoded);
+		std::auto_ptr<IOStream> indexCmbStr(BackupStoreFile::CombineFileIndices(diff, from));
+		CollectInBufferStream indexCmb;
+		indexCmbStr->CopyStreamTo(indexCmb);
+		// Then check that it's as expected!
+		FileStream result(to_encoded);
+		BackupStoreFile::MoveStreamPositionToBlockIndex(result);
+		CollectInBufferStream index;
+		result.CopyStreamTo(index);
+		TEST_THAT(indexCmb.GetSize() == index.GetSize());
+		TEST_THAT(::memcmp(indexCmb.GetBuffer(), index.GetBuffer(), index.GetSize()) == 0);
+	}
+	
+	// Check that reverse delta can be made, and that it decodes OK
+	{
+		// Create reverse delta
+		{
+			bool reversedCompletelyDifferent = !completelyDifferent;
+			FileStream diff(to_diff);
+			FileStream from(from_encoded);
+			FileStream from2(from_encoded);
+			FileStream reversed(rev_diff, O_WRONLY | O_CREAT);
+			BackupStoreFile::ReverseDiffFile(diff, from, from2, reversed, to, &reversedCompletelyDifferent);
+			TEST_THAT(reversedCompletelyDifferent == completelyDifferent);
+		}
+		// Use it to combine a file
+		{
+			FileStream diff(rev_diff);
+			FileStream diff2(rev_diff);
+			FileStream from(to_encoded);
+			FileStream out(from_rebuild, O_WRONLY | O_CREAT | O_EXCL);
+			BackupStoreFile::CombineFile(diff, diff2, from, out);
+		}
+		// And then confirm that this file is actually the one we want
+		{
+			FileStream enc(from_rebuild);
+			BackupStoreFile::DecodeFile(enc, from_rebuild_dec, IOStream::TimeOutInfinite);
+			TEST_THAT(files_identical(from_orig, from_rebuild_dec));
+		}
+		// Do some extra checking
+		{
+			TEST_THAT(files_identical(from_rebuild, from_encoded));
+		}
+	}
+}
+
+void test_combined_diff(int version1, int version2, int serial)
+{
+	char combined_file[256];
+	char last_diff[256];
+	sprintf(last_diff, "testfiles/f%d.diff", version1 + 1);	// ie from version1 to version1 + 1
+
+	for(int v = version1 + 2; v <= version2; ++v)
+	{
+		FileStream diff1(last_diff);
+		char next_diff[256];
+		sprintf(next_diff, "testfiles/f%d.diff", v);
+		FileStream diff2(next_diff);
+		FileStream diff2b(next_diff);
+		sprintf(combined_file, "testfiles/comb%d_%d.cmbdiff", version1, v);
+		FileStream out(combined_file, O_WRONLY | O_CREAT);
+		BackupStoreFile::CombineDiffs(diff1, diff2, diff2b, out);
+		strcpy(last_diff, combined_file);
+	}
+
+	// Then do a combine on it, and check that it decodes to the right thing
+	char orig_enc[256];
+	sprintf(orig_enc, "testfiles/f%d.encoded", version1);	
+	char combined_out[256];
+	sprintf(combined_out, "testfiles/comb%d_%d.out", version1, version2);
+
+	{
+		FileStream diff(combined_file);
+		FileStream diff2(combined_file);
+		FileStream from(orig_enc);
+		FileStream out(combined_out, O_WRONLY | O_CREAT);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+
+	char combined_out_dec[256];
+	sprintf(combined_out_dec, "testfiles/comb%d_%d_s%d.dec", version1, version2, serial);
+	char to_orig[256];
+	sprintf(to_orig, "testfiles/f%d", version2);
+
+	{
+		FileStream enc(combined_out);
+		BackupStoreFile::DecodeFile(enc, combined_out_dec, IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(to_orig, combined_out_dec));
+	}
+
+}
+
+#define MAX_DIFF 9
+void test_combined_diffs()
+{
+	int serial = 0;
+
+	// Number of items to combine at once
+	for(int stages = 2; stages <= 4; ++stages)
+	{
+		// Offset to get complete coverage
+		for(int offset = 0; offset < stages; ++offset)
+		{
+			// And then actual end file number
+			for(int f = 0; f <= (MAX_DIFF - stages - offset); ++f)
+			{
+				// And finally, do something!
+				test_combined_diff(offset + f, offset + f + stages, ++serial);
+			}
+		}
+	}
+}
+
+void count_blocks_in_index(const char *filename, int64_t &rNew, int64_t &rOld)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
+	rNew = 0;
+	rOld = 0;
+	for(int64_t b = 0; b < nblocks; ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		if((int64_t)box_ntoh64(en.mEncodedSize) > 0)
+		{
+			rNew++;
+		}
+		else
+		{
+			rOld++;
+		}
+	}
+}
+
+void make_random_file(const char *filename, int size, uint32_t seed,
+	int insert_at = -1, int insert_size = 0)
+{
+	FileStream out(filename, O_WRONLY | O_CREAT | O_EXCL);
+	uint8_t *data = (uint8_t *)::malloc(size);
+	uint32_t r = seed;
+	for(int i = 0; i < size; ++i)
+	{
+		r = (r * 1103515245) + 12345;
+		data[i] = (uint8_t)(r >> 16);
+	}
+	if(insert_at < 0)
+	{
+		out.Write(data, size);
+	}
+	else
+	{
+		out.Write(data, insert_at);
+		uint8_t *extra = (uint8_t *)::malloc(insert_size);
+		::memset(extra, 0x5a, insert_size);
+		out.Write(extra, insert_size);
+		::free(extra);
+		out.Write(data + insert_at, size - insert_at);
+	}
+	::free(data);
+}
+
+// Cuts the file into chunks of the given average size, returning the size
+// and putting the sizes of the chunks in an index, and their data in a set
+int32_t cut_file(const char *filename, int32_t average,
+	std::vector<BackupStoreFileCreation::BlocksAvailableEntry> &rIndex,
+	std::set<std::string> *pChunks = NULL)
+{
+	rIndex.clear();
+	FileStream file(filename);
+	ContentDefinedChunker chunker(file, file.BytesLeftToRead(), average);
+	const uint8_t *data;
+	int32_t size;
+	while(chunker.NextChunk(data, size))
+	{
+		BackupStoreFileCreation::BlocksAvailableEntry entry = {};
+		entry.mSize = size;
+		rIndex.push_back(entry);
+		if(pChunks)
+		{
+			pChunks->insert(std::string((const char *)data, size));
+		}
+	}
+	return average;
+}
+
+void test_content_defined_chunking()
+{
+	// A file, and the same file with some data inserted near the start
+	make_random_file("testfiles/cdc.0", 1024*1024, 42);
+	make_random_file("testfiles/cdc.1", 1024*1024, 42, 3000, 77);
+
+	// Check the chunks cover the file, within the size limits
+	{
+		FileStream file("testfiles/cdc.0");
+		int32_t average = ContentDefinedChunker::AverageSizeForFile(
+			file.BytesLeftToRead());
+		TEST_EQUAL(4096, average);
+		ContentDefinedChunker chunker(file, file.BytesLeftToRead(),
+			average);
+		int64_t total = 0, chunks = 0;
+		bool all_same_size = true;
+		const uint8_t *data;
+		int32_t size, first_size = 0;
+		while(chunker.NextChunk(data, size))
+		{
+			TEST_THAT(data != 0);
+			TEST_THAT(size <= chunker.GetMaximumSize());
+			if(total + size < 1024*1024)
+			{
+				TEST_THAT(size >= chunker.GetMinimumSize());
+			}
+			if(chunks == 0)
+			{
+				first_size = size;
+			}
+			else if(size != first_size)
+			{
+				all_same_size = false;
+			}
+			total += size;
+			++chunks;
+		}
+		TEST_EQUAL(1024*1024, total);
+		TEST_THAT(!all_same_size);
+		// Around the average size
+		TEST_THAT(chunks > (1024*1024) / (average * 2));
+		TEST_THAT(chunks < (1024*1024) / (average / 2));
+	}
+
+	// Chunks found in a mapping of the file are the same as those read
+	// from it, starting part way through, and carrying on from the same
+	// place if the mapping stops working
+	if(MemoryMappedFile::IsSupported())
+	{
+		make_random_file("testfiles/cdc.mapped", 1024*1024, 42);
+		std::vector<int32_t> sizes[3];
+		for(int pass = 0; pass < 3; ++pass)
+		{
+			FileStream file("testfiles/cdc.mapped");
+			file.Seek(1000, IOStream::SeekType_Absolute);
+			MemoryMappedFile mapping(file, 64*1024);
+			TEST_THAT(mapping.IsMapped());
+			ContentDefinedChunker chunker(file, 1024*1024 - 1000,
+				4096, (pass == 0) ? 0 : &mapping);
+			const uint8_t *data;
+			int32_t size;
+			while(chunker.NextChunk(data, size))
+			{
+				TEST_THAT(data != 0);
+				sizes[pass].push_back(size);
+				if(pass == 2 && sizes[pass].size() == 20)
+				{
+					FileStream out("testfiles/cdc.mapped",
+						O_WRONLY | O_APPEND);
+					out.Write("x", 1);
+				}
+			}
+			TEST_EQUAL((pass != 2), mapping.IsMapped());
+		}
+		TEST_THAT(sizes[0] == sizes[1]);
+		TEST_THAT(sizes[0] == sizes[2]);
+	}
+
+	// The chunk size a previous version was cut with is found from its
+	// block sizes, whether it was cut by content or into fixed blocks
+	{
+		std::vector<BackupStoreFileCreation::BlocksAvailableEntry> index;
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeForDiff(
+			NULL, 0, 1024*1024));
+		TEST_EQUAL(4096, cut_file("testfiles/cdc.0", 4096, index));
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+		TEST_EQUAL(8192, cut_file("testfiles/cdc.0", 8192, index));
+		TEST_EQUAL(8192, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+
+		index.resize(100);
+		for(int b = 0; b < 100; ++b)
+		{
+			index[b].mSize = 16384;
+		}
+		index[99].mSize = 200;
+		TEST_EQUAL(16384, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+
+		// A new version keeps it, unless its size has changed a lot
+		TEST_EQUAL(16384, ContentDefinedChunker::AverageSizeForDiff(
+			&index[0], index.size(), 32*1024*1024));
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeForDiff(
+			&index[0], index.size(), 1024*1024));
+
+		// With only a few blocks, it's worked out from the size
+		index.resize(3);
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+	}
+
+	// So it's the same for each of several versions, after the first
+	// one grows past a block size boundary, and most of the chunks in
+	// each version are found in the one before
+	{
+		TEST_EQUAL(8192, ContentDefinedChunker::AverageSizeForFile(
+			16*1024*1024 + 100));
+		make_random_file("testfiles/cdc3.0", 16*1024*1024 - 1000, 7);
+		make_random_file("testfiles/cdc3.1", 16*1024*1024 - 1000, 7,
+			1024*1024, 2000);
+		{
+			FileStream in("testfiles/cdc3.1");
+			FileStream out("testfiles/cdc3.2",
+				O_WRONLY | O_CREAT | O_EXCL);
+			in.CopyStreamTo(out);
+			uint8_t extra[3000];
+			::memset(extra, 0xa5, sizeof(extra));
+			out.Write(extra, sizeof(extra));
+		}
+
+		std::vector<BackupStoreFileCreation::BlocksAvailableEntry>
+			index[3];
+		std::set<std::string> chunks[3];
+		TEST_EQUAL(4096, cut_file("testfiles/cdc3.0",
+			ContentDefinedChunker::AverageSizeForDiff(NULL, 0,
+				16*1024*1024 - 1000), index[0], &chunks[0]));
+		for(int v = 1; v < 3; ++v)
+		{
+			std::ostringstream filename;
+			filename << "testfiles/cdc3." << v;
+			int64_t size = 16*1024*1024 - 1000 + 2000;
+			if(v == 2) size += 3000;
+			TEST_EQUAL_LINE(4096, cut_file(filename.str().c_str(),
+				ContentDefinedChunker::AverageSizeForDiff(
+					&index[v - 1][0], index[v - 1].size(),
+					size), index[v], &chunks[v]),
+				"version " << v);
+
+			int found = 0;
+			for(std::set<std::string>::iterator
+				i = chunks[v].begin(); i != chunks[v].end(); ++i)
+			{
+				if(chunks[v - 1].count(*i)) found++;
+			}
+			TEST_LINE(found > (int)(chunks[v].size() * 99 / 100),
+				"version " << v << ": only " << found << " of " <<
+				chunks[v].size() << " chunks found");
+		}
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(true);
+
+	int64_t nnew, nold;
+	{
+		BackupStoreFilenameClear name("cdc.0");
+		FileStream out("testfiles/cdc.0.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("testfiles/cdc.0", 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+	count_blocks_in_index("testfiles/cdc.0.encoded", nnew, nold);
+	TEST_EQUAL(0, nold);
+	int64_t blocks_in_original = nnew;
+	{
+		FileStream enc("testfiles/cdc.0.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/cdc.0.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/cdc.0", "testfiles/cdc.0.testdec"));
+	}
+
+	// Diff the changed file. All but the chunk with the insertion, and
+	// perhaps its neighbours, should be found without a rolling search
+	{
+		FileStream blockindex("testfiles/cdc.0.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		BackupStoreFilenameClear name("cdc.1");
+		FileStream out("testfiles/cdc.1.diff", O_WRONLY | O_CREAT | O_EXCL);
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff("testfiles/cdc.1",
+				1 /* dir ID */, name, 3000 /* diffing from */,
+				blockindex, IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0, &completelyDifferent));
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	count_blocks_in_index("testfiles/cdc.1.diff", nnew, nold);
+	TEST_THAT(nnew >= 1 && nnew <= 3);
+	TEST_THAT(nold >= blocks_in_original - 3);
+	{
+		FileStream diff("testfiles/cdc.1.diff");
+		FileStream diff2("testfiles/cdc.1.diff");
+		FileStream from("testfiles/cdc.0.encoded");
+		FileStream out("testfiles/cdc.1.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	{
+		FileStream enc("testfiles/cdc.1.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/cdc.1.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/cdc.1", "testfiles/cdc.1.testdec"));
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(false);
+}
+
+int32_t get_block_index_magic(const char *filename)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	return ntohl(hdr.mMagicValue);
+}
+
+std::auto_ptr<IOStream> encode_diff(const char *to_orig,
+	const char *from_encoded, bool &rCompletelyDifferent)
+{
+	FileStream blockindex(from_encoded);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+	BackupStoreFilenameClear name("filename");
+	std::auto_ptr<IOStream> encoded(
+		BackupStoreFile::EncodeFileDiff(to_orig, 1 /* dir ID */, name,
+			4000 /* diffing from */, blockindex,
+			IOStream::TimeOutInfinite,
+			NULL, // DiffTimer interface
+			0, &rCompletelyDifferent));
+	return encoded;
+}
+
+void test_fast_block_checksums()
+{
+	BackupStoreFile::SetFastBlockChecksums(true);
+
+	// Diff against a file with an MD5 index. The blocks are found in the
+	// same way, but the new index has XXH3 checksums for all of them.
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f2",
+			"testfiles/f1.encoded", completelyDifferent));
+		FileStream out("testfiles/f2.xxh3.diff", O_WRONLY | O_CREAT | O_EXCL);
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.xxh3.diff"));
+	int64_t nnew, nold;
+	count_blocks_in_index("testfiles/f2.xxh3.diff", nnew, nold);
+	TEST_EQUAL(7, nnew);
+	TEST_EQUAL(32, nold);
+	{
+		FileStream diff("testfiles/f2.xxh3.diff");
+		FileStream diff2("testfiles/f2.xxh3.diff");
+		FileStream from("testfiles/f1.encoded");
+		FileStream out("testfiles/f2.xxh3.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.xxh3.encoded"));
+	{
+		FileStream enc("testfiles/f2.xxh3.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f2.xxh3.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f2", "testfiles/f2.xxh3.testdec"));
+	}
+	{
+		FileStream index("testfiles/f2.xxh3.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex("testfiles/f2", index, IOStream::TimeOutInfinite));
+	}
+
+	// The old version, rebuilt from a reverse diff, keeps its MD5 index
+	{
+		FileStream diff("testfiles/f2.xxh3.diff");
+		FileStream from("testfiles/f1.encoded");
+		FileStream from2("testfiles/f1.encoded");
+		FileStream reversed("testfiles/f2.xxh3.revdiff", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::ReverseDiffFile(diff, from, from2, reversed, 2);
+	}
+	{
+		FileStream diff("testfiles/f2.xxh3.revdiff");
+		FileStream diff2("testfiles/f2.xxh3.revdiff");
+		FileStream from("testfiles/f2.xxh3.encoded");
+		FileStream out("testfiles/f2.xxh3.rebuilt", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	TEST_THAT(files_identical("testfiles/f1.encoded", "testfiles/f2.xxh3.rebuilt"));
+
+	// Diff against the file with the XXH3 index
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f3",
+			"testfiles/f2.xxh3.encoded", completelyDifferent));
+		FileStream out("testfiles/f3.xxh3.diff", O_WRONLY | O_CREAT | O_EXCL);
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	count_blocks_in_index("testfiles/f3.xxh3.diff", nnew, nold);
+	TEST_EQUAL(1, nnew);
+	TEST_EQUAL(29, nold);
+	{
+		FileStream diff("testfiles/f3.xxh3.diff");
+		FileStream diff2("testfiles/f3.xxh3.diff");
+		FileStream from("testfiles/f2.xxh3.encoded");
+		FileStream out("testfiles/f3.xxh3.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	{
+		FileStream enc("testfiles/f3.xxh3.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f3.xxh3.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f3", "testfiles/f3.xxh3.testdec"));
+	}
+
+	// The checksums of reused blocks are calculated again from the data,
+	// so the upload must fail if it's no longer what was diffed.
+	{
+		FileStream copy("testfiles/f2.changing", O_WRONLY | O_CREAT | O_EXCL);
+		FileStream orig("testfiles/f2");
+		orig.CopyStreamTo(copy);
+	}
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f2.changing",
+			"testfiles/f1.encoded", completelyDifferent));
+		TEST_THAT(!completelyDifferent);
+
+		// Overwrite the data in place, keeping the same size
+		int64_t size = 0;
+		TEST_THAT(FileExists("testfiles/f2.changing", &size));
+		uint8_t *data = (uint8_t *)::malloc(size);
+		::memset(data, 0xa5, size);
+		{
+			FileStream rewrite("testfiles/f2.changing", O_WRONLY);
+			rewrite.Write(data, size);
+		}
+		::free(data);
+
+		CollectInBufferStream out;
+		TEST_CHECK_THROWS(encoded->CopyStreamTo(out),
+			BackupStoreException, SourceFileChangedWhileEncoding);
+	}
+
+	BackupStoreFile::SetFastBlockChecksums(false);
+}
+
+int test(int argc, const char *argv[])
+{
+	// Want to trace out all the details
+	#ifndef BOX_RELEASE_BUILD
+	#ifndef WIN32
+	BackupStoreFile::TraceDetailsOfDiffProcess = true;
+	#endif
+	#endif
+
+	// Create all the test files
+	create_test_files();
+
+	// Setup the crypto
+	BackupClientCryptoKeys_Setup("testfiles/backup.keys");	
+
+	// Encode the first file
+	{
+		BackupStoreFilenameClear f0name("f0");
+		FileStream out("testfiles/f0.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("testfiles/f0", 1 /* dir ID */, f0name));
+		encoded->CopyStreamTo(out);
+		out.Close();
+		check_encoded_file("testfiles/f0.encoded", 0, 33, 0);
+	}
+	
+	// Check the "seek to index" code
+	{
+		FileStream enc("testfiles/f0.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+		// Read in header to check magic value is as expected
+		file_BlockIndexHeader hdr;
+		TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+		TEST_THAT(hdr.mMagicValue == (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1));
+	}
+
+	// Diff some files -- parameters are from number, to number,
+	// then the number of new blocks expected, and the number of old blocks expected.
+	
+	// Diff the original file to a copy of itself, and check that there is no data in the file
+	// This checks that the hash table is constructed properly, because two of the blocks share
+	// the same weak checksum.
+	test_diff(0, 1, 0, 33);
+
+	// Insert some new data
+	// Blocks from old file moved whole, but put in different order
+	test_diff(1, 2, 7, 32);
+
+	// Delete some data, but not on block boundaries
+	test_diff(2, 3, 1, 29);
+
+	// Add a very small amount of data, not on block boundary
+	// delete a little data
+	test_diff(3, 4, 3, 25);
+
+	// Files are mapped into memory where possible. Check that reading
+	// them instead, as is done when they can't be, gives the same results.
+	MemoryMappedFile::SetEnabled(false);
+
+	// Encode the new blocks of the rest with several threads, which
+	// work ahead of the block being sent
+	BackupStoreFile::SetEncodingThreads(3);
+
+	// 1 byte insertion between two blocks
+	test_diff(4, 5, 1, 28);
+
+	// a file with some new content at the very beginning
+	// NOTE: You might expect the last numbers to be 2, 29, but the small 1 byte block isn't searched for
+	test_diff(5, 6, 3, 28);
+
+	MemoryMappedFile::SetEnabled(true);
+
+	// Split the files into small segments, searched by several threads
+	BackupStoreFile::SetDiffingThreads(4, 16*1024);
+	
+	// some new content at the very end
+	// NOTE: 1 byte block deleted, so number aren't what you'd initial expect.
+	test_diff(6, 7, 2, 30);
+	
+	// a completely different file, with no blocks matching.
+	test_diff(7, 8, 14, 0, true /* completely different expected */);
+	
+	// diff to zero sized file
+	test_diff(8, 9, 0, 0, true /* completely different expected */);
+
+	BackupStoreFile::SetDiffingThreads(1);
+	BackupStoreFile::SetEncodingThreads(1);
+	
+	// Test that combining diffs works
+	test_combined_diffs();
+	
+	// Check zero sized file works OK to encode on its own, using normal encoding
+	{
+		{
+			// Encode
+			BackupStoreFilenameClear fn("filename");
+			FileStream out("testfiles/f9.zerotest", O_WRONLY | O_CREAT | O_EXCL);
+			std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("testfiles/f9", 1 /* dir ID */, fn));
+			encoded->CopyStreamTo(out);
+			out.Close();
+			check_encoded_file("testfiles/f9.zerotest", 0, 0, 0);		
+		}
+		{
+			// Decode
+			FileStream enc("testfiles/f9.zerotest");
+			BackupStoreFile::DecodeFile(enc, "testfiles/f9.testdec.zero", IOStream::TimeOutInfinite);
+			TEST_THAT(files_identical("testfiles/f9", "testfiles/f9.testdec.zero"));
+		}
+	}
+	
+#ifndef WIN32	
+	// Check that symlinks aren't diffed
+	TEST_THAT(::symlink("f2", "testfiles/f2.symlink") == 0)
+	// And go and diff it against the previous encoded file
+	{
+		bool completelyDifferent = false;
+		{
+			FileStream blockindex("testfiles/f1.encoded");
+			BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+			
+			BackupStoreFilenameClear f1name("filename");
+			FileStream out("testfiles/f2.symlink.diff", O_WRONLY | O_CREAT | O_EXCL);
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFileDiff(
+					"testfiles/f2.symlink", 
+					1 /* dir ID */, 
+					f1name,
+					1001 /* object ID of the file diffing from */, 
+					blockindex, 
+					IOStream::TimeOutInfinite,
+					NULL, // DiffTimer interface
+					0, 
+					&completelyDifferent));
+			encoded->CopyStreamTo(out);
+		}
+		TEST_THAT(completelyDifferent == true);
+		check_encoded_file("testfiles/f2.symlink.diff", 0, 0, 0);		
+	}
+#endif
+
+	// Check that diffing against a file which isn't "complete" and 
+	// references another isn't allowed
+	{
+		FileStream blockindex("testfiles/f1.diff");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		
+		BackupStoreFilenameClear f1name("filename");
+		FileStream out("testfiles/f2.testincomplete", O_WRONLY | O_CREAT | O_EXCL);
+		TEST_CHECK_THROWS(BackupStoreFile::EncodeFileDiff("testfiles/f2", 1 /* dir ID */, f1name,
+			1001 /* object ID of the file diffing from */, blockindex, IOStream::TimeOutInfinite,
+			0, 0), BackupStoreException, CannotDiffAnIncompleteStoreFile);
+	}
+
+	// Cut files into blocks by content, and diff them
+	test_content_defined_chunking();
+
+	// Write block indexes with XXH3 checksums, and diff between formats
+	test_fast_block_checksums();
+
+	// Found a nasty case where files of lots of the same thing 
+	// suck up lots of processor time -- because of lots of matches 
+	// found. Check this out!
+
+	#ifdef WIN32
+	BOX_WARNING("Testing diffing two large streams, may take a while!");
+	::fflush(stderr);
+	#endif
+
+	if (!make_file_of_zeros("testfiles/zero.0", 20*1024*1024))
+	{
+		return 1;
+	}
+
+	if (!make_file_of_zeros("testfiles/zero.1", 200*1024*1024))
+	{
+		remove("testfiles/zero.0");
+		return 1;
+	}
+
+	// Generate a first encoded file
+	{
+		BackupStoreFilenameClear f0name("zero.0");
+		FileStream out("testfiles/zero.0.enc", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("testfiles/zero.0", 1 /* dir ID */, f0name));
+		encoded->CopyStreamTo(out);
+	}
+	// Then diff from it -- time how long it takes...
+	{
+		int beginTime = time(0);
+		FileStream blockindex("testfiles/zero.0.enc");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+
+		BackupStoreFilenameClear f1name("zero.1");
+		FileStream out("testfiles/zero.1.enc", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFileDiff("testfiles/zero.1", 1 /* dir ID */, f1name,
+			2000 /* object ID of the file diffing from */, blockindex, IOStream::TimeOutInfinite,
+			0, 0));
+		encoded->CopyStreamTo(out);
+
+		printf("Time taken: %d seconds\n", (int)(time(0) - beginTime));
+
+		#ifdef WIN32
+		TEST_THAT(time(0) < (beginTime + 300));
+		#else
+		TEST_THAT(time(0) < (beginTime + 40));
+		#endif
+	}
+	// Remove zero-files to save disk space
+	remove("testfiles/zero.0");
+	remove("testfiles/zero.1");
+
+#if 0
+	// Code for a nasty real world example! (16Mb files, won't include them in the distribution
+	// for obvious reasons...)
+	// Generate a first encoded file
+	{
+		BackupStoreFilenameClear f0name("0000000000000000.old");
+		FileStream out("testfiles/0000000000000000.enc.0", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("/Users/ben/Desktop/0000000000000000.old", 1 /* dir ID */, f0name));
+		encoded->CopyStreamTo(out);
+	}
+	// Then diff from it -- time how long it takes...
+	{
+		int beginTime = time(0);
+		FileStream blockindex("testfiles/0000000000000000.enc.0");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+
+		BackupStoreFilenameClear f1name("0000000000000000.new");
+		FileStream out("testfiles/0000000000000000.enc.1", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFileDiff("/Users/ben/Desktop/0000000000000000.new", 1 /* dir ID */, f1name,
+			2000 /* object ID of the file diffing from */, blockindex, IOStream::TimeOutInfinite,
+			0, 0));
+		encoded->CopyStreamTo(out);
+		TEST_THAT(time(0) < (beginTime + 20));
+	}
+#endif // 0
+
+	return 0;
+}
+
+
@@ -103,6 +103,24 @@ esac
 
 AC_CHECK_HEADER([zlib.h],, [AC_MSG_ERROR([[cannot find zlib.h]])])
 AC_CHECK_LIB([z], [zlibVersion],, [AC_MSG_ERROR([[cannot find zlib]])])
+
+## Optional compression libraries, which can be chosen for new file data
+AC_CHECK_HEADER([zstd.h], [have_zstd=yes], [have_zstd=no])
+if test "$have_zstd" = "yes"; then
+  AC_SEARCH_LIBS([ZSTD_compressCCtx], [zstd],, [have_zstd=no])
+fi
+if test "$have_zstd" = "yes"; then
+  AC_DEFINE([HAVE_ZSTD], [1], [Define to 1 if zstd compression is available])
+fi
+
+AC_CHECK_HEADER([lz4.h], [have_lz4=yes], [have_lz4=no])
+if test "$have_lz4" = "yes"; then
+  AC_SEARCH_LIBS([LZ4_compress_default], [lz4],, [have_lz4=no])
+fi
+if test "$have_lz4" = "yes"; then
+  AC_DEFINE([HAVE_LZ4], [1], [Define to 1 if LZ4 compression is available])
+fi
+
 VL_LIB_READLINE([have_libreadline=yes], [have_libreadline=no])
 AC_CHECK_FUNCS([rl_filename_completion_function])
 
@@ -153,6 +171,12 @@ AC_CHECK_HEADERS([syslog.h time.h unistd.h])
 AC_CHECK_HEADERS([netinet/in.h netinet/tcp.h])
 AC_CHECK_HEADERS([sys/file.h sys/param.h sys/poll.h sys/socket.h sys/stat.h sys/time.h])
 AC_CHECK_HEADERS([sys/types.h sys/uio.h sys/un.h sys/wait.h sys/xattr.h])
+AC_CHECK_HEADERS([sys/mman.h sys/resource.h sys/inotify.h])
+AC_CHECK_HEADERS([pthread.h], [have_pthread_h=yes])
+
+if test "$have_pthread_h" = "yes"; then
+  AC_SEARCH_LIBS([pthread_create], [pthread])
+fi
 AC_CHECK_HEADERS([sys/ucred.h],,, [
 	#ifdef HAVE_SYS_PARAM_H
 	#	include <sys/param.h>
@@ -298,6 +322,8 @@ AC_TYPE_SIGNAL
 AC_FUNC_STAT
 AC_CHECK_FUNCS([ftruncate getpeereid getpeername getpid gettimeofday lchown])
 AC_CHECK_FUNCS([setproctitle utimensat])
+AC_CHECK_FUNCS([mmap madvise posix_fadvise])
+AC_CHECK_FUNCS([statx])
 AC_SEARCH_LIBS([setproctitle], [bsd])
 
 # NetBSD implements kqueue too differently for us to get it fixed by 0.10
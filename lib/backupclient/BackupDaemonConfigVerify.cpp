@@ -26,6 +26,10 @@ static const ConfigurationVerifyKey backuplocationkeys[] =
 	ConfigurationVerifyKey("AlwaysIncludeFilesRegex", ConfigTest_MultiValueAllowed),
 	ConfigurationVerifyKey("AlwaysIncludeDir", ConfigTest_MultiValueAllowed),
 	ConfigurationVerifyKey("AlwaysIncludeDirsRegex", ConfigTest_MultiValueAllowed),
+	ConfigurationVerifyKey("Compression", 0, "zlib"),
+	// zlib, zstd or lz4, if this build supports them
+	ConfigurationVerifyKey("CompressionLevel", ConfigTest_IsInt, 0),
+	// zstd level, or 0 for the default
 	ConfigurationVerifyKey("Path", ConfigTest_Exists | ConfigTest_LastEntry)
 };
 
@@ -100,6 +104,13 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 	// of seconds to wait before trying again if not
 
 	ConfigurationVerifyKey("MaximumDiffingTime", ConfigTest_IsInt),
+	ConfigurationVerifyKey("DiffingThreads", ConfigTest_IsInt, 1),
+	ConfigurationVerifyKey("EncodingThreads", ConfigTest_IsInt, 1),
+	ConfigurationVerifyKey("DirectoryScanThreads", ConfigTest_IsInt, 1),
+	ConfigurationVerifyKey("UploadConnections", ConfigTest_IsInt, 1),
+	ConfigurationVerifyKey("ChangeJournal", ConfigTest_IsBool, false),
+	ConfigurationVerifyKey("ContentDefinedChunking", ConfigTest_IsBool, false),
+	ConfigurationVerifyKey("BlockIndexCache", ConfigTest_IsBool, false),
 	ConfigurationVerifyKey("DeleteRedundantLocationsAfter",
 		ConfigTest_IsInt, 172800),
 
@@ -187,7 +187,7 @@ void BackupStoreFile::DumpFile(void *clibFileHandle, bool ToTrace, IOStream &rFi
 	// Read in header
 	file_BlockIndexHeader bhdr;
 	rFile.ReadFullBuffer(&bhdr, sizeof(bhdr), 0);
-	if(bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(bhdr.mMagicValue))
 		&& bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0))
 	{
 		OutputLine(file, ToTrace, "WARNING: Block header doesn't have the correct magic\n");
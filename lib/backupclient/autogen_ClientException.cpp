@@ -0,0 +1,35 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+#include "autogen_ClientException.h"
+
+#include "MemLeakFindOn.h"
+
+unsigned int ClientException::GetType() const throw()
+{
+	return ClientException::ExceptionType;
+}
+
+unsigned int ClientException::GetSubType() const throw()
+{
+	return mSubType;
+}
+
+const char * ClientException::what() const throw()
+{
+	return mWhat.c_str();
+}
+
+const char * ClientException::GetMessage(int SubType)
+{
+	switch(SubType)
+	{
+		case Internal: return "Internal";
+		case AssertFailed: return "AssertFailed";
+		case ClockWentBackwards: return "ClockWentBackwards";
+		case FailedToDeleteStoreObjectInfoFile: return "FailedToDeleteStoreObjectInfoFile";
+		case CorruptStoreObjectInfoFile: return "CorruptStoreObjectInfoFile";
+		default: return "Unknown";
+	}
+}
@@ -119,8 +119,11 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 {
 	CHECK_PHASE(Phase_Version)
 
-	// Correct version?
-	if(mVersion != BACKUP_STORE_SERVER_VERSION)
+	// Correct version? Clients which ask for the later version may
+	// upload block indexes in either format, which are both understood
+	// here anyway.
+	if(mVersion != BACKUP_STORE_SERVER_VERSION &&
+		mVersion != BACKUP_STORE_SERVER_VERSION_XXH3)
 	{
 		return PROTOCOL_ERROR(Err_WrongVersion);
 	}
@@ -128,8 +131,8 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 	// Mark the next phase
 	rContext.SetPhase(BackupStoreContext::Phase_Login);
 
-	// Return our version
-	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(BACKUP_STORE_SERVER_VERSION));
+	// Return the version the client asked for
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(mVersion));
 }
 
 // --------------------------------------------------------------------------
@@ -162,8 +165,14 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolLogin::DoCommand(BackupProtoc
 		return PROTOCOL_ERROR(Err_BadLogin);
 	}
 
+	// Helper sessions only stage files, which the writer session adds,
+	// so they don't need the lock
+	if((mFlags & Flags_Helper) == Flags_Helper)
+	{
+		rContext.SetHelperSession();
+	}
 	// If we need to write, check that nothing else has got a write lock
-	if((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
+	else if((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
 	{
 		// See if the context will get the lock
 		if(!rContext.AttemptToGetWriteLock())
@@ -197,8 +206,9 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolLogin::DoCommand(BackupProtoc
 	BOX_NOTICE("Login from Client ID " <<
 		BOX_FORMAT_ACCOUNT(mClientID) << " "
 		"(name=" << rContext.GetAccountName() << "): " <<
-		(((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
-			?"Read/Write":"Read-only") << " from " <<
+		(rContext.SessionIsHelper() ? "Helper" :
+			(!rContext.SessionIsReadOnly() ? "Read/Write" : "Read-only")) <<
+		" from " <<
 		rContext.GetConnectionDetails());
 
 	// Get the usage info for reporting to the client
@@ -306,6 +316,69 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolStoreFile::DoCommand(
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolStageFile::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to keep an encoded file on the server for the
+//			 writer session, which may be on another connection,
+//			 to store with StoreStagedFile
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolStageFile::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext,
+	IOStream& rDataStream) const
+{
+	CHECK_PHASE(Phase_Commands)
+	if(rContext.SessionIsReadOnly() && !rContext.SessionIsHelper())
+	{
+		BOX_ERROR("Received command " << ToString() << " "
+			"in a read-only session");
+		return PROTOCOL_ERROR(Err_SessionReadOnly);
+	}
+
+	std::auto_ptr<BackupProtocolMessage> hookResult =
+		rContext.StartCommandHook(*this);
+	if(hookResult.get())
+	{
+		return hookResult;
+	}
+
+	int64_t id = rContext.StageFile(rDataStream);
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(id));
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolStoreStagedFile::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to store a file which was staged with
+//			 StageFile, as StoreFile does
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolStoreStagedFile::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext) const
+{
+	CHECK_PHASE(Phase_Commands)
+	CHECK_WRITEABLE_SESSION
+
+	std::auto_ptr<BackupProtocolMessage> hookResult =
+		rContext.StartCommandHook(*this);
+	if(hookResult.get())
+	{
+		return hookResult;
+	}
+
+	int64_t id = rContext.AddStagedFile(mStagedID, mDirectoryObjectID,
+		mModificationTime, mAttributesHash, mFilename);
+
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(id));
+}
+
+
 
 
 // --------------------------------------------------------------------------
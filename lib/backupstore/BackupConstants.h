@@ -16,6 +16,15 @@
 // Time to wait for retry after a backup error
 #define	BACKUP_ERROR_RETRY_SECONDS 100
 
+// Most bytes an account can have staged at once, by all its helper sessions,
+// for the writer session to store, unless it has less space left under its
+// hard limit
+#define	BACKUP_STORE_MAX_STAGED_BYTES	(1024*1024*1024)
+
+// How often a session staging a file counts what the others have staged,
+// which bounds how far they can go over the limit together
+#define	BACKUP_STORE_STAGED_BYTES_RECOUNT	(1024*1024)
+
 // Should the store daemon convert files to Raid immediately?
 #define	BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY	true
 
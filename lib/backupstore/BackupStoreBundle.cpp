@@ -0,0 +1,475 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreBundle.cpp
+//		Purpose: Bundles of small files packed into one store object
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "Archive.h"
+#include "BackupStoreBundle.h"
+#include "BackupStoreException.h"
+#include "BackupStoreObjectMagic.h"
+#include "RaidFileRead.h"
+#include "RaidFileWrite.h"
+#include "StoreStructure.h"
+
+#include "MemLeakFindOn.h"
+
+// Magic value at the start of the index file
+#define BUNDLE_INDEX_MAGIC_VALUE	0x626E6978
+
+// Sizes of the parts of the table at the start of a bundle
+#define BUNDLE_HEADER_SIZE			(sizeof(int32_t) + sizeof(int64_t))
+#define BUNDLE_MEMBER_ENTRY_SIZE	(4 * sizeof(int64_t))
+
+// Sanity limit on the number of members in a bundle
+#define BUNDLE_MAX_MEMBERS			(1024*1024)
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::BackupStoreBundleIndex(
+//			 const std::string &, int)
+//		Purpose: Constructor. The index is empty until loaded.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupStoreBundleIndex::BackupStoreBundleIndex(const std::string &rAccountRoot,
+	int DiscSet)
+: mAccountRoot(rAccountRoot),
+  mDiscSet(DiscSet),
+  mGeneration(0),
+  mModified(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::~BackupStoreBundleIndex()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupStoreBundleIndex::~BackupStoreBundleIndex()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Load()
+//		Purpose: Reads the index from disc, replacing the contents.
+//			 An account without one has no bundled files.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::Load()
+{
+	std::auto_ptr<RaidFileRead> file;
+	int64_t generation = ReadGeneration(file);
+	ReadMembers(file.get(), generation);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Refresh()
+//		Purpose: Loads the index again if it's been saved since it
+//			 was loaded, discarding any changes. Returns true if
+//			 it was loaded.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupStoreBundleIndex::Refresh()
+{
+	std::auto_ptr<RaidFileRead> file;
+	int64_t generation = ReadGeneration(file);
+	if(generation == mGeneration)
+	{
+		return false;
+	}
+
+	ReadMembers(file.get(), generation);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::ReadGeneration(
+//			 std::auto_ptr<RaidFileRead> &)
+//		Purpose: Private. Opens the index file, and reads its header,
+//			 returning its generation number, or zero if there
+//			 isn't one.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreBundleIndex::ReadGeneration(
+	std::auto_ptr<RaidFileRead> &rapFile) const
+{
+	std::string filename(mAccountRoot + BUNDLE_INDEX_FILENAME);
+	if(!RaidFileRead::FileExists(mDiscSet, filename))
+	{
+		return 0;
+	}
+
+	rapFile = RaidFileRead::Open(mDiscSet, filename);
+
+	int32_t magic;
+	if(!rapFile->ReadFullBuffer(&magic, sizeof(magic), 0) ||
+		ntohl(magic) != BUNDLE_INDEX_MAGIC_VALUE)
+	{
+		THROW_FILE_ERROR("Bad magic number in bundle index",
+			filename, BackupStoreException, BundleFormatIncorrect);
+	}
+
+	Archive archive(*rapFile, IOStream::TimeOutInfinite);
+	int64_t generation;
+	archive.Read(generation);
+	return generation;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::ReadMembers(RaidFileRead *,
+//			 int64_t)
+//		Purpose: Private. Reads the rest of the index file after its
+//			 header, replacing the contents. The file may be null
+//			 if there isn't one.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::ReadMembers(RaidFileRead *pFile,
+	int64_t Generation)
+{
+	mMembers.clear();
+	mGeneration = Generation;
+	mModified = false;
+
+	if(pFile == 0)
+	{
+		return;
+	}
+
+	Archive archive(*pFile, IOStream::TimeOutInfinite);
+	int64_t count;
+	archive.Read(count);
+	for(int64_t i = 0; i < count; ++i)
+	{
+		int64_t objectID;
+		Member member;
+		archive.Read(objectID);
+		archive.Read(member.mBundleID);
+		archive.Read(member.mOffset);
+		archive.Read(member.mLength);
+		archive.Read(member.mSizeInBlocks);
+		mMembers[objectID] = member;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Save()
+//		Purpose: Writes the index to disc, if it's been changed,
+//			 with the next generation number. It's kept once
+//			 nothing is bundled, so that the numbers aren't
+//			 reused while readers remember an older one.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::Save()
+{
+	if(!mModified)
+	{
+		return;
+	}
+
+	std::string filename(mAccountRoot + BUNDLE_INDEX_FILENAME);
+	RaidFileWrite file(mDiscSet, filename);
+	file.Open(true /* allow overwriting */);
+
+	int32_t magic = htonl(BUNDLE_INDEX_MAGIC_VALUE);
+	file.Write(&magic, sizeof(magic));
+	Archive archive(file, IOStream::TimeOutInfinite);
+	archive.Write(mGeneration + 1);
+	archive.Write((int64_t)mMembers.size());
+	for(Members_t::const_iterator i(mMembers.begin());
+		i != mMembers.end(); ++i)
+	{
+		archive.Write(i->first);
+		archive.Write(i->second.mBundleID);
+		archive.Write(i->second.mOffset);
+		archive.Write(i->second.mLength);
+		archive.Write(i->second.mSizeInBlocks);
+	}
+
+	file.Commit(true /* convert to raid now */);
+	++mGeneration;
+	mModified = false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Find(int64_t)
+//		Purpose: Returns where a file is bundled, or null if it isn't
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const BackupStoreBundleIndex::Member *BackupStoreBundleIndex::Find(
+	int64_t ObjectID) const
+{
+	Members_t::const_iterator i(mMembers.find(ObjectID));
+	return (i == mMembers.end()) ? 0 : &(i->second);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Add(int64_t, const Member &)
+//		Purpose: Records that a file is in a bundle
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::Add(int64_t ObjectID, const Member &rMember)
+{
+	mMembers[ObjectID] = rMember;
+	mModified = true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::Remove(int64_t)
+//		Purpose: Forgets a bundled file, whose data stays in the
+//			 bundle until the bundle is compacted
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::Remove(int64_t ObjectID)
+{
+	if(mMembers.erase(ObjectID) > 0)
+	{
+		mModified = true;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::RemoveBundle(int64_t)
+//		Purpose: Forgets all the files in a bundle
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::RemoveBundle(int64_t BundleID)
+{
+	Members_t::iterator i(mMembers.begin());
+	while(i != mMembers.end())
+	{
+		if(i->second.mBundleID == BundleID)
+		{
+			mMembers.erase(i++);
+			mModified = true;
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::OpenMember(int64_t)
+//		Purpose: Returns a seekable stream of a bundled file's data,
+//			 which is the same as its object would have held
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStoreBundleIndex::OpenMember(
+	int64_t ObjectID) const
+{
+	const Member *pmember = Find(ObjectID);
+	if(pmember == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, ObjectDoesNotExist)
+	}
+
+	std::string bundleFilename;
+	StoreStructure::MakeObjectFilename(pmember->mBundleID, mAccountRoot,
+		mDiscSet, bundleFilename, false);
+	std::auto_ptr<RaidFileRead> bundle(RaidFileRead::Open(mDiscSet,
+		bundleFilename));
+	bundle->Seek(pmember->mOffset, IOStream::SeekType_Absolute);
+
+	// Members are small, so just read it into memory
+	std::auto_ptr<CollectInBufferStream> data(new CollectInBufferStream);
+	char buffer[16*1024];
+	int64_t left = pmember->mLength;
+	while(left > 0)
+	{
+		int bytes = (left > (int64_t)sizeof(buffer)) ? sizeof(buffer) :
+			(int)left;
+		if(!bundle->ReadFullBuffer(buffer, bytes, 0))
+		{
+			THROW_FILE_ERROR("Bundled object " <<
+				BOX_FORMAT_OBJECTID(ObjectID) << " is truncated",
+				bundleFilename, BackupStoreException,
+				BundleFormatIncorrect);
+		}
+		data->Write(buffer, bytes);
+		left -= bytes;
+	}
+	data->SetForReading();
+
+	return std::auto_ptr<IOStream>(data.release());
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleIndex::ReadBundleMembers(IOStream &,
+//			 int64_t, Members_t &)
+//		Purpose: Static. Reads the table of members from the start of
+//			 a bundle, adding all of them to the map, whether
+//			 they're still in use or not.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleIndex::ReadBundleMembers(IOStream &rBundle,
+	int64_t BundleID, Members_t &rMembersOut)
+{
+	int32_t magic;
+	if(!rBundle.ReadFullBuffer(&magic, sizeof(magic), 0) ||
+		ntohl(magic) != OBJECTMAGIC_BUNDLE_MAGIC_VALUE)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			BundleFormatIncorrect, "Bad magic number in bundle " <<
+			BOX_FORMAT_OBJECTID(BundleID));
+	}
+
+	Archive archive(rBundle, IOStream::TimeOutInfinite);
+	int64_t count;
+	archive.Read(count);
+	if(count <= 0 || count > BUNDLE_MAX_MEMBERS)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			BundleFormatIncorrect, "Bad number of members in "
+			"bundle " << BOX_FORMAT_OBJECTID(BundleID));
+	}
+
+	int64_t dataStart = BUNDLE_HEADER_SIZE +
+		(count * BUNDLE_MEMBER_ENTRY_SIZE);
+	for(int64_t i = 0; i < count; ++i)
+	{
+		int64_t objectID;
+		Member member;
+		member.mBundleID = BundleID;
+		archive.Read(objectID);
+		archive.Read(member.mOffset);
+		archive.Read(member.mLength);
+		archive.Read(member.mSizeInBlocks);
+		if(member.mOffset < dataStart || member.mLength <= 0)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException,
+				BundleFormatIncorrect, "Bad entry for " <<
+				BOX_FORMAT_OBJECTID(objectID) << " in bundle " <<
+				BOX_FORMAT_OBJECTID(BundleID));
+		}
+		rMembersOut[objectID] = member;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleWriter::BackupStoreBundleWriter()
+//		Purpose: Constructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupStoreBundleWriter::BackupStoreBundleWriter()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleWriter::Add(int64_t, IOStream &,
+//			 int64_t)
+//		Purpose: Adds the data of a file to the bundle being built,
+//			 and the size it took up as an object of its own
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreBundleWriter::Add(int64_t ObjectID, IOStream &rData,
+	int64_t SizeInBlocks)
+{
+	BackupStoreBundleIndex::Member member;
+	member.mBundleID = 0;
+	member.mOffset = mData.GetSize();
+	rData.CopyStreamTo(mData);
+	member.mLength = mData.GetSize() - member.mOffset;
+	member.mSizeInBlocks = SizeInBlocks;
+
+	mObjectIDs.push_back(ObjectID);
+	mMembers.push_back(member);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreBundleWriter::Write(const std::string &,
+//			 int, int64_t, BackupStoreBundleIndex &)
+//		Purpose: Writes the bundle as an object with the given ID,
+//			 and adds its members to the index, which the caller
+//			 must save. Returns the disc space used, in blocks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreBundleWriter::Write(const std::string &rFilename,
+	int DiscSet, int64_t BundleID, BackupStoreBundleIndex &rIndex)
+{
+	ASSERT(!mObjectIDs.empty());
+	int64_t dataStart = BUNDLE_HEADER_SIZE +
+		(mObjectIDs.size() * BUNDLE_MEMBER_ENTRY_SIZE);
+
+	RaidFileWrite file(DiscSet, rFilename);
+	file.Open(false /* no overwriting */);
+
+	int32_t magic = htonl(OBJECTMAGIC_BUNDLE_MAGIC_VALUE);
+	file.Write(&magic, sizeof(magic));
+	Archive archive(file, IOStream::TimeOutInfinite);
+	archive.Write((int64_t)mObjectIDs.size());
+	for(size_t i = 0; i < mObjectIDs.size(); ++i)
+	{
+		archive.Write(mObjectIDs[i]);
+		archive.Write(dataStart + mMembers[i].mOffset);
+		archive.Write(mMembers[i].mLength);
+		archive.Write(mMembers[i].mSizeInBlocks);
+	}
+	ASSERT(file.GetPosition() == dataStart);
+	file.Write(mData.GetBuffer(), mData.GetSize());
+
+	int64_t blocks = file.GetDiscUsageInBlocks();
+	file.Commit(true /* convert to raid now */);
+
+	for(size_t i = 0; i < mObjectIDs.size(); ++i)
+	{
+		BackupStoreBundleIndex::Member member(mMembers[i]);
+		member.mBundleID = BundleID;
+		member.mOffset += dataStart;
+		rIndex.Add(mObjectIDs[i], member);
+	}
+
+	return blocks;
+}
@@ -0,0 +1,137 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreBundle.h
+//		Purpose: Bundles of small files packed into one store object
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREBUNDLE__H
+#define BACKUPSTOREBUNDLE__H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CollectInBufferStream.h"
+
+class IOStream;
+class RaidFileRead;
+
+// Name of the index of bundled files, in the account root
+#define BUNDLE_INDEX_FILENAME		"bundles"
+
+// Housekeeping starts a new bundle once one reaches this size
+#define BACKUPSTORE_BUNDLE_MAX_SIZE	(4*1024*1024)
+
+// A bundle is rewritten without its deleted members once less than this
+// percentage of it is still in use
+#define BACKUPSTORE_BUNDLE_MIN_PERCENT_USED	50
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreBundleIndex
+//		Purpose: Where the bundled files of an account are. Each
+//			 bundle is a store object holding the encoded data of
+//			 many small files, with a table of its members at the
+//			 start. This only saves the inodes and the unused
+//			 parts of the last blocks of the files which are
+//			 bundled: they're still uploaded, synced and written
+//			 one by one, and housekeeping then writes them again
+//			 into bundles. Bundled files keep their object IDs and
+//			 directory entries, but have no object of their own,
+//			 so the index is checked when an object isn't found.
+//			 Only housekeeping, holding the write lock, changes
+//			 bundles; the index says which members are still in
+//			 use, and the tables in the bundles are only needed
+//			 to rebuild it. Readers don't hold the lock, so each
+//			 save gets a new generation number, which tells them
+//			 when to load the index again.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupStoreBundleIndex
+{
+public:
+	BackupStoreBundleIndex(const std::string &rAccountRoot, int DiscSet);
+	~BackupStoreBundleIndex();
+private:
+	// no copying
+	BackupStoreBundleIndex(const BackupStoreBundleIndex &);
+	BackupStoreBundleIndex &operator=(const BackupStoreBundleIndex &);
+public:
+
+	class Member
+	{
+	public:
+		int64_t mBundleID;
+		int64_t mOffset;		// in the bundle object
+		int64_t mLength;
+		int64_t mSizeInBlocks;	// as a separate object
+	};
+	typedef std::map<int64_t, Member> Members_t;	// by object ID
+
+	void Load();
+	void Save();
+	bool Refresh();
+	bool IsModified() const {return mModified;}
+
+	const Member *Find(int64_t ObjectID) const;
+	void Add(int64_t ObjectID, const Member &rMember);
+	void Remove(int64_t ObjectID);
+	void RemoveBundle(int64_t BundleID);
+	const Members_t &GetMembers() const {return mMembers;}
+
+	std::auto_ptr<IOStream> OpenMember(int64_t ObjectID) const;
+
+	static void ReadBundleMembers(IOStream &rBundle, int64_t BundleID,
+		Members_t &rMembersOut);
+
+private:
+	int64_t ReadGeneration(std::auto_ptr<RaidFileRead> &rapFile) const;
+	void ReadMembers(RaidFileRead *pFile, int64_t Generation);
+
+	std::string mAccountRoot;
+	int mDiscSet;
+	Members_t mMembers;
+	int64_t mGeneration;	// of the index on disc when loaded
+	bool mModified;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreBundleWriter
+//		Purpose: Collects the data of small files in memory, and then
+//			 writes them out as a new bundle object
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupStoreBundleWriter
+{
+public:
+	BackupStoreBundleWriter();
+private:
+	// no copying
+	BackupStoreBundleWriter(const BackupStoreBundleWriter &);
+	BackupStoreBundleWriter &operator=(const BackupStoreBundleWriter &);
+public:
+
+	void Add(int64_t ObjectID, IOStream &rData, int64_t SizeInBlocks);
+	int64_t GetSize() const {return mData.GetSize();}
+	size_t GetNumMembers() const {return mObjectIDs.size();}
+	const std::vector<int64_t> &GetObjectIDs() const {return mObjectIDs;}
+
+	int64_t Write(const std::string &rFilename, int DiscSet,
+		int64_t BundleID, BackupStoreBundleIndex &rIndex);
+
+private:
+	CollectInBufferStream mData;
+	std::vector<int64_t> mObjectIDs;
+	std::vector<BackupStoreBundleIndex::Member> mMembers;
+};
+
+#endif // BACKUPSTOREBUNDLE__H
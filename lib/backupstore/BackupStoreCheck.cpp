@@ -18,6 +18,7 @@
 
 #include "autogen_BackupStoreException.h"
 #include "BackupStoreAccountDatabase.h"
+#include "BackupStoreBundle.h"
 #include "BackupStoreCheck.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
@@ -53,6 +54,7 @@ BackupStoreCheck::BackupStoreCheck(const std::string &rStoreRoot, int DiscSetNum
 	  mLastIDInInfo(0),
 	  mpInfoLastBlock(0),
 	  mInfoLastBlockEntries(0),
+	  mNextBundledID(0),
 	  mLostDirNameSerial(0),
 	  mLostAndFoundDirectoryID(0),
 	  mBlocksUsed(0),
@@ -170,6 +172,7 @@ void BackupStoreCheck::Check()
 	{
 		BOX_INFO("Phase 6, regenerate store info...");
 	}
+	CheckBundles();
 	WriteNewStoreInfo();
 
 	try
@@ -310,11 +313,18 @@ void BackupStoreCheck::CheckObjects()
 			BOX_FORMAT_OBJECTID(maxDir));
 	}
 
+	// Bundled files have no objects of their own, so are checked as
+	// the scan reaches their IDs
+	LoadBundleIndex();
+
 	// Then go through and scan all the objects within those directories
 	for(int64_t d = 0; d <= maxDir; d += (1<<STORE_ID_SEGMENT_LENGTH))
 	{
 		CheckObjectsDir(d);
 	}
+
+	// And any bundled files after the last object
+	CheckBundledObjects(-1);
 }
 
 // --------------------------------------------------------------------------
@@ -455,9 +465,11 @@ void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
 		{
 			fileOK = false;
 		}
-		// info and refcount databases are OK in the root directory
+		// info, refcount databases and the bundle index are OK
+		// in the root directory
 		else if(*i == "info" || *i == "refcount.db" ||
-			*i == "refcount.rdb" || *i == "refcount.rdbX")
+			*i == "refcount.rdb" || *i == "refcount.rdbX" ||
+			*i == BUNDLE_INDEX_FILENAME)
 		{
 			fileOK = true;
 		}
@@ -524,9 +536,13 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 {
 	// Info on object...
 	bool isFile = true;
+	bool isBundle = false;
 	int64_t containerID = -1;
 	int64_t size = -1;
 
+	// Any files bundled with lower IDs must be added first
+	CheckBundledObjects(ObjectID);
+
 	try
 	{
 		// Open file
@@ -561,6 +577,14 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 			containerID = CheckDirInitial(ObjectID, *file);
 			break;
 
+		case OBJECTMAGIC_BUNDLE_MAGIC_VALUE:
+			// Not in any directory, so not added to the list. The
+			// files in it are checked through the bundle index.
+			isFile = false;
+			isBundle = true;
+			containerID = 0;
+			break;
+
 		default:
 			// Unknown signature. Bad file. Very bad file.
 			return false;
@@ -579,14 +603,32 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 		return false;
 	}
 
-	// Add to list of IDs known about
-	AddID(ObjectID, containerID, size, isFile);
+	if(isBundle)
+	{
+		mBundles.insert(ObjectID);
+		// Don't allocate its ID to anything else
+		mLastIDInInfo = ObjectID;
+	}
+	else
+	{
+		// Add to list of IDs known about
+		AddID(ObjectID, containerID, size, isFile);
 
-	// Add to usage counts
-	mBlocksUsed += size;
-	if(!isFile)
+		// Add to usage counts
+		mBlocksUsed += size;
+		if(!isFile)
+		{
+			mBlocksInDirectories += size;
+		}
+	}
+
+	// If housekeeping was interrupted after bundling this file, but
+	// before deleting it, the object of its own is used instead
+	if(mNextBundledID < mBundledIDs.size() &&
+		mBundledIDs[mNextBundledID] == ObjectID)
 	{
-		mBlocksInDirectories += size;
+		mapBundleIndex->Remove(ObjectID);
+		++mNextBundledID;
 	}
 
 	// If it looks like a good object, and it's non-RAID, and
@@ -695,6 +737,154 @@ int64_t BackupStoreCheck::CheckDirInitial(int64_t ObjectID, IOStream &rStream)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::LoadBundleIndex()
+//		Purpose: Load the index of bundled files, to check them in
+//			 order of ID with the objects found on disc
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::LoadBundleIndex()
+{
+	mapBundleIndex.reset(new BackupStoreBundleIndex(mStoreRoot,
+		mDiscSetNumber));
+
+	try
+	{
+		mapBundleIndex->Load();
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Bundle index is corrupt, files in bundles "
+			"will be lost" << (mFixErrors?", deleting it":"") <<
+			": " << e.what());
+		++mNumberErrorsFound;
+		mapBundleIndex.reset(new BackupStoreBundleIndex(mStoreRoot,
+			mDiscSetNumber));
+		if(mFixErrors)
+		{
+			RaidFileWrite del(mDiscSetNumber,
+				mStoreRoot + BUNDLE_INDEX_FILENAME);
+			del.Delete();
+		}
+	}
+
+	const BackupStoreBundleIndex::Members_t &members(
+		mapBundleIndex->GetMembers());
+	mBundledIDs.clear();
+	mBundledIDs.reserve(members.size());
+	for(BackupStoreBundleIndex::Members_t::const_iterator
+		i(members.begin()); i != members.end(); ++i)
+	{
+		mBundledIDs.push_back(i->first);
+	}
+	mNextBundledID = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckBundledObjects(int64_t)
+//		Purpose: Check the bundled files with IDs below the one
+//			 given, or all the rest if it's -1, and add the good
+//			 ones to the list as if they were objects on disc.
+//			 Bad ones are removed from the bundle index.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::CheckBundledObjects(int64_t BeforeID)
+{
+	while(mNextBundledID < mBundledIDs.size() &&
+		(BeforeID == -1 || mBundledIDs[mNextBundledID] < BeforeID))
+	{
+		int64_t ObjectID = mBundledIDs[mNextBundledID++];
+		const BackupStoreBundleIndex::Member *pmember =
+			mapBundleIndex->Find(ObjectID);
+		ASSERT(pmember != 0);
+
+		int64_t containerID = -1;
+		try
+		{
+			std::auto_ptr<IOStream> data(
+				mapBundleIndex->OpenMember(ObjectID));
+			containerID = CheckFile(ObjectID, *data);
+		}
+		catch(BoxException &e)
+		{
+			BOX_TRACE("Failed to read bundled file " <<
+				BOX_FORMAT_OBJECTID(ObjectID) << ": " <<
+				e.what());
+		}
+
+		if(containerID == -1)
+		{
+			BOX_ERROR("Corrupted file " <<
+				BOX_FORMAT_OBJECTID(ObjectID) << " found in "
+				"bundle " << BOX_FORMAT_OBJECTID(pmember->mBundleID) <<
+				(mFixErrors?", removing":""));
+			++mNumberErrorsFound;
+			mapBundleIndex->Remove(ObjectID);
+			continue;
+		}
+
+		AddID(ObjectID, containerID, pmember->mSizeInBlocks,
+			true /* is file */);
+		mBlocksUsed += pmember->mSizeInBlocks;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckBundles()
+//		Purpose: Delete bundles which no files are still in, and
+//			 save the bundle index without any bad files
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::CheckBundles()
+{
+	std::set<int64_t> used;
+	const BackupStoreBundleIndex::Members_t &members(
+		mapBundleIndex->GetMembers());
+	for(BackupStoreBundleIndex::Members_t::const_iterator
+		i(members.begin()); i != members.end(); ++i)
+	{
+		used.insert(i->second.mBundleID);
+	}
+
+	for(std::set<BackupStoreCheck_ID_t>::const_iterator
+		i(mBundles.begin()); i != mBundles.end(); ++i)
+	{
+		if(used.find(*i) != used.end())
+		{
+			continue;
+		}
+
+		BOX_ERROR("Unused bundle " << BOX_FORMAT_OBJECTID(*i) <<
+			" found" << (mFixErrors?", deleting":""));
+		++mNumberErrorsFound;
+		if(mFixErrors)
+		{
+			std::string filename;
+			StoreStructure::MakeObjectFilename(*i, mStoreRoot,
+				mDiscSetNumber, filename, false);
+			RaidFileWrite del(mDiscSetNumber, filename);
+			del.Delete();
+		}
+	}
+
+	if(mFixErrors)
+	{
+		mapBundleIndex->Save();
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -19,6 +19,7 @@
 #include "BackupStoreDirectory.h"
 
 class IOStream;
+class BackupStoreBundleIndex;
 class BackupStoreFilename;
 class BackupStoreRefCountDatabase;
 
@@ -47,6 +48,8 @@ The following problems can be fixed:
 		- patches depending on non-existent objects are deleted
 	* Bad store info and refcount files regenerated
 	* Bad sizes of files in directories fixed
+	* Corrupt or unattached bundled files removed from the bundle index,
+	  and bundles with no files still in use deleted
 
 */
 
@@ -134,6 +137,9 @@ private:
 	void CountDirectoryEntries(BackupStoreDirectory& dir);
 	int64_t CheckFile(int64_t ObjectID, IOStream &rStream);
 	int64_t CheckDirInitial(int64_t ObjectID, IOStream &rStream);
+	void LoadBundleIndex();
+	void CheckBundledObjects(int64_t BeforeID);
+	void CheckBundles();
 
 	// Fixing functions
 	bool TryToRecreateDirectory(int64_t MissingDirectoryID);
@@ -200,6 +206,12 @@ private:
 
 	// The refcount database, being reconstructed as the check/fix progresses
 	std::auto_ptr<BackupStoreRefCountDatabase> mapNewRefs;
+
+	// Files packed into bundles, checked in order with the other objects
+	std::auto_ptr<BackupStoreBundleIndex> mapBundleIndex;
+	std::vector<BackupStoreCheck_ID_t> mBundledIDs;
+	size_t mNextBundledID;
+	std::set<BackupStoreCheck_ID_t> mBundles;
 	
 	// Misc stuff
 	int32_t mLostDirNameSerial;
@@ -13,6 +13,7 @@
 #include <string.h>
 
 #include "autogen_BackupStoreException.h"
+#include "BackupStoreBundle.h"
 #include "BackupStoreCheck.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
@@ -157,6 +158,16 @@ void BackupStoreCheck::CheckUnattachedObjects()
 				}
 				else
 				{
+					// Bundled files are only made from files which
+					// were in directories, and can't be put back
+					if(mapBundleIndex->Find(ObjectID) != 0)
+					{
+						BOX_WARNING("Object " << BOX_FORMAT_OBJECTID(ObjectID) << " is unattached, and is bundled. Removing it from the bundle index.");
+						mapBundleIndex->Remove(ObjectID);
+						mBlocksUsed -= pblock->mObjectSizeInBlocks[e];
+						continue;
+					}
+
 					// File. Only attempt to attach it somewhere if it isn't a patch
 					{
 						int64_t diffFromObjectID = 0;
@@ -38,6 +38,8 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 		ConfigTest_Exists | ConfigTest_IsInt),
 	ConfigurationVerifyKey("ExtendedLogging", ConfigTest_IsBool, false),
 	// make value "yes" to enable in config file
+	ConfigurationVerifyKey("MaxBundledFileSize", ConfigTest_IsInt, 0),
+	// in bytes, zero to not bundle small files
 	ConfigurationVerifyKey("RaidFileConf", ConfigTest_LastEntry)
 };
 
@@ -14,9 +14,25 @@
 
 #define BACKUP_STORE_SERVER_VERSION		1
 
+// Servers which accept this version also accept block indexes with XXH3
+// strong checksums. Clients ask for it first, and fall back to the
+// original version if the server refuses it.
+#define BACKUP_STORE_SERVER_VERSION_XXH3	2
+
 // Minimum size for a chunk to be compressed
 #define BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE	256
 
+// Chunks are only compressed if the bytes sampled from them have less
+// entropy than this, in bits per byte. The estimate is only made for chunks
+// with at least the minimum number of bytes to sample, up to the maximum.
+#define BACKUP_FILE_INCOMPRESSIBLE_ENTROPY		7.8
+#define BACKUP_FILE_ENTROPY_MIN_SAMPLES			1024
+#define BACKUP_FILE_ENTROPY_MAX_SAMPLES			4096
+
+// Stop trying to compress a file after this many chunks in a row wouldn't
+// compress
+#define BACKUP_FILE_INCOMPRESSIBLE_CHUNK_LIMIT	16
+
 // min and max sizes for blocks
 #define BACKUP_FILE_MIN_BLOCK_SIZE				4096
 #define BACKUP_FILE_MAX_BLOCK_SIZE				(512*1024)
@@ -40,5 +56,31 @@
 // This is a multiple of the number of blocks in the diff from file.
 #define BACKUP_FILE_DIFF_MAX_BLOCK_FIND_MULTIPLE	4096
 
+// Files are only split into segments to be searched by separate threads
+// if each segment would be at least this big
+#define BACKUP_FILE_DIFF_MIN_SEGMENT_SIZE		(64*1024*1024)
+
+// With content defined chunking, only do rsync scans for block sizes used
+// by at least 1/this of the blocks in the original index
+#define BACKUP_FILE_DIFF_CDC_SCAN_SHARE			16
+
+// The average chunk size a previous version was cut with is only worked out
+// from its block sizes if it has at least this many blocks
+#define BACKUP_FILE_CDC_MIN_BLOCKS_FOR_AVERAGE	16
+
+// Files which can't be mapped are only read ahead in another thread while
+// finding content defined chunk boundaries if they're at least this big
+#define BACKUP_FILE_CHUNKING_READ_AHEAD_MIN_SIZE	(4*1024*1024)
+
+// When blocks are encoded by several threads, each thread can have this
+// many blocks queued for it or waiting to be sent, as long as the buffers
+// for them take no more than the maximum memory in total
+#define BACKUP_FILE_ENCODE_BLOCKS_PER_THREAD	2
+#define BACKUP_FILE_ENCODE_MAX_BUFFER_MEMORY	(64*1024*1024)
+
+// How often to check whether an upload should stop, while waiting for a
+// block to be encoded, in milliseconds
+#define BACKUP_FILE_ENCODE_POLL_INTERVAL		100
+
 #endif // BACKUPSTORECONSTANTS__H
 
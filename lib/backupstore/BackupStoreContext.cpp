@@ -9,9 +9,11 @@
 
 #include "Box.h"
 
+#include <errno.h>
 #include <stdio.h>
 
 #include "BackupConstants.h"
+#include "BackupStoreBundle.h"
 #include "BackupStoreContext.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreException.h"
@@ -23,8 +25,10 @@
 #include "FileStream.h"
 #include "InvisibleTempFileStream.h"
 #include "RaidFileController.h"
+#include "RaidFileException.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
+#include "Random.h"
 #include "StoreStructure.h"
 
 #include "MemLeakFindOn.h"
@@ -63,6 +67,8 @@ BackupStoreContext::BackupStoreContext(int32_t ClientID,
   mClientHasAccount(false),
   mStoreDiscSet(-1),
   mReadOnly(true),
+  mHelperSession(false),
+  mMaxStagedBytes(BACKUP_STORE_MAX_STAGED_BYTES),
   mSaveStoreInfoDelay(STORE_INFO_SAVE_DELAY),
   mpTestHook(NULL)
 // If you change the initialisers, be sure to update
@@ -130,6 +136,11 @@ void BackupStoreContext::ReceivedFinishCommand()
 	{
 		// Save the store info, not delayed
 		SaveStoreInfo(false);
+
+		// The client's helper sessions have finished by now, so
+		// anything they staged which wasn't stored never will be
+		StoreStructure::DeleteStagedFiles(mAccountRootDir,
+			mStoreDiscSet);
 	}
 
 	// Just in case someone wants to reuse a local protocol object,
@@ -140,10 +151,13 @@ void BackupStoreContext::ReceivedFinishCommand()
 	// mClientHasAccount, mAccountRootDir or mStoreDiscSet
 
 	mReadOnly = true;
+	mHelperSession = false;
+	mMaxStagedBytes = BACKUP_STORE_MAX_STAGED_BYTES;
 	mSaveStoreInfoDelay = STORE_INFO_SAVE_DELAY;
 	mpTestHook = NULL;
 	mapStoreInfo.reset();
 	mapRefCount.reset();
+	mapBundleIndex.reset();
 	ClearDirectoryCache();
 }
 
@@ -585,37 +599,52 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 				std::string oldVersionFilename;
 				MakeObjectFilename(DiffFromFileID, oldVersionFilename, false /* no need to make sure the directory it's in exists */);
 
-				// Reassemble that diff -- open previous file, and combine the patch and file
-				std::auto_ptr<RaidFileRead> from(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
-				BackupStoreFile::CombineFile(diff, diff2, *from, storeFile);
-
-				// Then... reverse the patch back (open the from file again, and create a write file to overwrite it)
-				std::auto_ptr<RaidFileRead> from2(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
-				ppreviousVerStoreFile = new RaidFileWrite(mStoreDiscSet, oldVersionFilename);
-				ppreviousVerStoreFile->Open(true /* allow overwriting */);
-				from->Seek(0, IOStream::SeekType_Absolute);
-				diff.Seek(0, IOStream::SeekType_Absolute);
-				BackupStoreFile::ReverseDiffFile(diff, *from, *from2, *ppreviousVerStoreFile,
-						DiffFromFileID, &reversedDiffIsCompletelyDifferent);
-
-				// Store disc space used
-				oldVersionNewBlocksUsed = ppreviousVerStoreFile->GetDiscUsageInBlocks();
-
-				// And make a space adjustment for the size calculation
-				spaceSavedByConversionToPatch =
-					from->GetDiscUsageInBlocks() - 
-					oldVersionNewBlocksUsed;
-
-				adjustment.mBlocksUsed -= spaceSavedByConversionToPatch;
-				// The code below will change the patch from a
-				// Current file to an Old file, so we need to
-				// account for it as a Current file here.
-				adjustment.mBlocksInCurrentFiles -=
-					spaceSavedByConversionToPatch;
-
-				// Don't adjust anything else here. We'll do it
-				// when we update the directory just below,
-				// which also accounts for non-diff replacements.
+				if(!RaidFileRead::FileExists(mStoreDiscSet, oldVersionFilename)
+					&& IsBundled(DiffFromFileID))
+				{
+					// The old version is in a bundle, which can't be
+					// rewritten, so combine the patch with it but
+					// leave it as it is, rather than reversing the
+					// patch over it.
+					std::auto_ptr<IOStream> from(
+						OpenBundledObject(DiffFromFileID));
+					BackupStoreFile::CombineFile(diff, diff2, *from, storeFile);
+					reversedDiffIsCompletelyDifferent = true;
+				}
+				else
+				{
+					// Reassemble that diff -- open previous file, and combine the patch and file
+					std::auto_ptr<RaidFileRead> from(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
+					BackupStoreFile::CombineFile(diff, diff2, *from, storeFile);
+
+					// Then... reverse the patch back (open the from file again, and create a write file to overwrite it)
+					std::auto_ptr<RaidFileRead> from2(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
+					ppreviousVerStoreFile = new RaidFileWrite(mStoreDiscSet, oldVersionFilename);
+					ppreviousVerStoreFile->Open(true /* allow overwriting */);
+					from->Seek(0, IOStream::SeekType_Absolute);
+					diff.Seek(0, IOStream::SeekType_Absolute);
+					BackupStoreFile::ReverseDiffFile(diff, *from, *from2, *ppreviousVerStoreFile,
+							DiffFromFileID, &reversedDiffIsCompletelyDifferent);
+
+					// Store disc space used
+					oldVersionNewBlocksUsed = ppreviousVerStoreFile->GetDiscUsageInBlocks();
+
+					// And make a space adjustment for the size calculation
+					spaceSavedByConversionToPatch =
+						from->GetDiscUsageInBlocks() - 
+						oldVersionNewBlocksUsed;
+
+					adjustment.mBlocksUsed -= spaceSavedByConversionToPatch;
+					// The code below will change the patch from a
+					// Current file to an Old file, so we need to
+					// account for it as a Current file here.
+					adjustment.mBlocksInCurrentFiles -=
+						spaceSavedByConversionToPatch;
+
+					// Don't adjust anything else here. We'll do it
+					// when we update the directory just below,
+					// which also accounts for non-diff replacements.
+				}
 
 				// Everything cleans up here...
 			}
@@ -688,9 +717,12 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 			poldEntry = dir.FindEntryByID(DiffFromFileID);
 			ASSERT(poldEntry != 0);
 
-			// Adjust size of old entry
-			int64_t oldSize = poldEntry->GetSizeInBlocks();
-			poldEntry->SetSizeInBlocks(oldVersionNewBlocksUsed);
+			// Adjust size of old entry, unless it was bundled and
+			// so left as it was
+			if(ppreviousVerStoreFile != 0)
+			{
+				poldEntry->SetSizeInBlocks(oldVersionNewBlocksUsed);
+			}
 		}
 
 		if(MarkFileWithSameNameAsOldVersions)
@@ -792,6 +824,182 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::StageFile(IOStream &)
+//		Purpose: Keep an encoded file sent by a helper session, for
+//			 the writer session to add with AddStagedFile.
+//			 Returns the staged ID, which is random so that
+//			 sessions don't need to agree on them. Refuses files
+//			 if the account is over its hard limit, or if all the
+//			 files staged in the account by any session, which
+//			 haven't been stored yet, would take more than the
+//			 space left under the hard limit or the most an
+//			 account may have staged.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::StageFile(IOStream &rFile)
+{
+	if(mReadOnly && !mHelperSession)
+	{
+		THROW_EXCEPTION(BackupStoreException, ContextIsReadOnly)
+	}
+
+	if(mReadOnly)
+	{
+		// The writer session changes the store info while this one
+		// is logged in, so the copy loaded at login is out of date
+		mapStoreInfo = BackupStoreInfo::Load(mClientID, mAccountRootDir,
+			mStoreDiscSet, true /* read only */);
+	}
+
+	if(HardLimitExceeded())
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			AddedFileExceedsStorageLimit, "Account is over its hard "
+			"limit, not staging file");
+	}
+
+	// The limit is for the whole account, as any number of helper
+	// sessions may be staging files at once
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	int64_t maxBytes = (mapStoreInfo->GetBlocksHardLimit() -
+		mapStoreInfo->GetBlocksUsed()) *
+		rcontroller.GetDiscSet(mStoreDiscSet).GetBlockSize();
+	if(maxBytes > mMaxStagedBytes)
+	{
+		maxBytes = mMaxStagedBytes;
+	}
+	int64_t othersStaged = StoreStructure::GetStagedFilesSize(
+		mAccountRootDir, mStoreDiscSet);
+
+	int64_t id = 0;
+	while(id == 0)
+	{
+		Random::Generate(&id, sizeof(id));
+		id &= 0x7fffffffffffffffLL;
+	}
+
+	std::string fn;
+	StoreStructure::MakeStagedFilename(id, mAccountRootDir, mStoreDiscSet,
+		fn);
+
+	int64_t bytes = 0;
+	int64_t bytesAtLastCount = 0;
+	try
+	{
+		FileStream staged(fn.c_str(),
+			O_WRONLY | O_CREAT | O_EXCL | O_BINARY);
+		char buffer[4096];
+		while(rFile.StreamDataLeft())
+		{
+			int got = rFile.Read(buffer, sizeof(buffer),
+				BACKUP_STORE_TIMEOUT);
+			if(got == 0 && rFile.StreamDataLeft())
+			{
+				THROW_EXCEPTION(BackupStoreException,
+					ReadFileFromStreamTimedOut)
+			}
+
+			if(bytes - bytesAtLastCount >=
+				BACKUP_STORE_STAGED_BYTES_RECOUNT)
+			{
+				// Other sessions may have staged more since,
+				// and what's written so far is counted too
+				othersStaged = StoreStructure::GetStagedFilesSize(
+					mAccountRootDir, mStoreDiscSet) - bytes;
+				bytesAtLastCount = bytes;
+			}
+
+			bytes += got;
+			if(othersStaged + bytes > maxBytes)
+			{
+				THROW_EXCEPTION_MESSAGE(BackupStoreException,
+					AddedFileExceedsStorageLimit, "Account "
+					"has too much data staged, not "
+					"staging file");
+			}
+			staged.Write(buffer, got);
+		}
+	}
+	catch(...)
+	{
+		::unlink(fn.c_str());
+		throw;
+	}
+
+	BOX_TRACE("Staged file " << BOX_FORMAT_OBJECTID(id) << " as " << fn);
+	return id;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::AddStagedFile(int64_t, int64_t,
+//			 int64_t, int64_t, const BackupStoreFilename &)
+//		Purpose: Add a file which was staged by StageFile, as
+//			 AddFile does for a full file, and then delete the
+//			 staged copy whether or not it was added. Returns
+//			 the object ID of the new file.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::AddStagedFile(int64_t StagedID,
+	int64_t InDirectory, int64_t ModificationTime, int64_t AttributesHash,
+	const BackupStoreFilename &rFilename)
+{
+	if(mReadOnly)
+	{
+		THROW_EXCEPTION(BackupStoreException, ContextIsReadOnly)
+	}
+
+	std::string fn;
+	StoreStructure::MakeStagedFilename(StagedID, mAccountRootDir,
+		mStoreDiscSet, fn);
+
+	std::auto_ptr<FileStream> apStaged;
+	try
+	{
+		apStaged.reset(new FileStream(fn.c_str(), O_RDONLY | O_BINARY));
+	}
+	catch(CommonException &e)
+	{
+		if(e.GetSubType() == CommonException::OSFileOpenError)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException,
+				ObjectDoesNotExist, "Staged file " << fn <<
+				" not found");
+		}
+		throw;
+	}
+
+	int64_t id = 0;
+	try
+	{
+		id = AddFile(*apStaged, InDirectory, ModificationTime,
+			AttributesHash, 0 /* not a diff */, rFilename,
+			true /* mark files with same name as old versions */);
+	}
+	catch(...)
+	{
+		apStaged.reset();
+		::unlink(fn.c_str());
+		throw;
+	}
+
+	apStaged.reset();
+	if(::unlink(fn.c_str()) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to delete staged file " << fn);
+	}
+
+	return id;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1531,8 +1739,9 @@ bool BackupStoreContext::ObjectExists(int64_t ObjectID, int MustBe)
 	MakeObjectFilename(ObjectID, filename);
 	if(!RaidFileRead::FileExists(mStoreDiscSet, filename))
 	{
-		// RaidFile reports no file there
-		return false;
+		// RaidFile reports no file there, but only directories
+		// always have one. Files may have been bundled.
+		return MustBe != ObjectExists_Directory && IsBundled(ObjectID);
 	}
 
 	// Do we need to be more specific?
@@ -1591,7 +1800,86 @@ std::auto_ptr<IOStream> BackupStoreContext::OpenObject(int64_t ObjectID)
 	// Attempt to open the file
 	std::string fn;
 	MakeObjectFilename(ObjectID, fn);
-	return std::auto_ptr<IOStream>(RaidFileRead::Open(mStoreDiscSet, fn).release());
+	if(RaidFileRead::FileExists(mStoreDiscSet, fn))
+	{
+		try
+		{
+			return std::auto_ptr<IOStream>(RaidFileRead::Open(mStoreDiscSet, fn).release());
+		}
+		catch(RaidFileException &e)
+		{
+			// Housekeeping may have bundled it since it was found,
+			// and deleted its own file
+			if(!IsBundled(ObjectID))
+			{
+				throw;
+			}
+		}
+	}
+	else if(!IsBundled(ObjectID))
+	{
+		// Fails in the usual way for a missing object
+		return std::auto_ptr<IOStream>(RaidFileRead::Open(mStoreDiscSet, fn).release());
+	}
+
+	return OpenBundledObject(ObjectID);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::OpenBundledObject(int64_t)
+//		Purpose: Private. Opens a file which IsBundled() has just
+//			 found in a bundle. Housekeeping may have compacted
+//			 that bundle since then, and deleted it, so if it's
+//			 gone the index is checked once more.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStoreContext::OpenBundledObject(int64_t ObjectID)
+{
+	try
+	{
+		return mapBundleIndex->OpenMember(ObjectID);
+	}
+	catch(RaidFileException &e)
+	{
+		if(!mapBundleIndex->Refresh())
+		{
+			throw;
+		}
+	}
+
+	return mapBundleIndex->OpenMember(ObjectID);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::IsBundled(int64_t)
+//		Purpose: Private. Whether an object without a file of its
+//			 own is a file which housekeeping has put in a bundle.
+//			 Loads the bundle index again if housekeeping has
+//			 saved it since it was loaded.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupStoreContext::IsBundled(int64_t ObjectID)
+{
+	if(mapBundleIndex.get() == 0)
+	{
+		mapBundleIndex.reset(new BackupStoreBundleIndex(mAccountRootDir,
+			mStoreDiscSet));
+		mapBundleIndex->Load();
+	}
+	else
+	{
+		mapBundleIndex->Refresh();
+	}
+
+	return mapBundleIndex->Find(ObjectID) != 0;
 }
 
 
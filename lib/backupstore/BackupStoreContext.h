@@ -21,6 +21,7 @@
 #include "Message.h"
 #include "Utils.h"
 
+class BackupStoreBundleIndex;
 class BackupStoreDirectory;
 class BackupStoreFilename;
 class IOStream;
@@ -86,6 +87,11 @@ public:
 	bool SessionIsReadOnly() {return mReadOnly;}
 	bool AttemptToGetWriteLock();
 
+	// Helper sessions are read only, but may stage files for the writer
+	void SetHelperSession() {mHelperSession = true;}
+	bool SessionIsHelper() const {return mHelperSession;}
+	void SetMaxStagedBytes(int64_t MaxBytes) {mMaxStagedBytes = MaxBytes;}
+
 	// Not really an API, but useful for BackupProtocolLocal2.
 	void ReleaseWriteLock()
 	{
@@ -147,6 +153,12 @@ public:
 		int64_t DiffFromFileID,
 		const BackupStoreFilename &rFilename,
 		bool MarkFileWithSameNameAsOldVersions);
+	int64_t StageFile(IOStream &rFile);
+	int64_t AddStagedFile(int64_t StagedID,
+		int64_t InDirectory,
+		int64_t ModificationTime,
+		int64_t AttributesHash,
+		const BackupStoreFilename &rFilename);
 	int64_t AddDirectory(int64_t InDirectory,
 		const BackupStoreFilename &rFilename,
 		const StreamableMemBlock &Attributes,
@@ -183,6 +195,8 @@ private:
 	void ClearDirectoryCache();
 	void DeleteDirectoryRecurse(int64_t ObjectID, bool Undelete);
 	int64_t AllocateObjectID();
+	bool IsBundled(int64_t ObjectID);
+	std::auto_ptr<IOStream> OpenBundledObject(int64_t ObjectID);
 
 	std::string mConnectionDetails;
 	int32_t mClientID;
@@ -193,6 +207,8 @@ private:
 	int mStoreDiscSet;
 
 	bool mReadOnly;
+	bool mHelperSession;
+	int64_t mMaxStagedBytes;
 	NamedLock mWriteLock;
 	int mSaveStoreInfoDelay; // how many times to delay saving the store info
 
@@ -205,6 +221,9 @@ private:
 	// Directory cache
 	std::map<int64_t, BackupStoreDirectory*> mDirectoryCache;
 
+	// Where housekeeping has bundled small files, loaded when needed
+	std::auto_ptr<BackupStoreBundleIndex> mapBundleIndex;
+
 public:
 	class TestHook
 	{
@@ -14,6 +14,7 @@
 #endif
 
 #include <sys/stat.h>
+#include <math.h>
 #include <string.h>
 #include <new>
 #include <string.h>
@@ -32,11 +33,13 @@
 #include "BackupStoreFilename.h"
 #include "BackupStoreInfo.h"
 #include "BackupStoreObjectMagic.h"
+#include "BoxTime.h"
 #include "CipherAES.h"
 #include "CipherBlowfish.h"
 #include "CipherContext.h"
 #include "CollectInBufferStream.h"
 #include "Compress.h"
+#include "CompressCodec.h"
 #include "FileModificationTime.h"
 #include "FileStream.h"
 #include "Guards.h"
@@ -46,6 +49,8 @@
 #include "Random.h"
 #include "ReadGatherStream.h"
 #include "RollingChecksum.h"
+#include "Thread.h"
+#include "XXH3Digest.h"
 
 #include "MemLeakFindOn.h"
 
@@ -54,13 +59,175 @@ using namespace BackupStoreFileCryptVar;
 // How big a buffer to use for copying files
 #define COPY_BUFFER_SIZE	(8*1024)
 
+// Longest key for file data (Blowfish allows up to 56 bytes)
+#define BACKUPSTOREFILE_MAX_KEY_LENGTH	64
+
 // Statistics
-BackupStoreFileStats BackupStoreFile::msStats = {0,0,0};
+BackupStoreFileStats BackupStoreFile::msStats = {0,0,0,0,0,0};
 
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	bool sWarnedAboutBackwardsCompatiblity = false;
 #endif
 
+// zlib contexts for EncodeChunk() and DecodeChunk(), kept between chunks
+// and reset before each one, rather than allocating new state every time
+static ThreadLocal<Compress<true> > sChunkCompressors;
+static ThreadLocal<Compress<false> > sChunkDecompressors;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ChunkCodecs
+//		Purpose: Codecs for chunks which aren't compressed with zlib,
+//			 created when first needed, and a buffer which the
+//			 compressed data of a chunk is decrypted into, so that
+//			 it can be decompressed in one go.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ChunkCodecs
+{
+public:
+	ChunkCodecs()
+	: mpBuffer(0),
+	  mBufferSize(0)
+	{
+		for(int l = 0; l < CompressCodec::NumberOfTypes; ++l)
+		{
+			mpCodecs[l] = 0;
+		}
+	}
+	~ChunkCodecs()
+	{
+		for(int l = 0; l < CompressCodec::NumberOfTypes; ++l)
+		{
+			delete mpCodecs[l];
+		}
+		::free(mpBuffer);
+	}
+
+	CompressCodec &GetCodec(int Type)
+	{
+		if(Type < 0 || Type >= CompressCodec::NumberOfTypes)
+		{
+			THROW_EXCEPTION_MESSAGE(CompressException,
+				CodecNotSupported, "Unknown compression "
+				"type " << Type)
+		}
+		if(mpCodecs[Type] == 0)
+		{
+			mpCodecs[Type] = CompressCodec::Create(Type).release();
+			// freed when the thread exits, which may be at exit
+			MEMLEAKFINDER_NOT_A_LEAK(mpCodecs[Type]);
+		}
+		return *mpCodecs[Type];
+	}
+
+	uint8_t *GetBuffer(int Size)
+	{
+		if(Size > mBufferSize)
+		{
+			uint8_t *pbuffer = (uint8_t *)::realloc(mpBuffer, Size);
+			if(pbuffer == 0)
+			{
+				throw std::bad_alloc();
+			}
+			mpBuffer = pbuffer;
+			mBufferSize = Size;
+			MEMLEAKFINDER_NOT_A_LEAK(mpBuffer);
+		}
+		return mpBuffer;
+	}
+
+private:
+	CompressCodec *mpCodecs[CompressCodec::NumberOfTypes];
+	uint8_t *mpBuffer;
+	int mBufferSize;
+};
+
+static ThreadLocal<ChunkCodecs> sChunkCodecs;
+static int sCompressionType = CompressCodec::Zlib;
+static int sCompressionLevel = 0;
+static int sIncompressibleChunkLimit = BACKUP_FILE_INCOMPRESSIBLE_CHUNK_LIMIT;
+
+// The key for file data, kept so that each thread which encodes chunks can
+// set up its own cipher context with it. The generation changes whenever
+// a new key is set.
+static uint8_t sEncryptKey[BACKUPSTOREFILE_MAX_KEY_LENGTH];
+static int sEncryptKeyLength = 0;
+static int sEncryptKeyGeneration = 0;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ChunkCipher
+//		Purpose: A thread's cipher context for encrypting chunks, set
+//			 up with the current key when first needed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ChunkCipher
+{
+public:
+	ChunkCipher()
+	: mKeyGeneration(0)
+	{
+	}
+
+	CipherContext &Get()
+	{
+		if(mKeyGeneration != sEncryptKeyGeneration)
+		{
+			mContext.Reset();
+#ifndef HAVE_OLD_SSL
+			if(sEncryptCipherType == HEADER_AES_ENCODING)
+			{
+				mContext.Init(CipherContext::Encrypt,
+					CipherAES(CipherDescription::Mode_CBC,
+						sEncryptKey, sEncryptKeyLength));
+			}
+			else
+#endif
+			{
+				mContext.Init(CipherContext::Encrypt,
+					CipherBlowfish(CipherDescription::Mode_CBC,
+						sEncryptKey, sEncryptKeyLength));
+			}
+			mKeyGeneration = sEncryptKeyGeneration;
+		}
+		return mContext;
+	}
+
+private:
+	CipherContext mContext;
+	int mKeyGeneration;
+};
+
+static ThreadLocal<ChunkCipher> sChunkCiphers;
+
+// Chunks may be encoded by several threads at once
+static Mutex sStatsMutex;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SetEncryptKey(const void *, int)
+//		Purpose: Keeps a copy of the key for encrypting file data
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static void SetEncryptKey(const void *pKey, int KeyLength)
+{
+	if(KeyLength < 0 || KeyLength > (int)sizeof(sEncryptKey))
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+	::memset(sEncryptKey, 0, sizeof(sEncryptKey));
+	::memcpy(sEncryptKey, pKey, KeyLength);
+	sEncryptKeyLength = KeyLength;
+	++sEncryptKeyGeneration;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -196,7 +363,7 @@ bool BackupStoreFile::VerifyEncodedFileFormat(IOStream &rFile, int64_t *pDiffFro
 	}
 
 	// Check header
-	if((ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if((!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -530,7 +697,7 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 	// Load the block index header
 	memcpy(&blkhdr, finished.GetBuffer(), sizeof(blkhdr));
 
-	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -538,6 +705,8 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 	{
 		THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
 			"Invalid block index magic in stream: expected " <<
+			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2) <<
+			", " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1) <<
 			" or " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0) <<
@@ -728,7 +897,8 @@ BackupStoreFile::DecodedStream::DecodedStream(IOStream &rEncodedFile, int Timeou
 	  mCurrentBlock(-1),
 	  mCurrentBlockClearSize(0),
 	  mPositionInCurrentBlock(0),
-	  mEntryIVBase(42)	// different to default value in the encoded stream!
+	  mEntryIVBase(42),	// different to default value in the encoded stream!
+	  mBlockIndexMagic(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	  , mIsOldVersion(false)
 #endif
@@ -804,6 +974,11 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		inFileOrder = false;
 		break;
 
+	case OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2:
+		inFileOrder = false;
+		mBlockIndexMagic = OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2;
+		break;
+
 	default:
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -963,7 +1138,7 @@ void BackupStoreFile::DecodedStream::ReadBlockIndex(bool MagicAlreadyRead)
 		}
 
 		// Check magic value
-		if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 			&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -971,6 +1146,9 @@ void BackupStoreFile::DecodedStream::ReadBlockIndex(bool MagicAlreadyRead)
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
+
+		// Which tells us how the block checksums were calculated
+		mBlockIndexMagic = ntohl(blkhdr.mMagicValue);
 	}
 
 	// Get the number of blocks out of the header
@@ -1133,10 +1311,11 @@ int BackupStoreFile::DecodedStream::Read(void *pBuffer, int NBytes, int Timeout)
 			}
 
 			// Check the digest
-			MD5Digest md5;
-			md5.Add(mpClearData, mCurrentBlockClearSize);
-			md5.Finish();
-			if(!md5.DigestMatches((uint8_t*)entryEnc.mStrongChecksum))
+			uint8_t checksum[sizeof(entryEnc.mStrongChecksum)];
+			CalculateStrongChecksum(mBlockIndexMagic, mpClearData,
+				mCurrentBlockClearSize, checksum);
+			if(::memcmp(checksum, entryEnc.mStrongChecksum,
+				sizeof(checksum)) != 0)
 			{
 				THROW_EXCEPTION(BackupStoreException, BackupStoreFileFailedIntegrityCheck)
 			}
@@ -1249,6 +1428,11 @@ void BackupStoreFile::SetBlowfishKeys(const void *pKey, int KeyLength, const voi
 	sBlowfishDecryptBlockEntry.Reset();
 	sBlowfishDecryptBlockEntry.Init(CipherContext::Decrypt, CipherBlowfish(CipherDescription::Mode_CBC, pBlockEntryKey, BlockEntryKeyLength));
 	sBlowfishDecryptBlockEntry.UsePadding(false);
+
+	if(spEncrypt == &sBlowfishEncrypt)
+	{
+		SetEncryptKey(pKey, KeyLength);
+	}
 }
 
 
@@ -1273,10 +1457,39 @@ void BackupStoreFile::SetAESKey(const void *pKey, int KeyLength)
 	// Set encryption to use this key, instead of the "default" blowfish key
 	spEncrypt = &sAESEncrypt;
 	sEncryptCipherType = HEADER_AES_ENCODING;
+	SetEncryptKey(pKey, KeyLength);
 }
 #endif
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CalculateStrongChecksum(int32_t, const void *, int, uint8_t *)
+//		Purpose: Calculates the strong checksum of a block of clear
+//			 data, as stored in a block index with the given magic
+//			 value (in host byte order). The output buffer must be
+//			 the size of file_BlockIndexEntryEnc::mStrongChecksum.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CalculateStrongChecksum(int32_t BlockIndexMagic,
+	const void *pData, int Size, uint8_t *pChecksumOut)
+{
+	if(BlockIndexMagic == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
+	{
+		XXH3Digest::Digest(pData, Size, pChecksumOut);
+	}
+	else
+	{
+		MD5Digest md5;
+		md5.Add(pData, Size);
+		md5.Finish();
+		md5.CopyDigestTo(pChecksumOut);
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1300,14 +1513,149 @@ int BackupStoreFile::MaxBlockSizeForChunkSize(int ChunkSize)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &)
-//		Purpose: Encodes a chunk (encryption, possible compressed beforehand)
+//		Name:    BackupStoreFile::SetCompression(int, int)
+//		Purpose: Sets the CompressCodec type used to compress new
+//			 chunks, and its level, 0 for the default. Throws an
+//			 exception if the type isn't supported.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetCompression(int Type, int Level)
+{
+	if(!CompressCodec::IsSupported(Type))
+	{
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotSupported,
+			"Compression type " << CompressCodec::GetName(Type) <<
+			" is not supported")
+	}
+	sCompressionType = Type;
+	sCompressionLevel = Level;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetCompressionType()
+//		Purpose: Returns the CompressCodec type used to compress new
+//			 chunks
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::GetCompressionType()
+{
+	return sCompressionType;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetCompressionLevel()
+//		Purpose: Returns the level used to compress new chunks
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::GetCompressionLevel()
+{
+	return sCompressionLevel;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetIncompressibleChunkLimit(int)
+//		Purpose: Sets how many chunks in a row must turn out to be
+//			 incompressible before encoding stops trying to
+//			 compress the rest of the file. 0 means never stop.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetIncompressibleChunkLimit(int Limit)
+{
+	sIncompressibleChunkLimit = (Limit < 0) ? 0 : Limit;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetIncompressibleChunkLimit()
+//		Purpose: Returns the limit set above
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::GetIncompressibleChunkLimit()
+{
+	return sIncompressibleChunkLimit;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::IsChunkCompressible(const void *, int)
+//		Purpose: Estimates whether compressing a chunk is worth the
+//			 time, from the entropy of a sample of its bytes.
+//			 Already compressed data, such as JPEGs, videos and
+//			 archives, looks random, so is not worth compressing.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::IsChunkCompressible(const void *Chunk, int ChunkSize)
+{
+	if(ChunkSize < BACKUP_FILE_ENTROPY_MIN_SAMPLES)
+	{
+		// Too few bytes for a useful estimate
+		return true;
+	}
+
+	// Sample bytes spread evenly over the chunk
+	int step = ChunkSize / BACKUP_FILE_ENTROPY_MAX_SAMPLES;
+	if(step < 1) step = 1;
+	const uint8_t *data = (const uint8_t *)Chunk;
+	int counts[256];
+	::memset(counts, 0, sizeof(counts));
+	int samples = 0;
+	for(int p = 0; p < ChunkSize; p += step)
+	{
+		counts[data[p]]++;
+		samples++;
+	}
+
+	double entropy = 0;
+	int distinct = 0;
+	for(int b = 0; b < 256; ++b)
+	{
+		if(counts[b] != 0)
+		{
+			double probability = (double)counts[b] / samples;
+			entropy -= probability * ::log(probability);
+			distinct++;
+		}
+	}
+
+	// Small samples underestimate entropy, so correct for that
+	// (Miller-Madow), then convert to bits
+	entropy += (distinct - 1) / (2.0 * samples);
+	entropy /= ::log(2.0);
+
+	return entropy < BACKUP_FILE_INCOMPRESSIBLE_ENTROPY;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &, bool)
+//		Purpose: Encodes a chunk (encryption, possible compressed beforehand).
+//				 Compression isn't tried if TryCompressing is false, or
+//				 if the chunk doesn't look compressible, and isn't used
+//				 if it doesn't make the chunk smaller.
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
-int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput)
+int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+	bool TryCompressing)
 {
-	ASSERT(spEncrypt != 0);
+	// Use this thread's own cipher context, as chunks may be encoded
+	// by several threads at once
+	CipherContext *pencrypt = &sChunkCiphers.Get().Get();
 
 	// Check there's some space in the output block
 	if(rOutput.mBufferSize < 256)
@@ -1320,24 +1668,34 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 
 	// Want to compress it?
 	bool compressChunk = (ChunkSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE);
+	int compressionType = sCompressionType;
+	int64_t bytesNotCompressed = 0;
+	if(compressChunk && (!TryCompressing ||
+		!IsChunkCompressible(Chunk, ChunkSize)))
+	{
+		compressChunk = false;
+		bytesNotCompressed = ChunkSize;
+	}
+	int64_t bytesCompressed = 0;
+	box_time_t compressionStart = 0;
+	box_time_t compressionTime = 0;
+	if(compressChunk)
+	{
+		compressionStart = GetCurrentBoxTime();
+		bytesCompressed = ChunkSize;
+	}
 
-	// Build header
-	uint8_t header = sEncryptCipherType << HEADER_ENCODING_SHIFT;
-	if(compressChunk) header |= HEADER_CHUNK_IS_COMPRESSED;
-
-	// Store header
-	rOutput.mpBuffer[0] = header;
+	// Store header, without the compression flags, which are added
+	// below if compression makes the chunk any smaller
+	rOutput.mpBuffer[0] = sEncryptCipherType << HEADER_ENCODING_SHIFT;
 	int outOffset = 1;
 
-	// Setup cipher, and store the IV
+	// Start encryption with a new IV, and store it
 	int ivLen = 0;
-	const void *iv = spEncrypt->SetRandomIV(ivLen);
+	const void *iv = pencrypt->BeginWithRandomIV(ivLen);
 	::memcpy(rOutput.mpBuffer + outOffset, iv, ivLen);
 	outOffset += ivLen;
 
-	// Start encryption process
-	spEncrypt->Begin();
-
 	#define ENCODECHUNK_CHECK_SPACE(ToEncryptSize)									\
 		{																			\
 			if((rOutput.mBufferSize - outOffset) < ((ToEncryptSize) + 128))			\
@@ -1346,47 +1704,89 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 			}																		\
 		}
 
-	// Encode the chunk
-	if(compressChunk)
+	// The chunk is compressed straight into the output buffer, where the
+	// encrypted data will go, and then encrypted in place with a single
+	// call. This is aligned to the cipher block size, as the header and
+	// IV take up a whole number of blocks after the coding offset.
+	int compressedSize = 0;
+	if(compressChunk && compressionType != CompressCodec::Zlib)
+	{
+		// Codecs other than zlib compress the whole chunk in one go
+		CompressCodec &codec(sChunkCodecs.Get().GetCodec(compressionType));
+		int maxCompressedSize = codec.MaxCompressedSize(ChunkSize);
+		ENCODECHUNK_CHECK_SPACE(maxCompressedSize)
+		compressedSize = codec.Compress(Chunk, ChunkSize,
+			rOutput.mpBuffer + outOffset, maxCompressedSize,
+			sCompressionLevel);
+	}
+	else if(compressChunk)
 	{
-		// buffer to compress into
-		uint8_t buffer[2048];
-
 		// Set compressor with all the chunk as an input
-		Compress<true> compress;
+		Compress<true> &compress(sChunkCompressors.Get());
+		compress.Reset();
 		compress.Input(Chunk, ChunkSize);
 		compress.FinishInput();
 
-		// Get and encrypt output
-		while(!compress.OutputHasFinished())
+		// Only give it as much space as the chunk itself, as there's
+		// no point carrying on once the output is any bigger.
+		ENCODECHUNK_CHECK_SPACE(ChunkSize)
+		uint8_t *compressed = rOutput.mpBuffer + outOffset;
+		while(!compress.OutputHasFinished() && compressedSize < ChunkSize)
 		{
-			int s = compress.Output(buffer, sizeof(buffer));
-			if(s > 0)
-			{
-				ENCODECHUNK_CHECK_SPACE(s)
-				outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, buffer, s);
-			}
-			else
+			int s = compress.Output(compressed + compressedSize,
+				ChunkSize - compressedSize);
+			if(s <= 0)
 			{
 				// Should never happen, as we put all the input in in one go.
 				// So if this happens, it means there's a logical problem somewhere
 				THROW_EXCEPTION(BackupStoreException, Internal)
 			}
+			compressedSize += s;
+		}
+		if(!compress.OutputHasFinished())
+		{
+			compressedSize = ChunkSize;
+		}
+	}
+
+	// Store it uncompressed if compression didn't help
+	if(compressChunk)
+	{
+		compressionTime = GetCurrentBoxTime() - compressionStart;
+		if(compressedSize < ChunkSize)
+		{
+			rOutput.mpBuffer[0] |= HEADER_CHUNK_IS_COMPRESSED |
+				(compressionType << HEADER_COMPRESSION_SHIFT);
+		}
+		else
+		{
+			compressChunk = false;
 		}
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
+	}
+
+	// Encrypt the compressed data in place, or the chunk itself
+	if(compressChunk)
+	{
+		outOffset += pencrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset,
+			rOutput.mpBuffer + outOffset, compressedSize);
 	}
 	else
 	{
-		// Straight encryption
 		ENCODECHUNK_CHECK_SPACE(ChunkSize)
-		outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, Chunk, ChunkSize);
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
+		outOffset += pencrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, Chunk, ChunkSize);
 	}
+	ENCODECHUNK_CHECK_SPACE(16)
+	outOffset += pencrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
 
 	ASSERT(outOffset < rOutput.mBufferSize);		// first check should have sorted this -- merely logic check
 
+	{
+		MutexLock lock(sStatsMutex);
+		msStats.mBytesCompressed += bytesCompressed;
+		msStats.mCompressionTime += compressionTime;
+		msStats.mBytesNotCompressed += bytesNotCompressed;
+	}
+
 	return outOffset;
 }
 
@@ -1417,11 +1817,16 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	// Get header, make checks, etc
 	uint8_t header = input[0];
 	bool chunkCompressed = (header & HEADER_CHUNK_IS_COMPRESSED) == HEADER_CHUNK_IS_COMPRESSED;
-	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT);
+	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT) & HEADER_ENCODING_MASK;
 	if(encodingType != HEADER_BLOWFISH_ENCODING && encodingType != HEADER_AES_ENCODING)
 	{
 		THROW_EXCEPTION(BackupStoreException, ChunkHasUnknownEncoding)
 	}
+	int compressionType = (header >> HEADER_COMPRESSION_SHIFT) & HEADER_COMPRESSION_MASK;
+	if(compressionType != CompressCodec::Zlib && !chunkCompressed)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadEncodedChunk)
+	}
 
 #ifndef HAVE_OLD_SSL
 	// Choose cipher
@@ -1443,8 +1848,7 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	}
 
 	// Set IV in decrypt context, and start
-	cipher.SetIV(input + 1);
-	cipher.Begin();
+	cipher.Begin(input + 1);
 
 	// Setup vars for code
 	int inOffset = 1 + ivLen;
@@ -1454,31 +1858,27 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	// Do action
 	if(chunkCompressed)
 	{
-		// Do things in chunks
-		uint8_t buffer[2048];
-		int inputBlockLen = cipher.InSizeForOutBufferSize(sizeof(buffer));
+		// Decrypt it all in one call, then decompress it in one go
+		int bufferSize = EncodedSize + 64;
+		uint8_t *buffer = sChunkCodecs.Get().GetBuffer(bufferSize);
+		int s = cipher.Transform(buffer, bufferSize, input + inOffset, EncodedSize - inOffset);
+		s += cipher.Final(buffer + s, bufferSize - s);
 
-		// Decompressor
-		Compress<false> decompress;
-
-		while(inOffset < EncodedSize)
+		if(compressionType != CompressCodec::Zlib)
 		{
-			// Decrypt a block
-			int bl = inputBlockLen;
-			if(bl > (EncodedSize - inOffset)) bl = EncodedSize - inOffset;	// not too long
-			int s = cipher.Transform(buffer, sizeof(buffer), input + inOffset, bl);
-			inOffset += bl;
-
-			// Decompress the decrypted data
-			if(s > 0)
+			CompressCodec &codec(sChunkCodecs.Get().GetCodec(compressionType));
+			outOffset = codec.Decompress(buffer, s, output, OutputSize);
+		}
+		else
+		{
+			Compress<false> &decompress(sChunkDecompressors.Get());
+			decompress.Reset();
+			decompress.Input(buffer, s);
+			decompress.FinishInput();
+			while(!decompress.OutputHasFinished())
 			{
-				decompress.Input(buffer, s);
-				int os = 0;
-				do
-				{
-					os = decompress.Output(output + outOffset, OutputSize - outOffset);
-					outOffset += os;
-				} while(os > 0);
+				int os = decompress.Output(output + outOffset, OutputSize - outOffset);
+				outOffset += os;
 
 				// Check that there's space left in the output buffer -- there always should be
 				if(outOffset >= OutputSize)
@@ -1487,22 +1887,6 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 				}
 			}
 		}
-
-		// Get any compressed data remaining in the cipher context and compression
-		int s = cipher.Final(buffer, sizeof(buffer));
-		decompress.Input(buffer, s);
-		decompress.FinishInput();
-		while(!decompress.OutputHasFinished())
-		{
-			int os = decompress.Output(output + outOffset, OutputSize - outOffset);
-			outOffset += os;
-
-			// Check that there's space left in the output buffer -- there always should be
-			if(outOffset >= OutputSize)
-			{
-				THROW_EXCEPTION(BackupStoreException, NotEnoughSpaceToDecodeChunk)
-			}
-		}
 	}
 	else
 	{
@@ -1604,6 +1988,30 @@ void BackupStoreFile::ResetStats()
 	msStats.mBytesInEncodedFiles = 0;
 	msStats.mBytesAlreadyOnServer = 0;
 	msStats.mTotalFileStreamSize = 0;
+	msStats.mBytesCompressed = 0;
+	msStats.mCompressionTime = 0;
+	msStats.mBytesNotCompressed = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EstimateCompressionTimeSaved()
+//		Purpose: Estimates the time (as a box_time_t) which would have
+//			 been spent compressing the chunks judged to be
+//			 incompressible, from the time spent compressing the
+//			 others.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreFile::EstimateCompressionTimeSaved()
+{
+	if(msStats.mBytesCompressed == 0)
+	{
+		return 0;
+	}
+	return (int64_t)((double)msStats.mCompressionTime *
+		msStats.mBytesNotCompressed / msStats.mBytesCompressed);
 }
 
 
@@ -1650,7 +2058,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 	}
 
 	// Check magic
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0)
 #endif
@@ -1666,6 +2074,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 	// Get basic information
 	int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
 	uint64_t entryIVBase = box_ntoh64(hdr.mEntryIVBase);
+	int32_t blockIndexMagic = ntohl(hdr.mMagicValue);
 
 	//TODO: Verify that these sizes look reasonable
 
@@ -1746,10 +2155,11 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 				else
 				{
 					// Check the checksum
-					MD5Digest md5;
-					md5.Add(data, blockClearSize);
-					md5.Finish();
-					if(!md5.DigestMatches(entryEnc.mStrongChecksum))
+					uint8_t checksum[sizeof(entryEnc.mStrongChecksum)];
+					CalculateStrongChecksum(blockIndexMagic, data,
+						blockClearSize, checksum);
+					if(::memcmp(checksum, entryEnc.mStrongChecksum,
+						sizeof(checksum)) != 0)
 					{
 						// Checksum didn't match
 						matches = false;
@@ -16,6 +16,7 @@
 
 #include "autogen_BackupProtocol.h"
 #include "BackupClientFileAttributes.h"
+#include "BackupStoreConstants.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreFilename.h"
 #include "CollectInBufferStream.h"
@@ -27,6 +28,9 @@ typedef struct
 	int64_t mBytesInEncodedFiles;
 	int64_t mBytesAlreadyOnServer;
 	int64_t mTotalFileStreamSize;
+	int64_t mBytesCompressed;		// clear bytes given to the compressor
+	int64_t mCompressionTime;		// box_time_t spent compressing them
+	int64_t mBytesNotCompressed;	// clear bytes judged incompressible
 } BackupStoreFileStats;
 
 class BackgroundTask;
@@ -119,6 +123,7 @@ public:
 		int mCurrentBlockClearSize;
 		int mPositionInCurrentBlock;
 		uint64_t mEntryIVBase;
+		int32_t mBlockIndexMagic;
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		bool mIsOldVersion;
 #endif
@@ -280,7 +285,9 @@ public:
 		int mBufferSize;
 	};
 	static int MaxBlockSizeForChunkSize(int ChunkSize);
-	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput);
+	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+		bool TryCompressing = true);
+	static bool IsChunkCompressible(const void *Chunk, int ChunkSize);
 
 	// Caller should know how big the output size is, but also allocate a bit more memory to cover various
 	// overheads allowed for in checks
@@ -291,8 +298,48 @@ public:
 	}
 	static int DecodeChunk(const void *Encoded, int EncodedSize, void *Output, int OutputSize);
 
+	// Diffing setup. Large files are split into segments which are
+	// searched for matching blocks by up to Threads threads at once,
+	// or one per processor if Threads is 0.
+	static void SetDiffingThreads(int Threads,
+		int64_t MinimumSegmentSize = BACKUP_FILE_DIFF_MIN_SEGMENT_SIZE);
+	static int GetDiffingThreads();
+
+	// Encoding setup. The new blocks of each file are compressed,
+	// encrypted and checksummed by up to Threads threads at once, ahead
+	// of the one being sent, or one per processor if Threads is 0. With
+	// 1, each block is encoded in the calling thread when it's needed.
+	static void SetEncodingThreads(int Threads);
+	static int GetEncodingThreads();
+
+	// Cut new data into blocks at boundaries chosen by its content,
+	// rather than at fixed sizes, so that later versions of the file
+	// which have had data inserted or removed can be diffed quickly.
+	static void SetContentDefinedChunking(bool Enabled);
+	static bool IsContentDefinedChunking();
+
+	// Write block indexes with XXH3 strong checksums, which are much
+	// quicker to calculate than MD5. Only for servers which accept them.
+	static void SetFastBlockChecksums(bool Enabled);
+	static bool IsFastBlockChecksums();
+	static void CalculateStrongChecksum(int32_t BlockIndexMagic,
+		const void *pData, int Size, uint8_t *pChecksumOut);
+
+	// Compress new blocks with this CompressCodec type. Level 0 means
+	// the default level for the type. Files can only be decoded by
+	// software which supports the type.
+	static void SetCompression(int Type, int Level = 0);
+	static int GetCompressionType();
+	static int GetCompressionLevel();
+
+	// Stop trying to compress a file after this many chunks in a row
+	// haven't been compressible. 0 means never stop trying.
+	static void SetIncompressibleChunkLimit(int Limit);
+	static int GetIncompressibleChunkLimit();
+
 	// Statisitics, not designed to be completely reliable	
 	static void ResetStats();
+	static int64_t EstimateCompressionTimeSaved();
 	static BackupStoreFileStats msStats;
 	
 	// For debug
@@ -159,7 +159,7 @@ static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEn
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(blkhdr.mNumBlocks) != NumEntries)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -219,7 +219,7 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffBlkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -361,7 +361,7 @@ static void WriteNewIndex(IOStream &rDiff, int64_t DiffNumBlocks, FromIndexEntry
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffBlkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
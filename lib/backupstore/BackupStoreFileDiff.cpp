@@ -11,8 +11,11 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <new>
 #include <map>
+#include <memory>
+#include <vector>
 
 #ifdef HAVE_TIME_H
 	#include <time.h>
@@ -28,9 +31,13 @@
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
 #include "CommonException.h"
+#include "ContentDefinedChunker.h"
 #include "FileStream.h"
 #include "MD5Digest.h"
+#include "MemoryMappedFile.h"
+#include "ReadAheadStream.h"
 #include "RollingChecksum.h"
+#include "Thread.h"
 #include "Timer.h"
 
 #include "MemLeakFindOn.h"
@@ -46,16 +53,20 @@ using namespace BackupStoreFileCreation;
 	bool BackupStoreFile::TraceDetailsOfDiffProcess = false;
 #endif
 
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis);
-static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES]);
-static void SearchForMatchingBlocks(IOStream &rFile, 
-	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex, 
-	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
-	DiffTimer *pDiffTimer);
-static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize, BlocksAvailableEntry **pHashTable);
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings, int Offset, int32_t BlockSize, int64_t FileBlockNumber,
-BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks);
-static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksAvailableEntry *pIndex, int64_t NumBlocks, std::map<int64_t, int64_t> &rFoundBlocks, int64_t SizeOfInputFile);
+// Blocks found in the file, as (offset in file, index in block index). The
+// file is scanned in order, so a plain vector stays sorted by offset and
+// avoids a tree node allocation and lookup for every match.
+typedef std::vector<std::pair<int64_t, int64_t> > FoundBlocks_t;
+
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, int32_t &rBlockIndexMagicOut);
+static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], int64_t MinimumCount);
+static void SearchForMatchingBlocks(const std::string &rFilename,
+	FileStream &rFile, FoundBlocks_t &rFoundBlocks,
+	BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockIndexMagic,
+	int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], DiffTimer *pDiffTimer);
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, const uint8_t *pBlock, int32_t BlockSize, int64_t FileOffset,
+BlocksAvailableEntry *pIndex, int32_t BlockIndexMagic, FoundBlocks_t &rFoundBlocks);
+static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksAvailableEntry *pIndex, int64_t NumBlocks, FoundBlocks_t &rFoundBlocks, int64_t SizeOfInputFile);
 
 // --------------------------------------------------------------------------
 //
@@ -156,7 +167,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	BlocksAvailableEntry *pindex = 0;
 	int64_t blocksInIndex = 0;
 	bool canDiffFromThis = false;
-	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis);
+	int32_t blockIndexMagic = 0;
+	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis, blockIndexMagic);
 	// BOX_TRACE("Diff: Blocks in index: " << blocksInIndex);
 	
 	if(!canDiffFromThis)
@@ -178,9 +190,22 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	
 	try
 	{
-		// Find which sizes should be scanned
+		// Find which sizes should be scanned. Blocks cut by content
+		// are found by looking up the chunks of the new file, so
+		// only scan for sizes shared by a good part of the file,
+		// which it will have if it was cut into fixed size blocks.
+		int64_t minimumCount = 1;
+		if(BackupStoreFile::IsContentDefinedChunking())
+		{
+			minimumCount = blocksInIndex / BACKUP_FILE_DIFF_CDC_SCAN_SHARE;
+			if(minimumCount < 2)
+			{
+				minimumCount = 2;
+			}
+		}
 		int32_t sizesToScan[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
-		FindMostUsedSizes(pindex, blocksInIndex, sizesToScan);
+		FindMostUsedSizes(pindex, blocksInIndex, sizesToScan,
+			minimumCount);
 		
 		// Flag for reporting to the user
 		bool completelyDifferent;
@@ -188,7 +213,7 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 		// BLOCK
 		{
 			// Search the file to find matching blocks
-			std::map<int64_t, int64_t> foundBlocks; // map of offset in file to index in block index
+			FoundBlocks_t foundBlocks;
 			int64_t sizeOfInputFile = 0;
 			// BLOCK
 			{
@@ -196,15 +221,16 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 				// Get size of file
 				sizeOfInputFile = file.BytesLeftToRead();
 				// Find all those lovely matching blocks
-				SearchForMatchingBlocks(file, foundBlocks, pindex, 
-					blocksInIndex, sizesToScan, pDiffTimer);
+				SearchForMatchingBlocks(Filename, file, foundBlocks,
+					pindex, blocksInIndex, blockIndexMagic,
+					sizesToScan, pDiffTimer);
 				
 				// Is it completely different?
 				completelyDifferent = (foundBlocks.size() == 0);
 			}
 			
 			// Create a recipe -- if the two files are completely different, don't put the from file ID in the recipe.
-			precipe = new BackupStoreFileEncodeStream::Recipe(pindex, blocksInIndex, completelyDifferent?(0):(DiffFromObjectID));
+			precipe = new BackupStoreFileEncodeStream::Recipe(pindex, blocksInIndex, completelyDifferent?(0):(DiffFromObjectID), blockIndexMagic);
 			BlocksAvailableEntry *pindexKeptRef = pindex;	// we need this later, but must set pindex == 0 now, because of exceptions
 			pindex = 0;		// Recipe now has ownership
 			
@@ -254,13 +280,15 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static LoadIndex(IOStream &, int64_t, BlocksAvailableEntry **, int64_t, bool &)
+//		Name:    static LoadIndex(IOStream &, int64_t, BlocksAvailableEntry **, int64_t, bool &, int32_t &)
 //		Purpose: Read in an index, and decrypt, and store in the in memory block format.
 //				 rCanDiffFromThis is set to false if the version of the from file is too old.
+//				 rBlockIndexMagicOut is set to the magic value of the index, which says
+//				 how the strong checksums were calculated.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis)
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, int32_t &rBlockIndexMagicOut)
 {
 	// Reset
 	rNumBlocksOut = 0;
@@ -294,7 +322,7 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 #endif
 
 	// Check magic
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1))
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(hdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -307,6 +335,7 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 
 	// Mark as an acceptable diff.
 	rCanDiffFromThis = true;
+	rBlockIndexMagicOut = ntohl(hdr.mMagicValue);
 
 	// Get basic information
 	int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
@@ -382,12 +411,12 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static FindMostUsedSizes(BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES])
+//		Name:    static FindMostUsedSizes(BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], int64_t)
 //		Purpose: Finds the most commonly used block sizes in the index
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES])
+static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], int64_t MinimumCount)
 {
 	// Array for lengths
 	int64_t sizeCounts[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
@@ -426,6 +455,12 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 	// Make the block sizes
 	for(std::map<int32_t, int64_t>::const_iterator i(foundSizes.begin()); i != foundSizes.end(); ++i)
 	{
+		if(i->second < MinimumCount)
+		{
+			// Too few blocks of this size to be worth a scan
+			continue;
+		}
+
 		// Find the position of the size in the array
 		for(int t = 0; t < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++t)
 		{
@@ -465,345 +500,1183 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 }
 
 
+// Number of rolling checksums calculated at once while scanning
+#define DIFF_HASH_BATCH_SIZE	256
+
+// Bits of Bloom filter per block in the hash table
+#define DIFF_HASH_FILTER_BITS_PER_BLOCK	16
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    DiffHashTable
+//		Purpose: Hash table of the blocks of one size in the block index,
+//			 keyed on the full weak checksum and sized from the number
+//			 of blocks. A Bloom filter in front of it rejects most
+//			 offsets in the file with a probe of a single word.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class DiffHashTable
+{
+public:
+	DiffHashTable()
+	: mBlockSize(0),
+	  mBucketShift(32),
+	  mFilterMask(0)
+	{
+	}
+
+	void Setup(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize);
+	int32_t GetBlockSize() const {return mBlockSize;}
+
+	// Is there possibly a block with this checksum in the table?
+	inline bool MightContain(uint32_t Checksum) const
+	{
+		uint32_t h = Mix(Checksum);
+		uint64_t bits = FilterBits(h);
+		return (mFilter[h & mFilterMask] & bits) == bits;
+	}
+
+	// Returns the list of blocks which might have this checksum, linked
+	// through mpNextInHashList, or 0 if there aren't any.
+	inline BlocksAvailableEntry *GetFirst(uint32_t Checksum) const
+	{
+		return mBuckets[Mix(Checksum) >> mBucketShift];
+	}
+
+private:
+	// The weak checksum isn't well distributed in its bits, particularly
+	// the lower half, so mix it up before use (MurmurHash3 finaliser)
+	static inline uint32_t Mix(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x85ebca6b;
+		x ^= x >> 13;
+		x *= 0xc2b2ae35;
+		x ^= x >> 16;
+		return x;
+	}
+
+	// Three bits in a 64 bit filter word
+	static inline uint64_t FilterBits(uint32_t h)
+	{
+		uint32_t g = h * 0x9e3779b1;
+		return (((uint64_t)1) << (g >> 26))
+			| (((uint64_t)1) << ((g >> 20) & 63))
+			| (((uint64_t)1) << ((g >> 14) & 63));
+	}
+
+	int32_t mBlockSize;
+	std::vector<BlocksAvailableEntry *> mBuckets;
+	int mBucketShift;
+	std::vector<uint64_t> mFilter;
+	uint32_t mFilterMask;
+};
+
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static SearchForMatchingBlocks(IOStream &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES])
-//		Purpose: Find the matching blocks within the file.
-//		Created: 12/1/04
+//		Name:    DiffHashTable::Setup(BlocksAvailableEntry *, int64_t, int32_t)
+//		Purpose: Set up the hash table ready for a scan
+//		Created: 14/1/04
 //
 // --------------------------------------------------------------------------
-static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t> &rFoundBlocks,
-	BlocksAvailableEntry *pIndex, int64_t NumBlocks, 
-	int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], DiffTimer *pDiffTimer)
+void DiffHashTable::Setup(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize)
 {
-	Timer maximumDiffingTime(0, "MaximumDiffingTime");
+	// Size the table and filter from the number of blocks of this size
+	int64_t blocks = 0;
+	for(int64_t b = 0; b < NumBlocks; ++b)
+	{
+		if(pIndex[b].mSize == BlockSize)
+		{
+			++blocks;
+		}
+	}
 
-	if(pDiffTimer && pDiffTimer->IsManaged())
+	int bucketBits = 4;
+	while(bucketBits < 30 && (((int64_t)1) << bucketBits) < blocks)
 	{
-		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
-			MILLI_SEC_IN_SEC, "MaximumDiffingTime");
+		++bucketBits;
 	}
-	
-	std::map<int64_t, int32_t> goodnessOfFit;
+	mBuckets.assign(((size_t)1) << bucketBits, 0);
+	mBucketShift = 32 - bucketBits;
 
-	// Allocate the hash lookup table
-	BlocksAvailableEntry **phashTable = (BlocksAvailableEntry **)::malloc(sizeof(BlocksAvailableEntry *) * (64*1024));
+	int filterBits = 0;
+	while(filterBits < 28 && (((int64_t)64) << filterBits) <
+		(blocks * DIFF_HASH_FILTER_BITS_PER_BLOCK))
+	{
+		++filterBits;
+	}
+	mFilter.assign(((size_t)1) << filterBits, 0);
+	mFilterMask = (((uint32_t)1) << filterBits) - 1;
+	mBlockSize = BlockSize;
 
-	// Choose a size for the buffer, just a little bit more than the maximum block size
-	int32_t bufSize = Sizes[0];
-	for(int z = 1; z < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++z)
+	// Scan through the blocks, building the hash table
+	for(int64_t b = 0; b < NumBlocks; ++b)
 	{
-		if(Sizes[z] > bufSize) bufSize = Sizes[z];
+		// Only look at the required block size
+		if(pIndex[b].mSize == BlockSize)
+		{
+			uint32_t h = Mix(pIndex[b].mWeakChecksum);
+			mFilter[h & mFilterMask] |= FilterBits(h);
+
+			// Add to the front of the list for this bucket
+			BlocksAvailableEntry *&rbucket(mBuckets[h >> mBucketShift]);
+			pIndex[b].mpNextInHashList = rbucket;
+			rbucket = pIndex + b;
+		}
 	}
-	bufSize += 4;
-	ASSERT(bufSize > Sizes[0]);
-	ASSERT(bufSize > 0);
-	if(bufSize > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BlockSizeScan
+//		Purpose: State of the scan for one block size, during the single
+//			 pass over the file in SearchForMatchingBlocks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BlockSizeScan
+{
+public:
+	BlockSizeScan(const DiffHashTable *pHashTable,
+		const uint8_t *pFirstBlock, int64_t FileOffset)
+	: mSize(pHashTable->GetBlockSize()),
+	  mpHashTable(pHashTable),
+	  mRolling(pFirstBlock, mSize),
+	  mRolledTo(FileOffset),
+	  mSkipUntil(FileOffset),
+	  mNextBoundary(((FileOffset + mSize - 1) / mSize) * mSize),
+	  mFinished(false),
+	  mHashesStart(FileOffset),
+	  mHashesEnd(FileOffset),
+	  mNextHit(FileOffset)
 	{
-		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
-	
-	// TODO: Because we read in the file a scanned block size at a time,
-	// it is likely to be inefficient. Probably will be much better to
-	// calculate checksums for all block sizes in a single pass.
 
-	// Allocate the buffers.
-	uint8_t *pbuffer0 = (uint8_t *)::malloc(bufSize);
-	uint8_t *pbuffer1 = (uint8_t *)::malloc(bufSize);
-	try
+	// The checksum isn't rolled forward while matches aren't being
+	// looked for, so bring it up to date before it's needed.
+	inline void RollTo(int64_t FileOffset, const uint8_t *pBuffer,
+		int64_t BufferStart)
 	{
-		// Check buffer allocation
-		if(pbuffer0 == 0 || pbuffer1 == 0 || phashTable == 0)
+		if(mRolledTo < FileOffset)
 		{
-			// If a buffer got allocated, it will be cleaned up in the catch block
-			throw std::bad_alloc();
+			const uint8_t *pstart = pBuffer + (mRolledTo - BufferStart);
+			mRolling.RollForwardSeveral(pstart, pstart + mSize, mSize,
+				FileOffset - mRolledTo);
+			mRolledTo = FileOffset;
 		}
-		
-		// Flag to abort the run, if too many blocks are found -- avoid using
-		// huge amounts of processor time when files contain many similar blocks.
-		bool abortSearch = false;
-		
-		// Search for each block size in turn
-		// NOTE: Do the smallest size first, so that the scheme for adding
-		// entries in the found list works as expected and replaces smaller blocks
-		// with larger blocks when it finds matches at the same offset in the file.
-		for(int s = BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1; s >= 0; --s)
+	}
+
+	// Calculate the checksums at the next Count offsets in one go,
+	// and find the first which might be in the hash table.
+	inline void FillHashes(int64_t FileOffset, int Count,
+		const uint8_t *pBuffer, int64_t BufferStart)
+	{
+		ASSERT(Count > 0 && Count <= DIFF_HASH_BATCH_SIZE);
+		RollTo(FileOffset, pBuffer, BufferStart);
+		const uint8_t *pstart = pBuffer + (FileOffset - BufferStart);
+		mRolling.GetChecksums(pstart, pstart + mSize, mSize,
+			Count, mChecksums);
+		mHashesStart = FileOffset;
+		mHashesEnd = FileOffset + Count;
+		mNextHit = FindHit(FileOffset);
+	}
+
+	// Returns the first offset from From onwards where the checksum
+	// might be in the hash table, or mHashesEnd if there isn't one.
+	inline int64_t FindHit(int64_t From) const
+	{
+		for(int64_t o = From; o < mHashesEnd; ++o)
 		{
-			ASSERT(Sizes[s] <= bufSize);
-			BOX_TRACE("Diff pass " << s << ", for block size " <<
-				Sizes[s]);
-			
-			// Check we haven't finished
-			if(Sizes[s] == 0)
+			if(mpHashTable->MightContain(mChecksums[o - mHashesStart]))
 			{
-				// empty entry, try next size
-				continue;
+				return o;
 			}
-			
-			// Set up the hash table entries
-			SetupHashTable(pIndex, NumBlocks, Sizes[s], phashTable);
-		
-			// Shift file position to beginning
-			rFile.Seek(0, IOStream::SeekType_Absolute);
-			
-			// Read first block
-			if(rFile.Read(pbuffer0, Sizes[s]) != Sizes[s])
+		}
+		return mHashesEnd;
+	}
+
+	int32_t mSize;
+	const DiffHashTable *mpHashTable;
+	RollingChecksum mRolling;
+	int64_t mRolledTo;	// offset of the block the checksum is for
+	int64_t mSkipUntil;	// no matches are looked for before this offset
+	int64_t mNextBoundary;	// next multiple of mSize in the file
+	bool mFinished;
+	uint32_t mChecksums[DIFF_HASH_BATCH_SIZE];
+	int64_t mHashesStart;	// offset of mChecksums[0]
+	int64_t mHashesEnd;	// offset after the last checksum calculated
+	int64_t mNextHit;	// next offset which might be in the hash table
+};
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static FillScanBuffer(IOStream &, uint8_t *, int, int, bool &)
+//		Purpose: Read from the file until the buffer is full or the end of
+//			 the file is reached. Returns the number of bytes now in the buffer.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static int FillScanBuffer(IOStream &rFile, uint8_t *pBuffer, int BytesInBuffer,
+	int BufferSize, bool &rEndOfFile)
+{
+	while(BytesInBuffer < BufferSize)
+	{
+		int bytes = rFile.Read(pBuffer + BytesInBuffer,
+			BufferSize - BytesInBuffer);
+		if(bytes <= 0)
+		{
+			rEndOfFile = true;
+			break;
+		}
+		BytesInBuffer += bytes;
+	}
+
+	return BytesInBuffer;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static MapScanWindow(MemoryMappedFile *, int64_t, int, const uint8_t *&, int &, bool &)
+//		Purpose: Map the part of the file from Offset, in place of
+//			 reading it into a buffer of BufferSize bytes. Returns
+//			 false if the file isn't, or is no longer, mapped.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static bool MapScanWindow(MemoryMappedFile *pMapping, int64_t Offset,
+	int BufferSize, const uint8_t *&rpBuffer, int &rBytesInBuffer,
+	bool &rEndOfFile)
+{
+	if(pMapping == 0 || !pMapping->IsMapped())
+	{
+		return false;
+	}
+	MemoryMappedFile &rMapping(*pMapping);
+
+	int64_t length = rMapping.GetWindowSize();
+	if(length < BufferSize)
+	{
+		length = BufferSize;
+	}
+	if(length > rMapping.GetFileSize() - Offset)
+	{
+		length = rMapping.GetFileSize() - Offset;
+	}
+
+	const uint8_t *pdata = rMapping.GetData(Offset, length);
+	if(pdata == 0)
+	{
+		return false;
+	}
+
+	rpBuffer = pdata;
+	rBytesInBuffer = length;
+	rEndOfFile = ((Offset + length) == rMapping.GetFileSize());
+	return true;
+}
+
+// Search segments have no end offset unless the file is split between threads
+#define DIFF_SEARCH_TO_END	0x7fffffffffffffffLL
+
+// How often the main thread checks the time limit and keeps the connection
+// alive while it waits for threads searching the file
+#define DIFF_SEARCH_POLL_INTERVAL	1000
+
+static int sDiffingThreads = 1;
+static int64_t sMinimumDiffingSegmentSize = BACKUP_FILE_DIFF_MIN_SEGMENT_SIZE;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetDiffingThreads(int, int64_t)
+//		Purpose: Sets the number of threads used to search each file
+//			 for matching blocks, 0 meaning one per processor. Files
+//			 are only split if each thread gets a segment of at
+//			 least MinimumSegmentSize bytes.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetDiffingThreads(int Threads, int64_t MinimumSegmentSize)
+{
+	sDiffingThreads = (Threads < 0)?1:Threads;
+	sMinimumDiffingSegmentSize = (MinimumSegmentSize < 1)?1:MinimumSegmentSize;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetDiffingThreads()
+//		Purpose: Returns the number of threads which will be used to
+//			 search a large file for matching blocks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::GetDiffingThreads()
+{
+	if(!Thread::IsSupported())
+	{
+		return 1;
+	}
+
+	return (sDiffingThreads == 0)?Thread::GetProcessorCount():sDiffingThreads;
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    DiffSearchControl
+//		Purpose: Decides when the search for matching blocks in a file
+//			 should stop, shared by all the threads searching it.
+//			 Only the thread which called EncodeFileDiff checks the
+//			 time limit and keeps the connection alive, and it stops
+//			 the others through Abort(). The limit on the number of
+//			 blocks found is for all the threads together.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class DiffSearchControl
+{
+public:
+	DiffSearchControl(DiffTimer *pDiffTimer, int64_t MaxBlocksFound)
+	: mpDiffTimer(pDiffTimer),
+	  mMaximumDiffingTime(0, "MaximumDiffingTime"),
+	  mAborted(false),
+	  mMaxBlocksFound(MaxBlocksFound),
+	  mBlocksFound(0)
+	{
+		if(pDiffTimer && pDiffTimer->IsManaged())
+		{
+			mMaximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
+				MILLI_SEC_IN_SEC, "MaximumDiffingTime");
+		}
+	}
+
+	// Called regularly by the main thread. Returns false if the
+	// search should stop.
+	bool CheckTimer()
+	{
+		if(IsAborted())
+		{
+			return false;
+		}
+
+		if(mMaximumDiffingTime.HasExpired())
+		{
+			ASSERT(mpDiffTimer != NULL);
+			BOX_INFO("MaximumDiffingTime reached - "
+				"suspending file diff");
+			Abort();
+			return false;
+		}
+
+		if(mpDiffTimer)
+		{
+			mpDiffTimer->DoKeepAlive();
+		}
+
+		return true;
+	}
+
+	void Abort()
+	{
+		MutexLock lock(mMutex);
+		mAborted = true;
+	}
+
+	bool IsAborted()
+	{
+		MutexLock lock(mMutex);
+		return mAborted;
+	}
+
+	// Adds to the number of blocks found by all the threads, which may
+	// be negative if a thread discards some. Returns false if too many
+	// have been found, and the search should stop.
+	bool CountBlocksFound(int64_t Change)
+	{
+		MutexLock lock(mMutex);
+		mBlocksFound += Change;
+		return mBlocksFound <= mMaxBlocksFound;
+	}
+
+private:
+	DiffTimer *mpDiffTimer;
+	Timer mMaximumDiffingTime;
+	Mutex mMutex;
+	bool mAborted;
+	int64_t mMaxBlocksFound;
+	int64_t mBlocksFound;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SearchFileSegment(FileStream &, int64_t, int64_t, const std::vector<DiffHashTable> &, BlocksAvailableEntry *, int64_t, int32_t, FoundBlocks_t &, DiffSearchControl &, bool, bool)
+//		Purpose: Find the matching blocks which start between Start and
+//			 End in the file. All the block sizes are scanned for in
+//			 a single pass, keeping a rolling checksum for each size.
+//			 The file is mapped into memory if possible and MapFile
+//			 is true, otherwise read into a buffer. Threads other
+//			 than the main thread don't log, and only stop when
+//			 told to by rControl.
+//		Created: 12/1/04
+//
+// --------------------------------------------------------------------------
+static void SearchFileSegment(FileStream &rFile, int64_t Start, int64_t End,
+	const std::vector<DiffHashTable> &rHashTables,
+	BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockIndexMagic,
+	FoundBlocks_t &rFoundBlocks, DiffSearchControl &rControl,
+	bool InMainThread, bool MapFile = true)
+{
+	// Find the largest size to scan for
+	int32_t maxSize = 0;
+	for(std::vector<DiffHashTable>::const_iterator i(rHashTables.begin());
+		i != rHashTables.end(); ++i)
+	{
+		if(i->GetBlockSize() > maxSize) maxSize = i->GetBlockSize();
+	}
+	if(maxSize == 0)
+	{
+		// Nothing worth scanning for
+		return;
+	}
+
+	// The buffer must hold the window for the largest block size, plus
+	// the byte after it which is needed to roll the checksum forward.
+	// Make it bigger than that, so that the file is read in large chunks.
+	int bufSize = (maxSize * 2) + (128*1024);
+
+	// Use the file's data directly from the page cache if it can be
+	// mapped, otherwise read it into a buffer, with another thread
+	// reading ahead while this one scans. If it changes while it's
+	// mapped, switch to reading the rest of it.
+	std::auto_ptr<MemoryMappedFile> apMapping;
+	if(MapFile)
+	{
+		apMapping.reset(new MemoryMappedFile(rFile));
+	}
+	size_t foundAtStart = rFoundBlocks.size();
+	int64_t blocksCounted = 0;	// in rControl, by this call
+	std::auto_ptr<ReadAheadStream> apReadAhead;
+	uint8_t *preadBuffer = 0;
+	try
+	{
+		// Get the start of the segment. If the rest of the file is
+		// shorter than the buffer, this is all of it.
+		const uint8_t *pbuffer = 0;
+		bool endOfFile = false;
+		int bytesInBuffer = 0;
+		int64_t bufferStart = Start;	// offset in file of pbuffer[0]
+		if(!MapScanWindow(apMapping.get(), Start, bufSize, pbuffer,
+			bytesInBuffer, endOfFile))
+		{
+			preadBuffer = (uint8_t *)::malloc(bufSize);
+			if(preadBuffer == 0)
+			{
+				throw std::bad_alloc();
+			}
+			if(Start != 0)
 			{
-				// Size of file too short to match -- do next size
+				rFile.Seek(Start, IOStream::SeekType_Absolute);
+			}
+			apReadAhead.reset(new ReadAheadStream(rFile));
+			bytesInBuffer = FillScanBuffer(*apReadAhead, preadBuffer,
+				0, bufSize, endOfFile);
+			pbuffer = preadBuffer;
+		}
+
+		// Set up the scan for each size which fits in the file.
+		// NOTE: At each offset, the sizes are tried in the order of the
+		// hash tables, ie in increasing order of the file area they
+		// cover, and a match of a later size replaces a match of an
+		// earlier size at the same offset in the found blocks list.
+		std::vector<BlockSizeScan> scans;
+		scans.reserve(rHashTables.size());
+		for(std::vector<DiffHashTable>::const_iterator i(rHashTables.begin());
+			i != rHashTables.end(); ++i)
+		{
+			if(i->GetBlockSize() > bytesInBuffer)
+			{
+				// The file is too short to match
 				continue;
 			}
-			
-			// Setup block pointers
-			uint8_t *beginnings = pbuffer0;
-			uint8_t *endings = pbuffer1;
-			int offset = 0;
-			
-			// Calculate the first checksum, ready for rolling
-			RollingChecksum rolling(beginnings, Sizes[s]);
-			
-			// Then roll, until the file is exhausted
-			int64_t fileBlockNumber = 0;
-			int64_t fileOffset = 0;
-			int rollOverInitialBytes = 0;
-			while(true)
+
+			scans.push_back(BlockSizeScan(&(*i), pbuffer, Start));
+		}
+
+		// Flag to abort the run, if too many blocks are found -- avoid using
+		// huge amounts of processor time when files contain many similar blocks.
+		bool abortSearch = false;
+
+		// Roll all the checksums along the file together, until every
+		// size has checked its last possible block.
+		int activeScans = scans.size();
+		int64_t fileOffset = Start;
+		int64_t nextTimerCheck = Start;
+		while(activeScans > 0 && fileOffset < End)
+		{
+			int bufferOffset = fileOffset - bufferStart;
+
+			// Check the time limit and keep the connection alive
+			// before starting, and after every buffer's worth of the
+			// file, even if it's all mapped at once
+			if(fileOffset >= nextTimerCheck)
 			{
-				if(maximumDiffingTime.HasExpired())
+				if(InMainThread?(!rControl.CheckTimer())
+					:rControl.IsAborted())
 				{
-					ASSERT(pDiffTimer != NULL);
-					BOX_INFO("MaximumDiffingTime reached - "
-						"suspending file diff");
-					abortSearch = true;
 					break;
 				}
-				
-				if(pDiffTimer)
+
+				nextTimerCheck = fileOffset + bufSize - maxSize;
+			}
+
+			// Need more data in the buffer?
+			if(!endOfFile && (bufferOffset + maxSize + 1) > bytesInBuffer)
+			{
+				// Bring all the checksums up to date, as the data
+				// before this offset is about to go
+				for(std::vector<BlockSizeScan>::iterator i(scans.begin());
+					i != scans.end(); ++i)
 				{
-					pDiffTimer->DoKeepAlive();
+					i->RollTo(fileOffset, pbuffer, bufferStart);
 				}
-				
-				// Load in another block of data, and record how big it is
-				int bytesInEndings = rFile.Read(endings, Sizes[s]);
-				int tmp;
 
-				// Skip any bytes from a previous matched block
-				if(rollOverInitialBytes > 0 && offset < bytesInEndings)
+				if(!MapScanWindow(apMapping.get(), fileOffset,
+					bufSize, pbuffer, bytesInBuffer, endOfFile))
 				{
-					int spaceLeft = bytesInEndings - offset;
-					int thisRoll = (rollOverInitialBytes > spaceLeft) ? spaceLeft : rollOverInitialBytes;
+					int bytesKept = 0;
+					if(preadBuffer == 0)
+					{
+						// Mapping failed part way through, so
+						// read the rest of the file instead
+						preadBuffer = (uint8_t *)::malloc(bufSize);
+						if(preadBuffer == 0)
+						{
+							throw std::bad_alloc();
+						}
+						rFile.Seek(fileOffset, IOStream::SeekType_Absolute);
+						apReadAhead.reset(new ReadAheadStream(rFile));
+					}
+					else
+					{
+						// Move the data still needed to the
+						// beginning of the buffer
+						bytesKept = bytesInBuffer - bufferOffset;
+						::memmove(preadBuffer, preadBuffer + bufferOffset,
+							bytesKept);
+					}
 
-					rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
+					// and fill up the rest
+					bytesInBuffer = FillScanBuffer(*apReadAhead,
+						preadBuffer, bytesKept, bufSize, endOfFile);
+					pbuffer = preadBuffer;
+				}
+				bufferStart = fileOffset;
+				bufferOffset = 0;
+			}
 
-					offset += thisRoll;
-					fileOffset += thisRoll;
-					rollOverInitialBytes -= thisRoll;
+			const uint8_t *pblock = pbuffer + bufferOffset;
 
-					if(rollOverInitialBytes)
-					{
-						goto refresh;
-					}
+			// Largest block matched at this offset so far
+			int32_t matchedSize = 0;
+
+			// The next offset at which any size needs to do something,
+			// which lets the scan jump over areas where every size is
+			// skipping over blocks it's already matched.
+			int64_t nextOffset = bufferStart + bytesInBuffer;
+			if(!endOfFile)
+			{
+				nextOffset -= maxSize;
+			}
+			if(nextOffset > End)
+			{
+				nextOffset = End;
+			}
+
+			for(std::vector<BlockSizeScan>::iterator i(scans.begin());
+				i != scans.end(); ++i)
+			{
+				if(i->mFinished)
+				{
+					continue;
 				}
 
-				if(goodnessOfFit.count(fileOffset))
+				int32_t size = i->mSize;
+				int64_t lastOffset = bufferStart + bytesInBuffer - size;
+
+				if(endOfFile && fileOffset == lastOffset)
 				{
-					tmp = goodnessOfFit[fileOffset];
+					// This is the last block in the file of this
+					// size, which is checked even if it overlaps
+					// a block which has already been matched.
+					i->RollTo(fileOffset, pbuffer, bufferStart);
+					uint32_t checksum = i->mRolling.GetChecksum();
+					BlocksAvailableEntry *pfirst = 0;
+					if(matchedSize < size && i->mpHashTable->MightContain(checksum)
+						&& (pfirst = i->mpHashTable->GetFirst(checksum)) != 0)
+					{
+						if(SecondStageMatch(pfirst, i->mRolling, pblock, size, fileOffset, pIndex, BlockIndexMagic, rFoundBlocks))
+						{
+							matchedSize = size;
+						}
+					}
+
+					i->mFinished = true;
+					--activeScans;
+					continue;
 				}
-				else
+				else if(endOfFile && lastOffset < nextOffset)
 				{
-					tmp = 0;
+					nextOffset = lastOffset;
 				}
 
-				if(tmp >= Sizes[s])
+				if(fileOffset < i->mSkipUntil)
 				{
-					// Skip over bigger ready-matched blocks completely
-					rollOverInitialBytes = tmp;
-					int spaceLeft = bytesInEndings - offset;
-					int thisRoll = (rollOverInitialBytes > spaceLeft) ? spaceLeft : rollOverInitialBytes;
-
-					rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
+					if(i->mSkipUntil < nextOffset)
+					{
+						nextOffset = i->mSkipUntil;
+					}
+					continue;
+				}
 
-					offset += thisRoll;
-					fileOffset += thisRoll;
-					rollOverInitialBytes -= thisRoll;
+				// Larger blocks which have already matched at
+				// this offset are skipped over when they're
+				// found on a boundary of this block size, or
+				// at the end of a previous skip.
+				bool atBoundary = (fileOffset == i->mSkipUntil);
+				if(i->mNextBoundary <= fileOffset)
+				{
+					if(i->mNextBoundary < fileOffset)
+					{
+						// Passed some boundaries while skipping
+						i->mNextBoundary += ((fileOffset -
+							i->mNextBoundary + size - 1) / size) * size;
+					}
+					if(i->mNextBoundary == fileOffset)
+					{
+						atBoundary = true;
+						i->mNextBoundary += size;
+					}
+				}
 
-					if(rollOverInitialBytes)
+				// Only the offsets where the checksum might be in
+				// the hash table need looking at, so find the next one
+				if(fileOffset >= i->mHashesEnd)
+				{
+					int64_t limit = endOfFile?lastOffset
+						:(bufferStart + bytesInBuffer - maxSize);
+					if(limit > End)
+					{
+						limit = End;
+					}
+					int count = DIFF_HASH_BATCH_SIZE;
+					if(limit - fileOffset < count)
 					{
-						goto refresh;
+						count = limit - fileOffset;
 					}
+					i->FillHashes(fileOffset, count, pbuffer, bufferStart);
 				}
+				else if(i->mNextHit < fileOffset)
+				{
+					// Skipped past it
+					i->mNextHit = i->FindHit(fileOffset);
+				}
+				bool hit = (i->mNextHit == fileOffset);
 
-				while(offset < bytesInEndings)
+				if(matchedSize >= size)
 				{
-					// Is current checksum in hash list?
-					uint16_t hash = rolling.GetComponentForHashing();
-					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
+					if(atBoundary)
 					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
-						{
-							BOX_TRACE("Found block match of " << Sizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
-							goodnessOfFit[fileOffset] = Sizes[s];
-
-							// Block matched, roll the checksum forward to the next block without doing
-							// any more comparisons, because these are pointless (as any more matches will be ignored when
-							// the recipe is generated) and just take up valuable processor time. Edge cases are
-							// especially nasty, using huge amounts of time and memory.
-							int skip = Sizes[s];
-							if(offset < bytesInEndings && skip > 0)
-							{
-								int spaceLeft = bytesInEndings - offset;
-								int thisRoll = (skip > spaceLeft) ? spaceLeft : skip;
-
-								rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
-
-								offset += thisRoll;
-								fileOffset += thisRoll;
-								skip -= thisRoll;
-							}
-							// Not all the bytes necessary will have been skipped, so get them
-							// skipped after the next block is loaded.
-							rollOverInitialBytes = skip;
-							
-							// End this loop, so the final byte isn't used again
-							break;
-						}
-						else
+						i->mSkipUntil = fileOffset + matchedSize;
+					}
+				}
+				else if(hit)
+				{
+					i->RollTo(fileOffset, pbuffer, bufferStart);
+					uint32_t checksum = i->mRolling.GetChecksum();
+					ASSERT(checksum == i->mChecksums[fileOffset - i->mHashesStart]);
+					BlocksAvailableEntry *pfirst = i->mpHashTable->GetFirst(checksum);
+
+					if(pfirst != 0 && SecondStageMatch(pfirst, i->mRolling, pblock, size, fileOffset, pIndex, BlockIndexMagic, rFoundBlocks))
+					{
+						if(InMainThread)
 						{
-							// Too many to log
-							// BOX_TRACE("False alarm match of " << Sizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
+							BOX_TRACE("Found block match of " << size << " bytes with checksum " << checksum << " at offset " << fileOffset);
 						}
-
-						int64_t NumBlocksFound = static_cast<int64_t>(
-							rFoundBlocks.size());
-						int64_t MaxBlocksFound = NumBlocks * 
-							BACKUP_FILE_DIFF_MAX_BLOCK_FIND_MULTIPLE;
-						
-						if(NumBlocksFound > MaxBlocksFound)
+						matchedSize = size;
+
+						// Block matched, so don't look for any more
+						// matches of this size until after it,
+						// because these are pointless (as any more
+						// matches will be ignored when the recipe is
+						// generated) and just take up valuable
+						// processor time. Edge cases are especially
+						// nasty, using huge amounts of time and memory.
+						i->mSkipUntil = fileOffset + size;
+					}
+					else
+					{
+						// Too many to log
+						// BOX_TRACE("False alarm match of " << size << " bytes with checksum " << checksum << " at offset " << fileOffset);
+
+						int64_t newBlocks =
+							(int64_t)(rFoundBlocks.size() -
+							foundAtStart) - blocksCounted;
+						blocksCounted += newBlocks;
+						if(!rControl.CountBlocksFound(newBlocks))
 						{
 							abortSearch = true;
 							break;
 						}
 					}
-					
-					// Roll checksum forward
-					rolling.RollForward(beginnings[offset], endings[offset], Sizes[s]);
-				
-					// Increment offsets
-					++offset;
-					++fileOffset;
 				}
-				
-				if(abortSearch) break;
-				
-			refresh:
-				// Finished?
-				if(bytesInEndings != Sizes[s])
+
+				if(fileOffset < i->mSkipUntil)
 				{
-					// No more data in file -- check the final block
-					// (Do a copy and paste of 5 lines of code instead of introducing a comparison for
-					// each byte of the file)
-					uint16_t hash = rolling.GetComponentForHashing();
-					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
+					// Started skipping
+					if(i->mSkipUntil < nextOffset)
 					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
-						{
-							goodnessOfFit[fileOffset] = Sizes[s];
-						}
+						nextOffset = i->mSkipUntil;
 					}
+					continue;
+				}
 
-					// finish
-					break;
+				// Nothing more to do for this size until the next
+				// offset with a checksum in the hash table
+				if(hit)
+				{
+					i->mNextHit = i->FindHit(fileOffset + 1);
 				}
-				
-				// Switch buffers, reset offset
-				beginnings = endings;
-				endings = (beginnings == pbuffer0)?(pbuffer1):(pbuffer0);	// ie the other buffer
-				offset = 0;
+				if(i->mNextHit < nextOffset)
+				{
+					nextOffset = i->mNextHit;
+				}
+			}
 
-				// And count the blocks which have been done
-				++fileBlockNumber;
+			if(abortSearch)
+			{
+				// Stop any other threads searching this file too
+				rControl.Abort();
+				break;
 			}
 
-			if(abortSearch) break;
+			ASSERT(nextOffset > fileOffset || activeScans == 0);
+			fileOffset = nextOffset;
+		}
+
+		// Free buffer
+		if(preadBuffer != 0)
+		{
+			::free(preadBuffer);
+			preadBuffer = 0;
 		}
-		
-		// Free buffers and hash table
-		::free(pbuffer1);
-		pbuffer1 = 0;
-		::free(pbuffer0);
-		pbuffer0 = 0;
-		::free(phashTable);
-		phashTable = 0;
 	}
 	catch(...)
 	{
 		// Cleanup and throw
-		if(pbuffer1 != 0) ::free(pbuffer1);
-		if(pbuffer0 != 0) ::free(pbuffer0);
-		if(phashTable != 0) ::free(phashTable);
+		if(preadBuffer != 0) ::free(preadBuffer);
 		throw;
 	}
-	
-#ifndef BOX_RELEASE_BUILD
-	if(BackupStoreFile::TraceDetailsOfDiffProcess)
+
+	if(apMapping.get() != 0 && apMapping->HasFaulted())
 	{
-		// Trace out the found blocks in debug mode
-		BOX_TRACE("Diff: list of found blocks");
-		BOX_TRACE("======== ======== ======== ========");
-		BOX_TRACE("  Offset   BlkIdx     Size Movement");
-		for(std::map<int64_t, int64_t>::const_iterator i(rFoundBlocks.begin()); i != rFoundBlocks.end(); ++i)
+		// The file was truncated while it was mapped, and some of it
+		// was scanned as zeros, so search it again by reading it as
+		// it is now, as if it had never been mapped
+		apMapping.reset();
+		apReadAhead.reset();
+		rFoundBlocks.resize(foundAtStart);
+		rControl.CountBlocksFound(-blocksCounted);
+		rFile.Seek(Start, IOStream::SeekType_Absolute);
+		SearchFileSegment(rFile, Start, End, rHashTables, pIndex,
+			NumBlocks, BlockIndexMagic, rFoundBlocks, rControl,
+			InMainThread, false);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    DiffSegmentSearch
+//		Purpose: Thread which searches one segment of a large file for
+//			 matching blocks, with its own handle on the file.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class DiffSegmentSearch : public Thread
+{
+public:
+	DiffSegmentSearch(const std::string &rFilename, int64_t Start,
+		int64_t End, const std::vector<DiffHashTable> &rHashTables,
+		BlocksAvailableEntry *pIndex, int64_t NumBlocks,
+		int32_t BlockIndexMagic, DiffSearchControl &rControl)
+	: mrFilename(rFilename),
+	  mStart(Start),
+	  mEnd(End),
+	  mrHashTables(rHashTables),
+	  mpIndex(pIndex),
+	  mNumBlocks(NumBlocks),
+	  mBlockIndexMagic(BlockIndexMagic),
+	  mrControl(rControl)
+	{
+	}
+
+	~DiffSegmentSearch()
+	{
+		Join();
+	}
+
+	// Search the segment in the calling thread instead
+	void Search(FileStream &rFile)
+	{
+		mFoundBlocks.clear();
+		SearchFileSegment(rFile, mStart, mEnd, mrHashTables, mpIndex,
+			mNumBlocks, mBlockIndexMagic, mFoundBlocks, mrControl,
+			true);
+	}
+
+	int64_t GetStart() const {return mStart;}
+
+	FoundBlocks_t mFoundBlocks;
+
+protected:
+	virtual void Run()
+	{
+		FileStream file(mrFilename);
+		SearchFileSegment(file, mStart, mEnd, mrHashTables, mpIndex,
+			mNumBlocks, mBlockIndexMagic, mFoundBlocks, mrControl,
+			false);
+	}
+
+private:
+	const std::string &mrFilename;
+	int64_t mStart;
+	int64_t mEnd;
+	const std::vector<DiffHashTable> &mrHashTables;
+	BlocksAvailableEntry *mpIndex;
+	int64_t mNumBlocks;
+	int32_t mBlockIndexMagic;
+	DiffSearchControl &mrControl;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static FindMatchingChunks(FileStream &, int64_t, BlocksAvailableEntry *, int64_t, int32_t, FoundBlocks_t &, DiffSearchControl &)
+//		Purpose: Cut the file into chunks by content, in the same way
+//			 as the encoder, and look each one up in the block index.
+//			 Blocks which were cut the same way last time are found
+//			 wherever they have moved to, with one checksum per
+//			 chunk instead of one per byte.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static void FindMatchingChunks(FileStream &rFile, int64_t FileSize,
+	BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockIndexMagic,
+	FoundBlocks_t &rFoundBlocks, DiffSearchControl &rControl)
+{
+	if(FileSize == 0 || NumBlocks == 0)
+	{
+		return;
+	}
+
+	// Blocks sorted by weak checksum. This doesn't use the hash lists
+	// in the index, as the rolling search needs them afterwards.
+	std::vector<std::pair<uint32_t, int64_t> > byChecksum;
+	byChecksum.reserve(NumBlocks);
+	for(int64_t b = 0; b < NumBlocks; ++b)
+	{
+		byChecksum.push_back(std::make_pair(pIndex[b].mWeakChecksum, b));
+	}
+	std::sort(byChecksum.begin(), byChecksum.end());
+
+	// Cut it in the same way as the encoder will
+	ContentDefinedChunker chunker(rFile, FileSize,
+		ContentDefinedChunker::AverageSizeForDiff(pIndex, NumBlocks,
+			FileSize));
+	int64_t offset = 0;
+	const uint8_t *pdata;
+	int32_t size;
+	while(chunker.NextChunk(pdata, size))
+	{
+		if(!rControl.CheckTimer())
 		{
-			int64_t orgLoc = 0;
-			for(int64_t b = 0; b < i->second; ++b)
+			break;
+		}
+		if(pdata == 0)
+		{
+			// The file has got shorter since it was opened
+			break;
+		}
+
+		RollingChecksum weak(pdata, size);
+		std::vector<std::pair<uint32_t, int64_t> >::const_iterator
+			i(std::lower_bound(byChecksum.begin(), byChecksum.end(),
+				std::make_pair(weak.GetChecksum(), (int64_t)0)));
+		bool strongDone = false;
+		uint8_t strong[MD5Digest::DigestLength];
+		for(; i != byChecksum.end() && i->first == weak.GetChecksum(); ++i)
+		{
+			if(pIndex[i->second].mSize != size)
 			{
-				orgLoc += pIndex[b].mSize;
+				continue;
+			}
+			if(!strongDone)
+			{
+				BackupStoreFile::CalculateStrongChecksum(
+					BlockIndexMagic, pdata, size, strong);
+				strongDone = true;
+			}
+			if(::memcmp(strong, pIndex[i->second].mStrongChecksum,
+				sizeof(strong)) == 0)
+			{
+				rFoundBlocks.push_back(std::make_pair(offset,
+					i->second));
+				break;
 			}
-			BOX_TRACE(std::setw(8) << i->first << " " <<
-				std::setw(8) << i->second << " " <<
-				std::setw(8) << pIndex[i->second].mSize << 
-				" " << 
-				std::setw(8) << (i->first - orgLoc));
 		}
-		BOX_TRACE("======== ======== ======== ========");
+
+		offset += size;
 	}
-#endif
+
+	BOX_TRACE("Diff: found " << rFoundBlocks.size() << " matching "
+		"chunks cut by content");
 }
 
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    FoundBlockOrder
+//		Purpose: Orders found blocks by offset, and then with the
+//			 biggest block first.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class FoundBlockOrder
+{
+public:
+	FoundBlockOrder(const BlocksAvailableEntry *pIndex)
+	: mpIndex(pIndex)
+	{
+	}
+
+	bool operator()(const std::pair<int64_t, int64_t> &rA,
+		const std::pair<int64_t, int64_t> &rB) const
+	{
+		if(rA.first != rB.first)
+		{
+			return rA.first < rB.first;
+		}
+		return mpIndex[rA.second].mSize > mpIndex[rB.second].mSize;
+	}
+
+private:
+	const BlocksAvailableEntry *mpIndex;
+};
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static SetupHashTable(BlocksAvailableEntry *, int64_t, in32_t, BlocksAvailableEntry **)
-//		Purpose: Set up the hash table ready for a scan
-//		Created: 14/1/04
+//		Name:    static SearchForMatchingBlocks(const std::string &, FileStream &, FoundBlocks_t &, BlocksAvailableEntry *, int64_t, int32_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], DiffTimer *)
+//		Purpose: Find the matching blocks within the file. Large files
+//			 are split into segments, which are searched by threads
+//			 of their own while this thread keeps the connection
+//			 alive, and the matches are merged in file order.
+//		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize, BlocksAvailableEntry **pHashTable)
+static void SearchForMatchingBlocks(const std::string &rFilename,
+	FileStream &rFile, FoundBlocks_t &rFoundBlocks,
+	BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockIndexMagic,
+	int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], DiffTimer *pDiffTimer)
 {
-	// Set all entries in the hash table to zero
-	::memset(pHashTable, 0, (sizeof(BlocksAvailableEntry *) * (64*1024)));
+	// Avoid using huge amounts of processor time and memory when files
+	// contain many similar blocks
+	DiffSearchControl control(pDiffTimer,
+		NumBlocks * BACKUP_FILE_DIFF_MAX_BLOCK_FIND_MULTIPLE);
+	int64_t fileSize = rFile.BytesLeftToRead();
+
+	// Look up chunks cut by content first, as they're cheap to find
+	FoundBlocks_t chunkBlocks;
+	if(BackupStoreFile::IsContentDefinedChunking())
+	{
+		FindMatchingChunks(rFile, fileSize, pIndex, NumBlocks,
+			BlockIndexMagic, chunkBlocks, control);
+		rFile.Seek(0, IOStream::SeekType_Absolute);
+	}
 
-	// Scan through the blocks, building the hash table
-	for(int64_t b = 0; b < NumBlocks; ++b)
+	// A hash lookup table for each size which fits in the file, in the
+	// order they're tried at each offset (see SearchFileSegment)
+	std::vector<DiffHashTable> hashTables;
+	for(int s = BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1; s >= 0; --s)
 	{
-		// Only look at the required block size
-		if(pIndex[b].mSize == BlockSize)
+		if(Sizes[s] > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
 		{
-			// Get the value under which to hash this entry
-			uint16_t hash = RollingChecksum::ExtractHashingComponent(pIndex[b].mWeakChecksum);
-			
-			// Already present in table?
-			if(pHashTable[hash] != 0)
+			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+		}
+		if(Sizes[s] == 0 || Sizes[s] > fileSize)
+		{
+			// Empty entry, or the file is too short to match
+			continue;
+		}
+
+		BOX_TRACE("Diff: scanning for block size " << Sizes[s]);
+		hashTables.push_back(DiffHashTable());
+		hashTables.back().Setup(pIndex, NumBlocks, Sizes[s]);
+	}
+	if(hashTables.empty())
+	{
+		// Nothing worth scanning for
+		rFoundBlocks.swap(chunkBlocks);
+		return;
+	}
+
+	// Split the file between threads if it's big enough
+	int64_t segments = BackupStoreFile::GetDiffingThreads();
+	if(segments > fileSize / sMinimumDiffingSegmentSize)
+	{
+		segments = fileSize / sMinimumDiffingSegmentSize;
+	}
+
+	if(segments <= 1)
+	{
+		SearchFileSegment(rFile, 0, DIFF_SEARCH_TO_END, hashTables,
+			pIndex, NumBlocks, BlockIndexMagic, rFoundBlocks, control,
+			true);
+	}
+	else
+	{
+		BOX_TRACE("Diff: searching " << segments << " segments of " <<
+			rFilename << " in parallel");
+
+		// Each segment has the matches which start in it, and reads
+		// on into the next as far as it needs to. The segments only
+		// depend on the size of the file, so the result is the same
+		// however the threads are scheduled.
+		std::vector<DiffSegmentSearch *> searches;
+		int started = 0;
+		try
+		{
+			int64_t segmentSize = fileSize / segments;
+			for(int s = 0; s < segments; ++s)
+			{
+				searches.push_back(new DiffSegmentSearch(rFilename,
+					s * segmentSize, (s == segments - 1)?DIFF_SEARCH_TO_END
+						:((s + 1) * segmentSize),
+					hashTables, pIndex, NumBlocks, BlockIndexMagic,
+					control));
+			}
+
+			try
+			{
+				for(; started < segments; ++started)
+				{
+					searches[started]->Start();
+				}
+			}
+			catch(CommonException &e)
+			{
+				if(e.GetSubType() != CommonException::ThreadCreateFailed)
+				{
+					throw;
+				}
+				BOX_WARNING("Failed to start a thread to search " <<
+					rFilename << " for matching blocks, searching "
+					"the rest of it in this thread: " <<
+					e.GetMessage());
+			}
+
+			// Search any segments which didn't get a thread, then
+			// wait for the rest, keeping the connection alive
+			for(int s = started; s < segments; ++s)
+			{
+				searches[s]->Search(rFile);
+			}
+			for(int s = 0; s < started; ++s)
+			{
+				while(!searches[s]->WaitForFinish(DIFF_SEARCH_POLL_INTERVAL))
+				{
+					control.CheckTimer();
+				}
+				searches[s]->Join();
+
+				if(searches[s]->HasFailed())
+				{
+					// Try again in this thread, which will throw
+					// the exception here if it happens again
+					BOX_WARNING("Failed to search " << rFilename <<
+						" from offset " << searches[s]->GetStart() <<
+						" for matching blocks in a thread, trying "
+						"again: " << searches[s]->GetErrorMessage());
+					searches[s]->Search(rFile);
+				}
+			}
+
+			for(int s = 0; s < segments; ++s)
+			{
+				rFoundBlocks.insert(rFoundBlocks.end(),
+					searches[s]->mFoundBlocks.begin(),
+					searches[s]->mFoundBlocks.end());
+				delete searches[s];
+				searches[s] = 0;
+			}
+		}
+		catch(...)
+		{
+			// Stop the threads before their data goes away
+			control.Abort();
+			for(std::vector<DiffSegmentSearch *>::iterator
+				i(searches.begin()); i != searches.end(); ++i)
 			{
-				//BOX_TRACE("Another hash entry for " << hash << " found");
-				// Yes -- need to set the pointer in this entry to the current entry to build the linked list
-				pIndex[b].mpNextInHashList = pHashTable[hash];
+				delete *i;
 			}
+			throw;
+		}
+	}
+
+	if(!chunkBlocks.empty())
+	{
+		// Put the two sets of blocks in order. Where blocks start at
+		// the same place, the biggest goes first, and the recipe will
+		// skip the rest as they overlap it.
+		rFoundBlocks.insert(rFoundBlocks.end(), chunkBlocks.begin(),
+			chunkBlocks.end());
+		std::sort(rFoundBlocks.begin(), rFoundBlocks.end(),
+			FoundBlockOrder(pIndex));
+	}
 
-			// Put a pointer to this entry in the hash table
-			pHashTable[hash] = pIndex + b;
+#ifndef BOX_RELEASE_BUILD
+	if(BackupStoreFile::TraceDetailsOfDiffProcess)
+	{
+		// Trace out the found blocks in debug mode
+		BOX_TRACE("Diff: list of found blocks");
+		BOX_TRACE("======== ======== ======== ========");
+		BOX_TRACE("  Offset   BlkIdx     Size Movement");
+		for(FoundBlocks_t::const_iterator i(rFoundBlocks.begin()); i != rFoundBlocks.end(); ++i)
+		{
+			int64_t orgLoc = 0;
+			for(int64_t b = 0; b < i->second; ++b)
+			{
+				orgLoc += pIndex[b].mSize;
+			}
+			BOX_TRACE(std::setw(8) << i->first << " " <<
+				std::setw(8) << i->second << " " <<
+				std::setw(8) << pIndex[i->second].mSize <<
+				" " <<
+				std::setw(8) << (i->first - orgLoc));
 		}
+		BOX_TRACE("======== ======== ======== ========");
 	}
+#endif
 }
 
 
@@ -815,23 +1688,19 @@ static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int3
 //		Created: 14/1/04
 //
 // --------------------------------------------------------------------------
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings,
-	int Offset, int32_t BlockSize, int64_t FileBlockNumber, BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks)
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, const uint8_t *pBlock,
+	int32_t BlockSize, int64_t FileOffset, BlocksAvailableEntry *pIndex, int32_t BlockIndexMagic, FoundBlocks_t &rFoundBlocks)
 {
 	// Check parameters
-	ASSERT(pBeginnings != 0);
-	ASSERT(pEndings != 0);
-	ASSERT(Offset >= 0);
+	ASSERT(pBlock != 0);
+	ASSERT(FileOffset >= 0);
 	ASSERT(BlockSize > 0);
 	ASSERT(pFirstInHashList != 0);
 	ASSERT(pIndex != 0);
 
-#ifndef BOX_RELEASE_BUILD
-	uint16_t DEBUG_Hash = fastSum.GetComponentForHashing();
-#endif
 	uint32_t Checksum = fastSum.GetChecksum();
 
-	// Before we go to the expense of the MD5, make sure it's a darn good match on the checksum we already know.
+	// Before we go to the expense of the strong digest, make sure it's a darn good match on the checksum we already know.
 	BlocksAvailableEntry *scan = pFirstInHashList;
 	bool found=false;
 	while(scan != 0)
@@ -848,41 +1717,45 @@ static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChec
 		return false;
 	}
 
-	// Calculate the strong MD5 digest for this block
-	MD5Digest strong;
-	// Add the data from the beginnings
-	strong.Add(pBeginnings + Offset, BlockSize - Offset);
-	// Add any data from the endings
-	if(Offset > 0)
-	{
-		strong.Add(pEndings, Offset);
-	}
-	strong.Finish();
+	// Calculate the strong digest for this block, in the same way as
+	// the index it's being compared with
+	uint8_t strong[MD5Digest::DigestLength];
+	BackupStoreFile::CalculateStrongChecksum(BlockIndexMagic, pBlock,
+		BlockSize, strong);
 	
-	// Then go through the entries in the hash list, comparing with the strong digest calculated
-	scan = pFirstInHashList;
+	// Then go through the entries in the hash list with the same weak checksum,
+	// starting with the one just found, comparing with the strong digest calculated
 	//BOX_TRACE("second stage match");
 	while(scan != 0)
 	{
 		//BOX_TRACE("scan size " << scan->mSize <<
 		//	", block size " << BlockSize <<
-		//	", hash " << Hash);
+		//	", checksum " << Checksum);
 		ASSERT(scan->mSize == BlockSize);
-		ASSERT(RollingChecksum::ExtractHashingComponent(scan->mWeakChecksum) == DEBUG_Hash);
 	
 		// Compare?
-		if(strong.DigestMatches(scan->mStrongChecksum))
+		if(scan->mWeakChecksum == Checksum &&
+			::memcmp(strong, scan->mStrongChecksum, sizeof(strong)) == 0)
 		{
 			//BOX_TRACE("Match!\n");
 			// Found! Add to list of found blocks...
-			int64_t fileOffset = (FileBlockNumber * BlockSize) + Offset;
 			int64_t blockIndex = (scan - pIndex);	// pointer arthmitic is frowned upon. But most efficient way of doing it here -- alternative is to use more memory
 			
 			// We do NOT search for smallest blocks first, as this code originally assumed.
 			// To prevent this from potentially overwriting a better match, the caller must determine
 			// the relative "goodness" of any existing match and this one, and avoid the call if it
 			// could be detrimental.
-			rFoundBlocks[fileOffset] = blockIndex;
+			if(!rFoundBlocks.empty() && rFoundBlocks.back().first == FileOffset)
+			{
+				// Replaces a match of another size at this offset
+				rFoundBlocks.back().second = blockIndex;
+			}
+			else
+			{
+				// The file is scanned in order, so appending keeps the list sorted
+				ASSERT(rFoundBlocks.empty() || rFoundBlocks.back().first < FileOffset);
+				rFoundBlocks.push_back(std::make_pair(FileOffset, blockIndex));
+			}
 			
 			// No point in searching further, report success
 			return true;
@@ -900,13 +1773,13 @@ static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChec
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static GenerateRecipe(BackupStoreFileEncodeStream::Recipe &, BlocksAvailableEntry *, int64_t, std::map<int64_t, int64_t> &)
+//		Name:    static GenerateRecipe(BackupStoreFileEncodeStream::Recipe &, BlocksAvailableEntry *, int64_t, FoundBlocks_t &)
 //		Purpose: Fills in the recipe from the found block list
 //		Created: 15/1/04
 //
 // --------------------------------------------------------------------------
 static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksAvailableEntry *pIndex,
-		int64_t NumBlocks, std::map<int64_t, int64_t> &rFoundBlocks, int64_t SizeOfInputFile)
+		int64_t NumBlocks, FoundBlocks_t &rFoundBlocks, int64_t SizeOfInputFile)
 {
 	// NOTE: This function could be a lot more sophisiticated. For example, if
 	// a small block overlaps a big block like this
@@ -948,7 +1821,7 @@ static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksA
 	int64_t loc = 0;
 
 	// Then iterate through the list, generating the recipe
-	std::map<int64_t, int64_t>::const_iterator i(rFoundBlocks.begin());
+	FoundBlocks_t::const_iterator i(rFoundBlocks.begin());
 	ASSERT(i != rFoundBlocks.end());	// check logic
 
 	// Counting for debug tracing
@@ -959,7 +1832,7 @@ static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksA
 	
 	for(; i != rFoundBlocks.end(); ++i)
 	{
-		// Remember... map is (position in file) -> (index of block in pIndex)
+		// Remember... list is of (position in file, index of block in pIndex)
 		
 		if(i->first < loc)
 		{
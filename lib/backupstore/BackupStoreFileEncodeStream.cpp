@@ -11,6 +11,8 @@
 
 #include <string.h>
 
+#include <memory>
+
 #include "BackgroundTask.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupStoreConstants.h"
@@ -21,9 +23,13 @@
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
 #include "BoxTime.h"
+#include "ContentDefinedChunker.h"
 #include "FileStream.h"
+#include "MemoryMappedFile.h"
 #include "Random.h"
+#include "ReadAheadStream.h"
 #include "RollingChecksum.h"
+#include "Thread.h"
 
 #include "MemLeakFindOn.h"
 
@@ -31,6 +37,547 @@
 
 using namespace BackupStoreFileCryptVar;
 
+static bool sContentDefinedChunking = false;
+static bool sFastBlockChecksums = false;
+static int sEncodingThreads = 1;
+
+// Streams may be read in other threads, such as by bbackupd's upload
+// helpers, so the shared block entry cipher and statistics are locked
+static Mutex sSharedStateMutex;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetContentDefinedChunking(bool)
+//		Purpose: Sets whether new data in files is cut into blocks at
+//			 boundaries chosen by its content, or at fixed sizes.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetContentDefinedChunking(bool Enabled)
+{
+	sContentDefinedChunking = Enabled;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::IsContentDefinedChunking()
+//		Purpose: Returns whether content defined chunking is enabled
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::IsContentDefinedChunking()
+{
+	return sContentDefinedChunking;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetFastBlockChecksums(bool)
+//		Purpose: Sets whether block indexes are written with XXH3
+//			 strong checksums, rather than MD5. The server must
+//			 have accepted BACKUP_STORE_SERVER_VERSION_XXH3.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetFastBlockChecksums(bool Enabled)
+{
+	sFastBlockChecksums = Enabled;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::IsFastBlockChecksums()
+//		Purpose: Returns whether block indexes are written with XXH3
+//			 strong checksums
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::IsFastBlockChecksums()
+{
+	return sFastBlockChecksums;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetEncodingThreads(int)
+//		Purpose: Sets the number of threads used to encode the new
+//			 blocks of each file, 0 meaning one per processor.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetEncodingThreads(int Threads)
+{
+	sEncodingThreads = (Threads < 0)?1:Threads;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetEncodingThreads()
+//		Purpose: Returns the number of threads which will encode the
+//			 blocks of a file.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::GetEncodingThreads()
+{
+#if !defined(LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER < 0x10100000L)
+	// Older versions of OpenSSL can't be used by several threads at
+	// once without locking callbacks
+	return 1;
+#else
+	if(!Thread::IsSupported())
+	{
+		return 1;
+	}
+
+	return (sEncodingThreads == 0)?Thread::GetProcessorCount():sEncodingThreads;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    EncodeBlockJob
+//		Purpose: A block of a file to be encoded, and the results:
+//			 the encoded data and the checksums for the index.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class EncodeBlockJob
+{
+public:
+	EncodeBlockJob()
+	: mState(Free),
+	  mBlockNumber(0),
+	  mpData(0),
+	  mSize(0),
+	  mTryCompressing(true),
+	  mpRawBuffer(0),
+	  mEncodedSize(0),
+	  mWeakChecksum(0),
+	  mFailed(false)
+	{
+	}
+	~EncodeBlockJob()
+	{
+		if(mpRawBuffer != 0)
+		{
+			::free(mpRawBuffer);
+		}
+	}
+private:
+	// no copying
+	EncodeBlockJob(const EncodeBlockJob &);
+	EncodeBlockJob &operator=(const EncodeBlockJob &);
+public:
+	void Encode(int32_t BlockIndexMagic)
+	{
+		mEncodedSize = BackupStoreFile::EncodeChunk(mpData, mSize,
+			mEncoded, mTryCompressing);
+
+		// Create block listing data -- generate checksums
+		RollingChecksum weakChecksum(mpData, mSize);
+		mWeakChecksum = weakChecksum.GetChecksum();
+		BackupStoreFile::CalculateStrongChecksum(BlockIndexMagic,
+			mpData, mSize, mStrongChecksum);
+	}
+
+	enum
+	{
+		Free = 0,
+		Queued = 1,
+		Encoding = 2,
+		Done = 3
+	};
+
+	int mState;
+	int64_t mBlockNumber;				// absolute block number in the file
+	const uint8_t *mpData;				// the block, in mpRawBuffer or mapped
+	int32_t mSize;
+	bool mTryCompressing;
+	uint8_t *mpRawBuffer;				// allocated when first needed
+	BackupStoreFile::EncodingBuffer mEncoded;
+	int32_t mEncodedSize;
+	uint32_t mWeakChecksum;
+	uint8_t mStrongChecksum[MD5Digest::DigestLength];
+	bool mFailed;
+	std::string mErrorMessage;
+};
+
+class BlockEncodeWorker;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BlockEncodePipeline
+//		Purpose: A fixed number of blocks, which are filled in the
+//			 order of the file, encoded by worker threads in any
+//			 order, and then taken out in the order of the file
+//			 again. Without workers, each block is encoded by the
+//			 thread which takes it out.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BlockEncodePipeline
+{
+public:
+	BlockEncodePipeline(int Threads, int Blocks, int32_t BufferSize,
+		int32_t BlockIndexMagic);
+	~BlockEncodePipeline();
+private:
+	// no copying
+	BlockEncodePipeline(const BlockEncodePipeline &);
+	BlockEncodePipeline &operator=(const BlockEncodePipeline &);
+public:
+	// For the thread using the pipeline
+	EncodeBlockJob *GetFreeJob();
+	void Submit();
+	bool IsEmpty() const {return mCount == 0;}
+	size_t GetSize() const {return mJobs.size();}
+	bool WaitForFirst(int TimeoutMilliseconds);
+	EncodeBlockJob &GetFirst() {return *mJobs[mFirst];}
+	void ReleaseFirst();
+
+	// For the workers
+	bool GetWork(EncodeBlockJob *&rpJob);
+	void WorkDone(EncodeBlockJob &rJob);
+	int32_t GetBlockIndexMagic() const {return mBlockIndexMagic;}
+
+private:
+	void Stop();
+
+	std::vector<EncodeBlockJob *> mJobs;	// used as a ring
+	std::vector<BlockEncodeWorker *> mWorkers;
+	size_t mFirst;						// oldest job submitted
+	size_t mCount;						// jobs submitted and not released
+	int32_t mBlockIndexMagic;
+	Mutex mMutex;						// protects job states and below
+	Condition mWorkQueued;
+	Condition mWorkDone;
+	bool mStopping;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BlockEncodeWorker
+//		Purpose: Thread which encodes blocks from a pipeline until it
+//			 is stopped
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BlockEncodeWorker : public Thread
+{
+public:
+	BlockEncodeWorker(BlockEncodePipeline &rPipeline)
+	: mrPipeline(rPipeline)
+	{
+	}
+
+	~BlockEncodeWorker()
+	{
+		Join();
+	}
+
+protected:
+	virtual void Run()
+	{
+		EncodeBlockJob *pjob = 0;
+		while(mrPipeline.GetWork(pjob))
+		{
+			// Failures are passed back with the job, to be
+			// tried again by the thread which wanted it
+			try
+			{
+				pjob->Encode(mrPipeline.GetBlockIndexMagic());
+			}
+			catch(BoxException &e)
+			{
+				pjob->mFailed = true;
+				pjob->mErrorMessage = e.GetMessage().empty()
+					? std::string(e.what()) : e.GetMessage();
+			}
+			catch(std::exception &e)
+			{
+				pjob->mFailed = true;
+				pjob->mErrorMessage = e.what();
+			}
+			mrPipeline.WorkDone(*pjob);
+		}
+	}
+
+private:
+	BlockEncodePipeline &mrPipeline;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::BlockEncodePipeline(int, int, int32_t, int32_t)
+//		Purpose: Constructor. Allocates the blocks and starts the
+//			 worker threads. If no more than one thread is wanted,
+//			 or none can be started, there are no workers.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BlockEncodePipeline::BlockEncodePipeline(int Threads, int Blocks,
+	int32_t BufferSize, int32_t BlockIndexMagic)
+: mFirst(0),
+  mCount(0),
+  mBlockIndexMagic(BlockIndexMagic),
+  mStopping(false)
+{
+	ASSERT(Blocks > 0);
+
+	try
+	{
+		for(int b = 0; b < Blocks; ++b)
+		{
+			mJobs.push_back(new EncodeBlockJob);
+#ifndef BOX_RELEASE_BUILD
+			// In debug builds, make sure that the reallocation code is exercised.
+			mJobs.back()->mEncoded.Allocate(BufferSize / 4);
+#else
+			mJobs.back()->mEncoded.Allocate(BufferSize);
+#endif
+		}
+
+		if(Threads > 1)
+		{
+			for(int t = 0; t < Threads; ++t)
+			{
+				std::auto_ptr<BlockEncodeWorker> apworker(
+					new BlockEncodeWorker(*this));
+				apworker->Start();
+				mWorkers.push_back(apworker.release());
+			}
+		}
+	}
+	catch(CommonException &e)
+	{
+		if(e.GetSubType() != CommonException::ThreadCreateFailed)
+		{
+			Stop();
+			throw;
+		}
+		BOX_WARNING("Failed to start a thread to encode file data, "
+			"using " << mWorkers.size() << " threads: " <<
+			e.GetMessage());
+	}
+	catch(...)
+	{
+		Stop();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::~BlockEncodePipeline()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BlockEncodePipeline::~BlockEncodePipeline()
+{
+	Stop();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::Stop()
+//		Purpose: Private. Stops the workers, which finish the blocks
+//			 they're encoding first, and frees the blocks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BlockEncodePipeline::Stop()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mWorkQueued.Broadcast();
+	}
+
+	for(std::vector<BlockEncodeWorker *>::iterator i(mWorkers.begin());
+		i != mWorkers.end(); ++i)
+	{
+		delete *i;
+	}
+	mWorkers.clear();
+
+	for(std::vector<EncodeBlockJob *>::iterator i(mJobs.begin());
+		i != mJobs.end(); ++i)
+	{
+		delete *i;
+	}
+	mJobs.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::GetFreeJob()
+//		Purpose: Returns the block to fill next, which must then be
+//			 passed to Submit(), or a null pointer if all of the
+//			 blocks are in use.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+EncodeBlockJob *BlockEncodePipeline::GetFreeJob()
+{
+	if(mCount == mJobs.size())
+	{
+		return 0;
+	}
+
+	EncodeBlockJob *pjob = mJobs[(mFirst + mCount) % mJobs.size()];
+	ASSERT(pjob->mState == EncodeBlockJob::Free);
+	return pjob;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::Submit()
+//		Purpose: Queues the block returned by GetFreeJob() to be
+//			 encoded
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BlockEncodePipeline::Submit()
+{
+	MutexLock lock(mMutex);
+	EncodeBlockJob *pjob = mJobs[(mFirst + mCount) % mJobs.size()];
+	pjob->mFailed = false;
+	pjob->mState = EncodeBlockJob::Queued;
+	++mCount;
+	mWorkQueued.Signal();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::WaitForFirst(int)
+//		Purpose: Waits up to the given time for the oldest block
+//			 submitted to be encoded, encoding it in this thread if
+//			 there are no workers, or if its worker failed. Returns
+//			 false if the time ran out.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BlockEncodePipeline::WaitForFirst(int TimeoutMilliseconds)
+{
+	ASSERT(mCount > 0);
+	EncodeBlockJob &rjob(*mJobs[mFirst]);
+
+	if(mWorkers.empty())
+	{
+		if(rjob.mState == EncodeBlockJob::Queued)
+		{
+			rjob.Encode(mBlockIndexMagic);
+			rjob.mState = EncodeBlockJob::Done;
+		}
+		return true;
+	}
+
+	{
+		MutexLock lock(mMutex);
+		if(rjob.mState != EncodeBlockJob::Done)
+		{
+			mWorkDone.Wait(mMutex, TimeoutMilliseconds);
+			if(rjob.mState != EncodeBlockJob::Done)
+			{
+				return false;
+			}
+		}
+	}
+
+	if(rjob.mFailed)
+	{
+		// Try again in this thread, which will throw the exception
+		// here if it happens again
+		BOX_WARNING("Failed to encode block " << rjob.mBlockNumber <<
+			" in a thread, trying again: " << rjob.mErrorMessage);
+		rjob.mFailed = false;
+		rjob.Encode(mBlockIndexMagic);
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::ReleaseFirst()
+//		Purpose: Frees the oldest block submitted, once its encoded
+//			 data has been used, so that it can be filled again
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BlockEncodePipeline::ReleaseFirst()
+{
+	MutexLock lock(mMutex);
+	ASSERT(mCount > 0);
+	ASSERT(mJobs[mFirst]->mState == EncodeBlockJob::Done);
+	mJobs[mFirst]->mState = EncodeBlockJob::Free;
+	mFirst = (mFirst + 1) % mJobs.size();
+	--mCount;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::GetWork(EncodeBlockJob *&)
+//		Purpose: Called by workers. Waits for a block to be queued,
+//			 and claims the oldest one. Returns false if the
+//			 worker should stop.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BlockEncodePipeline::GetWork(EncodeBlockJob *&rpJob)
+{
+	MutexLock lock(mMutex);
+	while(!mStopping)
+	{
+		for(size_t j = 0; j < mCount; ++j)
+		{
+			EncodeBlockJob *pjob = mJobs[(mFirst + j) % mJobs.size()];
+			if(pjob->mState == EncodeBlockJob::Queued)
+			{
+				pjob->mState = EncodeBlockJob::Encoding;
+				rpJob = pjob;
+				return true;
+			}
+		}
+		mWorkQueued.Wait(mMutex, BACKUP_FILE_ENCODE_POLL_INTERVAL);
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BlockEncodePipeline::WorkDone(EncodeBlockJob &)
+//		Purpose: Called by workers when they've finished a block
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BlockEncodePipeline::WorkDone(EncodeBlockJob &rJob)
+{
+	MutexLock lock(mMutex);
+	rJob.mState = EncodeBlockJob::Done;
+	mWorkDone.Broadcast();
+}
 
 // --------------------------------------------------------------------------
 //
@@ -44,6 +591,10 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
 : mpRecipe(0),
   mpFile(0),
   mpLogging(0),
+  mpReadLogging(0),
+  mpReadAhead(0),
+  mpMapping(0),
+  mSourcePosition(0),
   mpRunStatusProvider(NULL),
   mpBackgroundTask(NULL),
   mStatus(Status_Header),
@@ -55,14 +606,19 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
   mInstructionNumber(-1),
   mNumBlocks(0),
   mCurrentBlock(-1),
-  mCurrentBlockEncodedSize(0),
-  mPositionInCurrentBlock(0),
   mBlockSize(BACKUP_FILE_MIN_BLOCK_SIZE),
   mLastBlockSize(0),
+  mContentDefined(false),
   mTotalBytesSent(0),
+  mpCurrentBlockData(0),
+  mCurrentBlockEncodedSize(0),
+  mPositionInCurrentBlock(0),
   mpRawBuffer(0),
+  mpPipeline(0),
   mAllocatedBufferSize(0),
-  mEntryIVBase(0)
+  mEntryIVBase(0),
+  mBlockIndexMagic(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1),
+  mIncompressibleChunks(0)
 {
 }
 
@@ -76,6 +632,13 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
 // --------------------------------------------------------------------------
 BackupStoreFileEncodeStream::~BackupStoreFileEncodeStream()
 {
+	// Stop encoding, before the data being encoded goes away
+	if(mpPipeline)
+	{
+		delete mpPipeline;
+		mpPipeline = 0;
+	}
+
 	// Free buffers
 	if(mpRawBuffer)
 	{
@@ -83,18 +646,33 @@ BackupStoreFileEncodeStream::~BackupStoreFileEncodeStream()
 		mpRawBuffer = 0;
 	}
 
-	// Close the file, which we might have open
-	if(mpFile)
+	// Unmap the file, before closing it
+	if(mpMapping)
 	{
-		delete mpFile;
-		mpFile = 0;
+		delete mpMapping;
+		mpMapping = 0;
 	}
 
 	// Clear up logging stream
-	if(mpLogging)
+	if(mpReadLogging)
+	{
+		delete mpReadLogging;
+		mpReadLogging = 0;
+	}
+	mpLogging = 0;
+
+	// Stop reading ahead, before closing the file
+	if(mpReadAhead)
+	{
+		delete mpReadAhead;
+		mpReadAhead = 0;
+	}
+
+	// Close the file, which we might have open
+	if(mpFile)
 	{
-		delete mpLogging;
-		mpLogging = 0;
+		delete mpFile;
+		mpFile = 0;
 	}
 
 	// Free the recipe
@@ -154,12 +732,84 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			*pModificationTime = modTime;
 		}
 
+		// Send data? (symlinks don't have any data in them)
+		mSendData = !attr.IsSymLink();
+
+		// Which format of block index to write
+		mBlockIndexMagic = sFastBlockChecksums
+			? OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
+			: OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1;
+
+		// The block boundaries for new data have to be known before
+		// the header is sent, so if they depend on the content, the
+		// new data must be read through once to find them.
+		//
+		// The file is opened and mapped first, so that the same
+		// mapping is used for this and for encoding. If it can't be
+		// mapped, it's read separately, ahead in another thread if
+		// it's big enough to be worth it.
+		mContentDefined = mSendData && sContentDefinedChunking;
+		FileStream *pfile = 0;
+		std::auto_ptr<FileStream> apChunkingFile;
+		std::auto_ptr<ReadAheadStream> apChunkingReadAhead;
+		IOStream *pchunkingSource = 0;
+		int32_t chunkAverageSize = 0;
+		if(mContentDefined)
+		{
+			pfile = new FileStream(Filename);
+			mpFile = pfile;
+			mpMapping = new MemoryMappedFile(*pfile);
+			if(mpMapping->IsMapped())
+			{
+				pchunkingSource = pfile;
+			}
+			else
+			{
+				apChunkingFile.reset(new FileStream(Filename));
+				pchunkingSource = apChunkingFile.get();
+				if(fileSize >= BACKUP_FILE_CHUNKING_READ_AHEAD_MIN_SIZE)
+				{
+					apChunkingReadAhead.reset(
+						new ReadAheadStream(*apChunkingFile));
+					pchunkingSource = apChunkingReadAhead.get();
+				}
+			}
+			chunkAverageSize =
+				pRecipe->GetChunkAverageSize(fileSize);
+		}
+		int64_t positionInFile = 0;
+
 		// Go through each instruction in the recipe and work out how many blocks
 		// it will add, and the max clear size of these blocks
 		int maxBlockClearSize = 0;
+		int64_t newBlocks = 0;
 		for(uint64_t inst = 0; inst < pRecipe->size(); ++inst)
 		{
-			if((*pRecipe)[inst].mSpaceBefore > 0)
+			if(mContentDefined)
+			{
+				mInstructionFirstChunk.push_back(mChunkSizes.size());
+			}
+
+			if((*pRecipe)[inst].mSpaceBefore > 0 && mContentDefined)
+			{
+				pchunkingSource->Seek(positionInFile,
+					IOStream::SeekType_Absolute);
+				ContentDefinedChunker chunker(*pchunkingSource,
+					(*pRecipe)[inst].mSpaceBefore,
+					chunkAverageSize,
+					apChunkingFile.get() ? 0 : mpMapping);
+				const uint8_t *pdata;
+				int32_t chunkSize;
+				while(chunker.NextChunk(pdata, chunkSize))
+				{
+					mChunkSizes.push_back(chunkSize);
+					++mTotalBlocks;
+					++newBlocks;
+					if(chunkSize > maxBlockClearSize) maxBlockClearSize = chunkSize;
+				}
+				mBytesToUpload += (*pRecipe)[inst].mSpaceBefore;
+			}
+			else if((*pRecipe)[inst].mSpaceBefore > 0)
 			{
 				// Calculate the number of blocks the space before requires
 				int64_t numBlocks;
@@ -167,11 +817,13 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 				CalculateBlockSizes((*pRecipe)[inst].mSpaceBefore, numBlocks, blockSize, lastBlockSize);
 				// Add to accumlated total
 				mTotalBlocks += numBlocks;
+				newBlocks += numBlocks;
 				mBytesToUpload += (*pRecipe)[inst].mSpaceBefore;
 				// Update maximum clear size
 				if(blockSize > maxBlockClearSize) maxBlockClearSize = blockSize;
 				if(lastBlockSize > maxBlockClearSize) maxBlockClearSize = lastBlockSize;
 			}
+			positionInFile += (*pRecipe)[inst].mSpaceBefore;
 
 			// Add number of blocks copied from the previous file
 			mTotalBlocks += (*pRecipe)[inst].mBlocks;
@@ -186,11 +838,18 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			for(int32_t b = 0; b < (*pRecipe)[inst].mBlocks; ++b)
 			{
 				if((*pRecipe)[inst].mpStartBlock[b].mSize > maxBlockClearSize) maxBlockClearSize = (*pRecipe)[inst].mpStartBlock[b].mSize;
+				positionInFile += (*pRecipe)[inst].mpStartBlock[b].mSize;
 			}
 		}
+		if(mContentDefined)
+		{
+			mInstructionFirstChunk.push_back(mChunkSizes.size());
+			apChunkingReadAhead.reset();
+			apChunkingFile.reset();
 
-		// Send data? (symlinks don't have any data in them)
-		mSendData = !attr.IsSymLink();
+			// Encoding reads the file from the start
+			pfile->Seek(0, IOStream::SeekType_Absolute);
+		}
 
 		// If not data is being sent, then the max clear block size is zero
 		if(!mSendData)
@@ -220,43 +879,69 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		// Allocate some buffers for writing data
 		if(mSendData)
 		{
-			// Open the file
-			mpFile = new FileStream(Filename);
+			// Open the file, unless it was opened to find the
+			// chunk boundaries
+			if(pfile == 0)
+			{
+				pfile = new FileStream(Filename);
+				mpFile = pfile;
+				mpMapping = new MemoryMappedFile(*pfile);
+			}
+
+			// Encode blocks straight from the page cache if the
+			// file can be mapped, otherwise read it in another
+			// thread while the blocks already read are encoded
+			IOStream *psource = pfile;
+			if(!mpMapping->IsMapped())
+			{
+				mpReadAhead = new ReadAheadStream(*pfile);
+				psource = mpReadAhead;
+			}
 
 			if (pLogger)
 			{
 				// Create logging stream
-				mpLogging = new ReadLoggingStream(*mpFile,
+				mpReadLogging = new ReadLoggingStream(*psource,
 					*pLogger);
+				mpLogging = mpReadLogging;
 			}
 			else
 			{
-				// re-use FileStream instead
-				mpLogging = mpFile;
-				mpFile = NULL;
+				// re-use the source stream instead
+				mpLogging = psource;
 			}
 
-			// Work out the largest possible block required for the encoded data
+			// Work out the largest possible block required for the encoded data.
+			// Blocks for raw data are only allocated if the file can't be mapped.
 			mAllocatedBufferSize = BackupStoreFile::MaxBlockSizeForChunkSize(maxBlockClearSize);
 
-			// Then allocate two blocks of this size
-			mpRawBuffer = (uint8_t*)::malloc(mAllocatedBufferSize);
-			if(mpRawBuffer == 0)
+			// With several threads, blocks are encoded ahead of the
+			// one being sent, as far as the memory limit allows
+			int threads = BackupStoreFile::GetEncodingThreads();
+			int blocks = 1;
+			if(threads > 1)
 			{
-				throw std::bad_alloc();
+				int64_t maxBlocks = BACKUP_FILE_ENCODE_MAX_BUFFER_MEMORY /
+					((int64_t)mAllocatedBufferSize * 2);
+				int64_t wanted = (int64_t)threads *
+					BACKUP_FILE_ENCODE_BLOCKS_PER_THREAD;
+				if(wanted > maxBlocks) wanted = maxBlocks;
+				if(wanted > newBlocks) wanted = newBlocks;
+				blocks = (wanted < 2)?1:(int)wanted;
+				if(threads > blocks) threads = blocks;
 			}
-#ifndef BOX_RELEASE_BUILD
-			// In debug builds, make sure that the reallocation code is exercised.
-			mEncodedBuffer.Allocate(mAllocatedBufferSize / 4);
-#else
-			mEncodedBuffer.Allocate(mAllocatedBufferSize);
-#endif
+			mpPipeline = new BlockEncodePipeline(threads, blocks,
+				mAllocatedBufferSize, mBlockIndexMagic);
+
+			// Entries for the index are stored as blocks are sent, and
+			// blocks from the previous version as they're read
+			mBlockIndex.resize(mTotalBlocks);
 		}
 		else
 		{
 			// Write an empty block index for the symlink
 			file_BlockIndexHeader blkhdr;
-			blkhdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+			blkhdr.mMagicValue = htonl(mBlockIndexMagic);
 			blkhdr.mOtherFileID = box_hton64(0);	// not other file ID
 			blkhdr.mEntryIVBase = box_hton64(0);
 			blkhdr.mNumBlocks = box_hton64(0);
@@ -267,7 +952,10 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		mData.SetForReading();
 
 		// Update stats
-		BackupStoreFile::msStats.mBytesInEncodedFiles += fileSize;
+		{
+			MutexLock lock(sSharedStateMutex);
+			BackupStoreFile::msStats.mBytesInEncodedFiles += fileSize;
+		}
 
 		// Finally, store the pointer to the recipe, when we know exceptions won't occur
 		mpRecipe = pRecipe;
@@ -343,23 +1031,7 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 		return 0;
 	}
 
-	if(mpRunStatusProvider && mpRunStatusProvider->StopRun())
-	{
-		THROW_EXCEPTION(BackupStoreException, SignalReceived);
-	}
-
-	if(mpBackgroundTask)
-	{
-		BackgroundTask::State state = (mpRecipe->at(0).mBlocks == 0)
-			? BackgroundTask::Uploading_Full
-			: BackgroundTask::Uploading_Patch;
-		if(!mpBackgroundTask->RunBackgroundTask(state, mBytesUploaded,
-			mBytesToUpload))
-		{
-			THROW_EXCEPTION(BackupStoreException,
-				CancelledByBackgroundTask);
-		}
-	}
+	CheckForCancellation();
 
 	int bytesToRead = NBytes;
 	uint8_t *buffer = (uint8_t*)pBuffer;
@@ -385,15 +1057,17 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 				}
 				else
 				{
-					// Reset the buffer so it can be used for the next phase
-					mData.Reset();
-
 					// Get buffer ready for index?
 					if(mStatus == Status_Header)
 					{
+						// Reset the buffer so it can be used for the
+						// next phase. The index is kept after it has
+						// been sent, for CopyBlockIndexTo().
+						mData.Reset();
+
 						// Just finished doing the stream header, create the block index header
 						file_BlockIndexHeader blkhdr;
-						blkhdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+						blkhdr.mMagicValue = htonl(mBlockIndexMagic);
 						ASSERT(mpRecipe != 0);
 						blkhdr.mOtherFileID = box_hton64(mpRecipe->GetOtherFileID());
 						blkhdr.mNumBlocks = box_hton64(mTotalBlocks);
@@ -416,47 +1090,7 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 			if(mPositionInCurrentBlock >= mCurrentBlockEncodedSize)
 			{
 				// Next block!
-				++mCurrentBlock;
-				++mAbsoluteBlockNumber;
-				if(mCurrentBlock >= mNumBlocks)
-				{
-					// Output extra blocks for this instruction and move forward in file
-					if(mInstructionNumber >= 0)
-					{
-						SkipPreviousBlocksInInstruction();
-					}
-
-					// Is there another instruction to go?
-					++mInstructionNumber;
-
-					// Skip instructions which don't contain any data
-					while(mInstructionNumber < static_cast<int64_t>(mpRecipe->size())
-						&& (*mpRecipe)[mInstructionNumber].mSpaceBefore == 0)
-					{
-						SkipPreviousBlocksInInstruction();
-						++mInstructionNumber;
-					}
-
-					if(mInstructionNumber >= static_cast<int64_t>(mpRecipe->size()))
-					{
-						// End of blocks, go to next phase
-						++mStatus;
-
-						// Set the data to reading so the index can be written
-						mData.SetForReading();
-					}
-					else
-					{
-						// Get ready for this instruction
-						SetForInstruction();
-					}
-				}
-
-				// Can't use 'else' here as SetForInstruction() will change this
-				if(mCurrentBlock < mNumBlocks)
-				{
-					EncodeCurrentBlock();
-				}
+				StartSendingNextBlock();
 			}
 
 			// Send data from the current block (if there's data to send)
@@ -467,7 +1101,7 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 				if(s > bytesToRead) s = bytesToRead;
 
 				// Copy it in
-				::memcpy(buffer, mEncodedBuffer.mpBuffer + mPositionInCurrentBlock, s);
+				::memcpy(buffer, mpCurrentBlockData + mPositionInCurrentBlock, s);
 
 				// Update variables
 				bytesToRead -= s;
@@ -483,7 +1117,10 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 	}
 
 	// Add encoded size to stats
-	BackupStoreFile::msStats.mTotalFileStreamSize += (NBytes - bytesToRead);
+	{
+		MutexLock lock(sSharedStateMutex);
+		BackupStoreFile::msStats.mTotalFileStreamSize += (NBytes - bytesToRead);
+	}
 	mTotalBytesSent += (NBytes - bytesToRead);
 
 	// Return size of data to caller
@@ -491,6 +1128,191 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::CheckForCancellation()
+//		Purpose: Private. Throws an exception if the upload should
+//			 stop, and lets the background task run.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::CheckForCancellation()
+{
+	if(mpRunStatusProvider && mpRunStatusProvider->StopRun())
+	{
+		THROW_EXCEPTION(BackupStoreException, SignalReceived);
+	}
+
+	if(mpBackgroundTask)
+	{
+		BackgroundTask::State state = (mpRecipe->at(0).mBlocks == 0)
+			? BackgroundTask::Uploading_Full
+			: BackgroundTask::Uploading_Patch;
+		if(!mpBackgroundTask->RunBackgroundTask(state, mBytesUploaded,
+			mBytesToUpload))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				CancelledByBackgroundTask);
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::StartSendingNextBlock()
+//		Purpose: Private. Moves on to sending the next new block, once
+//			 it has been encoded, adding its entry to the index. Or
+//			 if there are no more, moves on to sending the index.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::StartSendingNextBlock()
+{
+	// Finished with the block which was being sent
+	if(mpCurrentBlockData != 0)
+	{
+		mpPipeline->ReleaseFirst();
+		mpCurrentBlockData = 0;
+		mCurrentBlockEncodedSize = 0;
+		mPositionInCurrentBlock = 0;
+	}
+
+	// Keep the encoders busy
+	QueueBlocks();
+
+	if(mpPipeline->IsEmpty())
+	{
+		// End of blocks, go to next phase
+		++mStatus;
+
+		// Set the data to reading so the index can be written
+		if(!mBlockIndex.empty())
+		{
+			mData.Write(&mBlockIndex[0],
+				mBlockIndex.size() * sizeof(file_BlockIndexEntry));
+		}
+		mData.SetForReading();
+		return;
+	}
+
+	// Wait for the next block to be encoded
+	while(!mpPipeline->WaitForFirst(BACKUP_FILE_ENCODE_POLL_INTERVAL))
+	{
+		CheckForCancellation();
+	}
+	EncodeBlockJob &rjob(mpPipeline->GetFirst());
+
+	// If the file was truncated while it was mapped, the block may have
+	// been encoded from zeros instead of the file's data, so give up as
+	// if it had been read and found to be short
+	if(mpMapping != 0 && mpMapping->HasFaulted())
+	{
+		THROW_EXCEPTION(BackupStoreException,
+			Temp_FileEncodeStreamDidntReadBuffer)
+	}
+
+	// Give up on compression for the rest of the file if enough blocks
+	// in a row didn't compress
+	if(rjob.mEncoded.mpBuffer[0] & HEADER_CHUNK_IS_COMPRESSED)
+	{
+		mIncompressibleChunks = 0;
+	}
+	else if(rjob.mSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE)
+	{
+		mIncompressibleChunks++;
+	}
+
+	mBytesUploaded += rjob.mSize;
+
+	// Add entry to the index
+	StoreBlockIndexEntry(rjob.mBlockNumber, rjob.mEncodedSize, rjob.mSize,
+		rjob.mWeakChecksum, rjob.mStrongChecksum);
+
+	// Set vars to reading this block
+	mpCurrentBlockData = rjob.mEncoded.mpBuffer;
+	mCurrentBlockEncodedSize = rjob.mEncodedSize;
+	mPositionInCurrentBlock = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::QueueBlocks()
+//		Purpose: Private. Reads new blocks from the file and queues
+//			 them to be encoded, until the pipeline is full or the
+//			 end of the recipe. Blocks from the previous version of
+//			 the file are added to the index on the way.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::QueueBlocks()
+{
+	while(mInstructionNumber < static_cast<int64_t>(mpRecipe->size())
+		&& mpPipeline->GetFreeJob() != 0)
+	{
+		// Next block!
+		++mCurrentBlock;
+		++mAbsoluteBlockNumber;
+		if(mCurrentBlock >= mNumBlocks)
+		{
+			// Output extra blocks for this instruction and move forward in file
+			if(mInstructionNumber >= 0)
+			{
+				SkipPreviousBlocksInInstruction();
+			}
+
+			// Is there another instruction to go?
+			++mInstructionNumber;
+
+			// Skip instructions which don't contain any data
+			while(mInstructionNumber < static_cast<int64_t>(mpRecipe->size())
+				&& (*mpRecipe)[mInstructionNumber].mSpaceBefore == 0)
+			{
+				SkipPreviousBlocksInInstruction();
+				++mInstructionNumber;
+			}
+
+			if(mInstructionNumber >= static_cast<int64_t>(mpRecipe->size()))
+			{
+				// End of blocks
+				break;
+			}
+
+			// Get ready for this instruction
+			SetForInstruction();
+		}
+
+		QueueCurrentBlock();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::CopyBlockIndexTo(IOStream &)
+//		Purpose: Writes the block index which was sent at the end of
+//			 the stream, in the same form as the server would send
+//			 it. Can only be called once the whole stream has been
+//			 read.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::CopyBlockIndexTo(IOStream &rStream)
+{
+	if(mStatus != Status_Finished || !mSendData)
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
+	rStream.Write(mData.GetBuffer(), mData.GetSize());
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -511,28 +1333,66 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 	// Index of the first block in old file (being diffed from)
 	int firstIndex = mpRecipe->BlockPtrToIndex((*mpRecipe)[mInstructionNumber].mpStartBlock);
 
+	// If the old file's index is in another format, the strong checksums
+	// of its blocks have to be calculated again from the data here.
+	bool recalculate = (mpRecipe->GetBlockIndexMagic() != mBlockIndexMagic);
+
 	int64_t sizeToSkip = 0;
 
 	for(int32_t b = 0; b < (*mpRecipe)[mInstructionNumber].mBlocks; ++b)
 	{
+		BackupStoreFileCreation::BlocksAvailableEntry &rblock(
+			(*mpRecipe)[mInstructionNumber].mpStartBlock[b]);
+
 		// Update stats
-		BackupStoreFile::msStats.mBytesAlreadyOnServer += (*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize;
+		{
+			MutexLock lock(sSharedStateMutex);
+			BackupStoreFile::msStats.mBytesAlreadyOnServer += rblock.mSize;
+		}
+
+		uint8_t *pstrongChecksum = rblock.mStrongChecksum;
+		uint8_t checksum[sizeof(rblock.mStrongChecksum)];
+		if(recalculate)
+		{
+			const uint8_t *pdata = ReadSourceBlock(rblock.mSize,
+				mpRawBuffer);
+
+			// The new checksum will be used to check the block on
+			// the server, so make sure it's still the same data.
+			BackupStoreFile::CalculateStrongChecksum(
+				mpRecipe->GetBlockIndexMagic(), pdata, rblock.mSize,
+				checksum);
+			if(::memcmp(checksum, rblock.mStrongChecksum,
+				sizeof(checksum)) != 0)
+			{
+				THROW_EXCEPTION(BackupStoreException,
+					SourceFileChangedWhileEncoding)
+			}
+
+			BackupStoreFile::CalculateStrongChecksum(mBlockIndexMagic,
+				pdata, rblock.mSize, checksum);
+			pstrongChecksum = checksum;
+		}
+		else
+		{
+			// Add the size of this block to the size to skip
+			sizeToSkip += rblock.mSize;
+		}
 
 		// Store the entry
-		StoreBlockIndexEntry(0 - (firstIndex + b),
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize,
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mWeakChecksum,
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mStrongChecksum);
+		StoreBlockIndexEntry(mAbsoluteBlockNumber, 0 - (firstIndex + b),
+			rblock.mSize, rblock.mWeakChecksum, pstrongChecksum);
 
 		// Increment the absolute block number -- kept encryption IV in sync
 		++mAbsoluteBlockNumber;
-
-		// Add the size of this block to the size to skip
-		sizeToSkip += (*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize;
 	}
 
 	// Move forward in the stream
-	mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
+	if(sizeToSkip > 0)
+	{
+		mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
+		mSourcePosition += sizeToSkip;
+	}
 }
 
 
@@ -547,12 +1407,19 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 void BackupStoreFileEncodeStream::SetForInstruction()
 {
 	// Calculate block sizes
-	CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	if(mContentDefined)
+	{
+		// The sizes were found in Setup()
+		mNumBlocks = mInstructionFirstChunk[mInstructionNumber + 1] -
+			mInstructionFirstChunk[mInstructionNumber];
+	}
+	else
+	{
+		CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	}
 
 	// Set variables
 	mCurrentBlock = 0;
-	mCurrentBlockEncodedSize = 0;
-	mPositionInCurrentBlock = 0;
 }
 
 
@@ -560,21 +1427,72 @@ void BackupStoreFileEncodeStream::SetForInstruction()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::EncodeCurrentBlock()
-//		Purpose: Private. Encodes the current block, and writes the block data to the index
+//		Name:    BackupStoreFileEncodeStream::QueueCurrentBlock()
+//		Purpose: Private. Reads the current block, and queues it to be
+//			 encoded
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
-void BackupStoreFileEncodeStream::EncodeCurrentBlock()
+void BackupStoreFileEncodeStream::QueueCurrentBlock()
 {
 	// How big is the block, raw?
 	int blockRawSize = mBlockSize;
-	if(mCurrentBlock == (mNumBlocks - 1))
+	if(mContentDefined)
+	{
+		blockRawSize = mChunkSizes[
+			mInstructionFirstChunk[mInstructionNumber] + mCurrentBlock];
+	}
+	else if(mCurrentBlock == (mNumBlocks - 1))
 	{
 		blockRawSize = mLastBlockSize;
 	}
 	ASSERT(blockRawSize < mAllocatedBufferSize);
 
+	EncodeBlockJob *pjob = mpPipeline->GetFreeJob();
+	ASSERT(pjob != 0);
+	pjob->mpData = ReadSourceBlock(blockRawSize, pjob->mpRawBuffer);
+	if(mpPipeline->GetSize() > 1 && pjob->mpData != pjob->mpRawBuffer)
+	{
+		// Mapped data is only valid until the next block is read, so
+		// blocks which are encoded ahead need a copy
+		if(pjob->mpRawBuffer == 0)
+		{
+			pjob->mpRawBuffer = (uint8_t*)::malloc(mAllocatedBufferSize);
+			if(pjob->mpRawBuffer == 0)
+			{
+				throw std::bad_alloc();
+			}
+		}
+		::memcpy(pjob->mpRawBuffer, pjob->mpData, blockRawSize);
+		pjob->mpData = pjob->mpRawBuffer;
+	}
+	pjob->mSize = blockRawSize;
+	pjob->mBlockNumber = mAbsoluteBlockNumber;
+
+	// Compress it, unless enough blocks in a row before it didn't
+	int limit = BackupStoreFile::GetIncompressibleChunkLimit();
+	pjob->mTryCompressing = (limit == 0 || mIncompressibleChunks < limit);
+
+	mpPipeline->Submit();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::ReadSourceBlock(int, uint8_t *&)
+//		Purpose: Private. Returns a pointer to the next Size bytes of
+//			 the source file, and moves on past them. The data is
+//			 either mapped, or read into the buffer given, which is
+//			 allocated if it's null, and is valid until the buffer
+//			 is used again.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const uint8_t *BackupStoreFileEncodeStream::ReadSourceBlock(int Size,
+	uint8_t *&rpBuffer)
+{
+	ASSERT(Size < mAllocatedBufferSize);
+
 	// Check file open
 	if(mpLogging == 0)
 	{
@@ -582,48 +1500,66 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 		THROW_EXCEPTION(BackupStoreException, Internal)
 	}
 
-	// Read the data in
-	if(!mpLogging->ReadFullBuffer(mpRawBuffer, blockRawSize,
-		0 /* not interested in size if failure */))
+	// Use the data in place if the file is mapped, moving the stream
+	// on to keep it in step. If it isn't, or it has changed since it
+	// was mapped, read the data in.
+	const uint8_t *pdata = 0;
+	if(mpMapping != 0 && mpMapping->IsMapped() &&
+		mSourcePosition + Size <= mpMapping->GetFileSize())
 	{
-		// TODO: Do something more intelligent, and abort
-		// this upload because the file has changed.
-		THROW_EXCEPTION(BackupStoreException,
-			Temp_FileEncodeStreamDidntReadBuffer)
+		pdata = mpMapping->GetData(mSourcePosition, Size);
 	}
+	if(pdata != 0)
+	{
+		if(mpReadLogging != 0)
+		{
+			mpReadLogging->SkipRead(Size);
+		}
+		else
+		{
+			mpLogging->Seek(Size, IOStream::SeekType_Relative);
+		}
+	}
+	else
+	{
+		if(rpBuffer == 0)
+		{
+			rpBuffer = (uint8_t*)::malloc(mAllocatedBufferSize);
+			if(rpBuffer == 0)
+			{
+				throw std::bad_alloc();
+			}
+		}
+		if(!mpLogging->ReadFullBuffer(rpBuffer, Size,
+			0 /* not interested in size if failure */))
+		{
+			// TODO: Do something more intelligent, and abort
+			// this upload because the file has changed.
+			THROW_EXCEPTION(BackupStoreException,
+				Temp_FileEncodeStreamDidntReadBuffer)
+		}
+		pdata = rpBuffer;
+	}
+	mSourcePosition += Size;
 
-	// Encode it
-	mCurrentBlockEncodedSize = BackupStoreFile::EncodeChunk(mpRawBuffer,
-		blockRawSize, mEncodedBuffer);
-
-	mBytesUploaded += blockRawSize;
-
-	//TRACE2("Encode: Encoded size of block %d is %d\n", (int32_t)mCurrentBlock, (int32_t)mCurrentBlockEncodedSize);
-
-	// Create block listing data -- generate checksums
-	RollingChecksum weakChecksum(mpRawBuffer, blockRawSize);
-	MD5Digest strongChecksum;
-	strongChecksum.Add(mpRawBuffer, blockRawSize);
-	strongChecksum.Finish();
-
-	// Add entry to the index
-	StoreBlockIndexEntry(mCurrentBlockEncodedSize, blockRawSize,
-		weakChecksum.GetChecksum(), strongChecksum.DigestAsData());
-
-	// Set vars to reading this block
-	mPositionInCurrentBlock = 0;
+	return pdata;
 }
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t, int32_t, uint32_t, uint8_t *)
-//		Purpose: Private. Adds an entry to the index currently being stored for sending at end of the stream.
+//		Name:    BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t, int64_t, int32_t, uint32_t, const uint8_t *)
+//		Purpose: Private. Stores the entry for the given block in the index to send at the end of the stream.
 //		Created: 16/1/04
 //
 // --------------------------------------------------------------------------
-void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum)
+void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t BlockNumber, int64_t EncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, const uint8_t *pStrongChecksum)
 {
+	if(BlockNumber < 0 || BlockNumber >= (int64_t)mBlockIndex.size())
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
 	// First, the encrypted section
 	file_BlockIndexEntryEnc entryEnc;
 	entryEnc.mSize = htonl(ClearSize);
@@ -635,13 +1571,14 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 	entry.mEncodedSize = box_hton64(((uint64_t)EncSizeOrBlkIndex));
 
 	// Then encrypt the encryted section
+	MutexLock lock(sSharedStateMutex);
 	// Generate the IV from the block number
 	if(sBlowfishEncryptBlockEntry.GetIVLength() != sizeof(mEntryIVBase))
 	{
 		THROW_EXCEPTION(BackupStoreException, IVLengthForEncodedBlockSizeDoesntMeetLengthRequirements)
 	}
 	uint64_t iv = mEntryIVBase;
-	iv += mAbsoluteBlockNumber;
+	iv += BlockNumber;
 	// Convert to network byte order before encrypting with it, so that restores work on
 	// platforms with different endiannesses.
 	iv = box_hton64(iv);
@@ -654,8 +1591,8 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 		THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
 	}
 
-	// Save to data block for sending at the end of the stream
-	mData.Write(&entry, sizeof(entry));
+	// Save for sending at the end of the stream
+	mBlockIndex[BlockNumber] = entry;
 }
 
 
@@ -704,17 +1641,19 @@ bool BackupStoreFileEncodeStream::StreamClosed()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::Recipe::Recipe(BackupStoreFileCreation::BlocksAvailableEntry *, int64_t)
-//		Purpose: Constructor. Takes ownership of the block index, and will delete it when it's deleted
+//		Name:    BackupStoreFileEncodeStream::Recipe::Recipe(BackupStoreFileCreation::BlocksAvailableEntry *, int64_t, int64_t, int32_t)
+//		Purpose: Constructor. Takes ownership of the block index, and will delete it when it's deleted.
+//				 The magic value (in host byte order) is that of the index the blocks came from.
 //		Created: 15/1/04
 //
 // --------------------------------------------------------------------------
 BackupStoreFileEncodeStream::Recipe::Recipe(
 	BackupStoreFileCreation::BlocksAvailableEntry *pBlockIndex,
-	int64_t NumBlocksInIndex, int64_t OtherFileID)
+	int64_t NumBlocksInIndex, int64_t OtherFileID, int32_t BlockIndexMagic)
 : mpBlockIndex(pBlockIndex),
   mNumBlocksInIndex(NumBlocksInIndex),
-  mOtherFileID(OtherFileID)
+  mOtherFileID(OtherFileID),
+  mBlockIndexMagic(BlockIndexMagic)
 {
 	ASSERT((mpBlockIndex == 0) || (NumBlocksInIndex != 0))
 }
@@ -736,6 +1675,24 @@ BackupStoreFileEncodeStream::Recipe::~Recipe()
 	}
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::Recipe::GetChunkAverageSize(int64_t)
+//		Purpose: Returns the average size to cut content defined
+//			 chunks of the new version of the file with, which
+//			 is the one the previous version was cut with if
+//			 there is one and it's still suitable
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileEncodeStream::Recipe::GetChunkAverageSize(
+	int64_t FileSize) const
+{
+	return ContentDefinedChunker::AverageSizeForDiff(mpBlockIndex,
+		mNumBlocksInIndex, FileSize);
+}
+
 
 
 
@@ -14,12 +14,18 @@
 
 #include "IOStream.h"
 #include "BackupStoreFilename.h"
+#include "BackupStoreObjectMagic.h"
 #include "CollectInBufferStream.h"
 #include "MD5Digest.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileWire.h"
 #include "ReadLoggingStream.h"
 #include "RunStatusProvider.h"
 
+class MemoryMappedFile;
+class ReadAheadStream;
+class BlockEncodePipeline;
+
 namespace BackupStoreFileCreation
 {
 	// Diffing and creation of files share some implementation details.
@@ -60,10 +66,13 @@ public:
 		// NOTE: This class is rather tied in with the implementation of diffing.
 	public:
 		Recipe(BackupStoreFileCreation::BlocksAvailableEntry *pBlockIndex, int64_t NumBlocksInIndex,
-			int64_t OtherFileID = 0);
+			int64_t OtherFileID = 0,
+			int32_t BlockIndexMagic = OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
 		~Recipe();
 	
 		int64_t GetOtherFileID() {return mOtherFileID;}
+		int32_t GetChunkAverageSize(int64_t FileSize) const;
+		int32_t GetBlockIndexMagic() {return mBlockIndexMagic;}
 		int64_t BlockPtrToIndex(BackupStoreFileCreation::BlocksAvailableEntry *pBlock)
 		{
 			return pBlock - mpBlockIndex;
@@ -73,6 +82,7 @@ public:
 		BackupStoreFileCreation::BlocksAvailableEntry *mpBlockIndex;
 		int64_t mNumBlocksInIndex;
 		int64_t mOtherFileID;
+		int32_t mBlockIndexMagic;
 	};
 	
 	void Setup(const std::string& Filename, Recipe *pRecipe, int64_t ContainerID,
@@ -89,6 +99,7 @@ public:
 	virtual bool StreamClosed();
 	int64_t GetBytesToUpload() { return mBytesToUpload; }
 	int64_t GetTotalBytesSent() { return mTotalBytesSent; }
+	void CopyBlockIndexTo(IOStream &rStream);
 
 	static void CalculateBlockSizes(int64_t DataSize, int64_t &rNumBlocksOut,
 		int32_t &rBlockSizeOut, int32_t &rLastBlockSizeOut);
@@ -102,15 +113,23 @@ private:
 		Status_Finished = 3
 	};
 
-	void EncodeCurrentBlock();
+	void CheckForCancellation();
+	void QueueBlocks();
+	void QueueCurrentBlock();
+	void StartSendingNextBlock();
+	const uint8_t *ReadSourceBlock(int Size, uint8_t *&rpBuffer);
 	void SkipPreviousBlocksInInstruction();
 	void SetForInstruction();
-	void StoreBlockIndexEntry(int64_t WncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum);
+	void StoreBlockIndexEntry(int64_t BlockNumber, int64_t EncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, const uint8_t *pStrongChecksum);
 
 	Recipe *mpRecipe;
 	IOStream *mpFile;					// source file
 	CollectInBufferStream mData;		// buffer for header and index entries
 	IOStream *mpLogging;
+	ReadLoggingStream *mpReadLogging;	// mpLogging, if it logs
+	ReadAheadStream *mpReadAhead;		// reads the file, if not mapped
+	MemoryMappedFile *mpMapping;		// source file mapping, if possible
+	int64_t mSourcePosition;			// current position in source file
 	RunStatusProvider* mpRunStatusProvider;
 	BackgroundTask* mpBackgroundTask;
 	int mStatus;
@@ -119,23 +138,34 @@ private:
 	int64_t mBytesToUpload; // Total number of clear bytes to encode and upload
 	int64_t mBytesUploaded; // Total number of clear bytes already encoded
 	// excluding reused blocks already on the server.
-	int64_t mAbsoluteBlockNumber;		// The absolute block number currently being output
+	// Blocks are read from the file and queued to be encoded ahead of
+	// the block being sent. The below are for the block being read.
+	int64_t mAbsoluteBlockNumber;		// The absolute block number currently being read
 	// Instruction number
 	int64_t mInstructionNumber;
 	// All the below are within the current instruction
 	int64_t mNumBlocks; // number of blocks. Last one will be a different size to the rest in most cases
 	int64_t mCurrentBlock;
-	int32_t mCurrentBlockEncodedSize;
-	int32_t mPositionInCurrentBlock;	// for reading out
 	int32_t mBlockSize;					// Basic block size of most of the blocks in the file
 	int32_t mLastBlockSize;				// the size (unencoded) of the last block in the file
+	// Content defined chunking: the sizes of all new blocks, and the
+	// index of the first one for each instruction (plus one at the end)
+	bool mContentDefined;
+	std::vector<int32_t> mChunkSizes;
+	std::vector<int64_t> mInstructionFirstChunk;
 	int64_t mTotalBytesSent;
+	// The block being sent
+	const uint8_t *mpCurrentBlockData;
+	int32_t mCurrentBlockEncodedSize;
+	int32_t mPositionInCurrentBlock;	// for reading out
 	// Buffers
 	uint8_t *mpRawBuffer;				// buffer for raw data
-	BackupStoreFile::EncodingBuffer mEncodedBuffer;
-										// buffer for encoded data
-	int32_t mAllocatedBufferSize;		// size of above two allocated blocks
+	BlockEncodePipeline *mpPipeline;	// blocks being encoded and sent
+	int32_t mAllocatedBufferSize;		// size of blocks allocated for raw or encoded data
 	uint64_t mEntryIVBase;				// base for block entry IV
+	int32_t mBlockIndexMagic;			// format of block index to write
+	std::vector<file_BlockIndexEntry> mBlockIndex;	// entries for the index, by block number
+	int mIncompressibleChunks;			// number of incompressible blocks in a row
 };
 
 
@@ -66,8 +66,14 @@ END_STRUCTURE_PACKING_FOR_WIRE
 // header for blocks of compressed data in files
 #define HEADER_CHUNK_IS_COMPRESSED		1	// bit
 #define HEADER_ENCODING_SHIFT			1	// shift value
-#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 7
-#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 7
+#define HEADER_ENCODING_MASK			7	// mask after shifting
+#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 3
+#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 3
+#define HEADER_COMPRESSION_SHIFT		4	// shift value
+#define HEADER_COMPRESSION_MASK			15	// mask after shifting
+// The compression type is a CompressCodec type, stored in bits 4 -- 7, and
+// is always 0 (zlib) if the chunk isn't compressed. Only zlib was used
+// before compression could be chosen, so older files have 0 there too.
 
 
 #endif // BACKUPSTOREFILEWIRE__H
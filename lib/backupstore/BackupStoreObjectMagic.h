@@ -23,9 +23,24 @@
 #define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 0x62696478
 // Do not use v0 in any new code!
 #define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0 0x46426C6B
+// v2 has the same layout as v1, but the strong checksum of each block is
+// a 128 bit XXH3 digest instead of MD5. Only sent to servers which accept
+// BACKUP_STORE_SERVER_VERSION_XXH3.
+#define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2 0x62696433
+
+// Is the value (in host byte order) the magic of a block index in one of
+// the current formats? An index which refers to blocks in another file has
+// its own entries for them, so the formats can be mixed in a chain of diffs.
+#define OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(value) \
+	((value) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 || \
+	 (value) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
 
 // Magic value for directory streams
 #define OBJECTMAGIC_DIR_MAGIC_VALUE 		0x4449525F
 
+// Magic value for bundles of small files packed together by housekeeping,
+// which aren't referenced by any directory (see BackupStoreBundle.h)
+#define OBJECTMAGIC_BUNDLE_MAGIC_VALUE		0x626E646C
+
 #endif // BACKUPSTOREOBJECTMAGIC__H
 
@@ -0,0 +1,411 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ContentDefinedChunker.cpp
+//		Purpose: Cut a stream into blocks at boundaries chosen by its
+//			 content, with a FastCDC style gear hash
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "BackupStoreConstants.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFileEncodeStream.h"
+#include "ContentDefinedChunker.h"
+#include "IOStream.h"
+#include "MemoryMappedFile.h"
+
+#include "MemLeakFindOn.h"
+
+// Random values for each byte, added into the hash as the bytes go past.
+// These must never change, or the boundaries in files which have already
+// been uploaded won't be found again.
+static uint64_t sGear[256];
+
+static bool InitialiseGear()
+{
+	// splitmix64, from a fixed seed
+	uint64_t state = 0x426f784261636b75ULL;
+	for(int i = 0; i < 256; ++i)
+	{
+		state += 0x9e3779b97f4a7c15ULL;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		sGear[i] = z ^ (z >> 31);
+	}
+	return true;
+}
+
+static bool sGearInitialised = InitialiseGear();
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::ContentDefinedChunker(IOStream &, int64_t, int32_t, MemoryMappedFile *)
+//		Purpose: Constructor. Chunks will be read from the current
+//			 position of the stream. AverageSize must be a power
+//			 of 2. If pMapping is given, it must map the stream's
+//			 file, and the chunks are found in it without copying
+//			 until it stops working, when the stream is read from
+//			 the same place instead.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+ContentDefinedChunker::ContentDefinedChunker(IOStream &rStream,
+	int64_t Length, int32_t AverageSize, MemoryMappedFile *pMapping)
+: mrStream(rStream),
+  mpMapping(pMapping),
+  mPosition(0),
+  mLengthLeft(Length),
+  mMinimumSize(AverageSize / 4),
+  mAverageSize(AverageSize),
+  mMaximumSize(AverageSize * 4),
+  mMaskSmall(0),
+  mMaskLarge(0),
+  mpBuffer(0),
+  mBufferSize(0),
+  mBufferStart(0),
+  mBytesInBuffer(0),
+  mEndOfStream(false)
+{
+	ASSERT(sGearInitialised);
+	ASSERT(AverageSize >= 64 && (AverageSize & (AverageSize - 1)) == 0);
+
+	if(mMaximumSize > BACKUP_FILE_MAX_BLOCK_SIZE)
+	{
+		mMaximumSize = BACKUP_FILE_MAX_BLOCK_SIZE;
+	}
+	if(mMaximumSize < mAverageSize)
+	{
+		mMaximumSize = mAverageSize;
+	}
+
+	// Normalised chunking: a cut is harder to find before the average
+	// size and easier after it, which keeps the sizes close to the
+	// average. The hash is shifted left as bytes are added, so its top
+	// bits depend on the most data.
+	int bits = 0;
+	while((1 << bits) < AverageSize)
+	{
+		++bits;
+	}
+	mMaskSmall = ~((~(uint64_t)0) >> (bits + 1));
+	mMaskLarge = ~((~(uint64_t)0) >> (bits - 1));
+
+	// Room for the largest chunk, plus a small tail which would be
+	// added to it, with plenty more so that the stream is read in
+	// large pieces. It's only allocated if the stream is read.
+	mBufferSize = (mMaximumSize * 2) + BACKUP_FILE_AVOID_BLOCKS_LESS_THAN;
+
+	if(mpMapping != 0)
+	{
+		mPosition = mrStream.GetPosition();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::~ContentDefinedChunker()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+ContentDefinedChunker::~ContentDefinedChunker()
+{
+	::free(mpBuffer);
+	mpBuffer = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::AverageSizeForFile(int64_t)
+//		Purpose: Static. The average chunk size to use for a file of
+//			 this size, which is the size of most of the blocks it
+//			 would have been cut into otherwise. Both the encoder and
+//			 the diff must use the same size to find the same chunks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int32_t ContentDefinedChunker::AverageSizeForFile(int64_t FileSize)
+{
+	int64_t numBlocks;
+	int32_t blockSize, lastBlockSize;
+	BackupStoreFileEncodeStream::CalculateBlockSizes(FileSize, numBlocks,
+		blockSize, lastBlockSize);
+
+	// Leave room for chunks bigger than the average
+	if(blockSize > BACKUP_FILE_MAX_BLOCK_SIZE / 2)
+	{
+		blockSize = BACKUP_FILE_MAX_BLOCK_SIZE / 2;
+	}
+
+	return blockSize;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::AverageSizeForDiff(
+//			 const BlocksAvailableEntry *, int64_t, int64_t)
+//		Purpose: Static. The average chunk size to use for a new
+//			 version of a file, diffed against a previous version
+//			 with the given block index (or none). The size the
+//			 previous version was actually cut with is kept, so
+//			 that a file which grows past a block size boundary
+//			 still has the same chunks in every later version,
+//			 until it's grown or shrunk so much that its blocks
+//			 would be far too small or too large.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int32_t ContentDefinedChunker::AverageSizeForDiff(
+	const BackupStoreFileCreation::BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int64_t FileSize)
+{
+	int32_t average = AverageSizeForFile(FileSize);
+	int32_t previousAverage = AverageSizeOfIndex(pIndex, NumBlocks);
+	if(previousAverage == 0)
+	{
+		return average;
+	}
+
+	if(average >= previousAverage * 4 || previousAverage >= average * 4)
+	{
+		return average;
+	}
+	return previousAverage;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::AverageSizeOfIndex(
+//			 const BlocksAvailableEntry *, int64_t)
+//		Purpose: Static. Works out the average chunk size a file was
+//			 cut with from the sizes of its blocks: the median
+//			 size, rounded to the nearest power of 2 and kept
+//			 within the sizes AverageSizeForFile could return.
+//			 Blocks of a fixed size give that size. Returns 0 if
+//			 there are too few blocks to tell, when the size of
+//			 the file is used instead.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+int32_t ContentDefinedChunker::AverageSizeOfIndex(
+	const BackupStoreFileCreation::BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks)
+{
+	if(NumBlocks <= 0)
+	{
+		return 0;
+	}
+
+	std::vector<int32_t> sizes;
+	sizes.reserve(NumBlocks);
+	int64_t fileSize = 0;
+	for(int64_t b = 0; b < NumBlocks; ++b)
+	{
+		sizes.push_back(pIndex[b].mSize);
+		fileSize += pIndex[b].mSize;
+	}
+	if(NumBlocks < BACKUP_FILE_CDC_MIN_BLOCKS_FOR_AVERAGE)
+	{
+		return AverageSizeForFile(fileSize);
+	}
+
+	std::nth_element(sizes.begin(), sizes.begin() + (NumBlocks / 2),
+		sizes.end());
+	int64_t median = sizes[NumBlocks / 2];
+
+	int64_t average = BACKUP_FILE_MIN_BLOCK_SIZE;
+	while(average < BACKUP_FILE_MAX_BLOCK_SIZE / 2 &&
+		median * median >= average * average * 2)
+	{
+		// Nearer to the next power of 2 (median >= average * sqrt 2)
+		average *= 2;
+	}
+
+	return average;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::NextChunk(const uint8_t *&, int32_t &)
+//		Purpose: Finds the next chunk, returning false if there are no
+//			 more. rpData points at its data until the next call. If
+//			 the stream ends early, the rest of the length is still
+//			 split into chunks, but rpData is set to 0 for them.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool ContentDefinedChunker::NextChunk(const uint8_t *&rpData, int32_t &rSize)
+{
+	if(mLengthLeft <= 0)
+	{
+		return false;
+	}
+
+	// Make sure there's enough data buffered for the largest chunk
+	// which could be returned
+	int64_t wanted = mMaximumSize + BACKUP_FILE_AVOID_BLOCKS_LESS_THAN;
+	if(wanted > mLengthLeft)
+	{
+		wanted = mLengthLeft;
+	}
+
+	if(mpMapping != 0)
+	{
+		const uint8_t *pmapped = 0;
+		if(mpMapping->IsMapped() &&
+			mPosition + wanted <= mpMapping->GetFileSize())
+		{
+			pmapped = mpMapping->GetData(mPosition, wanted);
+		}
+		if(pmapped != 0)
+		{
+			rpData = pmapped;
+			rSize = CutChunk(pmapped, wanted);
+			mPosition += rSize;
+			return true;
+		}
+
+		// The file has changed since it was mapped, so read the rest
+		// of it from where the mapping got to
+		mrStream.Seek(mPosition, IOStream::SeekType_Absolute);
+		mpMapping = 0;
+	}
+
+	if(mpBuffer == 0)
+	{
+		mpBuffer = (uint8_t *)::malloc(mBufferSize);
+		if(mpBuffer == 0)
+		{
+			throw std::bad_alloc();
+		}
+	}
+
+	if((mBytesInBuffer - mBufferStart) < wanted && !mEndOfStream)
+	{
+		// Move the data which is left to the start, and fill up the
+		// rest, without reading past the end of the section
+		int32_t kept = mBytesInBuffer - mBufferStart;
+		::memmove(mpBuffer, mpBuffer + mBufferStart, kept);
+		mBufferStart = 0;
+		mBytesInBuffer = kept;
+
+		int64_t toRead = mBufferSize - kept;
+		if(toRead > mLengthLeft - kept)
+		{
+			toRead = mLengthLeft - kept;
+		}
+		while(toRead > 0)
+		{
+			int bytes = mrStream.Read(mpBuffer + mBytesInBuffer, toRead);
+			if(bytes <= 0)
+			{
+				mEndOfStream = true;
+				break;
+			}
+			mBytesInBuffer += bytes;
+			toRead -= bytes;
+		}
+	}
+
+	int32_t available = mBytesInBuffer - mBufferStart;
+	if(available == 0)
+	{
+		// The stream ended early, so there's no data to cut by
+		rpData = 0;
+		rSize = (mLengthLeft > mMaximumSize)?mMaximumSize:mLengthLeft;
+		mLengthLeft -= rSize;
+		return true;
+	}
+
+	rpData = mpBuffer + mBufferStart;
+	rSize = CutChunk(rpData, available);
+	mBufferStart += rSize;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::CutChunk(const uint8_t *, int32_t)
+//		Purpose: Private. Returns the size of the next chunk, which
+//			 starts at pData, where Available bytes are ready, and
+//			 counts it as returned.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+int32_t ContentDefinedChunker::CutChunk(const uint8_t *pData,
+	int32_t Available)
+{
+	int32_t size = FindBoundary(pData,
+		(Available > mMaximumSize)?mMaximumSize:Available);
+
+	// Avoid leaving a tiny block at the end
+	int64_t after = mLengthLeft - size;
+	if(after > 0 && after < BACKUP_FILE_AVOID_BLOCKS_LESS_THAN &&
+		size + after <= Available)
+	{
+		size += after;
+	}
+
+	mLengthLeft -= size;
+	return size;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ContentDefinedChunker::FindBoundary(const uint8_t *, int32_t)
+//		Purpose: Private. Returns the size of the chunk at the start of
+//			 the data, which is Length if no boundary is found.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int32_t ContentDefinedChunker::FindBoundary(const uint8_t *pData,
+	int32_t Length) const
+{
+	if(Length <= mMinimumSize)
+	{
+		return Length;
+	}
+
+	// Nothing can be cut before the minimum size, so the hash only
+	// needs to start there
+	uint64_t hash = 0;
+	int32_t i = mMinimumSize;
+	int32_t normal = (Length < mAverageSize)?Length:mAverageSize;
+	for(; i < normal; ++i)
+	{
+		hash = (hash << 1) + sGear[pData[i]];
+		if((hash & mMaskSmall) == 0)
+		{
+			return i + 1;
+		}
+	}
+	for(; i < Length; ++i)
+	{
+		hash = (hash << 1) + sGear[pData[i]];
+		if((hash & mMaskLarge) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	return Length;
+}
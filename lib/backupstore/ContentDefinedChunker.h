@@ -0,0 +1,80 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ContentDefinedChunker.h
+//		Purpose: Cut a stream into blocks at boundaries chosen by its
+//			 content, with a FastCDC style gear hash
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef CONTENTDEFINEDCHUNKER__H
+#define CONTENTDEFINEDCHUNKER__H
+
+#include "BackupStoreFileEncodeStream.h"
+
+class IOStream;
+class MemoryMappedFile;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ContentDefinedChunker
+//		Purpose: Reads Length bytes from a stream, or a mapping of
+//			 the stream's file, and splits them into chunks
+//			 between the minimum and maximum sizes, cutting where
+//			 a hash of the last few bytes has enough zero bits.
+//			 An insertion or deletion only moves the boundaries near
+//			 it, so the rest of the chunks are unchanged and can be
+//			 found in the previous version of the file by lookup,
+//			 without a rolling search.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ContentDefinedChunker
+{
+public:
+	ContentDefinedChunker(IOStream &rStream, int64_t Length,
+		int32_t AverageSize, MemoryMappedFile *pMapping = 0);
+	~ContentDefinedChunker();
+private:
+	// no copying
+	ContentDefinedChunker(const ContentDefinedChunker &);
+	ContentDefinedChunker &operator=(const ContentDefinedChunker &);
+public:
+
+	bool NextChunk(const uint8_t *&rpData, int32_t &rSize);
+
+	int32_t GetMinimumSize() const {return mMinimumSize;}
+	int32_t GetAverageSize() const {return mAverageSize;}
+	int32_t GetMaximumSize() const {return mMaximumSize;}
+
+	static int32_t AverageSizeForFile(int64_t FileSize);
+	static int32_t AverageSizeForDiff(
+		const BackupStoreFileCreation::BlocksAvailableEntry *pIndex,
+		int64_t NumBlocks, int64_t FileSize);
+	static int32_t AverageSizeOfIndex(
+		const BackupStoreFileCreation::BlocksAvailableEntry *pIndex,
+		int64_t NumBlocks);
+
+private:
+	int32_t FindBoundary(const uint8_t *pData, int32_t Length) const;
+	int32_t CutChunk(const uint8_t *pData, int32_t Available);
+
+	IOStream &mrStream;
+	MemoryMappedFile *mpMapping;	// 0 if reading the stream
+	int64_t mPosition;		// in the file, if mapped
+	int64_t mLengthLeft;		// bytes not yet returned in chunks
+	int32_t mMinimumSize;
+	int32_t mAverageSize;
+	int32_t mMaximumSize;
+	uint64_t mMaskSmall;		// used before the average size
+	uint64_t mMaskLarge;		// used after it
+	uint8_t *mpBuffer;
+	int32_t mBufferSize;
+	int32_t mBufferStart;		// offset of the next chunk in mpBuffer
+	int32_t mBytesInBuffer;
+	bool mEndOfStream;
+};
+
+#endif // CONTENTDEFINEDCHUNKER__H
@@ -16,6 +16,7 @@
 #include "autogen_BackupStoreException.h"
 #include "BackupConstants.h"
 #include "BackupStoreAccountDatabase.h"
+#include "BackupStoreBundle.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreFile.h"
@@ -24,6 +25,7 @@
 #include "BufferedStream.h"
 #include "HousekeepStoreAccount.h"
 #include "NamedLock.h"
+#include "RaidFileController.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
 #include "StoreStructure.h"
@@ -51,6 +53,9 @@ HousekeepStoreAccount::HousekeepStoreAccount(int AccountID,
 	  mDeletionSizeTarget(0),
   	  mPotentialDeletionsTotalSize(0),
 	  mMaxSizeInPotentialDeletions(0),
+	  mMaxBundledFileSizeInBlocks(0),
+	  mFilesBundled(0),
+	  mBundlesWritten(0),
 	  mErrorCount(0),
 	  mBlocksUsed(0),
 	  mBlocksInOldFiles(0),
@@ -95,6 +100,23 @@ HousekeepStoreAccount::~HousekeepStoreAccount()
 	}
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::SetMaxBundledFileSize(int64_t)
+//		Purpose: Pack files no bigger than this into bundles, to
+//			 save the space wasted at the end of each one's last
+//			 block. Zero, the default, turns bundling off.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void HousekeepStoreAccount::SetMaxBundledFileSize(int64_t Bytes)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	int64_t blockSize = rcontroller.GetDiscSet(mStoreDiscSet).GetBlockSize();
+	mMaxBundledFileSizeInBlocks = Bytes / blockSize;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -149,6 +171,13 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 		mTagWithClientID.Change(tag.str());
 	}
 
+	// Writer sessions delete the files staged for them when they finish,
+	// but not if they never finish, so delete any which have been left
+	// long enough that nothing can be going to store them
+	StoreStructure::DeleteStagedFiles(mStoreRoot, mStoreDiscSet,
+		GetCurrentBoxTime() -
+		SecondsToBoxTime(STORE_STAGED_FILE_ORPHAN_AGE));
+
 	// Calculate how much should be deleted
 	mDeletionSizeTarget = info->GetBlocksUsed() - info->GetBlocksSoftLimit();
 	if(mDeletionSizeTarget < 0)
@@ -159,6 +188,11 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	BackupStoreAccountDatabase::Entry account(mAccountID, mStoreDiscSet);
 	mapNewRefs = BackupStoreRefCountDatabase::Create(account);
 
+	// Files which are deleted may be in bundles
+	mapBundleIndex.reset(new BackupStoreBundleIndex(mStoreRoot,
+		mStoreDiscSet));
+	mapBundleIndex->Load();
+
 	// Scan the directory for potential things to delete
 	// This will also remove eligible items marked with RemoveASAP
 	bool continueHousekeeping = ScanDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID,
@@ -207,6 +241,7 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	{
 		mapNewRefs->Discard();
 		info->Save();
+		mapBundleIndex->Save();
 		return false;
 	}
 
@@ -244,6 +279,14 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 		deleteInterrupted = DeleteEmptyDirectories(*info);
 	}
 
+	// Then pack small files into bundles, and rewrite the bundles
+	// which files were deleted from
+	if(!deleteInterrupted)
+	{
+		deleteInterrupted = BundleSmallFiles(*info);
+	}
+	mapBundleIndex->Save();
+
 	// Log deletion if anything was deleted
 	if(mFilesDeleted > 0 || mEmptyDirectoriesDeleted > 0)
 	{
@@ -256,6 +299,14 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 			(deleteInterrupted?" and was interrupted":""));
 	}
 
+	if(mBundlesWritten > 0)
+	{
+		BOX_INFO("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(mAccountID) << " "
+			"bundled " << mFilesBundled << " files into " <<
+			mBundlesWritten << " bundles");
+	}
+
 	// Make sure the delta's won't cause problems if the counts are
 	// really wrong, and it wasn't fixed because the store was
 	// updated during the scan.
@@ -439,6 +490,18 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 			if(en->IsOld()) mBlocksInOldFiles += enSizeInBlocks;
 			if(en->IsDeleted()) mBlocksInDeletedFiles += enSizeInBlocks;
 
+			// Small files can be bundled, unless they're part of
+			// a chain of patches, which are rewritten in place
+			if(mMaxBundledFileSizeInBlocks > 0 &&
+				enSizeInBlocks <= mMaxBundledFileSizeInBlocks &&
+				en->GetDependsNewer() == 0 &&
+				en->GetDependsOlder() == 0 &&
+				mapBundleIndex->Find(en->GetObjectID()) == 0)
+			{
+				mBundleCandidates.push_back(std::pair<int64_t, int64_t>(
+					en->GetObjectID(), enSizeInBlocks));
+			}
+
 			// Work out ages of this version from the last mark
 			int32_t enVersionAge = 0;
 			std::map<version_t, int32_t>::iterator enVersionAgeI(
@@ -886,8 +949,20 @@ BackupStoreRefCountDatabase::refcount_t HousekeepStoreAccount::DeleteFile(
 		BOX_FORMAT_OBJECTID(ObjectID));
 	std::string objFilename;
 	MakeObjectFilename(ObjectID, objFilename);
-	RaidFileWrite del(mStoreDiscSet, objFilename, mapNewRefs->GetRefCount(ObjectID));
-	del.Delete();
+	const BackupStoreBundleIndex::Member *pbundled =
+		mapBundleIndex->Find(ObjectID);
+	bool wasBundled = (pbundled != 0);
+	if(wasBundled)
+	{
+		// Its data stays in the bundle until that's rewritten
+		mBundlesChanged.insert(pbundled->mBundleID);
+		mapBundleIndex->Remove(ObjectID);
+	}
+	if(!wasBundled || RaidFileRead::FileExists(mStoreDiscSet, objFilename))
+	{
+		RaidFileWrite del(mStoreDiscSet, objFilename, mapNewRefs->GetRefCount(ObjectID));
+		del.Delete();
+	}
 
 	// Adjust counts for the file
 	++mFilesDeleted;
@@ -1150,3 +1225,229 @@ void HousekeepStoreAccount::DeleteEmptyDirectory(int64_t dirId,
 	}
 }
 
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::BundleSmallFiles(
+//			 BackupStoreInfo &)
+//		Purpose: Rewrite the bundles which files have been deleted
+//			 from, once less than half of them is used, and pack
+//			 the small files found by the scan into new bundles.
+//			 The sizes of bundled files in their directories
+//			 don't change, so neither do the usage counts.
+//			 Returns true if the operation was interrupted.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool HousekeepStoreAccount::BundleSmallFiles(BackupStoreInfo& rBackupStoreInfo)
+{
+	std::auto_ptr<BackupStoreBundleWriter> apWriter(
+		new BackupStoreBundleWriter);
+	// Whether the writer holds files from bundles which will be deleted
+	bool mustWrite = false;
+	std::vector<int64_t> bundlesToDelete;
+
+	if(!mBundlesChanged.empty())
+	{
+		// Find how much of each changed bundle is still used
+		const BackupStoreBundleIndex::Members_t &members(
+			mapBundleIndex->GetMembers());
+		std::map<int64_t, int64_t> bytesUsed;
+		std::map<int64_t, std::vector<int64_t> > membersOf;
+		for(BackupStoreBundleIndex::Members_t::const_iterator
+			i(members.begin()); i != members.end(); ++i)
+		{
+			if(mBundlesChanged.find(i->second.mBundleID) !=
+				mBundlesChanged.end())
+			{
+				bytesUsed[i->second.mBundleID] += i->second.mLength;
+				membersOf[i->second.mBundleID].push_back(i->first);
+			}
+		}
+
+		for(std::set<int64_t>::const_iterator b(mBundlesChanged.begin());
+			b != mBundlesChanged.end(); ++b)
+		{
+			if(bytesUsed[*b] > 0)
+			{
+				// Compare with everything which was put in it
+				std::string bundleFilename;
+				MakeObjectFilename(*b, bundleFilename);
+				std::auto_ptr<RaidFileRead> bundle(
+					RaidFileRead::Open(mStoreDiscSet,
+						bundleFilename));
+				BackupStoreBundleIndex::Members_t all;
+				BackupStoreBundleIndex::ReadBundleMembers(*bundle,
+					*b, all);
+				int64_t bytesInBundle = 0;
+				for(BackupStoreBundleIndex::Members_t::const_iterator
+					i(all.begin()); i != all.end(); ++i)
+				{
+					bytesInBundle += i->second.mLength;
+				}
+
+				if(bytesUsed[*b] * 100 >= bytesInBundle *
+					BACKUPSTORE_BUNDLE_MIN_PERCENT_USED)
+				{
+					// Still worth keeping as it is
+					continue;
+				}
+
+				// Move the files still used into a new bundle
+				const std::vector<int64_t> &ids(membersOf[*b]);
+				for(std::vector<int64_t>::const_iterator
+					i(ids.begin()); i != ids.end(); ++i)
+				{
+					std::auto_ptr<IOStream> data(
+						mapBundleIndex->OpenMember(*i));
+					apWriter->Add(*i, *data,
+						mapBundleIndex->Find(*i)->mSizeInBlocks);
+					mustWrite = true;
+
+					if(apWriter->GetSize() >=
+						BACKUPSTORE_BUNDLE_MAX_SIZE)
+					{
+						WriteBundle(*apWriter, rBackupStoreInfo);
+						apWriter.reset(new BackupStoreBundleWriter);
+						mustWrite = false;
+					}
+				}
+			}
+
+			bundlesToDelete.push_back(*b);
+		}
+	}
+
+	bool interrupted = false;
+	for(std::vector<std::pair<int64_t, int64_t> >::const_iterator
+		i(mBundleCandidates.begin()); i != mBundleCandidates.end(); ++i)
+	{
+#ifndef WIN32
+		if((--mCountUntilNextInterprocessMsgCheck) <= 0)
+		{
+			mCountUntilNextInterprocessMsgCheck = POLL_INTERPROCESS_MSG_CHECK_FREQUENCY;
+			// Check for having to stop
+			if(mpHousekeepingCallback && mpHousekeepingCallback->CheckForInterProcessMsg(mAccountID))	// include account ID here as the specified account is now locked
+			{
+				// Finish off what's been done so far, then stop
+				interrupted = true;
+				break;
+			}
+		}
+#endif
+
+		// Files in more than one directory, or deleted since the
+		// scan, are left alone
+		int64_t objectID = i->first;
+		if(mapNewRefs->GetRefCount(objectID) != 1 ||
+			mapBundleIndex->Find(objectID) != 0)
+		{
+			continue;
+		}
+
+		std::string objFilename;
+		MakeObjectFilename(objectID, objFilename);
+		if(!RaidFileRead::FileExists(mStoreDiscSet, objFilename))
+		{
+			continue;
+		}
+
+		std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mStoreDiscSet,
+			objFilename));
+		apWriter->Add(objectID, *file, i->second);
+
+		if(apWriter->GetSize() >= BACKUPSTORE_BUNDLE_MAX_SIZE)
+		{
+			WriteBundle(*apWriter, rBackupStoreInfo);
+			apWriter.reset(new BackupStoreBundleWriter);
+			mustWrite = false;
+		}
+	}
+
+	// A bundle of one file saves nothing, unless it's been moved from
+	// a bundle which is about to go
+	if(apWriter->GetNumMembers() > 1 ||
+		(mustWrite && apWriter->GetNumMembers() > 0))
+	{
+		WriteBundle(*apWriter, rBackupStoreInfo);
+	}
+
+	// Delete the bundles which nothing is in any more, now that the
+	// index doesn't point to them
+	mapBundleIndex->Save();
+	std::set<int64_t> inUse;
+	if(!bundlesToDelete.empty())
+	{
+		const BackupStoreBundleIndex::Members_t &members(
+			mapBundleIndex->GetMembers());
+		for(BackupStoreBundleIndex::Members_t::const_iterator
+			i(members.begin()); i != members.end(); ++i)
+		{
+			inUse.insert(i->second.mBundleID);
+		}
+	}
+	for(std::vector<int64_t>::const_iterator b(bundlesToDelete.begin());
+		b != bundlesToDelete.end(); ++b)
+	{
+		std::string bundleFilename;
+		MakeObjectFilename(*b, bundleFilename);
+		if(inUse.find(*b) != inUse.end() ||
+			!RaidFileRead::FileExists(mStoreDiscSet, bundleFilename))
+		{
+			continue;
+		}
+
+		BOX_TRACE("Removing unused bundle " << BOX_FORMAT_OBJECTID(*b));
+		RaidFileWrite del(mStoreDiscSet, bundleFilename);
+		del.Delete();
+	}
+
+	return interrupted;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::WriteBundle(
+//			 BackupStoreBundleWriter &, BackupStoreInfo &)
+//		Purpose: Write out a bundle with a new ID, and then delete
+//			 the objects of the files in it, which the index now
+//			 finds in the bundle instead
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void HousekeepStoreAccount::WriteBundle(BackupStoreBundleWriter &rWriter,
+	BackupStoreInfo& rBackupStoreInfo)
+{
+	int64_t bundleID = rBackupStoreInfo.AllocateObjectID();
+	std::string bundleFilename;
+	StoreStructure::MakeObjectFilename(bundleID, mStoreRoot, mStoreDiscSet,
+		bundleFilename, true /* make sure the directory exists */);
+	rWriter.Write(bundleFilename, mStoreDiscSet, bundleID, *mapBundleIndex);
+
+	// Nothing must be deleted until the ID of the bundle can't be
+	// allocated again, and the index says where the files are
+	rBackupStoreInfo.Save();
+	mapBundleIndex->Save();
+
+	const std::vector<int64_t> &ids(rWriter.GetObjectIDs());
+	for(std::vector<int64_t>::const_iterator i(ids.begin());
+		i != ids.end(); ++i)
+	{
+		std::string objFilename;
+		MakeObjectFilename(*i, objFilename);
+		if(RaidFileRead::FileExists(mStoreDiscSet, objFilename))
+		{
+			RaidFileWrite del(mStoreDiscSet, objFilename);
+			del.Delete();
+		}
+	}
+
+	BOX_TRACE("Housekeeping wrote bundle " << BOX_FORMAT_OBJECTID(bundleID) <<
+		" of " << ids.size() << " files");
+	mFilesBundled += ids.size();
+	++mBundlesWritten;
+}
@@ -16,6 +16,8 @@
 
 #include "BackupStoreRefCountDatabase.h"
 
+class BackupStoreBundleIndex;
+class BackupStoreBundleWriter;
 class BackupStoreDirectory;
 
 class HousekeepingCallback
@@ -42,6 +44,7 @@ public:
 	
 	bool DoHousekeeping(bool KeepTryingForever = false);
 	int GetErrorCount() { return mErrorCount; }
+	void SetMaxBundledFileSize(int64_t Bytes);
 	
 private:
 	// utility functions
@@ -59,6 +62,9 @@ private:
 		BackupStoreInfo& rBackupStoreInfo);
 	void UpdateDirectorySize(BackupStoreDirectory &rDirectory,
 		IOStream::pos_type new_size_in_blocks);
+	bool BundleSmallFiles(BackupStoreInfo& rBackupStoreInfo);
+	void WriteBundle(BackupStoreBundleWriter &rWriter,
+		BackupStoreInfo& rBackupStoreInfo);
 
 	typedef struct
 	{
@@ -89,6 +95,15 @@ private:
 	// List of directories which are empty, and might be good for deleting
 	std::vector<int64_t> mEmptyDirectories;
 
+	// Bundling of small files: those which might be bundled, in the
+	// order found, and the bundles which files have been deleted from
+	int64_t mMaxBundledFileSizeInBlocks;
+	std::auto_ptr<BackupStoreBundleIndex> mapBundleIndex;
+	std::vector<std::pair<int64_t, int64_t> > mBundleCandidates; // ID, size
+	std::set<int64_t> mBundlesChanged;
+	int64_t mFilesBundled;
+	int64_t mBundlesWritten;
+
 	// Count of errors found and fixed
 	int64_t mErrorCount;
 	
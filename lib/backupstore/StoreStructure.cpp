@@ -9,6 +9,13 @@
 
 #include "Box.h"
 
+#include <stdio.h>
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include "FileModificationTime.h"
 #include "StoreStructure.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
@@ -93,3 +100,146 @@ void StoreStructure::MakeWriteLockFilename(const std::string &rStoreRoot, int Di
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    StoreStructure::MakeStagedFilename(int64_t, const std::string &, int, std::string &)
+//		Purpose: Generate the on disc filename of a staged file. It's
+//			 not a RaidFile, so it's ignored by anything which
+//			 lists the store.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void StoreStructure::MakeStagedFilename(int64_t StagedID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet &rdiscSet(rcontroller.GetDiscSet(DiscSet));
+
+	char hex[32];
+	::snprintf(hex, sizeof(hex), "%llx", (unsigned long long)StagedID);
+
+	rFilenameOut = rdiscSet[0] + DIRECTORY_SEPARATOR + rStoreRoot +
+		STORE_STAGED_FILE_PREFIX + hex + STORE_STAGED_FILE_SUFFIX;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    IsStagedFilename(const std::string &)
+//		Purpose: Whether a file in an account root is a staged file
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+static bool IsStagedFilename(const std::string &rLeaf)
+{
+	std::string prefix(STORE_STAGED_FILE_PREFIX);
+	std::string suffix(STORE_STAGED_FILE_SUFFIX);
+	return rLeaf.size() > prefix.size() + suffix.size() &&
+		rLeaf.compare(0, prefix.size(), prefix) == 0 &&
+		rLeaf.compare(rLeaf.size() - suffix.size(), suffix.size(),
+			suffix) == 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    StoreStructure::DeleteStagedFiles(const std::string &, int, box_time_t)
+//		Purpose: Delete the staged files in an account, or only those
+//			 last modified before ModifiedBefore if it isn't zero.
+//			 Returns the number of files deleted.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+int StoreStructure::DeleteStagedFiles(const std::string &rStoreRoot, int DiscSet, box_time_t ModifiedBefore)
+{
+	// Staged files are all on the first disc, like the write lock
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	std::string dirName(rcontroller.GetDiscSet(DiscSet)[0] +
+		DIRECTORY_SEPARATOR + rStoreRoot);
+	DIR *dirHandle = ::opendir(dirName.c_str());
+	if(dirHandle == 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to open account root " << dirName <<
+			" to delete staged files");
+		return 0;
+	}
+
+	int deleted = 0;
+	struct dirent *en = 0;
+	while((en = ::readdir(dirHandle)) != 0)
+	{
+		std::string leaf(en->d_name);
+		if(!IsStagedFilename(leaf))
+		{
+			continue;
+		}
+
+		std::string filename(dirName + leaf);
+		if(ModifiedBefore != 0)
+		{
+			EMU_STRUCT_STAT st;
+			if(EMU_STAT(filename.c_str(), &st) != 0 ||
+				FileModificationTime(st) >= ModifiedBefore)
+			{
+				// Gone already, or may still be wanted
+				continue;
+			}
+		}
+
+		if(::unlink(filename.c_str()) != 0)
+		{
+			BOX_LOG_SYS_WARNING("Failed to delete staged file " <<
+				filename);
+		}
+		else
+		{
+			BOX_INFO("Deleted unused staged file " << filename);
+			deleted++;
+		}
+	}
+	::closedir(dirHandle);
+
+	return deleted;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    StoreStructure::GetStagedFilesSize(const std::string &, int)
+//		Purpose: Returns the total size of the staged files in an
+//			 account, whichever sessions are writing them.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+int64_t StoreStructure::GetStagedFilesSize(const std::string &rStoreRoot, int DiscSet)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	std::string dirName(rcontroller.GetDiscSet(DiscSet)[0] +
+		DIRECTORY_SEPARATOR + rStoreRoot);
+	DIR *dirHandle = ::opendir(dirName.c_str());
+	if(dirHandle == 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to open account root to count "
+			"staged files", dirName, CommonException, OSFileError);
+	}
+
+	int64_t size = 0;
+	struct dirent *en = 0;
+	while((en = ::readdir(dirHandle)) != 0)
+	{
+		std::string leaf(en->d_name);
+		EMU_STRUCT_STAT st;
+		if(IsStagedFilename(leaf) &&
+			EMU_STAT((dirName + leaf).c_str(), &st) == 0)
+		{
+			// Files which have gone since don't count
+			size += st.st_size;
+		}
+	}
+	::closedir(dirHandle);
+
+	return size;
+}
@@ -12,6 +12,8 @@
 
 #include <string>
 
+#include "BoxTime.h"
+
 #ifdef BOX_RELEASE_BUILD
 	#define STORE_ID_SEGMENT_LENGTH		8
 	#define STORE_ID_SEGMENT_MASK		0xff
@@ -22,10 +24,22 @@
 #endif
 
 
+// Files sent by helper sessions, waiting in the account root on the first
+// disc of the set to be stored by the writer session
+#define STORE_STAGED_FILE_PREFIX	"stage-"
+#define STORE_STAGED_FILE_SUFFIX	".stage"
+
+// Housekeeping deletes staged files which are older than this, in seconds,
+// as the writer session which should have stored or deleted them is gone
+#define STORE_STAGED_FILE_ORPHAN_AGE	(24*60*60)
+
 namespace StoreStructure
 {
 	void MakeObjectFilename(int64_t ObjectID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut, bool EnsureDirectoryExists);
 	void MakeWriteLockFilename(const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut);
+	void MakeStagedFilename(int64_t StagedID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut);
+	int DeleteStagedFiles(const std::string &rStoreRoot, int DiscSet, box_time_t ModifiedBefore = 0);
+	int64_t GetStagedFilesSize(const std::string &rStoreRoot, int DiscSet);
 };
 
 #endif // STORESTRUCTURE__H
@@ -0,0 +1,3439 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+
+#include <sstream>
+
+#include "autogen_BackupProtocol.h"
+#include "CollectInBufferStream.h"
+#include "MemBlockStream.h"
+#include "SelfFlushingStream.h"
+#include "SocketStream.h"
+#include "BackupStoreContext.h"
+#include "MemLeakFindOn.h"
+std::auto_ptr<BackupProtocolMessage> BackupProtocolMessage::DoCommand(BackupProtocolReplyable &rProtocol,
+	BackupStoreContext &rContext) const
+{
+	THROW_EXCEPTION(ConnectionException, Protocol_TriedToExecuteReplyCommand)
+}
+
+std::auto_ptr<BackupProtocolMessage> BackupProtocolMessage::DoCommand(BackupProtocolReplyable &rProtocol,
+	BackupStoreContext &rContext, IOStream& rDataStream) const
+{
+	THROW_EXCEPTION(ConnectionException, Protocol_TriedToExecuteReplyCommand)
+}
+BackupProtocolError::BackupProtocolError()
+	: mType(0),
+	  mSubType(0)
+{
+}
+BackupProtocolError::BackupProtocolError(const BackupProtocolError &rToCopy)
+	: mType(rToCopy.mType),
+	  mSubType(rToCopy.mSubType)
+{
+}
+BackupProtocolError::~BackupProtocolError()
+{
+}
+int BackupProtocolError::GetType() const
+{
+	return 0;
+}
+void BackupProtocolError::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mType);
+	rProtocol.Read(mSubType);
+}
+BackupProtocolError::BackupProtocolError(int32_t Type, int32_t SubType)
+	: mType(Type),
+	  mSubType(SubType)
+{
+}
+void BackupProtocolError::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mType);
+	rProtocol.Write(mSubType);
+}
+bool BackupProtocolError::IsError(int &rTypeOut, int &rSubTypeOut) const
+{
+	rTypeOut = mType;
+	rSubTypeOut = mSubType;
+	return true;
+}
+std::string BackupProtocolError::GetMessage(int subtype)
+{
+	switch(subtype)
+	{
+		case Err_WrongVersion: return "WrongVersion = 1";
+		case Err_NotInRightProtocolPhase: return "NotInRightProtocolPhase = 2";
+		case Err_BadLogin: return "BadLogin = 3";
+		case Err_CannotLockStoreForWriting: return "CannotLockStoreForWriting = 4";
+		case Err_SessionReadOnly: return "SessionReadOnly = 5";
+		case Err_FileDoesNotVerify: return "FileDoesNotVerify = 6";
+		case Err_DoesNotExist: return "DoesNotExist = 7";
+		case Err_DirectoryAlreadyExists: return "DirectoryAlreadyExists = 8";
+		case Err_CannotDeleteRoot: return "CannotDeleteRoot = 9";
+		case Err_TargetNameExists: return "TargetNameExists = 10";
+		case Err_StorageLimitExceeded: return "StorageLimitExceeded = 11";
+		case Err_DiffFromFileDoesNotExist: return "DiffFromFileDoesNotExist = 12";
+		case Err_DoesNotExistInDirectory: return "DoesNotExistInDirectory = 13";
+		case Err_PatchConsistencyError: return "PatchConsistencyError = 14";
+		case Err_MultiplyReferencedObject: return "MultiplyReferencedObject = 15";
+		case Err_DisabledAccount: return "DisabledAccount = 16";
+		default:
+			std::ostringstream out;
+			out << "Unknown subtype " << subtype;
+			return out.str();
+	}
+}
+std::string BackupProtocolError::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Error(" << (mType == 0 ? "0x" : "") << std::hex << std::showbase << mType << std::dec << "," << (mSubType == 0 ? "0x" : "") << std::hex << std::showbase << mSubType << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolError::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Error(" << (mType == 0 ? "0x" : "") << std::hex << std::showbase << mType << std::dec << "," << (mSubType == 0 ? "0x" : "") << std::hex << std::showbase << mSubType << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolError::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolVersion::BackupProtocolVersion()
+	: mVersion(0)
+{
+}
+BackupProtocolVersion::BackupProtocolVersion(const BackupProtocolVersion &rToCopy)
+	: mVersion(rToCopy.mVersion)
+{
+}
+BackupProtocolVersion::~BackupProtocolVersion()
+{
+}
+int BackupProtocolVersion::GetType() const
+{
+	return 1;
+}
+void BackupProtocolVersion::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mVersion);
+}
+BackupProtocolVersion::BackupProtocolVersion(int32_t Version)
+	: mVersion(Version)
+{
+}
+void BackupProtocolVersion::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mVersion);
+}
+std::string BackupProtocolVersion::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Version(" << (mVersion == 0 ? "0x" : "") << std::hex << std::showbase << mVersion << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolVersion::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Version(" << (mVersion == 0 ? "0x" : "") << std::hex << std::showbase << mVersion << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolVersion::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolLogin::BackupProtocolLogin()
+	: mClientID(0),
+	  mFlags(0)
+{
+}
+BackupProtocolLogin::BackupProtocolLogin(const BackupProtocolLogin &rToCopy)
+	: mClientID(rToCopy.mClientID),
+	  mFlags(rToCopy.mFlags)
+{
+}
+BackupProtocolLogin::~BackupProtocolLogin()
+{
+}
+int BackupProtocolLogin::GetType() const
+{
+	return 2;
+}
+void BackupProtocolLogin::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mClientID);
+	rProtocol.Read(mFlags);
+}
+BackupProtocolLogin::BackupProtocolLogin(int32_t ClientID, int32_t Flags)
+	: mClientID(ClientID),
+	  mFlags(Flags)
+{
+}
+void BackupProtocolLogin::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mClientID);
+	rProtocol.Write(mFlags);
+}
+std::string BackupProtocolLogin::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Login(" << (mClientID == 0 ? "0x" : "") << std::hex << std::showbase << mClientID << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolLogin::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Login(" << (mClientID == 0 ? "0x" : "") << std::hex << std::showbase << mClientID << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolLogin::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolLoginConfirmed::BackupProtocolLoginConfirmed()
+	: mClientStoreMarker(0),
+	  mBlocksUsed(0),
+	  mBlocksSoftLimit(0),
+	  mBlocksHardLimit(0)
+{
+}
+BackupProtocolLoginConfirmed::BackupProtocolLoginConfirmed(const BackupProtocolLoginConfirmed &rToCopy)
+	: mClientStoreMarker(rToCopy.mClientStoreMarker),
+	  mBlocksUsed(rToCopy.mBlocksUsed),
+	  mBlocksSoftLimit(rToCopy.mBlocksSoftLimit),
+	  mBlocksHardLimit(rToCopy.mBlocksHardLimit)
+{
+}
+BackupProtocolLoginConfirmed::~BackupProtocolLoginConfirmed()
+{
+}
+int BackupProtocolLoginConfirmed::GetType() const
+{
+	return 3;
+}
+void BackupProtocolLoginConfirmed::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mClientStoreMarker);
+	rProtocol.Read(mBlocksUsed);
+	rProtocol.Read(mBlocksSoftLimit);
+	rProtocol.Read(mBlocksHardLimit);
+}
+BackupProtocolLoginConfirmed::BackupProtocolLoginConfirmed(int64_t ClientStoreMarker, int64_t BlocksUsed, int64_t BlocksSoftLimit, int64_t BlocksHardLimit)
+	: mClientStoreMarker(ClientStoreMarker),
+	  mBlocksUsed(BlocksUsed),
+	  mBlocksSoftLimit(BlocksSoftLimit),
+	  mBlocksHardLimit(BlocksHardLimit)
+{
+}
+void BackupProtocolLoginConfirmed::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mClientStoreMarker);
+	rProtocol.Write(mBlocksUsed);
+	rProtocol.Write(mBlocksSoftLimit);
+	rProtocol.Write(mBlocksHardLimit);
+}
+std::string BackupProtocolLoginConfirmed::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "LoginConfirmed(" << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << "," << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolLoginConfirmed::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "LoginConfirmed(" << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << "," << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolLoginConfirmed::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolFinished::BackupProtocolFinished()
+{
+}
+BackupProtocolFinished::BackupProtocolFinished(const BackupProtocolFinished &rToCopy)
+{
+}
+BackupProtocolFinished::~BackupProtocolFinished()
+{
+}
+int BackupProtocolFinished::GetType() const
+{
+	return 4;
+}
+void BackupProtocolFinished::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolFinished::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+bool BackupProtocolFinished::IsConversationEnd() const
+{
+	return true;
+}
+std::string BackupProtocolFinished::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Finished(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolFinished::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Finished(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolFinished::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolSuccess::BackupProtocolSuccess()
+	: mObjectID(0)
+{
+}
+BackupProtocolSuccess::BackupProtocolSuccess(const BackupProtocolSuccess &rToCopy)
+	: mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolSuccess::~BackupProtocolSuccess()
+{
+}
+int BackupProtocolSuccess::GetType() const
+{
+	return 5;
+}
+void BackupProtocolSuccess::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolSuccess::BackupProtocolSuccess(int64_t ObjectID)
+	: mObjectID(ObjectID)
+{
+}
+void BackupProtocolSuccess::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolSuccess::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Success(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolSuccess::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Success(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolSuccess::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolSetClientStoreMarker::BackupProtocolSetClientStoreMarker()
+	: mClientStoreMarker(0)
+{
+}
+BackupProtocolSetClientStoreMarker::BackupProtocolSetClientStoreMarker(const BackupProtocolSetClientStoreMarker &rToCopy)
+	: mClientStoreMarker(rToCopy.mClientStoreMarker)
+{
+}
+BackupProtocolSetClientStoreMarker::~BackupProtocolSetClientStoreMarker()
+{
+}
+int BackupProtocolSetClientStoreMarker::GetType() const
+{
+	return 6;
+}
+void BackupProtocolSetClientStoreMarker::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mClientStoreMarker);
+}
+BackupProtocolSetClientStoreMarker::BackupProtocolSetClientStoreMarker(int64_t ClientStoreMarker)
+	: mClientStoreMarker(ClientStoreMarker)
+{
+}
+void BackupProtocolSetClientStoreMarker::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mClientStoreMarker);
+}
+std::string BackupProtocolSetClientStoreMarker::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "SetClientStoreMarker(" << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolSetClientStoreMarker::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "SetClientStoreMarker(" << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolSetClientStoreMarker::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetObject::BackupProtocolGetObject()
+	: mObjectID(0)
+{
+}
+BackupProtocolGetObject::BackupProtocolGetObject(const BackupProtocolGetObject &rToCopy)
+	: mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolGetObject::~BackupProtocolGetObject()
+{
+}
+int BackupProtocolGetObject::GetType() const
+{
+	return 10;
+}
+void BackupProtocolGetObject::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolGetObject::BackupProtocolGetObject(int64_t ObjectID)
+	: mObjectID(ObjectID)
+{
+}
+void BackupProtocolGetObject::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolGetObject::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetObject(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetObject::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetObject(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetObject::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolMoveObject::BackupProtocolMoveObject()
+	: mObjectID(0),
+	  mMoveFromDirectory(0),
+	  mMoveToDirectory(0),
+	  mFlags(0)
+{
+}
+BackupProtocolMoveObject::BackupProtocolMoveObject(const BackupProtocolMoveObject &rToCopy)
+	: mObjectID(rToCopy.mObjectID),
+	  mMoveFromDirectory(rToCopy.mMoveFromDirectory),
+	  mMoveToDirectory(rToCopy.mMoveToDirectory),
+	  mFlags(rToCopy.mFlags),
+	  mNewFilename(rToCopy.mNewFilename)
+{
+}
+BackupProtocolMoveObject::~BackupProtocolMoveObject()
+{
+}
+int BackupProtocolMoveObject::GetType() const
+{
+	return 11;
+}
+void BackupProtocolMoveObject::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+	rProtocol.Read(mMoveFromDirectory);
+	rProtocol.Read(mMoveToDirectory);
+	rProtocol.Read(mFlags);
+	rProtocol.Read(mNewFilename);
+}
+BackupProtocolMoveObject::BackupProtocolMoveObject(int64_t ObjectID, int64_t MoveFromDirectory, int64_t MoveToDirectory, int32_t Flags, const BackupStoreFilenameClear& NewFilename)
+	: mObjectID(ObjectID),
+	  mMoveFromDirectory(MoveFromDirectory),
+	  mMoveToDirectory(MoveToDirectory),
+	  mFlags(Flags),
+	  mNewFilename(NewFilename)
+{
+}
+void BackupProtocolMoveObject::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+	rProtocol.Write(mMoveFromDirectory);
+	rProtocol.Write(mMoveToDirectory);
+	rProtocol.Write(mFlags);
+	rProtocol.Write(mNewFilename);
+}
+std::string BackupProtocolMoveObject::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "MoveObject(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mMoveFromDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mMoveFromDirectory << std::dec << "," << (mMoveToDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mMoveToDirectory << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << "," << "\"" << mNewFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolMoveObject::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "MoveObject(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mMoveFromDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mMoveFromDirectory << std::dec << "," << (mMoveToDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mMoveToDirectory << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << "," << "\"" << mNewFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolMoveObject::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetObjectName::BackupProtocolGetObjectName()
+	: mObjectID(0),
+	  mContainingDirectoryID(0)
+{
+}
+BackupProtocolGetObjectName::BackupProtocolGetObjectName(const BackupProtocolGetObjectName &rToCopy)
+	: mObjectID(rToCopy.mObjectID),
+	  mContainingDirectoryID(rToCopy.mContainingDirectoryID)
+{
+}
+BackupProtocolGetObjectName::~BackupProtocolGetObjectName()
+{
+}
+int BackupProtocolGetObjectName::GetType() const
+{
+	return 12;
+}
+void BackupProtocolGetObjectName::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+	rProtocol.Read(mContainingDirectoryID);
+}
+BackupProtocolGetObjectName::BackupProtocolGetObjectName(int64_t ObjectID, int64_t ContainingDirectoryID)
+	: mObjectID(ObjectID),
+	  mContainingDirectoryID(ContainingDirectoryID)
+{
+}
+void BackupProtocolGetObjectName::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+	rProtocol.Write(mContainingDirectoryID);
+}
+std::string BackupProtocolGetObjectName::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetObjectName(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetObjectName::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetObjectName(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetObjectName::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolObjectName::BackupProtocolObjectName()
+	: mNumNameElements(0),
+	  mModificationTime(0),
+	  mAttributesHash(0),
+	  mFlags(0)
+{
+}
+BackupProtocolObjectName::BackupProtocolObjectName(const BackupProtocolObjectName &rToCopy)
+	: mNumNameElements(rToCopy.mNumNameElements),
+	  mModificationTime(rToCopy.mModificationTime),
+	  mAttributesHash(rToCopy.mAttributesHash),
+	  mFlags(rToCopy.mFlags)
+{
+}
+BackupProtocolObjectName::~BackupProtocolObjectName()
+{
+}
+int BackupProtocolObjectName::GetType() const
+{
+	return 13;
+}
+void BackupProtocolObjectName::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mNumNameElements);
+	rProtocol.Read(mModificationTime);
+	rProtocol.Read(mAttributesHash);
+	rProtocol.Read(mFlags);
+}
+BackupProtocolObjectName::BackupProtocolObjectName(int32_t NumNameElements, int64_t ModificationTime, int64_t AttributesHash, int16_t Flags)
+	: mNumNameElements(NumNameElements),
+	  mModificationTime(ModificationTime),
+	  mAttributesHash(AttributesHash),
+	  mFlags(Flags)
+{
+}
+void BackupProtocolObjectName::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mNumNameElements);
+	rProtocol.Write(mModificationTime);
+	rProtocol.Write(mAttributesHash);
+	rProtocol.Write(mFlags);
+}
+std::string BackupProtocolObjectName::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "ObjectName(" << (mNumNameElements == 0 ? "0x" : "") << std::hex << std::showbase << mNumNameElements << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolObjectName::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "ObjectName(" << (mNumNameElements == 0 ? "0x" : "") << std::hex << std::showbase << mNumNameElements << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mFlags == 0 ? "0x" : "") << std::hex << std::showbase << mFlags << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolObjectName::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolCreateDirectory::BackupProtocolCreateDirectory()
+	: mContainingDirectoryID(0),
+	  mAttributesModTime(0)
+{
+}
+BackupProtocolCreateDirectory::BackupProtocolCreateDirectory(const BackupProtocolCreateDirectory &rToCopy)
+	: mContainingDirectoryID(rToCopy.mContainingDirectoryID),
+	  mAttributesModTime(rToCopy.mAttributesModTime),
+	  mDirectoryName(rToCopy.mDirectoryName)
+{
+}
+BackupProtocolCreateDirectory::~BackupProtocolCreateDirectory()
+{
+}
+int BackupProtocolCreateDirectory::GetType() const
+{
+	return 20;
+}
+void BackupProtocolCreateDirectory::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mContainingDirectoryID);
+	rProtocol.Read(mAttributesModTime);
+	rProtocol.Read(mDirectoryName);
+}
+BackupProtocolCreateDirectory::BackupProtocolCreateDirectory(int64_t ContainingDirectoryID, int64_t AttributesModTime, const BackupStoreFilenameClear& DirectoryName)
+	: mContainingDirectoryID(ContainingDirectoryID),
+	  mAttributesModTime(AttributesModTime),
+	  mDirectoryName(DirectoryName)
+{
+}
+void BackupProtocolCreateDirectory::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mContainingDirectoryID);
+	rProtocol.Write(mAttributesModTime);
+	rProtocol.Write(mDirectoryName);
+}
+std::string BackupProtocolCreateDirectory::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "CreateDirectory(" << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << "," << "\"" << mDirectoryName.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolCreateDirectory::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "CreateDirectory(" << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << "," << "\"" << mDirectoryName.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolCreateDirectory::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolCreateDirectory2::BackupProtocolCreateDirectory2()
+	: mContainingDirectoryID(0),
+	  mAttributesModTime(0),
+	  mModificationTime(0)
+{
+}
+BackupProtocolCreateDirectory2::BackupProtocolCreateDirectory2(const BackupProtocolCreateDirectory2 &rToCopy)
+	: mContainingDirectoryID(rToCopy.mContainingDirectoryID),
+	  mAttributesModTime(rToCopy.mAttributesModTime),
+	  mModificationTime(rToCopy.mModificationTime),
+	  mDirectoryName(rToCopy.mDirectoryName)
+{
+}
+BackupProtocolCreateDirectory2::~BackupProtocolCreateDirectory2()
+{
+}
+int BackupProtocolCreateDirectory2::GetType() const
+{
+	return 46;
+}
+void BackupProtocolCreateDirectory2::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mContainingDirectoryID);
+	rProtocol.Read(mAttributesModTime);
+	rProtocol.Read(mModificationTime);
+	rProtocol.Read(mDirectoryName);
+}
+BackupProtocolCreateDirectory2::BackupProtocolCreateDirectory2(int64_t ContainingDirectoryID, int64_t AttributesModTime, int64_t ModificationTime, const BackupStoreFilenameClear& DirectoryName)
+	: mContainingDirectoryID(ContainingDirectoryID),
+	  mAttributesModTime(AttributesModTime),
+	  mModificationTime(ModificationTime),
+	  mDirectoryName(DirectoryName)
+{
+}
+void BackupProtocolCreateDirectory2::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mContainingDirectoryID);
+	rProtocol.Write(mAttributesModTime);
+	rProtocol.Write(mModificationTime);
+	rProtocol.Write(mDirectoryName);
+}
+std::string BackupProtocolCreateDirectory2::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "CreateDirectory2(" << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << "\"" << mDirectoryName.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolCreateDirectory2::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "CreateDirectory2(" << (mContainingDirectoryID == 0 ? "0x" : "") << std::hex << std::showbase << mContainingDirectoryID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << "\"" << mDirectoryName.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolCreateDirectory2::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolListDirectory::BackupProtocolListDirectory()
+	: mObjectID(0),
+	  mFlagsMustBeSet(0),
+	  mFlagsNotToBeSet(0),
+	  mSendAttributes(0)
+{
+}
+BackupProtocolListDirectory::BackupProtocolListDirectory(const BackupProtocolListDirectory &rToCopy)
+	: mObjectID(rToCopy.mObjectID),
+	  mFlagsMustBeSet(rToCopy.mFlagsMustBeSet),
+	  mFlagsNotToBeSet(rToCopy.mFlagsNotToBeSet),
+	  mSendAttributes(rToCopy.mSendAttributes)
+{
+}
+BackupProtocolListDirectory::~BackupProtocolListDirectory()
+{
+}
+int BackupProtocolListDirectory::GetType() const
+{
+	return 21;
+}
+void BackupProtocolListDirectory::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+	rProtocol.Read(mFlagsMustBeSet);
+	rProtocol.Read(mFlagsNotToBeSet);
+	rProtocol.Read(mSendAttributes);
+}
+BackupProtocolListDirectory::BackupProtocolListDirectory(int64_t ObjectID, int16_t FlagsMustBeSet, int16_t FlagsNotToBeSet, bool SendAttributes)
+	: mObjectID(ObjectID),
+	  mFlagsMustBeSet(FlagsMustBeSet),
+	  mFlagsNotToBeSet(FlagsNotToBeSet),
+	  mSendAttributes(SendAttributes)
+{
+}
+void BackupProtocolListDirectory::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+	rProtocol.Write(mFlagsMustBeSet);
+	rProtocol.Write(mFlagsNotToBeSet);
+	rProtocol.Write(mSendAttributes);
+}
+std::string BackupProtocolListDirectory::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "ListDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mFlagsMustBeSet == 0 ? "0x" : "") << std::hex << std::showbase << mFlagsMustBeSet << std::dec << "," << (mFlagsNotToBeSet == 0 ? "0x" : "") << std::hex << std::showbase << mFlagsNotToBeSet << std::dec << "," << ((mSendAttributes)?"true":"false") << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolListDirectory::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "ListDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mFlagsMustBeSet == 0 ? "0x" : "") << std::hex << std::showbase << mFlagsMustBeSet << std::dec << "," << (mFlagsNotToBeSet == 0 ? "0x" : "") << std::hex << std::showbase << mFlagsNotToBeSet << std::dec << "," << ((mSendAttributes)?"true":"false") << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolListDirectory::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolChangeDirAttributes::BackupProtocolChangeDirAttributes()
+	: mObjectID(0),
+	  mAttributesModTime(0)
+{
+}
+BackupProtocolChangeDirAttributes::BackupProtocolChangeDirAttributes(const BackupProtocolChangeDirAttributes &rToCopy)
+	: mObjectID(rToCopy.mObjectID),
+	  mAttributesModTime(rToCopy.mAttributesModTime)
+{
+}
+BackupProtocolChangeDirAttributes::~BackupProtocolChangeDirAttributes()
+{
+}
+int BackupProtocolChangeDirAttributes::GetType() const
+{
+	return 22;
+}
+void BackupProtocolChangeDirAttributes::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+	rProtocol.Read(mAttributesModTime);
+}
+BackupProtocolChangeDirAttributes::BackupProtocolChangeDirAttributes(int64_t ObjectID, int64_t AttributesModTime)
+	: mObjectID(ObjectID),
+	  mAttributesModTime(AttributesModTime)
+{
+}
+void BackupProtocolChangeDirAttributes::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+	rProtocol.Write(mAttributesModTime);
+}
+std::string BackupProtocolChangeDirAttributes::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "ChangeDirAttributes(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolChangeDirAttributes::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "ChangeDirAttributes(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << "," << (mAttributesModTime == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesModTime << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolChangeDirAttributes::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolDeleteDirectory::BackupProtocolDeleteDirectory()
+	: mObjectID(0)
+{
+}
+BackupProtocolDeleteDirectory::BackupProtocolDeleteDirectory(const BackupProtocolDeleteDirectory &rToCopy)
+	: mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolDeleteDirectory::~BackupProtocolDeleteDirectory()
+{
+}
+int BackupProtocolDeleteDirectory::GetType() const
+{
+	return 23;
+}
+void BackupProtocolDeleteDirectory::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolDeleteDirectory::BackupProtocolDeleteDirectory(int64_t ObjectID)
+	: mObjectID(ObjectID)
+{
+}
+void BackupProtocolDeleteDirectory::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolDeleteDirectory::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "DeleteDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolDeleteDirectory::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "DeleteDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolDeleteDirectory::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolUndeleteDirectory::BackupProtocolUndeleteDirectory()
+	: mObjectID(0)
+{
+}
+BackupProtocolUndeleteDirectory::BackupProtocolUndeleteDirectory(const BackupProtocolUndeleteDirectory &rToCopy)
+	: mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolUndeleteDirectory::~BackupProtocolUndeleteDirectory()
+{
+}
+int BackupProtocolUndeleteDirectory::GetType() const
+{
+	return 24;
+}
+void BackupProtocolUndeleteDirectory::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolUndeleteDirectory::BackupProtocolUndeleteDirectory(int64_t ObjectID)
+	: mObjectID(ObjectID)
+{
+}
+void BackupProtocolUndeleteDirectory::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolUndeleteDirectory::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "UndeleteDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolUndeleteDirectory::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "UndeleteDirectory(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolUndeleteDirectory::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolStoreFile::BackupProtocolStoreFile()
+	: mDirectoryObjectID(0),
+	  mModificationTime(0),
+	  mAttributesHash(0),
+	  mDiffFromFileID(0)
+{
+}
+BackupProtocolStoreFile::BackupProtocolStoreFile(const BackupProtocolStoreFile &rToCopy)
+	: mDirectoryObjectID(rToCopy.mDirectoryObjectID),
+	  mModificationTime(rToCopy.mModificationTime),
+	  mAttributesHash(rToCopy.mAttributesHash),
+	  mDiffFromFileID(rToCopy.mDiffFromFileID),
+	  mFilename(rToCopy.mFilename)
+{
+}
+BackupProtocolStoreFile::~BackupProtocolStoreFile()
+{
+}
+int BackupProtocolStoreFile::GetType() const
+{
+	return 30;
+}
+void BackupProtocolStoreFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mDirectoryObjectID);
+	rProtocol.Read(mModificationTime);
+	rProtocol.Read(mAttributesHash);
+	rProtocol.Read(mDiffFromFileID);
+	rProtocol.Read(mFilename);
+}
+BackupProtocolStoreFile::BackupProtocolStoreFile(int64_t DirectoryObjectID, int64_t ModificationTime, int64_t AttributesHash, int64_t DiffFromFileID, const BackupStoreFilenameClear& Filename)
+	: mDirectoryObjectID(DirectoryObjectID),
+	  mModificationTime(ModificationTime),
+	  mAttributesHash(AttributesHash),
+	  mDiffFromFileID(DiffFromFileID),
+	  mFilename(Filename)
+{
+}
+void BackupProtocolStoreFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mDirectoryObjectID);
+	rProtocol.Write(mModificationTime);
+	rProtocol.Write(mAttributesHash);
+	rProtocol.Write(mDiffFromFileID);
+	rProtocol.Write(mFilename);
+}
+std::string BackupProtocolStoreFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "StoreFile(" << (mDirectoryObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mDirectoryObjectID << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mDiffFromFileID == 0 ? "0x" : "") << std::hex << std::showbase << mDiffFromFileID << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolStoreFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "StoreFile(" << (mDirectoryObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mDirectoryObjectID << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mDiffFromFileID == 0 ? "0x" : "") << std::hex << std::showbase << mDiffFromFileID << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolStoreFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetFile::BackupProtocolGetFile()
+	: mInDirectory(0),
+	  mObjectID(0)
+{
+}
+BackupProtocolGetFile::BackupProtocolGetFile(const BackupProtocolGetFile &rToCopy)
+	: mInDirectory(rToCopy.mInDirectory),
+	  mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolGetFile::~BackupProtocolGetFile()
+{
+}
+int BackupProtocolGetFile::GetType() const
+{
+	return 31;
+}
+void BackupProtocolGetFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mInDirectory);
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolGetFile::BackupProtocolGetFile(int64_t InDirectory, int64_t ObjectID)
+	: mInDirectory(InDirectory),
+	  mObjectID(ObjectID)
+{
+}
+void BackupProtocolGetFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mInDirectory);
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolGetFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolSetReplacementFileAttributes::BackupProtocolSetReplacementFileAttributes()
+	: mInDirectory(0),
+	  mAttributesHash(0)
+{
+}
+BackupProtocolSetReplacementFileAttributes::BackupProtocolSetReplacementFileAttributes(const BackupProtocolSetReplacementFileAttributes &rToCopy)
+	: mInDirectory(rToCopy.mInDirectory),
+	  mAttributesHash(rToCopy.mAttributesHash),
+	  mFilename(rToCopy.mFilename)
+{
+}
+BackupProtocolSetReplacementFileAttributes::~BackupProtocolSetReplacementFileAttributes()
+{
+}
+int BackupProtocolSetReplacementFileAttributes::GetType() const
+{
+	return 32;
+}
+void BackupProtocolSetReplacementFileAttributes::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mInDirectory);
+	rProtocol.Read(mAttributesHash);
+	rProtocol.Read(mFilename);
+}
+BackupProtocolSetReplacementFileAttributes::BackupProtocolSetReplacementFileAttributes(int64_t InDirectory, int64_t AttributesHash, const BackupStoreFilenameClear& Filename)
+	: mInDirectory(InDirectory),
+	  mAttributesHash(AttributesHash),
+	  mFilename(Filename)
+{
+}
+void BackupProtocolSetReplacementFileAttributes::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mInDirectory);
+	rProtocol.Write(mAttributesHash);
+	rProtocol.Write(mFilename);
+}
+std::string BackupProtocolSetReplacementFileAttributes::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "SetReplacementFileAttributes(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolSetReplacementFileAttributes::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "SetReplacementFileAttributes(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolSetReplacementFileAttributes::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolDeleteFile::BackupProtocolDeleteFile()
+	: mInDirectory(0)
+{
+}
+BackupProtocolDeleteFile::BackupProtocolDeleteFile(const BackupProtocolDeleteFile &rToCopy)
+	: mInDirectory(rToCopy.mInDirectory),
+	  mFilename(rToCopy.mFilename)
+{
+}
+BackupProtocolDeleteFile::~BackupProtocolDeleteFile()
+{
+}
+int BackupProtocolDeleteFile::GetType() const
+{
+	return 33;
+}
+void BackupProtocolDeleteFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mInDirectory);
+	rProtocol.Read(mFilename);
+}
+BackupProtocolDeleteFile::BackupProtocolDeleteFile(int64_t InDirectory, const BackupStoreFilenameClear& Filename)
+	: mInDirectory(InDirectory),
+	  mFilename(Filename)
+{
+}
+void BackupProtocolDeleteFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mInDirectory);
+	rProtocol.Write(mFilename);
+}
+std::string BackupProtocolDeleteFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "DeleteFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolDeleteFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "DeleteFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolDeleteFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetBlockIndexByID::BackupProtocolGetBlockIndexByID()
+	: mObjectID(0)
+{
+}
+BackupProtocolGetBlockIndexByID::BackupProtocolGetBlockIndexByID(const BackupProtocolGetBlockIndexByID &rToCopy)
+	: mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolGetBlockIndexByID::~BackupProtocolGetBlockIndexByID()
+{
+}
+int BackupProtocolGetBlockIndexByID::GetType() const
+{
+	return 34;
+}
+void BackupProtocolGetBlockIndexByID::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolGetBlockIndexByID::BackupProtocolGetBlockIndexByID(int64_t ObjectID)
+	: mObjectID(ObjectID)
+{
+}
+void BackupProtocolGetBlockIndexByID::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolGetBlockIndexByID::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetBlockIndexByID(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetBlockIndexByID::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetBlockIndexByID(" << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetBlockIndexByID::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetBlockIndexByName::BackupProtocolGetBlockIndexByName()
+	: mInDirectory(0)
+{
+}
+BackupProtocolGetBlockIndexByName::BackupProtocolGetBlockIndexByName(const BackupProtocolGetBlockIndexByName &rToCopy)
+	: mInDirectory(rToCopy.mInDirectory),
+	  mFilename(rToCopy.mFilename)
+{
+}
+BackupProtocolGetBlockIndexByName::~BackupProtocolGetBlockIndexByName()
+{
+}
+int BackupProtocolGetBlockIndexByName::GetType() const
+{
+	return 35;
+}
+void BackupProtocolGetBlockIndexByName::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mInDirectory);
+	rProtocol.Read(mFilename);
+}
+BackupProtocolGetBlockIndexByName::BackupProtocolGetBlockIndexByName(int64_t InDirectory, const BackupStoreFilenameClear& Filename)
+	: mInDirectory(InDirectory),
+	  mFilename(Filename)
+{
+}
+void BackupProtocolGetBlockIndexByName::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mInDirectory);
+	rProtocol.Write(mFilename);
+}
+std::string BackupProtocolGetBlockIndexByName::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetBlockIndexByName(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetBlockIndexByName::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetBlockIndexByName(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetBlockIndexByName::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolUndeleteFile::BackupProtocolUndeleteFile()
+	: mInDirectory(0),
+	  mObjectID(0)
+{
+}
+BackupProtocolUndeleteFile::BackupProtocolUndeleteFile(const BackupProtocolUndeleteFile &rToCopy)
+	: mInDirectory(rToCopy.mInDirectory),
+	  mObjectID(rToCopy.mObjectID)
+{
+}
+BackupProtocolUndeleteFile::~BackupProtocolUndeleteFile()
+{
+}
+int BackupProtocolUndeleteFile::GetType() const
+{
+	return 36;
+}
+void BackupProtocolUndeleteFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mInDirectory);
+	rProtocol.Read(mObjectID);
+}
+BackupProtocolUndeleteFile::BackupProtocolUndeleteFile(int64_t InDirectory, int64_t ObjectID)
+	: mInDirectory(InDirectory),
+	  mObjectID(ObjectID)
+{
+}
+void BackupProtocolUndeleteFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mInDirectory);
+	rProtocol.Write(mObjectID);
+}
+std::string BackupProtocolUndeleteFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "UndeleteFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolUndeleteFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "UndeleteFile(" << (mInDirectory == 0 ? "0x" : "") << std::hex << std::showbase << mInDirectory << std::dec << "," << (mObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mObjectID << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolUndeleteFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolStageFile::BackupProtocolStageFile()
+{
+}
+BackupProtocolStageFile::BackupProtocolStageFile(const BackupProtocolStageFile &rToCopy)
+{
+}
+BackupProtocolStageFile::~BackupProtocolStageFile()
+{
+}
+int BackupProtocolStageFile::GetType() const
+{
+	return 47;
+}
+void BackupProtocolStageFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolStageFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+std::string BackupProtocolStageFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "StageFile(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolStageFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "StageFile(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolStageFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolStoreStagedFile::BackupProtocolStoreStagedFile()
+	: mDirectoryObjectID(0),
+	  mModificationTime(0),
+	  mAttributesHash(0),
+	  mStagedID(0)
+{
+}
+BackupProtocolStoreStagedFile::BackupProtocolStoreStagedFile(const BackupProtocolStoreStagedFile &rToCopy)
+	: mDirectoryObjectID(rToCopy.mDirectoryObjectID),
+	  mModificationTime(rToCopy.mModificationTime),
+	  mAttributesHash(rToCopy.mAttributesHash),
+	  mStagedID(rToCopy.mStagedID),
+	  mFilename(rToCopy.mFilename)
+{
+}
+BackupProtocolStoreStagedFile::~BackupProtocolStoreStagedFile()
+{
+}
+int BackupProtocolStoreStagedFile::GetType() const
+{
+	return 48;
+}
+void BackupProtocolStoreStagedFile::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mDirectoryObjectID);
+	rProtocol.Read(mModificationTime);
+	rProtocol.Read(mAttributesHash);
+	rProtocol.Read(mStagedID);
+	rProtocol.Read(mFilename);
+}
+BackupProtocolStoreStagedFile::BackupProtocolStoreStagedFile(int64_t DirectoryObjectID, int64_t ModificationTime, int64_t AttributesHash, int64_t StagedID, const BackupStoreFilenameClear& Filename)
+	: mDirectoryObjectID(DirectoryObjectID),
+	  mModificationTime(ModificationTime),
+	  mAttributesHash(AttributesHash),
+	  mStagedID(StagedID),
+	  mFilename(Filename)
+{
+}
+void BackupProtocolStoreStagedFile::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mDirectoryObjectID);
+	rProtocol.Write(mModificationTime);
+	rProtocol.Write(mAttributesHash);
+	rProtocol.Write(mStagedID);
+	rProtocol.Write(mFilename);
+}
+std::string BackupProtocolStoreStagedFile::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "StoreStagedFile(" << (mDirectoryObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mDirectoryObjectID << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mStagedID == 0 ? "0x" : "") << std::hex << std::showbase << mStagedID << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolStoreStagedFile::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "StoreStagedFile(" << (mDirectoryObjectID == 0 ? "0x" : "") << std::hex << std::showbase << mDirectoryObjectID << std::dec << "," << (mModificationTime == 0 ? "0x" : "") << std::hex << std::showbase << mModificationTime << std::dec << "," << (mAttributesHash == 0 ? "0x" : "") << std::hex << std::showbase << mAttributesHash << std::dec << "," << (mStagedID == 0 ? "0x" : "") << std::hex << std::showbase << mStagedID << std::dec << "," << "\"" << mFilename.GetClearFilenameIfPossible("OPAQUE").c_str() << "\"" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolStoreStagedFile::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetAccountUsage::BackupProtocolGetAccountUsage()
+{
+}
+BackupProtocolGetAccountUsage::BackupProtocolGetAccountUsage(const BackupProtocolGetAccountUsage &rToCopy)
+{
+}
+BackupProtocolGetAccountUsage::~BackupProtocolGetAccountUsage()
+{
+}
+int BackupProtocolGetAccountUsage::GetType() const
+{
+	return 40;
+}
+void BackupProtocolGetAccountUsage::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolGetAccountUsage::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+std::string BackupProtocolGetAccountUsage::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetAccountUsage(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetAccountUsage::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetAccountUsage(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetAccountUsage::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolAccountUsage::BackupProtocolAccountUsage()
+	: mBlocksUsed(0),
+	  mBlocksInOldFiles(0),
+	  mBlocksInDeletedFiles(0),
+	  mBlocksInDirectories(0),
+	  mBlocksSoftLimit(0),
+	  mBlocksHardLimit(0),
+	  mBlockSize(0)
+{
+}
+BackupProtocolAccountUsage::BackupProtocolAccountUsage(const BackupProtocolAccountUsage &rToCopy)
+	: mBlocksUsed(rToCopy.mBlocksUsed),
+	  mBlocksInOldFiles(rToCopy.mBlocksInOldFiles),
+	  mBlocksInDeletedFiles(rToCopy.mBlocksInDeletedFiles),
+	  mBlocksInDirectories(rToCopy.mBlocksInDirectories),
+	  mBlocksSoftLimit(rToCopy.mBlocksSoftLimit),
+	  mBlocksHardLimit(rToCopy.mBlocksHardLimit),
+	  mBlockSize(rToCopy.mBlockSize)
+{
+}
+BackupProtocolAccountUsage::~BackupProtocolAccountUsage()
+{
+}
+int BackupProtocolAccountUsage::GetType() const
+{
+	return 41;
+}
+void BackupProtocolAccountUsage::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mBlocksUsed);
+	rProtocol.Read(mBlocksInOldFiles);
+	rProtocol.Read(mBlocksInDeletedFiles);
+	rProtocol.Read(mBlocksInDirectories);
+	rProtocol.Read(mBlocksSoftLimit);
+	rProtocol.Read(mBlocksHardLimit);
+	rProtocol.Read(mBlockSize);
+}
+BackupProtocolAccountUsage::BackupProtocolAccountUsage(int64_t BlocksUsed, int64_t BlocksInOldFiles, int64_t BlocksInDeletedFiles, int64_t BlocksInDirectories, int64_t BlocksSoftLimit, int64_t BlocksHardLimit, int32_t BlockSize)
+	: mBlocksUsed(BlocksUsed),
+	  mBlocksInOldFiles(BlocksInOldFiles),
+	  mBlocksInDeletedFiles(BlocksInDeletedFiles),
+	  mBlocksInDirectories(BlocksInDirectories),
+	  mBlocksSoftLimit(BlocksSoftLimit),
+	  mBlocksHardLimit(BlocksHardLimit),
+	  mBlockSize(BlockSize)
+{
+}
+void BackupProtocolAccountUsage::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mBlocksUsed);
+	rProtocol.Write(mBlocksInOldFiles);
+	rProtocol.Write(mBlocksInDeletedFiles);
+	rProtocol.Write(mBlocksInDirectories);
+	rProtocol.Write(mBlocksSoftLimit);
+	rProtocol.Write(mBlocksHardLimit);
+	rProtocol.Write(mBlockSize);
+}
+std::string BackupProtocolAccountUsage::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "AccountUsage(" << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksInOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInOldFiles << std::dec << "," << (mBlocksInDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDeletedFiles << std::dec << "," << (mBlocksInDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDirectories << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << "," << (mBlockSize == 0 ? "0x" : "") << std::hex << std::showbase << mBlockSize << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolAccountUsage::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "AccountUsage(" << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksInOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInOldFiles << std::dec << "," << (mBlocksInDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDeletedFiles << std::dec << "," << (mBlocksInDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDirectories << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << "," << (mBlockSize == 0 ? "0x" : "") << std::hex << std::showbase << mBlockSize << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolAccountUsage::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetIsAlive::BackupProtocolGetIsAlive()
+{
+}
+BackupProtocolGetIsAlive::BackupProtocolGetIsAlive(const BackupProtocolGetIsAlive &rToCopy)
+{
+}
+BackupProtocolGetIsAlive::~BackupProtocolGetIsAlive()
+{
+}
+int BackupProtocolGetIsAlive::GetType() const
+{
+	return 42;
+}
+void BackupProtocolGetIsAlive::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolGetIsAlive::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+std::string BackupProtocolGetIsAlive::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetIsAlive(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetIsAlive::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetIsAlive(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetIsAlive::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolIsAlive::BackupProtocolIsAlive()
+{
+}
+BackupProtocolIsAlive::BackupProtocolIsAlive(const BackupProtocolIsAlive &rToCopy)
+{
+}
+BackupProtocolIsAlive::~BackupProtocolIsAlive()
+{
+}
+int BackupProtocolIsAlive::GetType() const
+{
+	return 43;
+}
+void BackupProtocolIsAlive::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolIsAlive::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+std::string BackupProtocolIsAlive::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "IsAlive(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolIsAlive::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "IsAlive(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolIsAlive::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolGetAccountUsage2::BackupProtocolGetAccountUsage2()
+{
+}
+BackupProtocolGetAccountUsage2::BackupProtocolGetAccountUsage2(const BackupProtocolGetAccountUsage2 &rToCopy)
+{
+}
+BackupProtocolGetAccountUsage2::~BackupProtocolGetAccountUsage2()
+{
+}
+int BackupProtocolGetAccountUsage2::GetType() const
+{
+	return 44;
+}
+void BackupProtocolGetAccountUsage2::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void BackupProtocolGetAccountUsage2::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+std::string BackupProtocolGetAccountUsage2::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetAccountUsage2(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolGetAccountUsage2::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetAccountUsage2(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolGetAccountUsage2::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolAccountUsage2::BackupProtocolAccountUsage2()
+	: mAccountEnabled(0),
+	  mClientStoreMarker(0),
+	  mBlockSize(0),
+	  mLastObjectIDUsed(0),
+	  mBlocksUsed(0),
+	  mBlocksInCurrentFiles(0),
+	  mBlocksInOldFiles(0),
+	  mBlocksInDeletedFiles(0),
+	  mBlocksInDirectories(0),
+	  mBlocksSoftLimit(0),
+	  mBlocksHardLimit(0),
+	  mNumCurrentFiles(0),
+	  mNumOldFiles(0),
+	  mNumDeletedFiles(0),
+	  mNumDirectories(0)
+{
+}
+BackupProtocolAccountUsage2::BackupProtocolAccountUsage2(const BackupProtocolAccountUsage2 &rToCopy)
+	: mAccountName(rToCopy.mAccountName),
+	  mAccountEnabled(rToCopy.mAccountEnabled),
+	  mClientStoreMarker(rToCopy.mClientStoreMarker),
+	  mBlockSize(rToCopy.mBlockSize),
+	  mLastObjectIDUsed(rToCopy.mLastObjectIDUsed),
+	  mBlocksUsed(rToCopy.mBlocksUsed),
+	  mBlocksInCurrentFiles(rToCopy.mBlocksInCurrentFiles),
+	  mBlocksInOldFiles(rToCopy.mBlocksInOldFiles),
+	  mBlocksInDeletedFiles(rToCopy.mBlocksInDeletedFiles),
+	  mBlocksInDirectories(rToCopy.mBlocksInDirectories),
+	  mBlocksSoftLimit(rToCopy.mBlocksSoftLimit),
+	  mBlocksHardLimit(rToCopy.mBlocksHardLimit),
+	  mNumCurrentFiles(rToCopy.mNumCurrentFiles),
+	  mNumOldFiles(rToCopy.mNumOldFiles),
+	  mNumDeletedFiles(rToCopy.mNumDeletedFiles),
+	  mNumDirectories(rToCopy.mNumDirectories)
+{
+}
+BackupProtocolAccountUsage2::~BackupProtocolAccountUsage2()
+{
+}
+int BackupProtocolAccountUsage2::GetType() const
+{
+	return 45;
+}
+void BackupProtocolAccountUsage2::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mAccountName);
+	rProtocol.Read(mAccountEnabled);
+	rProtocol.Read(mClientStoreMarker);
+	rProtocol.Read(mBlockSize);
+	rProtocol.Read(mLastObjectIDUsed);
+	rProtocol.Read(mBlocksUsed);
+	rProtocol.Read(mBlocksInCurrentFiles);
+	rProtocol.Read(mBlocksInOldFiles);
+	rProtocol.Read(mBlocksInDeletedFiles);
+	rProtocol.Read(mBlocksInDirectories);
+	rProtocol.Read(mBlocksSoftLimit);
+	rProtocol.Read(mBlocksHardLimit);
+	rProtocol.Read(mNumCurrentFiles);
+	rProtocol.Read(mNumOldFiles);
+	rProtocol.Read(mNumDeletedFiles);
+	rProtocol.Read(mNumDirectories);
+}
+BackupProtocolAccountUsage2::BackupProtocolAccountUsage2(const std::string& AccountName, bool AccountEnabled, int64_t ClientStoreMarker, int32_t BlockSize, int64_t LastObjectIDUsed, int64_t BlocksUsed, int64_t BlocksInCurrentFiles, int64_t BlocksInOldFiles, int64_t BlocksInDeletedFiles, int64_t BlocksInDirectories, int64_t BlocksSoftLimit, int64_t BlocksHardLimit, int64_t NumCurrentFiles, int64_t NumOldFiles, int64_t NumDeletedFiles, int64_t NumDirectories)
+	: mAccountName(AccountName),
+	  mAccountEnabled(AccountEnabled),
+	  mClientStoreMarker(ClientStoreMarker),
+	  mBlockSize(BlockSize),
+	  mLastObjectIDUsed(LastObjectIDUsed),
+	  mBlocksUsed(BlocksUsed),
+	  mBlocksInCurrentFiles(BlocksInCurrentFiles),
+	  mBlocksInOldFiles(BlocksInOldFiles),
+	  mBlocksInDeletedFiles(BlocksInDeletedFiles),
+	  mBlocksInDirectories(BlocksInDirectories),
+	  mBlocksSoftLimit(BlocksSoftLimit),
+	  mBlocksHardLimit(BlocksHardLimit),
+	  mNumCurrentFiles(NumCurrentFiles),
+	  mNumOldFiles(NumOldFiles),
+	  mNumDeletedFiles(NumDeletedFiles),
+	  mNumDirectories(NumDirectories)
+{
+}
+void BackupProtocolAccountUsage2::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mAccountName);
+	rProtocol.Write(mAccountEnabled);
+	rProtocol.Write(mClientStoreMarker);
+	rProtocol.Write(mBlockSize);
+	rProtocol.Write(mLastObjectIDUsed);
+	rProtocol.Write(mBlocksUsed);
+	rProtocol.Write(mBlocksInCurrentFiles);
+	rProtocol.Write(mBlocksInOldFiles);
+	rProtocol.Write(mBlocksInDeletedFiles);
+	rProtocol.Write(mBlocksInDirectories);
+	rProtocol.Write(mBlocksSoftLimit);
+	rProtocol.Write(mBlocksHardLimit);
+	rProtocol.Write(mNumCurrentFiles);
+	rProtocol.Write(mNumOldFiles);
+	rProtocol.Write(mNumDeletedFiles);
+	rProtocol.Write(mNumDirectories);
+}
+std::string BackupProtocolAccountUsage2::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "AccountUsage2(" << "OPAQUE" << "," << ((mAccountEnabled)?"true":"false") << "," << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << "," << (mBlockSize == 0 ? "0x" : "") << std::hex << std::showbase << mBlockSize << std::dec << "," << (mLastObjectIDUsed == 0 ? "0x" : "") << std::hex << std::showbase << mLastObjectIDUsed << std::dec << "," << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksInCurrentFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInCurrentFiles << std::dec << "," << (mBlocksInOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInOldFiles << std::dec << "," << (mBlocksInDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDeletedFiles << std::dec << "," << (mBlocksInDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDirectories << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << "," << (mNumCurrentFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumCurrentFiles << std::dec << "," << (mNumOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumOldFiles << std::dec << "," << (mNumDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumDeletedFiles << std::dec << "," << (mNumDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mNumDirectories << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void BackupProtocolAccountUsage2::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "AccountUsage2(" << "OPAQUE" << "," << ((mAccountEnabled)?"true":"false") << "," << (mClientStoreMarker == 0 ? "0x" : "") << std::hex << std::showbase << mClientStoreMarker << std::dec << "," << (mBlockSize == 0 ? "0x" : "") << std::hex << std::showbase << mBlockSize << std::dec << "," << (mLastObjectIDUsed == 0 ? "0x" : "") << std::hex << std::showbase << mLastObjectIDUsed << std::dec << "," << (mBlocksUsed == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksUsed << std::dec << "," << (mBlocksInCurrentFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInCurrentFiles << std::dec << "," << (mBlocksInOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInOldFiles << std::dec << "," << (mBlocksInDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDeletedFiles << std::dec << "," << (mBlocksInDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksInDirectories << std::dec << "," << (mBlocksSoftLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksSoftLimit << std::dec << "," << (mBlocksHardLimit == 0 ? "0x" : "") << std::hex << std::showbase << mBlocksHardLimit << std::dec << "," << (mNumCurrentFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumCurrentFiles << std::dec << "," << (mNumOldFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumOldFiles << std::dec << "," << (mNumDeletedFiles == 0 ? "0x" : "") << std::hex << std::showbase << mNumDeletedFiles << std::dec << "," << (mNumDirectories == 0 ? "0x" : "") << std::hex << std::showbase << mNumDirectories << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void BackupProtocolAccountUsage2::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+BackupProtocolClientServer::BackupProtocolClientServer()
+: mLastErrorType(Protocol::NoError),
+  mLastErrorSubType(Protocol::NoError)
+{ }
+
+BackupProtocolClientServer::~BackupProtocolClientServer()
+{ }
+
+const char *BackupProtocol::GetProtocolIdentString()
+{
+	return "Box-Backup:v=C";
+}
+
+std::auto_ptr<Message> BackupProtocol::MakeMessage(int ObjType)
+{
+	switch(ObjType)
+	{
+	case 0:
+		return std::auto_ptr<Message>(new BackupProtocolError());
+		break;
+	case 1:
+		return std::auto_ptr<Message>(new BackupProtocolVersion());
+		break;
+	case 2:
+		return std::auto_ptr<Message>(new BackupProtocolLogin());
+		break;
+	case 3:
+		return std::auto_ptr<Message>(new BackupProtocolLoginConfirmed());
+		break;
+	case 4:
+		return std::auto_ptr<Message>(new BackupProtocolFinished());
+		break;
+	case 5:
+		return std::auto_ptr<Message>(new BackupProtocolSuccess());
+		break;
+	case 6:
+		return std::auto_ptr<Message>(new BackupProtocolSetClientStoreMarker());
+		break;
+	case 10:
+		return std::auto_ptr<Message>(new BackupProtocolGetObject());
+		break;
+	case 11:
+		return std::auto_ptr<Message>(new BackupProtocolMoveObject());
+		break;
+	case 12:
+		return std::auto_ptr<Message>(new BackupProtocolGetObjectName());
+		break;
+	case 13:
+		return std::auto_ptr<Message>(new BackupProtocolObjectName());
+		break;
+	case 20:
+		return std::auto_ptr<Message>(new BackupProtocolCreateDirectory());
+		break;
+	case 46:
+		return std::auto_ptr<Message>(new BackupProtocolCreateDirectory2());
+		break;
+	case 21:
+		return std::auto_ptr<Message>(new BackupProtocolListDirectory());
+		break;
+	case 22:
+		return std::auto_ptr<Message>(new BackupProtocolChangeDirAttributes());
+		break;
+	case 23:
+		return std::auto_ptr<Message>(new BackupProtocolDeleteDirectory());
+		break;
+	case 24:
+		return std::auto_ptr<Message>(new BackupProtocolUndeleteDirectory());
+		break;
+	case 30:
+		return std::auto_ptr<Message>(new BackupProtocolStoreFile());
+		break;
+	case 31:
+		return std::auto_ptr<Message>(new BackupProtocolGetFile());
+		break;
+	case 32:
+		return std::auto_ptr<Message>(new BackupProtocolSetReplacementFileAttributes());
+		break;
+	case 33:
+		return std::auto_ptr<Message>(new BackupProtocolDeleteFile());
+		break;
+	case 34:
+		return std::auto_ptr<Message>(new BackupProtocolGetBlockIndexByID());
+		break;
+	case 35:
+		return std::auto_ptr<Message>(new BackupProtocolGetBlockIndexByName());
+		break;
+	case 36:
+		return std::auto_ptr<Message>(new BackupProtocolUndeleteFile());
+		break;
+	case 47:
+		return std::auto_ptr<Message>(new BackupProtocolStageFile());
+		break;
+	case 48:
+		return std::auto_ptr<Message>(new BackupProtocolStoreStagedFile());
+		break;
+	case 40:
+		return std::auto_ptr<Message>(new BackupProtocolGetAccountUsage());
+		break;
+	case 41:
+		return std::auto_ptr<Message>(new BackupProtocolAccountUsage());
+		break;
+	case 42:
+		return std::auto_ptr<Message>(new BackupProtocolGetIsAlive());
+		break;
+	case 43:
+		return std::auto_ptr<Message>(new BackupProtocolIsAlive());
+		break;
+	case 44:
+		return std::auto_ptr<Message>(new BackupProtocolGetAccountUsage2());
+		break;
+	case 45:
+		return std::auto_ptr<Message>(new BackupProtocolAccountUsage2());
+		break;
+	default:
+		THROW_EXCEPTION(ConnectionException, Protocol_UnknownCommandRecieved)
+	}
+}
+
+BackupProtocolReplyable::~BackupProtocolReplyable()
+{
+	// If there were any streams left over, there's no longer any way to
+	// access them, and we're responsible for them, so we'd better delete them.
+	DeleteStreamsToSend();
+}
+
+void BackupProtocolReplyable::SendStreamAfterCommand(std::auto_ptr<IOStream> apStream)
+{
+	ASSERT(apStream.get() != NULL);
+	mStreamsToSend.push_back(apStream.release());
+}
+
+void BackupProtocolReplyable::DeleteStreamsToSend()
+{
+	for(std::list<IOStream*>::iterator i(mStreamsToSend.begin()); i != mStreamsToSend.end(); ++i)
+	{
+		delete (*i);
+	}
+
+	mStreamsToSend.clear();
+}
+
+void BackupProtocolCallable::CheckReply(const std::string& requestCommandName,
+	const BackupProtocolMessage &rCommand, const BackupProtocolMessage &rReply,
+	int expectedType)
+{
+	if(rReply.GetType() == expectedType)
+	{
+		// Correct response, do nothing
+		SetLastError(Protocol::NoError, Protocol::NoError);
+	}
+	else
+	{
+		// Set protocol error
+		int type, subType;
+		
+		if(rReply.IsError(type, subType))
+		{
+			SetLastError(type, subType);
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply,
+				requestCommandName << " command failed: "
+				"received error " <<
+				((BackupProtocolError&)rReply).GetMessage());
+		}
+		else
+		{
+			SetLastError(Protocol::UnknownError, Protocol::UnknownError);
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply,
+				requestCommandName << " command failed: "
+				"received unexpected response type " <<
+				rReply.GetType());
+		}
+	}
+
+	// As a client, if we get an unexpected reply later, we'll want to know
+	// the last command that we executed, and the reply, to help debug the
+	// server.
+	mPreviousCommand = rCommand.ToString();
+	mPreviousReply = rReply.ToString();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Protocol::GetLastError(int &, int &)
+//		Purpose: Returns true if there was an error, and type and subtype if there was.
+//		Created: 2003/08/19
+//
+// --------------------------------------------------------------------------
+bool BackupProtocolClientServer::GetLastError(int &rTypeOut, int &rSubTypeOut)
+{
+	if(mLastErrorType == Protocol::NoError)
+	{
+		// no error.
+		return false;
+	}
+	
+	// Return type and subtype in args
+	rTypeOut = mLastErrorType;
+	rSubTypeOut = mLastErrorSubType;
+	
+	// and unset them
+	mLastErrorType = Protocol::NoError;
+	mLastErrorSubType = Protocol::NoError;
+	
+	return true;
+}
+
+std::auto_ptr<IOStream> BackupProtocolClient::ReceiveStream()
+{
+	try
+	{
+		return BackupProtocol::ReceiveStream();
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_ObjWhenStreamExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_ObjWhenStreamExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+}
+BackupProtocolClient::BackupProtocolClient(std::auto_ptr<SocketStream> apConn)
+: BackupProtocol(apConn)
+{ }
+BackupProtocolClient::~BackupProtocolClient()
+{
+}
+std::auto_ptr<BackupProtocolMessage> BackupProtocolClient::Receive()
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+
+	try
+	{
+		apReply = std::auto_ptr<BackupProtocolMessage>(
+			static_cast<BackupProtocolMessage *>
+			(BackupProtocol::ReceiveInternal().release()));
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_StreamWhenObjExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_StreamWhenObjExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+
+	if(GetLogToSysLog())
+	{
+		apReply->LogSysLog("Receive");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		apReply->LogFile("Receive", GetLogToFile());
+	}
+
+	return apReply;
+}
+
+void BackupProtocolClient::Send(const BackupProtocolMessage &rObject)
+{
+	if(GetLogToSysLog())
+	{
+		rObject.LogSysLog("Send");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		rObject.LogFile("Send", GetLogToFile());
+	}
+
+	Protocol::SendInternal(rObject);
+}
+
+std::auto_ptr<BackupProtocolVersion> BackupProtocolClient::Query(const BackupProtocolVersion &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("Version", rQuery, *apReply, 1);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolVersion>(
+		static_cast<BackupProtocolVersion *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolLoginConfirmed> BackupProtocolClient::Query(const BackupProtocolLogin &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("Login", rQuery, *apReply, 3);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolLoginConfirmed>(
+		static_cast<BackupProtocolLoginConfirmed *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolFinished> BackupProtocolClient::Query(const BackupProtocolFinished &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("Finished", rQuery, *apReply, 4);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolFinished>(
+		static_cast<BackupProtocolFinished *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolSetClientStoreMarker &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("SetClientStoreMarker", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolGetObject &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetObject", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolMoveObject &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("MoveObject", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolObjectName> BackupProtocolClient::Query(const BackupProtocolGetObjectName &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetObjectName", rQuery, *apReply, 13);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolObjectName>(
+		static_cast<BackupProtocolObjectName *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolCreateDirectory &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("CreateDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolCreateDirectory2 &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("CreateDirectory2", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolListDirectory &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("ListDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolChangeDirAttributes &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("ChangeDirAttributes", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolDeleteDirectory &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("DeleteDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolUndeleteDirectory &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("UndeleteDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolStoreFile &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("StoreFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolGetFile &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolSetReplacementFileAttributes &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("SetReplacementFileAttributes", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolDeleteFile &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("DeleteFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolGetBlockIndexByID &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetBlockIndexByID", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolGetBlockIndexByName &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetBlockIndexByName", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolUndeleteFile &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("UndeleteFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolStageFile &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("StageFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolClient::Query(const BackupProtocolStoreStagedFile &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("StoreStagedFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolAccountUsage> BackupProtocolClient::Query(const BackupProtocolGetAccountUsage &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetAccountUsage", rQuery, *apReply, 41);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolAccountUsage>(
+		static_cast<BackupProtocolAccountUsage *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolIsAlive> BackupProtocolClient::Query(const BackupProtocolGetIsAlive &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetIsAlive", rQuery, *apReply, 43);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolIsAlive>(
+		static_cast<BackupProtocolIsAlive *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolAccountUsage2> BackupProtocolClient::Query(const BackupProtocolGetAccountUsage2 &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<BackupProtocolMessage> apReply = Receive();
+	CheckReply("GetAccountUsage2", rQuery, *apReply, 45);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolAccountUsage2>(
+		static_cast<BackupProtocolAccountUsage2 *>(apReply.release()));
+}
+std::auto_ptr<IOStream> BackupProtocolServer::ReceiveStream()
+{
+	try
+	{
+		return BackupProtocol::ReceiveStream();
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_ObjWhenStreamExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_ObjWhenStreamExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+}
+BackupProtocolServer::BackupProtocolServer(std::auto_ptr<SocketStream> apConn)
+: BackupProtocol(apConn)
+{ }
+BackupProtocolServer::~BackupProtocolServer()
+{
+	DeleteStreamsToSend();
+}
+std::auto_ptr<BackupProtocolMessage> BackupProtocolServer::Receive()
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+
+	try
+	{
+		apReply = std::auto_ptr<BackupProtocolMessage>(
+			static_cast<BackupProtocolMessage *>
+			(BackupProtocol::ReceiveInternal().release()));
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_StreamWhenObjExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_StreamWhenObjExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+
+	if(GetLogToSysLog())
+	{
+		apReply->LogSysLog("Receive");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		apReply->LogFile("Receive", GetLogToFile());
+	}
+
+	return apReply;
+}
+
+void BackupProtocolServer::Send(const BackupProtocolMessage &rObject)
+{
+	if(GetLogToSysLog())
+	{
+		rObject.LogSysLog("Send");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		rObject.LogFile("Send", GetLogToFile());
+	}
+
+	Protocol::SendInternal(rObject);
+}
+
+void BackupProtocolServer::DoServer(BackupStoreContext &rContext)
+{
+	// Handshake with client
+	Handshake();
+
+	// Command processing loop
+	bool inProgress = true;
+	while(inProgress)
+	{
+		// Get an object from the conversation
+		std::auto_ptr<BackupProtocolMessage> pobj = Receive();
+		std::auto_ptr<BackupProtocolMessage> preply;
+
+		// Run the command
+		try
+		{
+			try
+			{
+				if(pobj->HasStreamWithCommand())
+				{
+					std::auto_ptr<IOStream> apDataStream = ReceiveStream();
+					SelfFlushingStream autoflush(*apDataStream);
+					preply = pobj->DoCommand(*this, rContext, *apDataStream);
+				}
+				else
+				{
+					preply = pobj->DoCommand(*this, rContext);
+				}
+			}
+			catch(BoxException &e)
+			{
+				// First try a the built-in exception handler
+				preply = HandleException(e);
+			}
+		}
+		catch (...)
+		{
+			// Fallback in case the exception isn't a BoxException
+			// or the exception handler fails as well. This path
+			// throws the exception upwards, killing the process
+			// that handles the current client.
+			Send(BackupProtocolError(-1));
+			throw;
+		}
+
+		// Send the reply
+		Send(*preply);
+
+		// Send any streams
+		for(std::list<IOStream*>::iterator
+			i =  mStreamsToSend.begin();
+			i != mStreamsToSend.end(); ++i)
+		{
+			SendStream(**i);
+		}
+
+		// As a server, if we get an unexpected message later, we'll
+		// want to know the last command that we received, and the
+		// reply, to help debug our response to it.
+		mPreviousCommand = pobj->ToString();
+		std::ostringstream reply;
+		reply << preply->ToString() << " and " <<
+			mStreamsToSend.size() << " streams";
+		mPreviousReply = reply.str();
+
+		// Delete these streams
+		DeleteStreamsToSend();
+
+		// Does this end the conversation?
+		if(pobj->IsConversationEnd())
+		{
+			inProgress = false;
+		}
+	}
+}
+
+BackupProtocolLocal::BackupProtocolLocal(BackupStoreContext &rContext)
+: mrContext(rContext)
+{ }
+BackupProtocolLocal::~BackupProtocolLocal()
+{
+}
+std::auto_ptr<BackupProtocolMessage> BackupProtocolLocal::Receive()
+{
+	return mapLastReply;
+}
+void BackupProtocolLocal::Send(const BackupProtocolMessage &rObject)
+{
+	mapLastReply = rObject.DoCommand(*this, mrContext);
+}
+std::auto_ptr<BackupProtocolVersion> BackupProtocolLocal::Query(const BackupProtocolVersion &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Version", rQuery, *apReply, 1);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolVersion>(
+		static_cast<BackupProtocolVersion *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolLoginConfirmed> BackupProtocolLocal::Query(const BackupProtocolLogin &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Login", rQuery, *apReply, 3);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolLoginConfirmed>(
+		static_cast<BackupProtocolLoginConfirmed *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolFinished> BackupProtocolLocal::Query(const BackupProtocolFinished &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Finished", rQuery, *apReply, 4);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolFinished>(
+		static_cast<BackupProtocolFinished *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolSetClientStoreMarker &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("SetClientStoreMarker", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolGetObject &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetObject", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolMoveObject &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("MoveObject", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolObjectName> BackupProtocolLocal::Query(const BackupProtocolGetObjectName &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetObjectName", rQuery, *apReply, 13);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolObjectName>(
+		static_cast<BackupProtocolObjectName *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolCreateDirectory &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("CreateDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolCreateDirectory2 &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("CreateDirectory2", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolListDirectory &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("ListDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolChangeDirAttributes &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("ChangeDirAttributes", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolDeleteDirectory &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("DeleteDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolUndeleteDirectory &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("UndeleteDirectory", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolStoreFile &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("StoreFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolGetFile &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolSetReplacementFileAttributes &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("SetReplacementFileAttributes", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolDeleteFile &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("DeleteFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolGetBlockIndexByID &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetBlockIndexByID", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolGetBlockIndexByName &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetBlockIndexByName", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolUndeleteFile &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("UndeleteFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolStageFile &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("StageFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolSuccess> BackupProtocolLocal::Query(const BackupProtocolStoreStagedFile &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("StoreStagedFile", rQuery, *apReply, 5);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolSuccess>(
+		static_cast<BackupProtocolSuccess *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolAccountUsage> BackupProtocolLocal::Query(const BackupProtocolGetAccountUsage &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetAccountUsage", rQuery, *apReply, 41);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolAccountUsage>(
+		static_cast<BackupProtocolAccountUsage *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolIsAlive> BackupProtocolLocal::Query(const BackupProtocolGetIsAlive &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetIsAlive", rQuery, *apReply, 43);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolIsAlive>(
+		static_cast<BackupProtocolIsAlive *>(apReply.release()));
+}
+std::auto_ptr<BackupProtocolAccountUsage2> BackupProtocolLocal::Query(const BackupProtocolGetAccountUsage2 &rQuery)
+{
+	std::auto_ptr<BackupProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetAccountUsage2", rQuery, *apReply, 45);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<BackupProtocolAccountUsage2>(
+		static_cast<BackupProtocolAccountUsage2 *>(apReply.release()));
+}
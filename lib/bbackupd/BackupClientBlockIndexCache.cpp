@@ -0,0 +1,257 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.cpp
+//		Purpose: Local copies of the block indexes of files on the store
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <sstream>
+#include <iomanip>
+
+#include "BackupClientBlockIndexCache.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
+#include "BoxException.h"
+#include "CollectInBufferStream.h"
+#include "CommonException.h"
+#include "FileStream.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::BackupClientBlockIndexCache(const std::string &)
+//		Purpose: Constructor. The directory is created if it doesn't
+//			 exist already.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::BackupClientBlockIndexCache(
+	const std::string &rDirectory)
+: mDirectory(rDirectory)
+{
+	if(ObjectExists(mDirectory) != ObjectExists_Dir)
+	{
+		if(mkdir(mDirectory.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+		{
+			THROW_SYS_FILE_ERROR("Failed to create block index "
+				"cache directory", mDirectory,
+				CommonException, OSFileError);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::GetFilename(int64_t)
+//		Purpose: Private. Returns the name of the file which holds
+//			 the index of an object.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::string BackupClientBlockIndexCache::GetFilename(int64_t ObjectID) const
+{
+	std::ostringstream filename;
+	filename << mDirectory << DIRECTORY_SEPARATOR << std::hex <<
+		std::setw(16) << std::setfill('0') << ObjectID;
+	return filename.str();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Get(int64_t)
+//		Purpose: Returns a stream containing the block index of the
+//			 object, as it would be sent by the server, or a null
+//			 pointer if it isn't in the cache or the copy is damaged.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupClientBlockIndexCache::Get(int64_t ObjectID)
+{
+	std::auto_ptr<IOStream> result;
+	std::string filename(GetFilename(ObjectID));
+	int64_t fileSize = 0;
+	if(!FileExists(filename, &fileSize))
+	{
+		return result;
+	}
+
+	// Indexes are small, so read it all in, checking it's complete.
+	// Only indexes which don't refer to another file are stored.
+	std::auto_ptr<CollectInBufferStream> apindex(new CollectInBufferStream);
+	try
+	{
+		FileStream file(filename);
+		file.CopyStreamTo(*apindex);
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to read cached block index " <<
+			filename << ": " << e.what());
+		return result;
+	}
+
+	bool valid = false;
+	if(apindex->GetSize() >= (int)sizeof(file_BlockIndexHeader))
+	{
+		const file_BlockIndexHeader *phdr =
+			(const file_BlockIndexHeader *)apindex->GetBuffer();
+		int64_t numBlocks = box_ntoh64(phdr->mNumBlocks);
+		valid = OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(
+				ntohl(phdr->mMagicValue))
+			&& phdr->mOtherFileID == 0
+			&& numBlocks >= 0
+			&& apindex->GetSize() == (int64_t)sizeof(file_BlockIndexHeader)
+				+ (numBlocks * (int64_t)sizeof(file_BlockIndexEntry));
+	}
+	if(!valid)
+	{
+		BOX_WARNING("Cached block index " << filename << " is damaged, "
+			"removing it");
+		Remove(ObjectID);
+		return result;
+	}
+
+	apindex->SetForReading();
+	result.reset(apindex.release());
+	return result;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Store(int64_t, IOStream &)
+//		Purpose: Stores the block index of an object, read from the
+//			 stream. Failures are logged but otherwise ignored, as
+//			 the index can always be fetched from the server.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Store(int64_t ObjectID, IOStream &rBlockIndex)
+{
+	std::string filename(GetFilename(ObjectID));
+	std::string tempFilename(filename + ".n");
+
+	try
+	{
+		// Write it to a temporary file first, so that a partly
+		// written index is never used
+		{
+			FileStream file(tempFilename,
+				O_WRONLY | O_CREAT | O_TRUNC | O_BINARY);
+			rBlockIndex.CopyStreamTo(file);
+		}
+
+#ifdef WIN32
+		// win32 rename doesn't overwrite existing files
+		::remove(filename.c_str());
+#endif
+		if(::rename(tempFilename.c_str(), filename.c_str()) != 0)
+		{
+			THROW_SYS_FILE_ERROR("Failed to rename cached block "
+				"index", tempFilename, CommonException,
+				OSFileError);
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to store block index of object " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << " in cache: " <<
+			e.what());
+		::remove(tempFilename.c_str());
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Remove(int64_t)
+//		Purpose: Removes the block index of an object from the cache,
+//			 if it's there.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Remove(int64_t ObjectID)
+{
+	std::string filename(GetFilename(ObjectID));
+	if(::remove(filename.c_str()) != 0 && errno != ENOENT)
+	{
+		BOX_LOG_SYS_WARNING("Failed to remove cached block index " <<
+			filename);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Clear()
+//		Purpose: Removes every index from the cache, for when the
+//			 state of the store is no longer known.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Clear()
+{
+	DIR *dirHandle = ::opendir(mDirectory.c_str());
+	if(dirHandle == 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to open block index cache "
+			"directory " << mDirectory);
+		return;
+	}
+
+	int removed = 0;
+	struct dirent *en = 0;
+	while((en = ::readdir(dirHandle)) != 0)
+	{
+		std::string leaf(en->d_name);
+		if(leaf == "." || leaf == "..")
+		{
+			continue;
+		}
+
+		std::string filename(mDirectory + DIRECTORY_SEPARATOR + leaf);
+		if(::remove(filename.c_str()) != 0)
+		{
+			BOX_LOG_SYS_WARNING("Failed to remove cached block "
+				"index " << filename);
+		}
+		else
+		{
+			++removed;
+		}
+	}
+	::closedir(dirHandle);
+
+	BOX_TRACE("Removed " << removed << " entries from block index cache");
+}
@@ -0,0 +1,54 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.h
+//		Purpose: Local copies of the block indexes of files on the store
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTBLOCKINDEXCACHE__H
+#define BACKUPCLIENTBLOCKINDEXCACHE__H
+
+#include <memory>
+#include <string>
+
+class IOStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientBlockIndexCache
+//		Purpose: Keeps a copy on disc of the block index of each file
+//			 uploaded, keyed on its object ID on the store, so that
+//			 the next version can be diffed against it without
+//			 downloading the index from the server. Object IDs are
+//			 never reused for different data, so an entry is valid
+//			 for as long as the object is the current version of the
+//			 file on the store.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientBlockIndexCache
+{
+public:
+	BackupClientBlockIndexCache(const std::string &rDirectory);
+	~BackupClientBlockIndexCache();
+private:
+	// no copying
+	BackupClientBlockIndexCache(const BackupClientBlockIndexCache &);
+	BackupClientBlockIndexCache &operator=(const BackupClientBlockIndexCache &);
+public:
+
+	std::auto_ptr<IOStream> Get(int64_t ObjectID);
+	void Store(int64_t ObjectID, IOStream &rBlockIndex);
+	void Remove(int64_t ObjectID);
+	void Clear();
+
+private:
+	std::string GetFilename(int64_t ObjectID) const;
+
+	std::string mDirectory;
+};
+
+#endif // BACKUPCLIENTBLOCKINDEXCACHE__H
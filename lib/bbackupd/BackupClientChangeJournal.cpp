@@ -0,0 +1,460 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientChangeJournal.cpp
+//		Purpose: Keeps track of which local directories have changed
+//			 between syncs, using filesystem change notifications
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+	#include <poll.h>
+	#include <sys/inotify.h>
+#endif
+
+#include "BackupClientChangeJournal.h"
+
+#include "MemLeakFindOn.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+	// Anything which could change what's backed up from a directory,
+	// or its own attributes
+	#define BACKUPCLIENTCHANGEJOURNAL_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | \
+		IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY | \
+		IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientChangeJournalThread
+//		Purpose: Thread which reads notifications until the journal
+//			 is destroyed
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientChangeJournalThread : public Thread
+{
+public:
+	BackupClientChangeJournalThread(BackupClientChangeJournal &rJournal)
+	: mrJournal(rJournal)
+	{
+	}
+
+	~BackupClientChangeJournalThread()
+	{
+		Join();
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrJournal.ReadNotifications();
+	}
+
+private:
+	BackupClientChangeJournal &mrJournal;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::BackupClientChangeJournal()
+//		Purpose: Constructor. Nothing is watched until Start() is
+//			 called.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientChangeJournal::BackupClientChangeJournal()
+: mFileDescriptor(-1),
+  mpThread(0),
+  mWatchLimitReached(false),
+  mFullScan(true),
+  mOverflowed(false),
+  mStopping(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::~BackupClientChangeJournal()
+//		Purpose: Destructor. Stops the thread and all the watches.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientChangeJournal::~BackupClientChangeJournal()
+{
+	if(mpThread)
+	{
+		{
+			MutexLock lock(mMutex);
+			mStopping = true;
+		}
+
+		// Deleting the thread joins it
+		delete mpThread;
+		mpThread = 0;
+	}
+
+	if(mFileDescriptor != -1)
+	{
+		// Removes all the watches too
+		::close(mFileDescriptor);
+		mFileDescriptor = -1;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::IsSupported()
+//		Purpose: Static. Whether this platform can tell us about
+//			 changes to directories.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::IsSupported()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::Start()
+//		Purpose: Starts listening for notifications, and the thread
+//			 which reads them, if there are threads. Returns
+//			 false if it can't, in which case every directory is
+//			 read by every sync, as before.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::Start()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	ASSERT(mFileDescriptor == -1);
+
+	mFileDescriptor = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(mFileDescriptor == -1)
+	{
+		BOX_LOG_SYS_WARNING("Failed to start the change journal, "
+			"reading all directories in every backup");
+		return false;
+	}
+
+	if(Thread::IsSupported())
+	{
+		mpThread = new BackupClientChangeJournalThread(*this);
+		try
+		{
+			mpThread->Start();
+		}
+		catch(...)
+		{
+			delete mpThread;
+			mpThread = 0;
+			throw;
+		}
+	}
+
+	return true;
+#else
+	BOX_WARNING("The change journal isn't supported on this platform, "
+		"reading all directories in every backup");
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::Watch(const std::string &)
+//		Purpose: Starts watching a directory, if it isn't already,
+//			 before it's read by the sync, so that anything which
+//			 changes after that is noticed. Returns false if it
+//			 can't be watched, in which case it's never
+//			 unchanged.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::Watch(const std::string &rPath)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if(mFileDescriptor == -1)
+	{
+		return false;
+	}
+
+	MutexLock lock(mMutex);
+
+	int wd = ::inotify_add_watch(mFileDescriptor, rPath.c_str(),
+		BACKUPCLIENTCHANGEJOURNAL_EVENTS);
+	if(wd == -1)
+	{
+		if(errno == ENOSPC && !mWatchLimitReached)
+		{
+			// The thread doesn't log, so it's safe to here
+			mWatchLimitReached = true;
+			BOX_WARNING("Too many directories for the change "
+				"journal to watch, the rest will be read in "
+				"every backup (increase "
+				"fs.inotify.max_user_watches to avoid this)");
+		}
+		return false;
+	}
+
+	// Watching the same directory twice gives the same descriptor. If
+	// it had another name, it's not watched under that name any more.
+	std::map<int, std::string>::iterator p(mWatchPaths.find(wd));
+	if(p != mWatchPaths.end() && p->second != rPath)
+	{
+		mChanged.insert(p->second);
+		mWatches.erase(p->second);
+	}
+
+	// If another directory was watched under this name, it's been
+	// replaced, and anything which happens to it doesn't matter.
+	std::map<std::string, int>::iterator w(mWatches.find(rPath));
+	if(w != mWatches.end() && w->second != wd)
+	{
+		mWatchPaths.erase(w->second);
+	}
+
+	mWatchPaths[wd] = rPath;
+	mWatches[rPath] = wd;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::StartSync()
+//		Purpose: Called at the start of each sync. Takes the list of
+//			 directories which changed since the last one, which
+//			 IsUnchanged() uses for the rest of the sync. Changes
+//			 during the sync are kept for the next one.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::StartSync()
+{
+	mChangedThisSync.clear();
+
+	if(mFileDescriptor == -1)
+	{
+		mFullScan = true;
+		return;
+	}
+
+	bool overflowed;
+	{
+		MutexLock lock(mMutex);
+
+		// Pick up anything which happened just before the sync
+		// started, which the thread might not have read yet
+		ReadAvailable();
+
+		overflowed = mOverflowed;
+		mOverflowed = false;
+		mChangedThisSync.swap(mChanged);
+	}
+
+	mFullScan = overflowed;
+	if(overflowed)
+	{
+		BOX_NOTICE("Too many changes for the change journal to keep "
+			"track of, reading all directories in this backup");
+	}
+	else
+	{
+		BOX_TRACE("Change journal: " << mChangedThisSync.size() <<
+			" directories changed since the last backup");
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::IsUnchanged(
+//			 const std::string &)
+//		Purpose: Whether a directory has been watched since before
+//			 the last sync, and nothing happened in it before this
+//			 one. Things in its subdirectories don't count.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::IsUnchanged(const std::string &rPath)
+{
+	if(mFullScan ||
+		mChangedThisSync.find(rPath) != mChangedThisSync.end())
+	{
+		return false;
+	}
+
+	MutexLock lock(mMutex);
+	return mWatches.find(rPath) != mWatches.end();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::ReadNotifications()
+//		Purpose: Run by the thread. Reads notifications whenever
+//			 there are some, until the journal is destroyed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::ReadNotifications()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	struct pollfd pfd;
+	pfd.fd = mFileDescriptor;
+	pfd.events = POLLIN;
+
+	while(true)
+	{
+		{
+			MutexLock lock(mMutex);
+			if(mStopping)
+			{
+				return;
+			}
+		}
+
+		pfd.revents = 0;
+		int result = ::poll(&pfd, 1,
+			BACKUPCLIENTCHANGEJOURNAL_POLL_INTERVAL);
+		if(result > 0)
+		{
+			MutexLock lock(mMutex);
+			ReadAvailable();
+		}
+		else if(result == -1 && errno != EINTR)
+		{
+			// Leave it to StartSync(). If the queue fills up
+			// before then, the kernel says so.
+			return;
+		}
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::ReadAvailable()
+//		Purpose: Reads the notifications which are waiting, without
+//			 blocking, and marks the directories they're for as
+//			 changed. Must be called with the mutex locked.
+//			 Returns false if there weren't any.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::ReadAvailable()
+{
+	bool readSome = false;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	union
+	{
+		struct inotify_event mAlignment;
+		char mBytes[16384];
+	} buffer;
+
+	while(true)
+	{
+		ssize_t bytes = ::read(mFileDescriptor, buffer.mBytes,
+			sizeof(buffer.mBytes));
+		if(bytes <= 0)
+		{
+			// Nothing more to read (EAGAIN), or it's broken, in
+			// which case the next sync reads everything
+			if(bytes == -1 && errno != EAGAIN && errno != EINTR)
+			{
+				mOverflowed = true;
+			}
+			break;
+		}
+
+		readSome = true;
+		for(ssize_t offset = 0; offset < bytes; )
+		{
+			const struct inotify_event *pEvent =
+				(const struct inotify_event *)
+				(buffer.mBytes + offset);
+			offset += sizeof(struct inotify_event) + pEvent->len;
+
+			if(pEvent->mask & IN_Q_OVERFLOW)
+			{
+				mOverflowed = true;
+				continue;
+			}
+
+			std::map<int, std::string>::iterator i(
+				mWatchPaths.find(pEvent->wd));
+			if(i == mWatchPaths.end())
+			{
+				// For a watch which has been forgotten
+				continue;
+			}
+
+			mChanged.insert(i->second);
+
+			if(pEvent->mask & IN_MOVE_SELF)
+			{
+				// Its name is wrong now. The sync watches it
+				// again under its new name when it finds it.
+				::inotify_rm_watch(mFileDescriptor, pEvent->wd);
+				Forget(pEvent->wd);
+			}
+			else if(pEvent->mask & IN_IGNORED)
+			{
+				// Deleted or unmounted
+				Forget(pEvent->wd);
+			}
+		}
+	}
+#endif
+
+	return readSome;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::Forget(int)
+//		Purpose: Forgets about a watch which the kernel has removed,
+//			 or is about to. Must be called with the mutex locked.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::Forget(int WatchDescriptor)
+{
+	std::map<int, std::string>::iterator i(
+		mWatchPaths.find(WatchDescriptor));
+	if(i == mWatchPaths.end())
+	{
+		return;
+	}
+
+	std::map<std::string, int>::iterator w(mWatches.find(i->second));
+	if(w != mWatches.end() && w->second == WatchDescriptor)
+	{
+		mWatches.erase(w);
+	}
+
+	mWatchPaths.erase(i);
+}
@@ -0,0 +1,84 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientChangeJournal.h
+//		Purpose: Keeps track of which local directories have changed
+//			 between syncs, using filesystem change notifications
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTCHANGEJOURNAL__H
+#define BACKUPCLIENTCHANGEJOURNAL__H
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "Thread.h"
+
+// How often the thread reading notifications checks whether to stop
+#define BACKUPCLIENTCHANGEJOURNAL_POLL_INTERVAL		1000
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientChangeJournal
+//		Purpose: Watches the local directories which are backed up,
+//			 with inotify, and remembers which of them anything
+//			 happened in. The sync asks it whether a directory
+//			 has changed since the last sync, and only reads the
+//			 directories which have, or which aren't watched.
+//			 Notifications are read by a thread between syncs,
+//			 so that the kernel's queue doesn't fill up. If it
+//			 does, or the journal is new, nothing is known about
+//			 which directories changed, and the next sync reads
+//			 all of them.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientChangeJournal
+{
+public:
+	BackupClientChangeJournal();
+	~BackupClientChangeJournal();
+private:
+	// no copying
+	BackupClientChangeJournal(const BackupClientChangeJournal &);
+	BackupClientChangeJournal &operator=(const BackupClientChangeJournal &);
+public:
+
+	static bool IsSupported();
+
+	bool Start();
+	bool Watch(const std::string &rPath);
+	void StartSync();
+	bool IsUnchanged(const std::string &rPath);
+
+	bool IsStarted() const {return mFileDescriptor != -1;}
+	bool IsFullScan() const {return mFullScan;}
+
+private:
+	friend class BackupClientChangeJournalThread;
+	void ReadNotifications();
+	bool ReadAvailable();
+	void Forget(int WatchDescriptor);
+
+	int mFileDescriptor;
+	Thread *mpThread;
+	bool mWatchLimitReached;
+
+	// Used only by the sync
+	bool mFullScan;
+	std::set<std::string> mChangedThisSync;
+
+	// Shared with the thread, protected by mMutex
+	Mutex mMutex;
+	std::map<int, std::string> mWatchPaths;
+	std::map<std::string, int> mWatches;
+	std::set<std::string> mChanged;
+	bool mOverflowed;
+	bool mStopping;
+};
+
+#endif // BACKUPCLIENTCHANGEJOURNAL__H
@@ -20,6 +20,7 @@
 #include "BoxPortsAndFiles.h"
 #include "BoxTime.h"
 #include "BackupClientContext.h"
+#include "BackupClientBlockIndexCache.h"
 #include "SocketStreamTLS.h"
 #include "Socket.h"
 #include "BackupStoreConstants.h"
@@ -59,6 +60,7 @@ BackupClientContext::BackupClientContext
   mHostname(rHostname),
   mPort(Port),
   mAccountNumber(AccountNumber),
+  mServerVersion(BACKUP_STORE_SERVER_VERSION),
   mExtendedLogging(ExtendedLogging),
   mExtendedLogToFile(ExtendedLogToFile),
   mExtendedLogFile(ExtendedLogFile),
@@ -70,6 +72,7 @@ BackupClientContext::BackupClientContext
   mStorageLimitExceeded(false),
   mpExcludeFiles(0),
   mpExcludeDirs(0),
+  mpBlockIndexCache(0),
   mKeepAliveTimer(0, "KeepAliveTime"),
   mbIsManaged(false),
   mrProgressNotifier(rProgressNotifier),
@@ -174,14 +177,44 @@ BackupProtocolCallable &BackupClientContext::GetConnection()
 		// Handshake
 		pClient->Handshake();
 
-		// Check the version of the server
+		// Check the version of the server. Ask for the version which
+		// allows faster block checksums first, and if the server is
+		// too old to know about it, fall back to the original one.
 		{
-			std::auto_ptr<BackupProtocolVersion> serverVersion(
-				mapConnection->QueryVersion(BACKUP_STORE_SERVER_VERSION));
-			if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_VERSION)
+			int32_t version = BACKUP_STORE_SERVER_VERSION_XXH3;
+			std::auto_ptr<BackupProtocolVersion> serverVersion;
+			try
+			{
+				HideSpecificExceptionGuard guard(
+					ConnectionException::ExceptionType,
+					ConnectionException::Protocol_UnexpectedReply);
+				serverVersion = mapConnection->QueryVersion(version);
+			}
+			catch(ConnectionException &e)
+			{
+				int type, subtype;
+				if(e.GetSubType() != ConnectionException::Protocol_UnexpectedReply ||
+					!mapConnection->GetLastError(type, subtype) ||
+					type != BackupProtocolError::ErrorType ||
+					subtype != BackupProtocolError::Err_WrongVersion)
+				{
+					throw;
+				}
+
+				BOX_TRACE("Server doesn't support XXH3 block "
+					"checksums, using MD5");
+				version = BACKUP_STORE_SERVER_VERSION;
+				serverVersion = mapConnection->QueryVersion(version);
+			}
+
+			if(serverVersion->GetVersion() != version)
 			{
 				THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
 			}
+
+			BackupStoreFile::SetFastBlockChecksums(
+				version == BACKUP_STORE_SERVER_VERSION_XXH3);
+			mServerVersion = version;
 		}
 
 		// Login -- if this fails, the Protocol will exception
@@ -222,6 +255,13 @@ BackupProtocolCallable &BackupClientContext::GetConnection()
 			
 			// Record it so that it can be picked up later.
 			mClientStoreMarker = marker;
+
+			// Nothing is known about the state of the store, so
+			// cached block indexes may not match what's on it
+			if(mpBlockIndexCache != 0)
+			{
+				mpBlockIndexCache->Clear();
+			}
 		}
 
 		// Log success
@@ -252,6 +292,46 @@ BackupProtocolCallable* BackupClientContext::GetOpenConnection() const
 	return mapConnection.get();
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientContext::OpenHelperConnection()
+//		Purpose: Opens another connection to the store and logs into
+//			 it as a helper session, which may only stage files
+//			 for the main connection to store. Asks for the same
+//			 version as the main connection, so opens that first
+//			 if necessary. Nice mode and extended logging are
+//			 only for the main connection.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolCallable> BackupClientContext::OpenHelperConnection()
+{
+	GetConnection();
+
+	std::auto_ptr<SocketStream> apSocket(new SocketStreamTLS);
+	((SocketStreamTLS *)(apSocket.get()))->Open(mrTLSContext,
+		Socket::TypeINET, mHostname, mPort);
+
+	std::auto_ptr<BackupProtocolClient> apClient(
+		new BackupProtocolClient(apSocket));
+	apClient->Handshake();
+
+	std::auto_ptr<BackupProtocolVersion> serverVersion(
+		apClient->QueryVersion(mServerVersion));
+	if(serverVersion->GetVersion() != mServerVersion)
+	{
+		THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
+	}
+
+	// Stores which don't know about helper sessions try to lock the
+	// account, which the main connection has, so this fails.
+	apClient->QueryLogin(mAccountNumber,
+		BackupProtocolLogin::Flags_Helper);
+
+	return std::auto_ptr<BackupProtocolCallable>(apClient.release());
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -20,6 +20,7 @@
 #include "Timer.h"
 
 class TLSContext;
+class BackupClientBlockIndexCache;
 class BackupProtocolClient;
 class SocketStreamTLS;
 class BackupClientInodeToIDMap;
@@ -64,6 +65,9 @@ public:
 	// GetOpenConnection() will not open a connection, just return NULL if there is
 	// no connection already open.
 	virtual BackupProtocolCallable* GetOpenConnection() const;
+	// OpenHelperConnection() opens another connection, which may only
+	// stage files for this one to store. It's not kept by the context.
+	virtual std::auto_ptr<BackupProtocolCallable> OpenHelperConnection();
 	void CloseAnyOpenConnection();
 	int GetTimeout() const;
 	BackupClientDeleteList &GetDeleteList();
@@ -113,6 +117,25 @@ public:
 		mpExcludeDirs = pExcludeDirs;
 	}
 	
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    BackupClientContext::SetBlockIndexCache(BackupClientBlockIndexCache *)
+	//		Purpose: Sets the cache of block indexes of uploaded files.
+	//			 Can be 0, in which case indexes are always fetched
+	//			 from the server for diffing.
+	//		Created: 16/10/26
+	//
+	// --------------------------------------------------------------------------
+	void SetBlockIndexCache(BackupClientBlockIndexCache *pBlockIndexCache)
+	{
+		mpBlockIndexCache = pBlockIndexCache;
+	}
+	BackupClientBlockIndexCache *GetBlockIndexCache() const
+	{
+		return mpBlockIndexCache;
+	}
+
 	// --------------------------------------------------------------------------
 	//
 	// Function
@@ -173,6 +196,7 @@ public:
 	//
 	// --------------------------------------------------------------------------
 	virtual void SetKeepAliveTime(int iSeconds);
+	int GetKeepAliveTime() const {return mKeepAliveTime;}
 
 	// --------------------------------------------------------------------------
 	//
@@ -229,6 +253,7 @@ private:
 	int mPort;
 	uint32_t mAccountNumber;
 	std::auto_ptr<BackupProtocolCallable> mapConnection;
+	int32_t mServerVersion;
 	bool mExtendedLogging;
 	bool mExtendedLogToFile;
 	std::string mExtendedLogFile;
@@ -240,6 +265,7 @@ private:
 	bool mStorageLimitExceeded;
 	ExcludeList *mpExcludeFiles;
 	ExcludeList *mpExcludeDirs;
+	BackupClientBlockIndexCache *mpBlockIndexCache;
 	Timer mKeepAliveTimer;
 	bool mbIsManaged;
 	int mKeepAliveTime;
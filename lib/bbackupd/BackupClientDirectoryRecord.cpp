@@ -10,10 +10,6 @@
 
 #include "Box.h"
 
-#ifdef HAVE_DIRENT_H
-	#include <dirent.h>
-#endif
-
 #include <errno.h>
 #include <string.h>
 
@@ -21,8 +17,11 @@
 #include "autogen_CipherException.h"
 #include "autogen_ClientException.h"
 #include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientContext.h"
 #include "BackupClientDirectoryRecord.h"
+#include "BackupClientDirectoryScanner.h"
 #include "BackupClientInodeToIDMap.h"
 #include "BackupDaemon.h"
 #include "BackupStoreException.h"
@@ -31,6 +30,7 @@
 #include "BufferedStream.h"
 #include "CommonException.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
 #include "FileModificationTime.h"
 #include "IOStream.h"
 #include "Logging.h"
@@ -56,9 +56,13 @@ BackupClientDirectoryRecord::BackupClientDirectoryRecord(int64_t ObjectID, const
 	  mSubDirName(rSubDirName),
 	  mInitialSyncDone(false),
 	  mSyncDone(false),
-	  mpPendingEntries(0)
+	  mpPendingEntries(0),
+	  mUnchangedInJournal(false),
+	  mSyncIncomplete(false),
+	  mpJournalIDMapEntries(0)
 {
 	::memset(mStateChecksum, 0, sizeof(mStateChecksum));
+	::memset(mSavedStateDigest, 0, sizeof(mSavedStateDigest));
 }
 
 // --------------------------------------------------------------------------
@@ -80,6 +84,11 @@ BackupClientDirectoryRecord::~BackupClientDirectoryRecord()
 		delete mpPendingEntries;
 		mpPendingEntries = 0;
 	}
+	if(mpJournalIDMapEntries != 0)
+	{
+		delete mpJournalIDMapEntries;
+		mpJournalIDMapEntries = 0;
+	}
 }
 
 // --------------------------------------------------------------------------
@@ -169,6 +178,37 @@ void BackupClientDirectoryRecord::SyncDirectory(
 		i->second->mSyncDone = false;
 	}
 
+	// If the change journal says that nothing has happened in this
+	// directory since it was last read, don't read it again. Its
+	// subdirectories may have changed though.
+	if(!ThisDirHasJustBeenCreated &&
+		IsUnchangedInJournal(rParams, rLocalPath))
+	{
+		SyncUnchangedDirectory(rParams, rLocalPath, rRemotePath,
+			rBackupLocation);
+		return;
+	}
+
+	// Until this sync has finished with it, it must be read again
+	mUnchangedInJournal = false;
+	mSyncIncomplete = false;
+	bool watchedByJournal = false;
+	if(rParams.mpChangeJournal)
+	{
+		// Watch it before reading it, so that nothing is missed
+		watchedByJournal = rParams.mpChangeJournal->Watch(rLocalPath);
+		if(mpJournalIDMapEntries == 0)
+		{
+			mpJournalIDMapEntries = new std::vector<IDMapEntry>;
+		}
+		mpJournalIDMapEntries->clear();
+	}
+	else if(mpJournalIDMapEntries != 0)
+	{
+		delete mpJournalIDMapEntries;
+		mpJournalIDMapEntries = 0;
+	}
+
 	// Work out the time in the future after which the file should
 	// be uploaded regardless. This is a simple way to avoid having
 	// too many problems with file servers when they have clients
@@ -181,12 +221,29 @@ void BackupClientDirectoryRecord::SyncDirectory(
 	// so byte order isn't considered.
 	MD5Digest currentStateChecksum;
 	
-	EMU_STRUCT_STAT dest_st;
-	// Stat the directory, to get attribute info
+	// Stat and read the directory, unless a scanner thread has already
+	// done it, to get attribute info and the entries
+	std::auto_ptr<BackupClientDirectoryScanner::Directory> apScanned;
+	if(rParams.mpDirectoryScanner)
+	{
+		apScanned = rParams.mpDirectoryScanner->Take(rLocalPath,
+			rContext, rParams.mpBackgroundTask);
+	}
+	else
+	{
+		apScanned.reset(new BackupClientDirectoryScanner::Directory);
+		BackupClientDirectoryScanner::Scan(rLocalPath, *apScanned,
+			&rContext, rParams.mpBackgroundTask);
+	}
+
+	rParams.mDirectoryEntriesRead += apScanned->mEntries.size();
+	rParams.mMetadataSystemCalls += apScanned->mSystemCalls;
+
 	// If it's a symbolic link, we want the link target here
 	// (as we're about to back up the contents of the directory)
+	EMU_STRUCT_STAT dest_st = apScanned->mStat;
 	{
-		if(EMU_STAT(rLocalPath.c_str(), &dest_st) != 0)
+		if(apScanned->mStatErrno != 0)
 		{
 			// The directory has probably been deleted, so
 			// just ignore this error. In a future scan, this
@@ -194,7 +251,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 			// and this object deleted.
 			rNotifier.NotifyDirStatFailed(this,
 				ConvertVssPathToRealPath(rLocalPath, rBackupLocation),
-				strerror(errno));
+				strerror(apScanned->mStatErrno));
 			return;
 		}
 
@@ -204,12 +261,9 @@ void BackupClientDirectoryRecord::SyncDirectory(
 
 		// Store inode number in map so directories are tracked
 		// in case they're renamed
-		{
-			BackupClientInodeToIDMap &idMap(
-				rParams.mrContext.GetNewIDMap());
-			idMap.AddToMap(dest_st.st_ino, mObjectID, ContainingDirectoryID,
-				ConvertVssPathToRealPath(rLocalPath, rBackupLocation));
-		}
+		AddToNewIDMap(rParams, dest_st.st_ino, mObjectID,
+			ContainingDirectoryID,
+			ConvertVssPathToRealPath(rLocalPath, rBackupLocation));
 		// Add attributes to checksum
 		currentStateChecksum.Add(&dest_st.st_mode,
 			sizeof(dest_st.st_mode));
@@ -228,90 +282,79 @@ void BackupClientDirectoryRecord::SyncDirectory(
 		StreamableMemBlock xattr;
 		BackupClientFileAttributes::FillExtendedAttr(xattr,
 			rLocalPath.c_str());
+		rParams.mExtendedAttributesRead++;
 		currentStateChecksum.Add(xattr.GetBuffer(), xattr.GetSize());
 	}
 	
-	// Read directory entries, building arrays of names
-	// First, need to read the contents of the directory.
+	// Go through the directory entries, building arrays of names
 	std::vector<std::string> dirs;
 	std::vector<std::string> files;
 	bool downloadDirectoryRecordBecauseOfFutureFiles = false;
+	// Another name for a file here could be changed without the
+	// change journal saying that this directory has changed
+	bool hasHardLinkedFiles = false;
 
 	// BLOCK
 	{
-		// read the contents...
-		DIR *dirHandle = 0;
-		try
-		{
-			std::string nonVssDirPath = ConvertVssPathToRealPath(rLocalPath,
-					rBackupLocation);
-			rNotifier.NotifyScanDirectory(this, nonVssDirPath);
+		std::string nonVssDirPath = ConvertVssPathToRealPath(rLocalPath,
+				rBackupLocation);
+		rNotifier.NotifyScanDirectory(this, nonVssDirPath);
 
-			dirHandle = ::opendir(rLocalPath.c_str());
-			if(dirHandle == 0)
+		if(apScanned->mOpenErrno != 0)
+		{
+			// Report the error (logs and eventual email to administrator)
+			if (apScanned->mOpenErrno == EACCES)
 			{
-				// Report the error (logs and eventual email to administrator)
-				if (errno == EACCES)
-				{
-					rNotifier.NotifyDirListFailed(this,
-						nonVssDirPath,
-						"Access denied");
-				}
-				else
-				{
-					rNotifier.NotifyDirListFailed(this,
-						nonVssDirPath,
-						strerror(errno));
-				}
-
-				// Report the error (logs and eventual email
-				// to administrator)
-				SetErrorWhenReadingFilesystemObject(rParams,
-					nonVssDirPath);
-				// Ignore this directory for now.
-				return;
+				rNotifier.NotifyDirListFailed(this,
+					nonVssDirPath,
+					"Access denied");
+			}
+			else
+			{
+				rNotifier.NotifyDirListFailed(this,
+					nonVssDirPath,
+					strerror(apScanned->mOpenErrno));
 			}
 
-			struct dirent *en = 0;
-			int num_entries_found = 0;
+			// Report the error (logs and eventual email
+			// to administrator)
+			SetErrorWhenReadingFilesystemObject(rParams,
+				nonVssDirPath);
+			// Ignore this directory for now.
+			return;
+		}
 
-			while((en = ::readdir(dirHandle)) != 0)
+		for(std::vector<BackupClientDirectoryScanner::Entry>::const_iterator
+			i = apScanned->mEntries.begin();
+			i != apScanned->mEntries.end(); ++i)
+		{
+#ifndef WIN32
+			if(S_ISREG(i->mStat.st_mode) && i->mStat.st_nlink > 1)
 			{
-				num_entries_found++;
-				rParams.mrContext.DoKeepAlive();
-				if(rParams.mpBackgroundTask)
-				{
-					rParams.mpBackgroundTask->RunBackgroundTask(
-						BackgroundTask::Scanning_Dirs,
-						num_entries_found, 0);
-				}
-
-				if (!SyncDirectoryEntry(rParams, rNotifier,
-					rBackupLocation, rLocalPath,
-					currentStateChecksum, en, dest_st, dirs,
-					files, downloadDirectoryRecordBecauseOfFutureFiles))
-				{
-					// This entry is not to be backed up.
-					continue;
-				}
+				hasHardLinkedFiles = true;
 			}
-	
-			if(::closedir(dirHandle) != 0)
+#endif
+
+			if (!SyncDirectoryEntry(rParams, rNotifier,
+				rBackupLocation, rLocalPath,
+				currentStateChecksum, *i, dest_st, dirs,
+				files, downloadDirectoryRecordBecauseOfFutureFiles))
 			{
-				THROW_EXCEPTION(CommonException, OSFileError)
+				// This entry is not to be backed up.
+				continue;
 			}
-			dirHandle = 0;
 		}
-		catch(...)
+
+		if(apScanned->mCloseFailed)
 		{
-			if(dirHandle != 0)
-			{
-				::closedir(dirHandle);
-			}
-			throw;
+			THROW_EXCEPTION(CommonException, OSFileError)
 		}
 	}
 
+	// The entries aren't needed any more, and the sync of the
+	// subdirectories can take a while
+	apScanned.reset();
+
 	// Finish off the checksum, and compare with the one currently stored
 	bool checksumDifferent = true;
 	currentStateChecksum.Finish();
@@ -323,6 +366,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 
 	// Pointer to potentially downloaded store directory info
 	std::auto_ptr<BackupStoreDirectory> apDirOnStore;
+	bool updateCompleteSuccess = false;
 	
 	try
 	{
@@ -365,7 +409,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 		}
 		
 		// Do the directory reading
-		bool updateCompleteSuccess = UpdateItems(rParams, rLocalPath,
+		updateCompleteSuccess = UpdateItems(rParams, rLocalPath,
 			rRemotePath, rBackupLocation, apDirOnStore.get(),
 			entriesLeftOver, files, dirs);
 		
@@ -393,6 +437,140 @@ void BackupClientDirectoryRecord::SyncDirectory(
 	// Flag things as having happened.
 	mInitialSyncDone = true;
 	mSyncDone = true;
+
+	// Don't read it again until the change journal says it's changed,
+	// if everything in it was backed up, and will stay that way until
+	// then. Files which are too new to upload yet are pending entries.
+	mUnchangedInJournal = watchedByJournal && updateCompleteSuccess &&
+		!mSyncIncomplete && !hasHardLinkedFiles &&
+		!downloadDirectoryRecordBecauseOfFutureFiles &&
+		mpPendingEntries == 0 &&
+		!rParams.mrContext.StorageLimitExceeded();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::IsUnchangedInJournal(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::string &)
+//		Purpose: Private. Whether the directory needn't be read by
+//			 this sync, because everything in it was backed up
+//			 by the last sync which read it, and the change
+//			 journal says nothing has happened in it since.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::IsUnchangedInJournal(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rLocalPath)
+{
+	return rParams.mpChangeJournal != 0 && mUnchangedInJournal &&
+		mpJournalIDMapEntries != 0 &&
+		rParams.mpChangeJournal->IsUnchanged(rLocalPath);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SyncUnchangedDirectory(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::string &, const std::string &,
+//			 const Location &)
+//		Purpose: Private. Syncs a directory which hasn't changed
+//			 since it was last read, without reading it or asking
+//			 the store about it. Puts back what it added to the
+//			 new ID map last time, and syncs its subdirectories,
+//			 which may have changed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SyncUnchangedDirectory(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rLocalPath,
+	const std::string &rRemotePath,
+	const Location& rBackupLocation)
+{
+	BackupClientContext& rContext(rParams.mrContext);
+
+	BOX_TRACE("Change journal: not reading unchanged directory '" <<
+		rLocalPath << "'");
+
+	BackupClientInodeToIDMap &idMap(rContext.GetNewIDMap());
+	for(std::vector<IDMapEntry>::const_iterator
+		i = mpJournalIDMapEntries->begin();
+		i != mpJournalIDMapEntries->end(); ++i)
+	{
+		idMap.AddToMap(i->mInodeNum, i->mObjectID, i->mInDirectory,
+			i->mLocalPath);
+	}
+
+	std::vector<std::string> dirs;
+	for(std::map<std::string, BackupClientDirectoryRecord *>::iterator
+		i = mSubDirectories.begin(); i != mSubDirectories.end(); ++i)
+	{
+		dirs.push_back(i->first);
+	}
+	ReadAheadSubDirectories(rParams, rLocalPath, dirs);
+
+	for(std::vector<std::string>::const_iterator d = dirs.begin();
+		d != dirs.end(); ++d)
+	{
+		rContext.DoKeepAlive();
+		mSubDirectories[*d]->SyncDirectory(rParams, mObjectID,
+			MakeFullPath(rLocalPath, *d), rRemotePath + "/" + *d,
+			rBackupLocation);
+	}
+
+	mSyncDone = true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::ReadAheadSubDirectories(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::string &,
+//			 const std::vector<std::string> &)
+//		Purpose: Private. Has the directory scanner read the
+//			 subdirectories which are about to be synced, in
+//			 order, except for those which won't be read because
+//			 they haven't changed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::ReadAheadSubDirectories(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rLocalPath,
+	const std::vector<std::string> &rDirs)
+{
+	if(!rParams.mpDirectoryScanner)
+	{
+		return;
+	}
+
+	std::vector<std::string> dirPaths;
+	for(std::vector<std::string>::const_iterator d = rDirs.begin();
+		d != rDirs.end(); ++d)
+	{
+		std::string dirname(MakeFullPath(rLocalPath, *d));
+
+		std::map<std::string, BackupClientDirectoryRecord *>::iterator
+			e(mSubDirectories.find(*d));
+		if(e != mSubDirectories.end() &&
+			e->second->IsUnchangedInJournal(rParams, dirname))
+		{
+			continue;
+		}
+
+		if(rParams.mpChangeJournal)
+		{
+			// Watch it before a scanner thread reads it
+			rParams.mpChangeJournal->Watch(dirname);
+		}
+		dirPaths.push_back(dirname);
+	}
+	rParams.mpDirectoryScanner->Queue(dirPaths);
 }
 
 // --------------------------------------------------------------------------
@@ -413,20 +591,15 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	const Location& rBackupLocation,
 	const std::string &rDirLocalPath,
 	MD5Digest& currentStateChecksum,
-	struct dirent *en,
-	EMU_STRUCT_STAT dir_st,
+	const BackupClientDirectoryScanner::Entry &rEntry,
+	const EMU_STRUCT_STAT &dir_st,
 	std::vector<std::string>& rDirs,
 	std::vector<std::string>& rFiles,
 	bool& rDownloadDirectoryRecordBecauseOfFutureFiles)
 {
-	std::string entry_name = en->d_name;
-	if(entry_name == "." || entry_name == "..")
-	{
-		// ignore parent directory entries
-		return false;
-	}
+	const std::string &entry_name(rEntry.mName);
 
-	// Stat file to get info
+	// The entry was lstat'ed when the directory was scanned
 	std::string filename = MakeFullPath(rDirLocalPath, entry_name);
 	std::string realFileName = ConvertVssPathToRealPath(filename,
 		rBackupLocation);
@@ -436,12 +609,12 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	// Don't stat the file just yet, to ensure that users can exclude
 	// unreadable files to suppress warnings that they are not accessible.
 	//
-	// Our emulated readdir() abuses en->d_type, which would normally
+	// Our emulated readdir() abuses d_type, which would normally
 	// contain DT_REG, DT_DIR, etc, but we only use it here and prefer to
-	// have the full file attributes.
+	// have the full file attributes. The scanner keeps it in mAttributes.
 
 	int type;
-	if (en->d_type & FILE_ATTRIBUTE_DIRECTORY)
+	if (rEntry.mAttributes & FILE_ATTRIBUTE_DIRECTORY)
 	{
 		type = S_IFDIR;
 	}
@@ -450,7 +623,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 		type = S_IFREG;
 	}
 #else // !WIN32
-	if(EMU_LSTAT(filename.c_str(), &file_st) != 0)
+	if(rEntry.mStatErrno != 0)
 	{
 		// We don't know whether it's a file or a directory, so check
 		// both. This only affects whether a warning message is
@@ -461,7 +634,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 			// Report the error (logs and eventual email to
 			// administrator)
 			rNotifier.NotifyFileStatFailed(this, filename,
-				strerror(errno));
+				strerror(rEntry.mStatErrno));
 
 			// FIXME move to NotifyFileStatFailed()
 			SetErrorWhenReadingFilesystemObject(rParams, filename);
@@ -471,6 +644,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 		return false;
 	}
 
+	file_st = rEntry.mStat;
 	BOX_TRACE("Stat entry '" << filename << "' found device/inode " <<
 		file_st.st_dev << "/" << file_st.st_ino);
 
@@ -519,7 +693,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 		// parent directory under Vista and later, and causes an
 		// infinite loop:
 		// http://social.msdn.microsoft.com/forums/en-US/windowscompatibility/thread/05d14368-25dd-41c8-bdba-5590bf762a68/
-		if (en->d_type & FILE_ATTRIBUTE_REPARSE_POINT)
+		if (rEntry.mAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
 		{
 			rNotifier.NotifyMountPointSkipped(this, realFileName);
 			return false;
@@ -592,7 +766,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	checksum_info.mAttributeModificationTime = FileAttrModificationTime(file_st);
 	checksum_info.mSize = file_st.st_size;
 	currentStateChecksum.Add(&checksum_info, sizeof(checksum_info));
-	currentStateChecksum.Add(en->d_name, strlen(en->d_name));
+	currentStateChecksum.Add(entry_name.c_str(), entry_name.size());
 	
 	// If the file has been modified madly into the future, download the 
 	// directory record anyway to ensure that it doesn't get uploaded
@@ -794,6 +968,9 @@ bool BackupClientDirectoryRecord::UpdateItems(
 		}
 	}
 
+	// New files being sent on upload helper connections, in order
+	std::deque<PendingUpload> pendingUploads;
+
 	// Do files
 	for(std::vector<std::string>::const_iterator f = rFiles.begin();
 		f != rFiles.end(); ++f)
@@ -808,13 +985,14 @@ bool BackupClientDirectoryRecord::UpdateItems(
 
 		// Get relevant info about file
 		box_time_t modTime = 0;
-		uint64_t attributesHash = 0;
 		int64_t fileSize = 0;
 		InodeRefType inodeNum = 0;
+		EMU_STRUCT_STAT st;
 		// BLOCK
 		{
-			// Stat the file
-			EMU_STRUCT_STAT st;
+			// Stat the file again, as it may have changed since the
+			// directory was scanned
+			rParams.mMetadataSystemCalls++;
 			if(EMU_LSTAT(filename.c_str(), &st) != 0)
 			{
 				rNotifier.NotifyFileStatFailed(this, nonVssFilePath,
@@ -832,7 +1010,6 @@ bool BackupClientDirectoryRecord::UpdateItems(
 			modTime = FileModificationTime(st);
 			fileSize = st.st_size;
 			inodeNum = st.st_ino;
-			attributesHash = BackupClientFileAttributes::GenerateAttributeHash(st, filename, *f);
 		}
 
 		// See if it's in the listing (if we have one)
@@ -1058,7 +1235,25 @@ bool BackupClientDirectoryRecord::UpdateItems(
 			(doUpload ? "will upload" : "will not upload") <<
 			" (" << decisionReason << ")");
 
+		// Reading the extended attributes for the hash takes more
+		// system calls than everything else about the file, so it's
+		// only done if the hash will be stored or compared with the
+		// one on the store. Otherwise the file's entry in the
+		// directory on the store is up to date, as its state checksum
+		// hasn't changed.
+		uint64_t attributesHash = 0;
+		if(doUpload || en != 0)
+		{
+			attributesHash = BackupClientFileAttributes::GenerateAttributeHash(st, filename, *f);
+			rParams.mExtendedAttributesRead++;
+		}
+		else
+		{
+			rParams.mExtendedAttributesSkipped++;
+		}
+
 		bool fileSynced = true;
+		bool uploadPending = false;
 
 		if (doUpload)
 		{
@@ -1079,66 +1274,58 @@ bool BackupClientDirectoryRecord::UpdateItems(
 				// object ID it returns
 				bool noPreviousVersionOnServer =
 					((pDirOnStore != 0) && (en == 0));
-				
-				// Surround this in a try/catch block, to
-				// catch errors, but still continue
-				bool uploadSuccess = false;
-				try
+
+				// Which object is the current version on the
+				// server, if that's known without asking it? The
+				// ID map is only trusted if the file still has
+				// the same name.
+				int64_t previousObjectID = latestObjectID;
+				if(previousObjectID == 0 && !noPreviousVersionOnServer)
 				{
-					latestObjectID = UploadFile(rParams,
-						filename,
-						nonVssFilePath,
-						rRemotePath + "/" + *f,
-						storeFilename,
-						fileSize, modTime,
-						attributesHash,
-						noPreviousVersionOnServer);
-
-					if (latestObjectID == 0)
-					{
-						// storage limit exceeded
-						rParams.mrContext.SetStorageLimitExceeded();
-						uploadSuccess = false;
-						allUpdatedSuccessfully = false;
-					}
-					else
+					int64_t objid = 0, dirid = 0;
+					std::string localPath;
+					if(rContext.GetCurrentIDMap().Lookup(inodeNum,
+						objid, dirid, &localPath) &&
+						dirid == mObjectID &&
+						localPath == nonVssFilePath)
 					{
-						uploadSuccess = true;
+						previousObjectID = objid;
 					}
 				}
-				catch(ConnectionException &e)
+				
+				// New files can be sent on an upload helper
+				// connection, and stored later, while this one
+				// carries on
+				BackupClientUploadHelpers::Upload *pUpload = 0;
+				if(noPreviousVersionOnServer && rParams.mpUploadHelpers)
 				{
-					// Connection errors should just be
-					// passed on to the main handler,
-					// retries would probably just cause
-					// more problems.
-					rNotifier.NotifyFileUploadException(
-						this, nonVssFilePath, e);
-					throw;
+					pUpload = rParams.mpUploadHelpers->Start(
+						filename, mObjectID, storeFilename);
 				}
-				catch(BoxException &e)
+
+				if(pUpload != 0)
 				{
-					if (e.GetType() == BackupStoreException::ExceptionType &&
-						e.GetSubType() == BackupStoreException::SignalReceived)
-					{
-						// abort requested, pass the
-						// exception on up.
-						throw;
-					}
-					
-					// an error occured -- make return
-					// code false, to show error in directory
-					allUpdatedSuccessfully = false;
-					// Log it.
-					SetErrorWhenReadingFilesystemObject(rParams,
-						nonVssFilePath);
-					rNotifier.NotifyFileUploadException(this,
-						nonVssFilePath, e);
+					PendingUpload pending;
+					pending.mLeafName = *f;
+					pending.mFilename = filename;
+					pending.mNonVssFilePath = nonVssFilePath;
+					pending.mRemotePath = rRemotePath + "/" + *f;
+					pending.mStoreFilename = storeFilename;
+					pending.mFileSize = fileSize;
+					pending.mModificationTime = modTime;
+					pending.mAttributesHash = attributesHash;
+					pending.mInodeNum = inodeNum;
+					pending.mPendingFirstSeenTime =
+						pendingFirstSeenTime;
+					pending.mpUpload = pUpload;
+					pendingUploads.push_back(pending);
+					uploadPending = true;
 				}
-
-				// Update structures if the file was uploaded
-				// successfully.
-				if(uploadSuccess)
+				else if(TryUploadFile(rParams, filename,
+					nonVssFilePath, rRemotePath + "/" + *f,
+					storeFilename, fileSize, modTime,
+					attributesHash, noPreviousVersionOnServer,
+					previousObjectID, 0, latestObjectID))
 				{
 					fileSynced = true;
 
@@ -1148,6 +1335,10 @@ bool BackupClientDirectoryRecord::UpdateItems(
 						mpPendingEntries->erase(*f);
 					}
 				}
+				else
+				{
+					allUpdatedSuccessfully = false;
+				}
 			}
 			else
 			{
@@ -1220,58 +1411,20 @@ bool BackupClientDirectoryRecord::UpdateItems(
 			}
 		}
 		
-		// Does this file need an entry in the ID map?
-		if(fileSize >= rParams.mFileTrackingSizeThreshold)
+		if(uploadPending)
 		{
-			// Get the map
-			BackupClientInodeToIDMap &idMap(rContext.GetNewIDMap());
-		
-			// Need to get an ID from somewhere...
-			if(latestObjectID == 0)
-			{
-				// Don't know it -- haven't sent anything to the store, and didn't get a listing.
-				// Look it up in the current map, and if it's there, use that.
-				const BackupClientInodeToIDMap &currentIDMap(rContext.GetCurrentIDMap());
-				int64_t objid = 0, dirid = 0;
-				if(currentIDMap.Lookup(inodeNum, objid, dirid))
-				{
-					// Found
-					if (dirid != mObjectID)
-					{
-						BOX_WARNING("Found conflicting parent ID for "
-							"file ID " << inodeNum << " (" <<
-							nonVssFilePath << "): expected " <<
-							mObjectID << " but found " << dirid <<
-							" (same directory used in two different "
-							"locations?)");
-					}
-
-					ASSERT(dirid == mObjectID);
-
-					// NOTE: If the above assert fails, an inode number has been reused by the OS,
-					// or there is a problem somewhere. If this happened on a short test run, look
-					// into it. However, in a long running process this may happen occasionally and
-					// not indicate anything wrong.
-					// Run the release version for real life use, where this check is not made.
-
-					latestObjectID = objid;
-				}
-			}
-
-			if(latestObjectID != 0)
-			{
-				BOX_TRACE("Storing uploaded file ID " <<
-					inodeNum << " (" << nonVssFilePath << ") "
-					"in ID map as object " <<
-					latestObjectID << " with parent " <<
-					mObjectID);
-				idMap.AddToMap(inodeNum, latestObjectID,
-					mObjectID /* containing directory */,
-					nonVssFilePath);
-			}
-
+			// The rest is done when it's been stored. Don't let
+			// too many build up, so that the helpers keep going
+			// but the sync doesn't get too far ahead of them.
+			FinishPendingUploads(rParams, pendingUploads,
+				rParams.mpUploadHelpers->GetMaxPending(),
+				allUpdatedSuccessfully);
+			continue;
 		}
 
+		UpdateNewIDMap(rParams, inodeNum, latestObjectID, fileSize,
+			nonVssFilePath);
+
 		if (fileSynced)
 		{
 			rNotifier.NotifyFileSynchronised(this, nonVssFilePath,
@@ -1279,6 +1432,11 @@ bool BackupClientDirectoryRecord::UpdateItems(
 		}
 	}
 
+	// Store everything sent on the helpers before going on, so that
+	// the directory is complete
+	FinishPendingUploads(rParams, pendingUploads, 0,
+		allUpdatedSuccessfully);
+
 	// Erase contents of files to save space when recursing
 	rFiles.clear();
 
@@ -1291,6 +1449,9 @@ bool BackupClientDirectoryRecord::UpdateItems(
 		mpPendingEntries = 0;
 	}
 	
+	// Have the subdirectories read ahead, in the order they're synced
+	ReadAheadSubDirectories(rParams, rLocalPath, rDirs);
+
 	// Do directories
 	for(std::vector<std::string>::const_iterator d = rDirs.begin();
 		d != rDirs.end(); ++d)
@@ -1435,6 +1596,16 @@ bool BackupClientDirectoryRecord::UpdateItems(
 				rRemotePath + "/" + *d, rBackupLocation,
 				haveJustCreatedDirOnServer);
 		}
+		else
+		{
+			// Not backed up, so this must be read again
+			mSyncIncomplete = true;
+
+			if(rParams.mpDirectoryScanner)
+			{
+				rParams.mpDirectoryScanner->Forget(dirname);
+			}
+		}
 	}
 
 	// Delete everything which is on the store, but not on disc
@@ -1688,17 +1859,21 @@ void BackupClientDirectoryRecord::RemoveDirectoryInPlaceOfFile(
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupClientDirectoryRecord::UploadFile(
+//		Name:    BackupClientDirectoryRecord::TryUploadFile(
 //			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::string &, const std::string &,
 //			 const std::string &,
-//			 const BackupStoreFilename &,
-//			 int64_t, box_time_t, box_time_t, bool)
-//		Purpose: Private. Upload a file to the server. May send
-//			 a patch instead of the whole thing
-//		Created: 20/1/04
+//			 const BackupStoreFilenameClear &, int64_t,
+//			 box_time_t, box_time_t, bool, int64_t,
+//			 BackupClientUploadHelpers::Upload *, int64_t &)
+//		Purpose: Private. Uploads a file, catching and reporting
+//			 errors so that the sync can carry on with the next
+//			 one. Returns true, and the new object ID, if it was
+//			 uploaded.
+//		Created: 16/10/26
 //
 // --------------------------------------------------------------------------
-int64_t BackupClientDirectoryRecord::UploadFile(
+bool BackupClientDirectoryRecord::TryUploadFile(
 	BackupClientDirectoryRecord::SyncParams &rParams,
 	const std::string &rLocalPath,
 	const std::string &rNonVssFilePath,
@@ -1707,63 +1882,366 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	int64_t FileSize,
 	box_time_t ModificationTime,
 	box_time_t AttributesHash,
-	bool NoPreviousVersionOnServer)
+	bool NoPreviousVersionOnServer,
+	int64_t PreviousObjectID,
+	BackupClientUploadHelpers::Upload *pUpload,
+	int64_t &rObjectIDOut)
 {
-	BackupClientContext& rContext(rParams.mrContext);
-	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
-
-	// Get the connection
-	BackupProtocolCallable &connection(rContext.GetConnection());
+	ProgressNotifier& rNotifier(rParams.mrContext.GetProgressNotifier());
 
-	// Info
-	int64_t objID = 0;
-	int64_t uploadedSize = -1;
-	
-	// Use a try block to catch store full errors
 	try
 	{
-		std::auto_ptr<BackupStoreFileEncodeStream> apStreamToUpload;
-		int64_t diffFromID = 0;
+		rObjectIDOut = UploadFile(rParams, rLocalPath,
+			rNonVssFilePath, rRemotePath, rStoreFilename,
+			FileSize, ModificationTime, AttributesHash,
+			NoPreviousVersionOnServer, PreviousObjectID,
+			pUpload);
 
-		// Might an old version be on the server, and is the file
-		// size over the diffing threshold?
-		if(!NoPreviousVersionOnServer &&
-			FileSize >= rParams.mDiffingUploadSizeThreshold)
+		if (rObjectIDOut == 0)
 		{
-			// YES -- try to do diff, if possible
-			// First, query the server to see if there's an old version available
-			std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
-			diffFromID = getBlockIndex->GetObjectID();
-			
-			if(diffFromID != 0)
-			{
-				// Found an old version
+			// storage limit exceeded
+			rParams.mrContext.SetStorageLimitExceeded();
+			return false;
+		}
+	}
+	catch(ConnectionException &e)
+	{
+		// Connection errors should just be
+		// passed on to the main handler,
+		// retries would probably just cause
+		// more problems.
+		rNotifier.NotifyFileUploadException(
+			this, rNonVssFilePath, e);
+		throw;
+	}
+	catch(BoxException &e)
+	{
+		if (e.GetType() == BackupStoreException::ExceptionType &&
+			e.GetSubType() == BackupStoreException::SignalReceived)
+		{
+			// abort requested, pass the
+			// exception on up.
+			throw;
+		}
 
-				// Get the index
-				std::auto_ptr<IOStream> blockIndexStream(connection.ReceiveStream());
-			
-				//
-				// Diff the file
-				//
+		// Log it.
+		SetErrorWhenReadingFilesystemObject(rParams,
+			rNonVssFilePath);
+		rNotifier.NotifyFileUploadException(this,
+			rNonVssFilePath, e);
+		return false;
+	}
 
-				rContext.ManageDiffProcess();
+	return true;
+}
 
-				bool isCompletelyDifferent = false;
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::FinishPendingUploads(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 std::deque<PendingUpload> &, size_t, bool &)
+//		Purpose: Private. Stores files started on the upload
+//			 helpers, oldest first, until no more than MaxLeft
+//			 are still pending. Clears rAllUpdatedSuccessfully
+//			 if any of them failed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::FinishPendingUploads(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	std::deque<PendingUpload> &rUploads, size_t MaxLeft,
+	bool &rAllUpdatedSuccessfully)
+{
+	BackupClientContext& rContext(rParams.mrContext);
+	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
 
-				apStreamToUpload = BackupStoreFile::EncodeFileDiff(
-					rLocalPath,
-					mObjectID, /* containing directory */
-					rStoreFilename, diffFromID, *blockIndexStream,
-					connection.GetTimeout(),
-					&rContext, // DiffTimer implementation
-					0 /* not interested in the modification time */, 
-					&isCompletelyDifferent,
-					rParams.mpBackgroundTask);
+	while(rUploads.size() > MaxLeft)
+	{
+		PendingUpload pending(rUploads.front());
+		rUploads.pop_front();
 
-				if(isCompletelyDifferent)
-				{
-					diffFromID = 0;
-				}
+		bool fileSynced = false;
+		int64_t objectID = 0;
+
+		if(rContext.StorageLimitExceeded())
+		{
+			// Filled up since it was started, so don't store it
+			std::auto_ptr<BackupStoreFileEncodeStream> unused;
+			rParams.mpUploadHelpers->Finish(pending.mpUpload, unused);
+			rNotifier.NotifyFileSkippedServerFull(this,
+				pending.mNonVssFilePath);
+		}
+		else if(TryUploadFile(rParams, pending.mFilename,
+			pending.mNonVssFilePath, pending.mRemotePath,
+			pending.mStoreFilename, pending.mFileSize,
+			pending.mModificationTime, pending.mAttributesHash,
+			true /* no previous version on server */,
+			0 /* previous object ID */, pending.mpUpload,
+			objectID))
+		{
+			fileSynced = true;
+
+			// delete from pending entries
+			if(pending.mPendingFirstSeenTime != 0 &&
+				mpPendingEntries != 0)
+			{
+				mpPendingEntries->erase(pending.mLeafName);
+			}
+		}
+		else
+		{
+			rAllUpdatedSuccessfully = false;
+		}
+
+		UpdateNewIDMap(rParams, pending.mInodeNum, objectID,
+			pending.mFileSize, pending.mNonVssFilePath);
+
+		if(fileSynced)
+		{
+			rNotifier.NotifyFileSynchronised(this,
+				pending.mNonVssFilePath, pending.mFileSize);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::UpdateNewIDMap(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 InodeRefType, int64_t, int64_t,
+//			 const std::string &)
+//		Purpose: Private. Records the object ID of a file in the new
+//			 inode to ID map, if it's big enough to be tracked.
+//			 If the ID is 0, because nothing was uploaded, it's
+//			 taken from the current map, if the file is there.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::UpdateNewIDMap(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	InodeRefType InodeNum, int64_t ObjectID, int64_t FileSize,
+	const std::string &rNonVssFilePath)
+{
+	BackupClientContext& rContext(rParams.mrContext);
+
+	// Does this file need an entry in the ID map?
+	if(FileSize < rParams.mFileTrackingSizeThreshold)
+	{
+		return;
+	}
+
+	// Need to get an ID from somewhere...
+	if(ObjectID == 0)
+	{
+		// Don't know it -- haven't sent anything to the store, and didn't get a listing.
+		// Look it up in the current map, and if it's there, use that.
+		const BackupClientInodeToIDMap &currentIDMap(rContext.GetCurrentIDMap());
+		int64_t objid = 0, dirid = 0;
+		if(currentIDMap.Lookup(InodeNum, objid, dirid))
+		{
+			// Found
+			if (dirid != mObjectID)
+			{
+				BOX_WARNING("Found conflicting parent ID for "
+					"file ID " << InodeNum << " (" <<
+					rNonVssFilePath << "): expected " <<
+					mObjectID << " but found " << dirid <<
+					" (same directory used in two different "
+					"locations?)");
+			}
+
+			ASSERT(dirid == mObjectID);
+
+			// NOTE: If the above assert fails, an inode number has been reused by the OS,
+			// or there is a problem somewhere. If this happened on a short test run, look
+			// into it. However, in a long running process this may happen occasionally and
+			// not indicate anything wrong.
+			// Run the release version for real life use, where this check is not made.
+
+			ObjectID = objid;
+		}
+	}
+
+	if(ObjectID != 0)
+	{
+		BOX_TRACE("Storing uploaded file ID " <<
+			InodeNum << " (" << rNonVssFilePath << ") "
+			"in ID map as object " <<
+			ObjectID << " with parent " <<
+			mObjectID);
+		AddToNewIDMap(rParams, InodeNum, ObjectID,
+			mObjectID /* containing directory */,
+			rNonVssFilePath);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::AddToNewIDMap(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 InodeRefType, int64_t, int64_t,
+//			 const std::string &)
+//		Purpose: Private. Adds a file or directory in this directory,
+//			 or the directory itself, to the new inode to ID map,
+//			 remembering it if there's a change journal, in case
+//			 the directory isn't read next time.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::AddToNewIDMap(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	InodeRefType InodeNum, int64_t ObjectID, int64_t InDirectory,
+	const std::string &rLocalPath)
+{
+	rParams.mrContext.GetNewIDMap().AddToMap(InodeNum, ObjectID,
+		InDirectory, rLocalPath);
+
+	if(mpJournalIDMapEntries != 0)
+	{
+		IDMapEntry entry;
+		entry.mInodeNum = InodeNum;
+		entry.mObjectID = ObjectID;
+		entry.mInDirectory = InDirectory;
+		entry.mLocalPath = rLocalPath;
+		mpJournalIDMapEntries->push_back(entry);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::UploadFile(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::string &,
+//			 const BackupStoreFilename &,
+//			 int64_t, box_time_t, box_time_t, bool, int64_t,
+//			 BackupClientUploadHelpers::Upload *)
+//		Purpose: Private. Upload a file to the server. May send
+//			 a patch instead of the whole thing. If the object ID
+//			 of the current version on the server is known, and
+//			 its block index is in the cache, the diff is done
+//			 against that instead of asking the server for it.
+//			 If the file was started on an upload helper, it's
+//			 stored from there if the helper staged it, or sent
+//			 here if not.
+//		Created: 20/1/04
+//
+// --------------------------------------------------------------------------
+int64_t BackupClientDirectoryRecord::UploadFile(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rLocalPath,
+	const std::string &rNonVssFilePath,
+	const std::string &rRemotePath,
+	const BackupStoreFilenameClear &rStoreFilename,
+	int64_t FileSize,
+	box_time_t ModificationTime,
+	box_time_t AttributesHash,
+	bool NoPreviousVersionOnServer,
+	int64_t PreviousObjectID,
+	BackupClientUploadHelpers::Upload *pUpload)
+{
+	BackupClientContext& rContext(rParams.mrContext);
+	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
+	BackupClientBlockIndexCache *pcache = rContext.GetBlockIndexCache();
+
+	// Get the connection
+	BackupProtocolCallable &connection(rContext.GetConnection());
+
+	// Collect the file from the upload helper, if it was given to one
+	int64_t stagedID = 0;
+	std::auto_ptr<BackupStoreFileEncodeStream> apStaged;
+	if(pUpload != 0)
+	{
+		ASSERT(NoPreviousVersionOnServer);
+		stagedID = rParams.mpUploadHelpers->Finish(pUpload, apStaged);
+	}
+
+	// Info
+	int64_t objID = 0;
+	int64_t uploadedSize = -1;
+	bool diffFromCachedIndex = false;
+	
+	// Use a try block to catch store full errors
+	try
+	{
+		std::auto_ptr<BackupStoreFileEncodeStream> apStreamToUpload;
+		int64_t diffFromID = 0;
+		std::auto_ptr<IOStream> blockIndexStream;
+
+		// Might an old version be on the server, and is the file
+		// size over the diffing threshold?
+		if(!NoPreviousVersionOnServer &&
+			FileSize >= rParams.mDiffingUploadSizeThreshold)
+		{
+			// YES -- try to do diff, if possible
+			// First, see if the index of the old version is cached
+			if(pcache != 0 && PreviousObjectID != 0)
+			{
+				blockIndexStream = pcache->Get(PreviousObjectID);
+				if(blockIndexStream.get())
+				{
+					diffFromID = PreviousObjectID;
+					diffFromCachedIndex = true;
+					BOX_TRACE("Using cached block index of " <<
+						BOX_FORMAT_OBJECTID(diffFromID) <<
+						" to diff " << rNonVssFilePath);
+				}
+			}
+
+			if(!diffFromCachedIndex)
+			{
+				// Query the server to see if there's an old version available
+				std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
+				diffFromID = getBlockIndex->GetObjectID();
+			}
+			
+			if(diffFromID != 0)
+			{
+				// Found an old version
+
+				// Get the index
+				if(!diffFromCachedIndex)
+				{
+					blockIndexStream = connection.ReceiveStream();
+
+					if(pcache != 0)
+					{
+						// Keep a copy, to make the index of
+						// the new version from later
+						std::auto_ptr<CollectInBufferStream> apcopy(
+							new CollectInBufferStream);
+						blockIndexStream->CopyStreamTo(*apcopy,
+							connection.GetTimeout());
+						apcopy->SetForReading();
+						blockIndexStream.reset(apcopy.release());
+					}
+				}
+			
+				//
+				// Diff the file
+				//
+
+				rContext.ManageDiffProcess();
+
+				bool isCompletelyDifferent = false;
+
+				apStreamToUpload = BackupStoreFile::EncodeFileDiff(
+					rLocalPath,
+					mObjectID, /* containing directory */
+					rStoreFilename, diffFromID, *blockIndexStream,
+					connection.GetTimeout(),
+					&rContext, // DiffTimer implementation
+					0 /* not interested in the modification time */, 
+					&isCompletelyDifferent,
+					rParams.mpBackgroundTask);
+
+				if(isCompletelyDifferent)
+				{
+					diffFromID = 0;
+				}
 
 				rContext.UnManageDiffProcess();
 			}
@@ -1779,43 +2257,108 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 			// below threshold or nothing to diff from, so upload whole
 			rNotifier.NotifyFileUploading(this, rNonVssFilePath);
 			
-			// Prepare to upload, getting a stream which will encode the file as we go along
-			apStreamToUpload = BackupStoreFile::EncodeFile(
-				rLocalPath, mObjectID, /* containing directory */
-				rStoreFilename, NULL, &rParams,
-				&(rParams.mrRunStatusProvider),
-				rParams.mpBackgroundTask);
+			if(apStaged.get())
+			{
+				// Already sent by the helper, or set up for it
+				// and not started, so send it here instead
+				apStreamToUpload = apStaged;
+			}
+			else
+			{
+				// Prepare to upload, getting a stream which
+				// will encode the file as we go along
+				apStreamToUpload = BackupStoreFile::EncodeFile(
+					rLocalPath, mObjectID, /* containing directory */
+					rStoreFilename, NULL, &rParams,
+					&(rParams.mrRunStatusProvider),
+					rParams.mpBackgroundTask);
+			}
 		}
 
-		rContext.SetNiceMode(true);
-		std::auto_ptr<IOStream> apWrappedStream;
+		std::auto_ptr<BackupProtocolSuccess> stored;
 
-		if(rParams.mMaxUploadRate > 0)
+		if(stagedID != 0)
 		{
-			apWrappedStream.reset(new RateLimitingStream(
-				*apStreamToUpload, rParams.mMaxUploadRate));
+			// Store the file which the helper sent
+			stored = connection.QueryStoreStagedFile(mObjectID,
+				ModificationTime, AttributesHash, stagedID,
+				rStoreFilename);
 		}
 		else
 		{
-			// Wrap the stream in *something*, so that
-			// QueryStoreFile() doesn't delete the original
-			// stream (upload object) and we can retrieve
-			// the byte counter.
-			apWrappedStream.reset(new BufferedStream(
-				*apStreamToUpload));
-		}
+			rContext.SetNiceMode(true);
+			std::auto_ptr<IOStream> apWrappedStream;
 
-		// Send to store
-		std::auto_ptr<BackupProtocolSuccess> stored(
-			connection.QueryStoreFile(mObjectID, ModificationTime,
-				AttributesHash, diffFromID, rStoreFilename,
-				apWrappedStream));
+			if(rParams.mMaxUploadRate > 0)
+			{
+				apWrappedStream.reset(new RateLimitingStream(
+					*apStreamToUpload, rParams.mMaxUploadRate));
+			}
+			else
+			{
+				// Wrap the stream in *something*, so that
+				// QueryStoreFile() doesn't delete the original
+				// stream (upload object) and we can retrieve
+				// the byte counter.
+				apWrappedStream.reset(new BufferedStream(
+					*apStreamToUpload));
+			}
 
-		rContext.SetNiceMode(false);
+			// Send to store
+			stored = connection.QueryStoreFile(mObjectID,
+				ModificationTime, AttributesHash, diffFromID,
+				rStoreFilename, apWrappedStream);
+
+			rContext.SetNiceMode(false);
+		}
 
 		// Get object ID from the result
 		objID = stored->GetObjectID();
 		uploadedSize = apStreamToUpload->GetTotalBytesSent();
+
+		// Keep the index of the new version, to diff the next one
+		// against, in place of the old version's
+		if(pcache != 0 &&
+			FileSize >= rParams.mDiffingUploadSizeThreshold)
+		{
+			try
+			{
+				CollectInBufferStream index;
+				apStreamToUpload->CopyBlockIndexTo(index);
+				index.SetForReading();
+				if(diffFromID == 0)
+				{
+					pcache->Store(objID, index);
+				}
+				else
+				{
+					// The index which was sent refers to
+					// blocks in the old version, so
+					// combine them as the server does
+					blockIndexStream->Seek(0,
+						IOStream::SeekType_Absolute);
+					std::auto_ptr<IOStream> combined(
+						BackupStoreFile::CombineFileIndices(
+							index, *blockIndexStream,
+							true, true));
+					pcache->Store(objID, *combined);
+				}
+			}
+			catch(BoxException &e)
+			{
+				BOX_WARNING("Failed to cache block index of " <<
+					rNonVssFilePath << ": " << e.what());
+			}
+
+			if(PreviousObjectID != 0)
+			{
+				pcache->Remove(PreviousObjectID);
+			}
+			if(diffFromID != 0 && diffFromID != PreviousObjectID)
+			{
+				pcache->Remove(diffFromID);
+			}
+		}
 	}
 	catch(BoxException &e)
 	{
@@ -1829,6 +2372,26 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 			int type, subtype;
 			if(connection.GetLastError(type, subtype))
 			{
+				if(diffFromCachedIndex &&
+					type == BackupProtocolError::ErrorType &&
+					subtype == BackupProtocolError::Err_DiffFromFileDoesNotExist)
+				{
+					// The cached index was for a version
+					// which has gone from the server, so
+					// try again, asking the server for it
+					BOX_WARNING("Cached block index of " <<
+						BOX_FORMAT_OBJECTID(PreviousObjectID) <<
+						" is out of date, uploading " <<
+						rNonVssFilePath << " again");
+					pcache->Remove(PreviousObjectID);
+					return UploadFile(rParams, rLocalPath,
+						rNonVssFilePath, rRemotePath,
+						rStoreFilename, FileSize,
+						ModificationTime, AttributesHash,
+						NoPreviousVersionOnServer,
+						0 /* don't use the cache */);
+				}
+
 				if(type == BackupProtocolError::ErrorType
 				&& subtype == BackupProtocolError::Err_StorageLimitExceeded)
 				{
@@ -1873,6 +2436,7 @@ void BackupClientDirectoryRecord::SetErrorWhenReadingFilesystemObject(
 {
 	// Zero hash, so it gets synced properly next time round.
 	::memset(mStateChecksum, 0, sizeof(mStateChecksum));
+	mSyncIncomplete = true;
 
 	// More detailed logging was already done by the caller, but if we
 	// have a read error reported, we need to be able to search the logs
@@ -1914,8 +2478,15 @@ BackupClientDirectoryRecord::SyncParams::SyncParams(
   mrContext(rContext),
   mReadErrorsOnFilesystemObjects(false),
   mMaxUploadRate(0),
+  mpDirectoryScanner(0),
+  mpUploadHelpers(0),
+  mpChangeJournal(0),
   mUploadAfterThisTimeInTheFuture(99999999999999999LL),
-  mHaveLoggedWarningAboutFutureFileTimes(false)
+  mHaveLoggedWarningAboutFutureFileTimes(false),
+  mDirectoryEntriesRead(0),
+  mMetadataSystemCalls(0),
+  mExtendedAttributesRead(0),
+  mExtendedAttributesSkipped(0)
 {
 }
 
@@ -1946,6 +2517,49 @@ void BackupClientDirectoryRecord::Deserialize(Archive & rArchive)
 	// Make deletion recursive
 	DeleteSubDirectories();
 
+	DeserializeOwnState(rArchive);
+
+	//
+	//
+	//
+	int64_t iCount = 0;
+	rArchive.Read(iCount);
+
+	if (iCount > 0)
+	{
+		for (int v = 0; v < iCount; v++)
+		{
+			std::string strItem;
+			rArchive.Read(strItem);
+
+			BackupClientDirectoryRecord* pSubDirRecord = 
+				new BackupClientDirectoryRecord(0, ""); 
+			// will be deserialized anyway, give it id 0 for now
+
+			if (!pSubDirRecord)
+			{
+				throw std::bad_alloc();
+			}
+
+			/***** RECURSE *****/
+			pSubDirRecord->Deserialize(rArchive);
+			mSubDirectories[strItem] = pSubDirRecord;
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::DeserializeOwnState(
+//			 Archive &)
+//		Purpose: Private. Deserializes everything about this record
+//			 except its subdirectories.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::DeserializeOwnState(Archive &rArchive)
+{
 	// Delete maps
 	if(mpPendingEntries != 0)
 	{
@@ -2004,46 +2618,50 @@ void BackupClientDirectoryRecord::Deserialize(Archive & rArchive)
 			(*mpPendingEntries)[strItem] = btItem;
 		}
 	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::Serialize(Archive & rArchive)
+//		Purpose: Serializes this object instance into a stream of bytes, using an Archive abstraction.
+//
+//		Created: 2005/04/11
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::Serialize(Archive & rArchive) const
+{
+	SerializeOwnState(rArchive);
 
 	//
 	//
 	//
-	iCount = 0;
-	rArchive.Read(iCount);
+	int64_t iCount = mSubDirectories.size();
+	rArchive.Write(iCount);
 
-	if (iCount > 0)
+	for (std::map<std::string, BackupClientDirectoryRecord*>::const_iterator
+		i =  mSubDirectories.begin(); 
+		i != mSubDirectories.end(); i++)
 	{
-		for (int v = 0; v < iCount; v++)
-		{
-			std::string strItem;
-			rArchive.Read(strItem);
-
-			BackupClientDirectoryRecord* pSubDirRecord = 
-				new BackupClientDirectoryRecord(0, ""); 
-			// will be deserialized anyway, give it id 0 for now
-
-			if (!pSubDirRecord)
-			{
-				throw std::bad_alloc();
-			}
+		const BackupClientDirectoryRecord* pSubItem = i->second;
+		ASSERT(pSubItem);
 
-			/***** RECURSE *****/
-			pSubDirRecord->Deserialize(rArchive);
-			mSubDirectories[strItem] = pSubDirRecord;
-		}
+		rArchive.Write(i->first);
+		pSubItem->Serialize(rArchive);
 	}
 }
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupClientDirectoryRecord::Serialize(Archive & rArchive)
-//		Purpose: Serializes this object instance into a stream of bytes, using an Archive abstraction.
-//
-//		Created: 2005/04/11
+//		Name:    BackupClientDirectoryRecord::SerializeOwnState(
+//			 Archive &)
+//		Purpose: Private. Serializes everything about this record
+//			 except its subdirectories.
+//		Created: 16/10/26
 //
 // --------------------------------------------------------------------------
-void BackupClientDirectoryRecord::Serialize(Archive & rArchive) const
+void BackupClientDirectoryRecord::SerializeOwnState(Archive &rArchive) const
 {
 	//
 	//
@@ -2089,21 +2707,178 @@ void BackupClientDirectoryRecord::Serialize(Archive & rArchive) const
 			rArchive.Write(i->second);
 		}
 	}
-	//
-	//
-	//
-	iCount = mSubDirectories.size();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SerializeChange(
+//			 Archive &)
+//		Purpose: Private. Serializes this record for the changes
+//			 file: everything about it, and the names of its
+//			 subdirectories, but not their records.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SerializeChange(Archive &rArchive) const
+{
+	SerializeOwnState(rArchive);
+
+	int64_t iCount = mSubDirectories.size();
 	rArchive.Write(iCount);
 
 	for (std::map<std::string, BackupClientDirectoryRecord*>::const_iterator
 		i =  mSubDirectories.begin(); 
 		i != mSubDirectories.end(); i++)
 	{
-		const BackupClientDirectoryRecord* pSubItem = i->second;
-		ASSERT(pSubItem);
-
 		rArchive.Write(i->first);
-		pSubItem->Serialize(rArchive);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::DeserializeChange(
+//			 Archive &)
+//		Purpose: Replaces this record with one from the changes
+//			 file. Subdirectories which it doesn't name any more
+//			 are deleted, and new ones are created empty, to be
+//			 filled in by their own changes which follow.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::DeserializeChange(Archive &rArchive)
+{
+	DeserializeOwnState(rArchive);
+
+	int64_t iCount = 0;
+	rArchive.Read(iCount);
+
+	std::map<std::string, BackupClientDirectoryRecord *> subDirectories;
+	try
+	{
+		for (int v = 0; v < iCount; v++)
+		{
+			std::string strItem;
+			rArchive.Read(strItem);
+
+			std::map<std::string, BackupClientDirectoryRecord *>::iterator
+				i(mSubDirectories.find(strItem));
+			if(i != mSubDirectories.end())
+			{
+				subDirectories[strItem] = i->second;
+				mSubDirectories.erase(i);
+			}
+			else if(subDirectories.find(strItem) ==
+				subDirectories.end())
+			{
+				subDirectories[strItem] =
+					new BackupClientDirectoryRecord(0, "");
+			}
+		}
+	}
+	catch(...)
+	{
+		// Put back the ones which were taken out, to be deleted
+		// with the rest
+		mSubDirectories.insert(subDirectories.begin(),
+			subDirectories.end());
+		throw;
+	}
+
+	// Whatever's left is gone
+	DeleteSubDirectories();
+	mSubDirectories.swap(subDirectories);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::GetSavedStateDigest(
+//			 MD5Digest &)
+//		Purpose: Private. Calculates the digest of the record as
+//			 it would be saved in the changes file, and returns
+//			 whether it differs from the one last saved.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::GetSavedStateDigest(MD5Digest &rDigest) const
+{
+	CollectInBufferStream buffer;
+	Archive archive(buffer, 0);
+	SerializeChange(archive);
+	rDigest.Add(buffer.GetBuffer(), buffer.GetSize());
+	rDigest.Finish();
+	return !rDigest.DigestMatches((uint8_t *)mSavedStateDigest);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SerializeChanges(
+//			 Archive &, const std::string &,
+//			 std::vector<std::string> &, int64_t &)
+//		Purpose: Writes this record and those of its
+//			 subdirectories, recursively, which have changed since
+//			 they were last saved, each with the name of the
+//			 location and the path to it from there. Parents are
+//			 written before their subdirectories.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SerializeChanges(Archive &rArchive,
+	const std::string &rLocationName, std::vector<std::string> &rPath,
+	int64_t &rNumChanged)
+{
+	MD5Digest digest;
+	if(GetSavedStateDigest(digest))
+	{
+		int64_t aMagicMarker = ARCHIVE_MAGIC_VALUE_RECURSE;
+		rArchive.Write(aMagicMarker);
+		rArchive.Write(rLocationName);
+		rArchive.Write((int64_t)rPath.size());
+		for(std::vector<std::string>::const_iterator
+			i = rPath.begin(); i != rPath.end(); i++)
+		{
+			rArchive.Write(*i);
+		}
+		SerializeChange(rArchive);
+		digest.CopyDigestTo(mSavedStateDigest);
+		rNumChanged++;
+	}
+
+	for (std::map<std::string, BackupClientDirectoryRecord*>::const_iterator
+		i =  mSubDirectories.begin(); 
+		i != mSubDirectories.end(); i++)
+	{
+		rPath.push_back(i->first);
+		i->second->SerializeChanges(rArchive, rLocationName, rPath,
+			rNumChanged);
+		rPath.pop_back();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SetStateSaved()
+//		Purpose: Records that this record and those of its
+//			 subdirectories, recursively, are saved as they are
+//			 now, after the whole state was saved or loaded.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SetStateSaved()
+{
+	MD5Digest digest;
+	GetSavedStateDigest(digest);
+	digest.CopyDigestTo(mSavedStateDigest);
+
+	for (std::map<std::string, BackupClientDirectoryRecord*>::const_iterator
+		i =  mSubDirectories.begin(); 
+		i != mSubDirectories.end(); i++)
+	{
+		i->second->SetStateSaved();
 	}
 }
 
@@ -2116,7 +2891,9 @@ void BackupClientDirectoryRecord::Serialize(Archive & rArchive) const
 //
 // --------------------------------------------------------------------------
 Location::Location()
-: mIDMapIndex(0)
+: mIDMapIndex(0),
+  mCompressionType(CompressCodec::Zlib),
+  mCompressionLevel(0)
 { }
 
 // --------------------------------------------------------------------------
@@ -10,12 +10,15 @@
 #ifndef BACKUPCLIENTDIRECTORYRECORD__H
 #define BACKUPCLIENTDIRECTORYRECORD__H
 
+#include <deque>
 #include <string>
 #include <map>
 #include <memory>
 
 #include "BackgroundTask.h"
+#include "BackupClientDirectoryScanner.h"
 #include "BackupClientFileAttributes.h"
+#include "BackupClientUploadHelpers.h"
 #include "BackupDaemonInterface.h"
 #include "BackupStoreDirectory.h"
 #include "BoxTime.h"
@@ -31,6 +34,7 @@
 #endif
 
 class Archive;
+class BackupClientChangeJournal;
 class BackupClientContext;
 class BackupDaemon;
 class ExcludeList;
@@ -52,6 +56,20 @@ public:
 
 	void Deserialize(Archive & rArchive);
 	void Serialize(Archive & rArchive) const;
+
+	// Saving only the records which changed since they were last saved,
+	// to the changes file which follows the store object info file
+	void SerializeChanges(Archive &rArchive,
+		const std::string &rLocationName,
+		std::vector<std::string> &rPath, int64_t &rNumChanged);
+	void DeserializeChange(Archive &rArchive);
+	void SetStateSaved();
+	BackupClientDirectoryRecord *GetSubDirectory(const std::string &rName)
+	{
+		std::map<std::string, BackupClientDirectoryRecord *>::iterator
+			i(mSubDirectories.find(rName));
+		return (i == mSubDirectories.end()) ? NULL : i->second;
+	}
 private:
 	BackupClientDirectoryRecord(const BackupClientDirectoryRecord &);
 public:
@@ -100,10 +118,19 @@ public:
 		BackupClientContext &mrContext;
 		bool mReadErrorsOnFilesystemObjects;
 		int64_t mMaxUploadRate;
+		BackupClientDirectoryScanner *mpDirectoryScanner;
+		BackupClientUploadHelpers *mpUploadHelpers;
+		BackupClientChangeJournal *mpChangeJournal;
 		
 		// Member variables modified by syncing process
 		box_time_t mUploadAfterThisTimeInTheFuture;
 		bool mHaveLoggedWarningAboutFutureFileTimes;
+
+		// How much work reading the local metadata took
+		int64_t mDirectoryEntriesRead;
+		int64_t mMetadataSystemCalls;
+		int64_t mExtendedAttributesRead;
+		int64_t mExtendedAttributesSkipped;
 	
 		bool StopRun() { return mrRunStatusProvider.StopRun(); }
 		void NotifySysadmin(SysadminNotifier::EventCode Event)
@@ -146,8 +173,8 @@ public:
 		const Location& rBackupLocation,
 		const std::string &rDirLocalPath,
 		MD5Digest& currentStateChecksum,
-		struct dirent *en,
-		EMU_STRUCT_STAT dir_st,
+		const BackupClientDirectoryScanner::Entry &rEntry,
+		const EMU_STRUCT_STAT &dir_st,
 		std::vector<std::string>& rDirs,
 		std::vector<std::string>& rFiles,
 		bool& rDownloadDirectoryRecordBecauseOfFutureFiles);
@@ -159,6 +186,19 @@ public:
 
 private:
 	void DeleteSubDirectories();
+	void SerializeOwnState(Archive &rArchive) const;
+	void DeserializeOwnState(Archive &rArchive);
+	void SerializeChange(Archive &rArchive) const;
+	bool GetSavedStateDigest(MD5Digest &rDigest) const;
+	bool IsUnchangedInJournal(SyncParams &rParams,
+		const std::string &rLocalPath);
+	void SyncUnchangedDirectory(SyncParams &rParams,
+		const std::string &rLocalPath,
+		const std::string &rRemotePath,
+		const Location& rBackupLocation);
+	void ReadAheadSubDirectories(SyncParams &rParams,
+		const std::string &rLocalPath,
+		const std::vector<std::string> &rDirs);
 	std::auto_ptr<BackupStoreDirectory> FetchDirectoryListing(SyncParams &rParams);
 	void UpdateAttributes(SyncParams &rParams,
 		BackupStoreDirectory *pDirOnStore,
@@ -179,13 +219,51 @@ private:
 		BackupStoreFilenameClear& storeFilename,
 		bool* pHaveJustCreatedDirOnServer,
 		BackupClientDirectoryRecord::SyncParams &rParams);
+	// A new file being sent on an upload helper connection, to be
+	// stored when UpdateItems() gets back to it
+	class PendingUpload
+	{
+	public:
+		std::string mLeafName;
+		std::string mFilename;
+		std::string mNonVssFilePath;
+		std::string mRemotePath;
+		BackupStoreFilenameClear mStoreFilename;
+		int64_t mFileSize;
+		box_time_t mModificationTime;
+		box_time_t mAttributesHash;
+		InodeRefType mInodeNum;
+		box_time_t mPendingFirstSeenTime;
+		BackupClientUploadHelpers::Upload *mpUpload;
+	};
+	void FinishPendingUploads(SyncParams &rParams,
+		std::deque<PendingUpload> &rUploads, size_t MaxLeft,
+		bool &rAllUpdatedSuccessfully);
+	bool TryUploadFile(SyncParams &rParams,
+		const std::string &rFilename,
+		const std::string &rNonVssFilePath,
+		const std::string &rRemotePath,
+		const BackupStoreFilenameClear &rStoreFilename,
+		int64_t FileSize, box_time_t ModificationTime,
+		box_time_t AttributesHash, bool NoPreviousVersionOnServer,
+		int64_t PreviousObjectID,
+		BackupClientUploadHelpers::Upload *pUpload,
+		int64_t &rObjectIDOut);
 	int64_t UploadFile(SyncParams &rParams,
 		const std::string &rFilename,
 		const std::string &rNonVssFilePath,
 		const std::string &rRemotePath,
 		const BackupStoreFilenameClear &rStoreFilename,
 		int64_t FileSize, box_time_t ModificationTime,
-		box_time_t AttributesHash, bool NoPreviousVersionOnServer);
+		box_time_t AttributesHash, bool NoPreviousVersionOnServer,
+		int64_t PreviousObjectID,
+		BackupClientUploadHelpers::Upload *pUpload = 0);
+	void UpdateNewIDMap(SyncParams &rParams, InodeRefType InodeNum,
+		int64_t ObjectID, int64_t FileSize,
+		const std::string &rNonVssFilePath);
+	void AddToNewIDMap(SyncParams &rParams, InodeRefType InodeNum,
+		int64_t ObjectID, int64_t InDirectory,
+		const std::string &rLocalPath);
 	void SetErrorWhenReadingFilesystemObject(SyncParams &rParams,
 		const std::string& rFilename);
 	void RemoveDirectoryInPlaceOfFile(SyncParams &rParams,
@@ -211,6 +289,31 @@ private:
 	// mpPendingEntries is a pointer rather than simple a member
 	// variable, because most of the time it'll be empty. This would
 	// waste a lot of memory because of STL allocation policies.
+
+	// Set if everything in the directory was backed up by the last sync
+	// which read it, and the change journal was watching it by then, so
+	// it needn't be read again until the journal says it's changed
+	bool		mUnchangedInJournal;
+	// Set by errors while syncing the directory, which clear the above
+	bool		mSyncIncomplete;
+
+	// What the last sync which read the directory added to the inode
+	// to ID map, to add again when it isn't read. Only kept when
+	// there's a change journal.
+	class IDMapEntry
+	{
+	public:
+		InodeRefType mInodeNum;
+		int64_t mObjectID;
+		int64_t mInDirectory;
+		std::string mLocalPath;
+	};
+	std::vector<IDMapEntry> *mpJournalIDMapEntries;
+
+	// Digest of this record (without its subdirectories' records) when
+	// it was last saved, so that only the ones which changed need to be
+	// saved again
+	uint8_t mSavedStateDigest[MD5Digest::DigestLength];
 };
 
 class Location
@@ -231,6 +334,8 @@ public:
 	std::auto_ptr<ExcludeList> mapExcludeFiles;
 	std::auto_ptr<ExcludeList> mapExcludeDirs;
 	int mIDMapIndex;
+	int mCompressionType;
+	int mCompressionLevel;
 
 #ifdef ENABLE_VSS
 	bool mIsSnapshotCreated;
@@ -0,0 +1,616 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientDirectoryScanner.cpp
+//		Purpose: Reads local directories ahead of the sync, in other
+//			 threads
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef HAVE_SYSCALL
+	#include <sys/syscall.h>
+#endif
+
+// Read entries straight from the kernel, a buffer full at a time, and stat
+// them relative to the directory, asking only for what the sync needs
+#if defined HAVE_STATX && defined HAVE_SYSCALL && defined SYS_getdents64 && \
+	defined O_DIRECTORY && defined O_CLOEXEC && !defined WIN32
+	#define BACKUPCLIENTDIRECTORYSCANNER_BATCHED
+	#include <sys/sysmacros.h>
+
+	#define BACKUPCLIENTDIRECTORYSCANNER_STATX_MASK (STATX_TYPE | \
+		STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | \
+		STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME)
+
+	// The kernel's layout, which the C library may not declare
+	struct BackupClientDirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+#endif
+
+#include "BackgroundTask.h"
+#include "BackupClientContext.h"
+#include "BackupClientDirectoryScanner.h"
+#include "PathUtils.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientDirectoryScanThread
+//		Purpose: Thread which scans queued directories until the
+//			 scanner is destroyed
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientDirectoryScanThread : public Thread
+{
+public:
+	BackupClientDirectoryScanThread(BackupClientDirectoryScanner &rScanner)
+	: mrScanner(rScanner)
+	{
+	}
+
+	~BackupClientDirectoryScanThread()
+	{
+		Join();
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrScanner.ScanQueued();
+	}
+
+private:
+	BackupClientDirectoryScanner &mrScanner;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Directory::Directory()
+//		Purpose: Constructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::Directory::Directory()
+: mStatErrno(0),
+  mOpenErrno(0),
+  mCloseFailed(false),
+  mSystemCalls(0)
+{
+	::memset(&mStat, 0, sizeof(mStat));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::BackupClientDirectoryScanner(int)
+//		Purpose: Constructor. Starts the threads, unless threads
+//			 aren't supported.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::BackupClientDirectoryScanner(int Threads)
+: mMaxScanned(0),
+  mStopping(false)
+{
+	if(!Thread::IsSupported() || Threads < 1)
+	{
+		return;
+	}
+
+	mMaxScanned = Threads *
+		BACKUPCLIENTDIRECTORYSCANNER_MAX_SCANNED_PER_THREAD;
+
+	try
+	{
+		for(int t = 0; t < Threads; ++t)
+		{
+			mThreads.push_back(0);
+			mThreads.back() = new BackupClientDirectoryScanThread(*this);
+			mThreads.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		StopThreads();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::~BackupClientDirectoryScanner()
+//		Purpose: Destructor. Stops the threads, and throws away any
+//			 directories which were scanned but not used.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::~BackupClientDirectoryScanner()
+{
+	StopThreads();
+
+	for(std::map<std::string, Directory *>::iterator i = mDone.begin();
+		i != mDone.end(); ++i)
+	{
+		delete i->second;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::StopThreads()
+//		Purpose: Tells the threads to stop after the directory which
+//			 they're scanning, and waits for them
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::StopThreads()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mWorkAvailable.Broadcast();
+	}
+
+	for(size_t t = 0; t < mThreads.size(); ++t)
+	{
+		// Deleting the thread joins it
+		delete mThreads[t];
+	}
+	mThreads.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Scan(const std::string &,
+//			 BackupClientDirectoryScanner::Directory &,
+//			 BackupClientContext *, BackgroundTask *)
+//		Purpose: Static. Stats a directory, reads its entries and
+//			 lstats each of them. Failures are recorded in the
+//			 Directory for the sync to report. If a context and
+//			 background task are given, they're kept going while
+//			 reading a large directory.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Scan(const std::string &rPath,
+	Directory &rDirectory, BackupClientContext *pContext,
+	BackgroundTask *pBackgroundTask)
+{
+	// If it's a symbolic link, we want the link target here
+	rDirectory.mSystemCalls++;
+	if(EMU_STAT(rPath.c_str(), &rDirectory.mStat) != 0)
+	{
+		rDirectory.mStatErrno = errno;
+		return;
+	}
+
+#ifdef BACKUPCLIENTDIRECTORYSCANNER_BATCHED
+	ScanBatched(rPath, rDirectory, pContext, pBackgroundTask);
+#else
+	rDirectory.mSystemCalls++;
+	DIR *dirHandle = ::opendir(rPath.c_str());
+	if(dirHandle == 0)
+	{
+		rDirectory.mOpenErrno = errno;
+		return;
+	}
+
+	try
+	{
+		struct dirent *en = 0;
+		int num_entries_found = 0;
+
+		// Counted as if every readdir() were a system call, although
+		// the C library reads many entries at a time
+		while(rDirectory.mSystemCalls++, (en = ::readdir(dirHandle)) != 0)
+		{
+			Entry *pEntry = AddEntry(rDirectory, en->d_name,
+				num_entries_found, pContext, pBackgroundTask);
+			if(pEntry == 0)
+			{
+				continue;
+			}
+
+#ifdef WIN32
+			// Don't stat the file yet, so that users can exclude
+			// unreadable files to suppress warnings about them.
+			pEntry->mAttributes = en->d_type;
+#else
+			rDirectory.mSystemCalls++;
+			if(EMU_LSTAT(MakeFullPath(rPath, pEntry->mName).c_str(),
+				&pEntry->mStat) != 0)
+			{
+				pEntry->mStatErrno = errno;
+			}
+#endif
+		}
+	}
+	catch(...)
+	{
+		::closedir(dirHandle);
+		throw;
+	}
+
+	rDirectory.mSystemCalls++;
+	if(::closedir(dirHandle) != 0)
+	{
+		rDirectory.mCloseFailed = true;
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::AddEntry(
+//			 BackupClientDirectoryScanner::Directory &,
+//			 const char *, int &, BackupClientContext *,
+//			 BackgroundTask *)
+//		Purpose: Private. Static. Adds an entry read from the
+//			 directory, keeping the context and background task
+//			 going. Returns 0 for . and .., which aren't added.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::Entry *BackupClientDirectoryScanner::AddEntry(
+	Directory &rDirectory, const char *pName, int &rNumEntriesFound,
+	BackupClientContext *pContext, BackgroundTask *pBackgroundTask)
+{
+	rNumEntriesFound++;
+	if(pContext)
+	{
+		pContext->DoKeepAlive();
+	}
+	if(pBackgroundTask)
+	{
+		pBackgroundTask->RunBackgroundTask(
+			BackgroundTask::Scanning_Dirs,
+			rNumEntriesFound, 0);
+	}
+
+	if(::strcmp(pName, ".") == 0 || ::strcmp(pName, "..") == 0)
+	{
+		return 0;
+	}
+
+	rDirectory.mEntries.push_back(Entry());
+	Entry &rEntry(rDirectory.mEntries.back());
+	rEntry.mName = pName;
+	rEntry.mStatErrno = 0;
+	::memset(&rEntry.mStat, 0, sizeof(rEntry.mStat));
+	return &rEntry;
+}
+
+#ifdef BACKUPCLIENTDIRECTORYSCANNER_BATCHED
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::ScanBatched(
+//			 const std::string &,
+//			 BackupClientDirectoryScanner::Directory &,
+//			 BackupClientContext *, BackgroundTask *)
+//		Purpose: Private. Static. Reads the entries of a directory
+//			 with getdents64(), many at a time, and gets just the
+//			 attributes the sync uses with statx(), relative to
+//			 the open directory so that the kernel doesn't look
+//			 up the whole path again for every entry.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::ScanBatched(const std::string &rPath,
+	Directory &rDirectory, BackupClientContext *pContext,
+	BackgroundTask *pBackgroundTask)
+{
+	rDirectory.mSystemCalls++;
+	// Close on exec, as opendir() does, so scripts run during the sync
+	// don't inherit it
+	int dirFD = ::open(rPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirFD == -1)
+	{
+		rDirectory.mOpenErrno = errno;
+		return;
+	}
+
+	try
+	{
+		// Aligned for the entries in it
+		std::vector<uint64_t> buffer(
+			BACKUPCLIENTDIRECTORYSCANNER_DIRENT_BUFFER_SIZE /
+			sizeof(uint64_t));
+		int num_entries_found = 0;
+
+		while(true)
+		{
+			rDirectory.mSystemCalls++;
+			long bytes = ::syscall(SYS_getdents64, dirFD,
+				&buffer[0], buffer.size() * sizeof(uint64_t));
+			if(bytes <= 0)
+			{
+				// The end, or an error, which like readdir()
+				// is treated as the end
+				break;
+			}
+
+			for(long offset = 0; offset < bytes; )
+			{
+				const BackupClientDirent64 *pDirent =
+					(const BackupClientDirent64 *)
+					((const char *)&buffer[0] + offset);
+				offset += pDirent->d_reclen;
+
+				Entry *pEntry = AddEntry(rDirectory,
+					pDirent->d_name, num_entries_found,
+					pContext, pBackgroundTask);
+				if(pEntry == 0)
+				{
+					continue;
+				}
+
+				struct statx stx;
+				rDirectory.mSystemCalls++;
+				if(::statx(dirFD, pDirent->d_name,
+					AT_SYMLINK_NOFOLLOW,
+					BACKUPCLIENTDIRECTORYSCANNER_STATX_MASK,
+					&stx) != 0)
+				{
+					pEntry->mStatErrno = errno;
+				}
+				else if((stx.stx_mask &
+					BACKUPCLIENTDIRECTORYSCANNER_STATX_MASK) !=
+					BACKUPCLIENTDIRECTORYSCANNER_STATX_MASK)
+				{
+					// The filesystem couldn't say, so ask
+					// the old way
+					rDirectory.mSystemCalls++;
+					if(EMU_LSTAT(MakeFullPath(rPath,
+						pEntry->mName).c_str(),
+						&pEntry->mStat) != 0)
+					{
+						pEntry->mStatErrno = errno;
+					}
+				}
+				else
+				{
+					EMU_STRUCT_STAT &st(pEntry->mStat);
+					st.st_dev = makedev(stx.stx_dev_major,
+						stx.stx_dev_minor);
+					st.st_ino = stx.stx_ino;
+					st.st_mode = stx.stx_mode;
+					st.st_nlink = stx.stx_nlink;
+					st.st_uid = stx.stx_uid;
+					st.st_gid = stx.stx_gid;
+					st.st_size = stx.stx_size;
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+					st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+					st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+					st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+					st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+#else
+					st.st_mtime = stx.stx_mtime.tv_sec;
+					st.st_ctime = stx.stx_ctime.tv_sec;
+#endif
+				}
+			}
+		}
+	}
+	catch(...)
+	{
+		::close(dirFD);
+		throw;
+	}
+
+	rDirectory.mSystemCalls++;
+	if(::close(dirFD) != 0)
+	{
+		rDirectory.mCloseFailed = true;
+	}
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Queue(
+//			 const std::vector<std::string> &)
+//		Purpose: Adds directories to be scanned by the threads. The
+//			 first is scanned first, and all of them before any
+//			 directory queued earlier. Does nothing without
+//			 threads.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Queue(const std::vector<std::string> &rPaths)
+{
+	if(mThreads.empty() || rPaths.empty())
+	{
+		return;
+	}
+
+	MutexLock lock(mMutex);
+	for(std::vector<std::string>::const_reverse_iterator
+		i = rPaths.rbegin(); i != rPaths.rend(); ++i)
+	{
+		if(mQueued.insert(*i).second)
+		{
+			mStack.push_back(*i);
+		}
+	}
+	mWorkAvailable.Broadcast();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Take(
+//			 const std::string &, BackupClientContext &,
+//			 BackgroundTask *)
+//		Purpose: Returns the scan of a directory, waiting for a
+//			 thread which is scanning it, or scanning it here if
+//			 no thread has started it, or one failed to.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupClientDirectoryScanner::Directory>
+BackupClientDirectoryScanner::Take(const std::string &rPath,
+	BackupClientContext &rContext, BackgroundTask *pBackgroundTask)
+{
+	if(!mThreads.empty())
+	{
+		MutexLock lock(mMutex);
+		mQueued.erase(rPath);
+
+		while(mScanning.find(rPath) != mScanning.end())
+		{
+			rContext.DoKeepAlive();
+			mScanned.Wait(mMutex,
+				BACKUPCLIENTDIRECTORYSCANNER_POLL_INTERVAL);
+		}
+
+		std::map<std::string, Directory *>::iterator i(
+			mDone.find(rPath));
+		if(i != mDone.end())
+		{
+			std::auto_ptr<Directory> apDirectory(i->second);
+			mDone.erase(i);
+			// There's room for another one now
+			mWorkAvailable.Broadcast();
+			return apDirectory;
+		}
+	}
+
+	std::auto_ptr<Directory> apDirectory(new Directory);
+	Scan(rPath, *apDirectory, &rContext, pBackgroundTask);
+	return apDirectory;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Forget(const std::string &)
+//		Purpose: Says that a queued directory won't be taken after
+//			 all, so that its scan doesn't use up space
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Forget(const std::string &rPath)
+{
+	if(mThreads.empty())
+	{
+		return;
+	}
+
+	MutexLock lock(mMutex);
+	mQueued.erase(rPath);
+
+	if(mScanning.find(rPath) != mScanning.end())
+	{
+		// Thrown away when the thread has finished with it
+		mForgotten.insert(rPath);
+	}
+
+	std::map<std::string, Directory *>::iterator i(mDone.find(rPath));
+	if(i != mDone.end())
+	{
+		delete i->second;
+		mDone.erase(i);
+		mWorkAvailable.Broadcast();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::ScanQueued()
+//		Purpose: Run by each thread. Scans the most recently queued
+//			 directory whenever there's room for another scan,
+//			 until the scanner is stopped.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::ScanQueued()
+{
+	while(true)
+	{
+		std::string path;
+
+		{
+			MutexLock lock(mMutex);
+			while(true)
+			{
+				if(mStopping)
+				{
+					return;
+				}
+
+				// Skip directories which were taken or
+				// forgotten before a thread got to them
+				while(!mStack.empty() &&
+					mQueued.find(mStack.back()) == mQueued.end())
+				{
+					mStack.pop_back();
+				}
+
+				if(!mStack.empty() &&
+					mDone.size() + mScanning.size() < mMaxScanned)
+				{
+					break;
+				}
+
+				mWorkAvailable.Wait(mMutex,
+					BACKUPCLIENTDIRECTORYSCANNER_POLL_INTERVAL);
+			}
+
+			path = mStack.back();
+			mStack.pop_back();
+			mQueued.erase(path);
+			mScanning.insert(path);
+		}
+
+		std::auto_ptr<Directory> apDirectory(new Directory);
+		bool scanned = false;
+		try
+		{
+			Scan(path, *apDirectory);
+			scanned = true;
+		}
+		catch(...)
+		{
+			// Leave it for Take() to scan again, so that the
+			// error is reported by the sync
+		}
+
+		MutexLock lock(mMutex);
+		mScanning.erase(path);
+		if(mForgotten.erase(path) == 0 && scanned)
+		{
+			Directory *&rpDone(mDone[path]);
+			delete rpDone;
+			rpDone = apDirectory.release();
+		}
+		mScanned.Broadcast();
+	}
+}
@@ -0,0 +1,133 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientDirectoryScanner.h
+//		Purpose: Reads local directories ahead of the sync, in other
+//			 threads
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTDIRECTORYSCANNER__H
+#define BACKUPCLIENTDIRECTORYSCANNER__H
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Thread.h"
+
+class BackgroundTask;
+class BackupClientContext;
+
+// Directories read ahead and not yet used, for each thread
+#define BACKUPCLIENTDIRECTORYSCANNER_MAX_SCANNED_PER_THREAD	16
+
+// How often threads waiting for each other check whether to give up
+#define BACKUPCLIENTDIRECTORYSCANNER_POLL_INTERVAL		1000
+
+// Size of the buffer which entries are read into, where they're read in
+// batches, which is large so that a network filesystem can send many at once
+#define BACKUPCLIENTDIRECTORYSCANNER_DIRENT_BUFFER_SIZE	(128*1024)
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientDirectoryScanner
+//		Purpose: Does the filesystem work of scanning a directory --
+//			 stat, readdir and an lstat of every entry, or on
+//			 Linux getdents64 and statx, which need fewer and
+//			 cheaper system calls -- for
+//			 directories which the sync will reach soon, in a
+//			 pool of threads. The most recently queued
+//			 directories are scanned first, to follow the depth
+//			 first order of the sync. Everything else, such as
+//			 extended attributes, exclusions, notifications, the
+//			 state checksum and talking to the store, is still
+//			 done by the sync in its own thread and order, so the
+//			 results don't depend on the threads. Without
+//			 threads, or when a directory hasn't been started,
+//			 Take() scans it in the calling thread.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientDirectoryScanner
+{
+public:
+	BackupClientDirectoryScanner(int Threads);
+	~BackupClientDirectoryScanner();
+private:
+	// no copying
+	BackupClientDirectoryScanner(const BackupClientDirectoryScanner &);
+	BackupClientDirectoryScanner &operator=(
+		const BackupClientDirectoryScanner &);
+public:
+
+	class Entry
+	{
+	public:
+		std::string mName;
+		int mStatErrno;				// 0 if the lstat worked
+		EMU_STRUCT_STAT mStat;
+#ifdef WIN32
+		int mAttributes;			// from the emulated readdir
+#endif
+	};
+
+	class Directory
+	{
+	public:
+		Directory();
+		int mStatErrno;				// 0 if the stat worked
+		EMU_STRUCT_STAT mStat;
+		int mOpenErrno;				// 0 if it could be read
+		bool mCloseFailed;
+		std::vector<Entry> mEntries;	// without . and ..
+		int64_t mSystemCalls;		// made to read all this
+	private:
+		// no copying
+		Directory(const Directory &);
+		Directory &operator=(const Directory &);
+	};
+
+	static void Scan(const std::string &rPath, Directory &rDirectory,
+		BackupClientContext *pContext = 0,
+		BackgroundTask *pBackgroundTask = 0);
+
+	void Queue(const std::vector<std::string> &rPaths);
+	std::auto_ptr<Directory> Take(const std::string &rPath,
+		BackupClientContext &rContext,
+		BackgroundTask *pBackgroundTask);
+	void Forget(const std::string &rPath);
+
+	int GetNumThreads() const {return mThreads.size();}
+
+private:
+	friend class BackupClientDirectoryScanThread;
+	static Entry *AddEntry(Directory &rDirectory, const char *pName,
+		int &rNumEntriesFound, BackupClientContext *pContext,
+		BackgroundTask *pBackgroundTask);
+	static void ScanBatched(const std::string &rPath,
+		Directory &rDirectory, BackupClientContext *pContext,
+		BackgroundTask *pBackgroundTask);
+	void ScanQueued();
+	void StopThreads();
+
+	std::vector<Thread *> mThreads;
+	size_t mMaxScanned;
+
+	// Shared with the threads, protected by mMutex
+	Mutex mMutex;
+	Condition mWorkAvailable;
+	Condition mScanned;
+	std::vector<std::string> mStack;	// next at the back, may be stale
+	std::set<std::string> mQueued;		// in mStack and still wanted
+	std::set<std::string> mScanning;
+	std::set<std::string> mForgotten;	// while being scanned
+	std::map<std::string, Directory *> mDone;
+	bool mStopping;
+};
+
+#endif // BACKUPCLIENTDIRECTORYSCANNER__H
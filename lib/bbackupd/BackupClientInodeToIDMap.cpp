@@ -9,53 +9,130 @@
 
 #include "Box.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
 #include <depot.h>
 
-#define BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
 #include "BackupClientInodeToIDMap.h"
-#undef BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
 
 #include "Archive.h"
 #include "BackupStoreException.h"
-#include "CollectInBufferStream.h"
+#include "FileStream.h"
+#include "InvisibleTempFileStream.h"
 #include "MemBlockStream.h"
+#include "MemoryMappedFile.h"
 #include "autogen_CommonException.h"
 
 #include "MemLeakFindOn.h"
 
+// Version of maps in the old QDBM format, which can be converted
 #define BOX_DBM_INODE_DB_VERSION_KEY "BackupClientInodeToIDMap.Version"
 #define BOX_DBM_INODE_DB_VERSION_CURRENT 2
 
+#define BOX_DBM_MAGIC_LITTLE_ENDIAN "[depot]\n\f"
+#define BOX_DBM_MAGIC_BIG_ENDIAN "[DEPOT]\n\f"
+
 #define BOX_DBM_MESSAGE(stuff) stuff << " (qdbm): " << dperrmsg(dpecode)
 
-#define BOX_LOG_DBM_ERROR(stuff) \
-	BOX_ERROR(BOX_DBM_MESSAGE(stuff))
+// 'BIM' and the version, which follows on from the QDBM format's
+#define INODE_MAP_MAGIC_VALUE	0x42494d03
 
-#define THROW_DBM_ERROR(message, filename, exception, subtype) \
-	BOX_LOG_DBM_ERROR(message << ": " << filename); \
-	THROW_EXCEPTION_MESSAGE(exception, subtype, \
-		BOX_DBM_MESSAGE(message << ": " << filename));
+// Suffix of the file which an old map is converted into
+#define INODE_MAP_CONVERT_SUFFIX	".c"
 
-#define ASSERT_DBM_OK(operation, message, filename, exception, subtype) \
-	if(!(operation)) \
-	{ \
-		THROW_DBM_ERROR(message, filename, exception, subtype); \
-	}
+// Suffix of the temporary file which table entries are spilled to
+#define INODE_MAP_SPILL_SUFFIX	".t"
 
-#define ASSERT_DBM_OPEN() \
-	if(mpDepot == 0) \
+#define INODE_MAP_TABLE_PARTS	(1 << BACKUPCLIENTINODETOIDMAP_TABLE_PARTS_BITS)
+
+// Anything wrong with the file, rather than the way it's used. The daemon
+// deletes the maps when it sees this exception, and starts again.
+#define THROW_MAP_ERROR(message) \
+	THROW_FILE_ERROR(message, mFilename, BackupStoreException, \
+		BerkelyDBFailure)
+
+#define ASSERT_MAP_OPEN() \
+	if(mapFile.get() == 0) \
 	{ \
 		THROW_EXCEPTION_MESSAGE(BackupStoreException, InodeMapNotOpen, \
 			"Inode database not open"); \
 	}
 
-#define ASSERT_DBM_CLOSED() \
-	if(mpDepot != 0) \
+#define ASSERT_MAP_CLOSED() \
+	if(mapFile.get() != 0) \
 	{ \
 		THROW_EXCEPTION_MESSAGE(CommonException, Internal, \
 			"Inode database already open: " << mFilename); \
-	} 
+	}
+
+// The format of the file. Everything is in network byte order.
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "BeginStructPackForWire.h"
+#else
+BEGIN_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+typedef struct
+{
+	int32_t mMagicValue;
+	int64_t mNumRecords;
+	int64_t mNumSlots;	// hashed to, a power of two, at least one per part
+	int64_t mTableOffset;	// 0 if the map wasn't finished
+} inode_map_header;
+
+// Records follow the header, each followed by its local path
+typedef struct
+{
+	uint64_t mInodeRef;
+	int64_t mObjectID;
+	int64_t mInDirectory;
+	int32_t mLocalPathLength;
+} inode_map_record;
+
+// The hash table follows the records, to the end of the file. An inode goes
+// in the slot given by the top bits of its hash, or the next free one after
+// it. Probes don't wrap round, so there may be a few more slots than
+// mNumSlots, for those which went past the end.
+typedef struct
+{
+	uint64_t mInodeRef;
+	int64_t mRecordOffset;	// 0 if the slot is empty
+} inode_map_slot;
+
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "EndStructPackForWire.h"
+#else
+END_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+// A table entry spilled while the map is written, in native byte order
+typedef struct
+{
+	uint64_t mInodeRef;
+	int64_t mRecordOffset;
+} inode_map_spilled;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    InodeMapHash(uint64_t)
+//		Purpose: Spreads out inode numbers, which are often close
+//			 together, across the slots of the hash table
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static inline uint64_t InodeMapHash(uint64_t InodeRef)
+{
+	uint64_t hash = InodeRef;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
 
 // --------------------------------------------------------------------------
 //
@@ -68,7 +145,13 @@
 BackupClientInodeToIDMap::BackupClientInodeToIDMap()
 	: mReadOnly(true),
 	  mEmpty(false),
-	  mpDepot(0)
+	  mFileSize(0),
+	  mTableOffset(0),
+	  mNumSlots(0),
+	  mNumSlotsInFile(0),
+	  mHashShift(0),
+	  mNumRecordsAdded(0),
+	  mWriteOffset(0)
 {
 }
 
@@ -82,7 +165,7 @@ BackupClientInodeToIDMap::BackupClientInodeToIDMap()
 // --------------------------------------------------------------------------
 BackupClientInodeToIDMap::~BackupClientInodeToIDMap()
 {
-	if(mpDepot != 0)
+	if(mapFile.get() != 0)
 	{
 		Close();
 	}
@@ -92,88 +175,246 @@ BackupClientInodeToIDMap::~BackupClientInodeToIDMap()
 //
 // Function
 //		Name:    BackupClientInodeToIDMap::Open(const char *, bool, bool)
-//		Purpose: Open the database map, creating a file on disc to store everything
+//		Purpose: Open the database map, creating a file on disc to
+//			 store everything. A new map can only be written, and
+//			 an existing one only read.
 //		Created: 20/11/03
 //
 // --------------------------------------------------------------------------
 void BackupClientInodeToIDMap::Open(const char *Filename, bool ReadOnly,
 	bool CreateNew)
 {
-	mFilename = Filename;
-
 	// Correct arguments?
 	ASSERT(!(CreateNew && ReadOnly));
-	
+
 	// Correct usage?
-	ASSERT_DBM_CLOSED();
+	ASSERT_MAP_CLOSED();
 	ASSERT(!mEmpty);
-	
-	// Open the database file
-	int mode = ReadOnly ? DP_OREADER : DP_OWRITER;
-	if(CreateNew)
+
+	mFilename = Filename;
+	mReadOnly = ReadOnly;
+
+	if(!CreateNew)
 	{
-		mode |= DP_OCREAT;
+		if(!ReadOnly)
+		{
+			THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+				"Inode databases can't be changed once "
+				"written: " << mFilename);
+		}
+
+		OpenForReading();
+		return;
 	}
-	
-	mpDepot = dpopen(Filename, mode, 0);
-	
-	if(!mpDepot)
+
+	mapFile.reset(new FileStream(mFilename,
+		O_WRONLY | O_CREAT | O_TRUNC));
+
+	// Written properly when it's closed
+	inode_map_header header;
+	memset(&header, 0, sizeof(header));
+	header.mMagicValue = htonl(INODE_MAP_MAGIC_VALUE);
+	mWriteBuffer.assign((const char *)&header, sizeof(header));
+	mWriteOffset = sizeof(header);
+
+	mapSpillFile.reset(new InvisibleTempFileStream(
+		mFilename + INODE_MAP_SPILL_SUFFIX,
+		O_RDWR | O_CREAT | O_TRUNC | O_BINARY));
+	mSpillBuffers.resize(INODE_MAP_TABLE_PARTS);
+	mSpillBlocks.resize(INODE_MAP_TABLE_PARTS);
+	mNumRecordsAdded = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::OpenForReading()
+//		Purpose: Private. Opens an existing map, and checks that it's
+//			 complete, converting it first if it's in the old
+//			 format.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::OpenForReading()
+{
+	mapFile.reset(new FileStream(mFilename, O_RDONLY));
+
+	inode_map_header header;
+	memset(&header, 0, sizeof(header));
+	int bytes = 0;
+	mapFile->ReadFullBuffer(&header, sizeof(header), &bytes);
+
+	const size_t depotMagicSize = sizeof(BOX_DBM_MAGIC_LITTLE_ENDIAN) - 1;
+	if(bytes >= (int)depotMagicSize &&
+		(memcmp(&header, BOX_DBM_MAGIC_LITTLE_ENDIAN, depotMagicSize) == 0 ||
+		 memcmp(&header, BOX_DBM_MAGIC_BIG_ENDIAN, depotMagicSize) == 0))
 	{
-		THROW_EXCEPTION_MESSAGE(BackupStoreException, BerkelyDBFailure,
-			BOX_DBM_MESSAGE("Failed to open inode database: " <<
-				mFilename));
+		mapFile.reset();
+		ConvertDepot();
+		OpenForReading();
+		return;
 	}
 
-	const char* version_key = BOX_DBM_INODE_DB_VERSION_KEY;
-	int32_t version = 0;
+	if(bytes != sizeof(header) ||
+		ntohl(header.mMagicValue) != INODE_MAP_MAGIC_VALUE)
+	{
+		mapFile.reset();
+		THROW_MAP_ERROR("Not an inode database, or the wrong version. "
+			"Perhaps it needs to be recreated");
+	}
 
-	if(CreateNew)
+	mTableOffset = box_ntoh64(header.mTableOffset);
+	mNumSlots = box_ntoh64(header.mNumSlots);
+	mapFile->Seek(0, IOStream::SeekType_End);
+	mFileSize = mapFile->GetPosition();
+
+	mNumSlotsInFile = (mFileSize - mTableOffset) /
+		(int64_t)sizeof(inode_map_slot);
+	if(mTableOffset < (int64_t)sizeof(header) ||
+		mNumSlots < INODE_MAP_TABLE_PARTS ||
+		(mNumSlots & (mNumSlots - 1)) != 0 ||
+		mNumSlotsInFile < mNumSlots ||
+		mTableOffset + mNumSlotsInFile * (int64_t)sizeof(inode_map_slot)
+			!= mFileSize)
 	{
-		version = BOX_DBM_INODE_DB_VERSION_CURRENT;
+		mapFile.reset();
+		THROW_MAP_ERROR("Incomplete inode database. Perhaps it needs "
+			"to be recreated");
+	}
 
-		int ret = dpput(mpDepot, version_key, strlen(version_key),
-			(char *)(&version), sizeof(version), DP_DKEEP);
+	mHashShift = 64;
+	for(int64_t n = mNumSlots; n > 1; n >>= 1)
+	{
+		--mHashShift;
+	}
 
-		if(!ret)
-		{
-			THROW_EXCEPTION_MESSAGE(BackupStoreException, BerkelyDBFailure,
-				BOX_DBM_MESSAGE("Failed to write version number to inode "
-					"database: " << mFilename));
-		}
+	// Map all of it on 64 bit systems, as lookups go anywhere in it
+	int64_t windowSize = MEMORYMAPPEDFILE_DEFAULT_WINDOW_SIZE;
+	if(sizeof(void *) >= 8 && mFileSize > windowSize)
+	{
+		windowSize = mFileSize;
+	}
+	mapMapping.reset(new MemoryMappedFile(*mapFile, windowSize,
+		false /* not read sequentially */));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::ConvertDepot()
+//		Purpose: Private. Converts a map in the old QDBM format
+//			 into the current one, replacing the old file.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::ConvertDepot()
+{
+	BOX_NOTICE("Converting inode database to the new format: " <<
+		mFilename);
+
+	DEPOT *pDepot = dpopen(mFilename.c_str(), DP_OREADER, 0);
+	if(!pDepot)
+	{
+		THROW_MAP_ERROR(BOX_DBM_MESSAGE("Failed to open old inode "
+			"database"));
 	}
-	else
+
+	std::string convertedName(mFilename + INODE_MAP_CONVERT_SUFFIX);
+
+	try
 	{
-		int ret = dpgetwb(mpDepot, version_key, strlen(version_key), 0,
+		const char* version_key = BOX_DBM_INODE_DB_VERSION_KEY;
+		int32_t version = 0;
+		int ret = dpgetwb(pDepot, version_key, strlen(version_key), 0,
 			sizeof(version), (char *)(&version));
-
-		if(ret == -1)
+		if(ret != sizeof(version) ||
+			version != BOX_DBM_INODE_DB_VERSION_CURRENT)
 		{
-			THROW_EXCEPTION_MESSAGE(BackupStoreException, BerkelyDBFailure,
-				"Missing version number in inode database. Perhaps it "
-				"needs to be recreated: " << mFilename);
+			THROW_MAP_ERROR("Missing or wrong version number in old "
+				"inode database. Perhaps it needs to be recreated");
 		}
 
-		if(ret != sizeof(version))
+		BackupClientInodeToIDMap converted;
+		converted.Open(convertedName.c_str(), false /* read only */,
+			true /* create new */);
+
+		if(!dpiterinit(pDepot))
 		{
-			THROW_EXCEPTION_MESSAGE(BackupStoreException, BerkelyDBFailure,
-				"Wrong size version number in inode database: expected "
-				<< sizeof(version) << " bytes but found " << ret);
+			THROW_MAP_ERROR(BOX_DBM_MESSAGE("Failed to read old "
+				"inode database"));
 		}
 
-		if(version != BOX_DBM_INODE_DB_VERSION_CURRENT)
+		int keySize;
+		char *key;
+		while((key = dpiternext(pDepot, &keySize)) != NULL)
 		{
-			THROW_EXCEPTION_MESSAGE(BackupStoreException, BerkelyDBFailure,
-				"Wrong version number in inode database: expected " <<
-				BOX_DBM_INODE_DB_VERSION_CURRENT << " but found " <<
-				version << ". Perhaps it needs to be recreated: " <<
-				mFilename);
+			MemoryBlockGuard<char *> keyGuard(key);
+			if(keySize != sizeof(InodeRefType))
+			{
+				// The version number
+				continue;
+			}
+
+			InodeRefType inodeRef;
+			memcpy(&inodeRef, key, sizeof(inodeRef));
+
+			int size;
+			char* data = dpget(pDepot, key, keySize, 0, -1, &size);
+			if(data == NULL)
+			{
+				THROW_MAP_ERROR(BOX_DBM_MESSAGE("Failed to read "
+					"record from old inode database"));
+			}
+
+			MemoryBlockGuard<char *> guard(data);
+			MemBlockStream stream(data, size);
+			Archive arc(stream, IOStream::TimeOutInfinite);
+
+			int64_t objectID, inDirectory;
+			std::string localPath;
+			try
+			{
+				arc.Read(objectID);
+				arc.Read(inDirectory);
+				arc.Read(localPath);
+			}
+			catch(CommonException &e)
+			{
+				if(e.GetSubType() == CommonException::ArchiveBlockIncompleteRead)
+				{
+					THROW_MAP_ERROR("Failed to convert record in "
+						"inode database: " << inodeRef <<
+						": not enough data in record");
+				}
+
+				throw;
+			}
+
+			converted.AddToMap(inodeRef, objectID, inDirectory,
+				localPath);
 		}
 
-		// By this point the version number has been checked and is OK.
+		converted.Close();
+	}
+	catch(...)
+	{
+		dpclose(pDepot);
+		::unlink(convertedName.c_str());
+		throw;
+	}
+
+	dpclose(pDepot);
+
+#ifdef WIN32
+	// win32 rename doesn't overwrite existing files
+	::remove(mFilename.c_str());
+#endif
+	if(::rename(convertedName.c_str(), mFilename.c_str()) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to replace old inode database "
+			"with converted one", mFilename, CommonException,
+			OSFileError);
 	}
-	
-	// Read only flag
-	mReadOnly = ReadOnly;
 }
 
 // --------------------------------------------------------------------------
@@ -189,8 +430,7 @@ void BackupClientInodeToIDMap::Open(const char *Filename, bool ReadOnly,
 // --------------------------------------------------------------------------
 void BackupClientInodeToIDMap::OpenEmpty()
 {
-	ASSERT_DBM_CLOSED();
-	ASSERT(mpDepot == 0);
+	ASSERT_MAP_CLOSED();
 	mEmpty = true;
 	mReadOnly = true;
 }
@@ -199,16 +439,224 @@ void BackupClientInodeToIDMap::OpenEmpty()
 //
 // Function
 //		Name:    BackupClientInodeToIDMap::Close()
-//		Purpose: Close the database file
+//		Purpose: Close the database file, finishing it first if it's
+//			 being written
 //		Created: 20/11/03
 //
 // --------------------------------------------------------------------------
 void BackupClientInodeToIDMap::Close()
 {
-	ASSERT_DBM_OPEN();
-	ASSERT_DBM_OK(dpclose(mpDepot), "Failed to close inode database",
-		mFilename, BackupStoreException, BerkelyDBFailure);
-	mpDepot = 0;
+	ASSERT_MAP_OPEN();
+
+	try
+	{
+		if(!mReadOnly)
+		{
+			WriteHashTable();
+		}
+	}
+	catch(...)
+	{
+		mapFile.reset();
+		throw;
+	}
+
+	mapMapping.reset();
+	mapFile.reset();
+	mapSpillFile.reset();
+	std::vector<std::string>().swap(mSpillBuffers);
+	std::vector<std::vector<std::pair<int64_t, int> > >().swap(mSpillBlocks);
+	std::string().swap(mWriteBuffer);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::FlushWriteBuffer()
+//		Purpose: Private. Writes out the records collected so far.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::FlushWriteBuffer()
+{
+	if(!mWriteBuffer.empty())
+	{
+		mapFile->Write(mWriteBuffer.c_str(), mWriteBuffer.size());
+		mWriteBuffer.clear();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::FlushSpillBuffer(int)
+//		Purpose: Private. Writes out the table entries collected so
+//			 far for one part of the table, as a block in the
+//			 spill file.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::FlushSpillBuffer(int Part)
+{
+	std::string &rbuffer(mSpillBuffers[Part]);
+	if(!rbuffer.empty())
+	{
+		mapSpillFile->Seek(0, IOStream::SeekType_End);
+		mSpillBlocks[Part].push_back(std::make_pair(
+			mapSpillFile->GetPosition(), (int)rbuffer.size()));
+		mapSpillFile->Write(rbuffer.c_str(), rbuffer.size());
+		rbuffer.clear();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    InsertIntoTablePart(std::vector<inode_map_slot> &,
+//			 int64_t, const inode_map_spilled &,
+//			 std::vector<inode_map_spilled> &)
+//		Purpose: Puts an entry in the part of the hash table being
+//			 built, in the given slot or the next free one, or
+//			 replaces the entry for the same inode. Entries which
+//			 don't fit before the end of the part are kept to go
+//			 at the start of the next one. Returns true if the
+//			 inode wasn't there already.
+//		Created: 17/10/26
+//
+// --------------------------------------------------------------------------
+static bool InsertIntoTablePart(std::vector<inode_map_slot> &rTable,
+	int64_t Slot, const inode_map_spilled &rEntry,
+	std::vector<inode_map_spilled> &rCarried)
+{
+	uint64_t inodeRef = box_hton64(rEntry.mInodeRef);
+	for(; Slot < (int64_t)rTable.size(); ++Slot)
+	{
+		if(rTable[Slot].mRecordOffset == 0 ||
+			rTable[Slot].mInodeRef == inodeRef)
+		{
+			bool added = (rTable[Slot].mRecordOffset == 0);
+			rTable[Slot].mInodeRef = inodeRef;
+			rTable[Slot].mRecordOffset =
+				box_hton64(rEntry.mRecordOffset);
+			return added;
+		}
+	}
+
+	for(std::vector<inode_map_spilled>::iterator i = rCarried.begin();
+		i != rCarried.end(); ++i)
+	{
+		if(i->mInodeRef == rEntry.mInodeRef)
+		{
+			i->mRecordOffset = rEntry.mRecordOffset;
+			return false;
+		}
+	}
+
+	rCarried.push_back(rEntry);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::WriteHashTable()
+//		Purpose: Private. Builds the hash table of all the records
+//			 written, one part at a time from the entries spilled
+//			 for it, appends it to the file, and then fills in
+//			 the header, which makes the map complete.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::WriteHashTable()
+{
+	// At most three quarters full, so that probes are short
+	int tableBits = BACKUPCLIENTINODETOIDMAP_TABLE_PARTS_BITS;
+	while(((int64_t)1 << tableBits) <
+		mNumRecordsAdded + mNumRecordsAdded / 3 + 1)
+	{
+		++tableBits;
+	}
+	int64_t numSlots = (int64_t)1 << tableBits;
+	int64_t partSlots = numSlots / INODE_MAP_TABLE_PARTS;
+
+	for(int part = 0; part < INODE_MAP_TABLE_PARTS; ++part)
+	{
+		FlushSpillBuffer(part);
+	}
+	FlushWriteBuffer();
+	int64_t tableOffset = mWriteOffset;
+
+	std::vector<inode_map_slot> table(partSlots);
+	std::vector<inode_map_spilled> carriedIn, carriedOut;
+	std::vector<inode_map_spilled> block(
+		BACKUPCLIENTINODETOIDMAP_SPILL_BLOCK_SIZE /
+		sizeof(inode_map_spilled) + 1);
+	int64_t numRecords = 0;
+
+	for(int part = 0; part < INODE_MAP_TABLE_PARTS; ++part)
+	{
+		memset(&table[0], 0, partSlots * sizeof(inode_map_slot));
+
+		// Those which went past the end of the last part come first.
+		// They were counted there, and none are for the same inodes
+		// as this part's.
+		for(std::vector<inode_map_spilled>::const_iterator
+			i = carriedIn.begin(); i != carriedIn.end(); ++i)
+		{
+			InsertIntoTablePart(table, 0, *i, carriedOut);
+		}
+
+		// Then this part's, in the order they were added, so later
+		// records replace earlier ones for the same inode
+		const std::vector<std::pair<int64_t, int> > &rblocks(
+			mSpillBlocks[part]);
+		for(std::vector<std::pair<int64_t, int> >::const_iterator
+			b = rblocks.begin(); b != rblocks.end(); ++b)
+		{
+			mapSpillFile->Seek(b->first, IOStream::SeekType_Absolute);
+			if(!mapSpillFile->ReadFullBuffer(&block[0], b->second,
+				NULL))
+			{
+				THROW_MAP_ERROR("Failed to read back inode "
+					"database table entries");
+			}
+
+			int entries = b->second / sizeof(inode_map_spilled);
+			for(int e = 0; e < entries; ++e)
+			{
+				int64_t slot = (InodeMapHash(block[e].mInodeRef) >>
+					(64 - tableBits)) - (part * partSlots);
+				if(InsertIntoTablePart(table, slot, block[e],
+					carriedOut))
+				{
+					++numRecords;
+				}
+			}
+		}
+
+		mapFile->Write(&table[0],
+			(int)(partSlots * sizeof(inode_map_slot)));
+		carriedIn.swap(carriedOut);
+		carriedOut.clear();
+	}
+
+	// Any which went past the end of the last part go after it
+	for(std::vector<inode_map_spilled>::const_iterator
+		i = carriedIn.begin(); i != carriedIn.end(); ++i)
+	{
+		inode_map_slot slot;
+		slot.mInodeRef = box_hton64(i->mInodeRef);
+		slot.mRecordOffset = box_hton64(i->mRecordOffset);
+		mapFile->Write(&slot, sizeof(slot));
+	}
+
+	inode_map_header header;
+	header.mMagicValue = htonl(INODE_MAP_MAGIC_VALUE);
+	header.mNumRecords = box_hton64(numRecords);
+	header.mNumSlots = box_hton64(numSlots);
+	header.mTableOffset = box_hton64(tableOffset);
+	mapFile->Seek(0, IOStream::SeekType_Absolute);
+	mapFile->Write(&header, sizeof(header));
 }
 
 // --------------------------------------------------------------------------
@@ -229,25 +677,89 @@ void BackupClientInodeToIDMap::AddToMap(InodeRefType InodeRef, int64_t ObjectID,
 		THROW_EXCEPTION(BackupStoreException, InodeMapIsReadOnly);
 	}
 
-	if(mpDepot == 0)
+	ASSERT_MAP_OPEN();
+
+	inode_map_record record;
+	record.mInodeRef = box_hton64((uint64_t)InodeRef);
+	record.mObjectID = box_hton64(ObjectID);
+	record.mInDirectory = box_hton64(InDirectory);
+	record.mLocalPathLength = htonl(LocalPath.size());
+
+	inode_map_spilled entry;
+	entry.mInodeRef = (uint64_t)InodeRef;
+	entry.mRecordOffset = mWriteOffset;
+	int part = InodeMapHash(entry.mInodeRef) >>
+		(64 - BACKUPCLIENTINODETOIDMAP_TABLE_PARTS_BITS);
+	mSpillBuffers[part].append((const char *)&entry, sizeof(entry));
+	if(mSpillBuffers[part].size() >=
+		BACKUPCLIENTINODETOIDMAP_SPILL_BLOCK_SIZE)
 	{
-		THROW_EXCEPTION(BackupStoreException, InodeMapNotOpen);
+		FlushSpillBuffer(part);
 	}
+	++mNumRecordsAdded;
 
-	ASSERT_DBM_OPEN();
+	mWriteBuffer.append((const char *)&record, sizeof(record));
+	mWriteBuffer.append(LocalPath);
+	mWriteOffset += sizeof(record) + LocalPath.size();
 
-	// Setup structures
-	CollectInBufferStream buf;
-	Archive arc(buf, IOStream::TimeOutInfinite);
-	arc.WriteExact((uint64_t)ObjectID);
-	arc.WriteExact((uint64_t)InDirectory);
-	arc.Write(LocalPath);
-	buf.SetForReading();
+	if(mWriteBuffer.size() >= BACKUPCLIENTINODETOIDMAP_WRITE_BUFFER_SIZE)
+	{
+		FlushWriteBuffer();
+	}
+}
 
-	ASSERT_DBM_OK(dpput(mpDepot, (const char *)&InodeRef, sizeof(InodeRef),
-		(const char *)buf.GetBuffer(), buf.GetSize(), DP_DOVER),
-		"Failed to add record to inode database", mFilename,
-		BackupStoreException, BerkelyDBFailure);
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::ReadFromFile(int64_t,
+//			 void *, int) const
+//		Purpose: Private. Reads part of the file, when it isn't
+//			 mapped into memory.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::ReadFromFile(int64_t Offset, void *pBuffer,
+	int Length) const
+{
+	mapFile->Seek(Offset, IOStream::SeekType_Absolute);
+	if(!mapFile->ReadFullBuffer(pBuffer, Length, NULL))
+	{
+		THROW_MAP_ERROR("Failed to read from inode database");
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::GetData(int64_t, int,
+//			 std::string &) const
+//		Purpose: Private. Returns a pointer to part of the file, in
+//			 the mapping if there is one, otherwise read into the
+//			 buffer. Only valid until the next call.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const uint8_t *BackupClientInodeToIDMap::GetData(int64_t Offset, int Length,
+	std::string &rBuffer) const
+{
+	if(Offset < 0 || Length < 0 || Offset + Length > mFileSize)
+	{
+		THROW_MAP_ERROR("Corrupt inode database: offset " << Offset <<
+			" is past the end of the file");
+	}
+
+	const uint8_t *pData = mapMapping->GetData(Offset, Length);
+	if(pData != 0)
+	{
+		return pData;
+	}
+
+	rBuffer.resize(Length);
+	if(Length > 0)
+	{
+		ReadFromFile(Offset, &rBuffer[0], Length);
+	}
+	return (const uint8_t *)rBuffer.c_str();
 }
 
 // --------------------------------------------------------------------------
@@ -270,49 +782,72 @@ bool BackupClientInodeToIDMap::Lookup(InodeRefType InodeRef, int64_t &rObjectIDO
 		return false;
 	}
 
-	if(mpDepot == 0)
-	{
-		THROW_EXCEPTION(BackupStoreException, InodeMapNotOpen);
-	}
-	
-	ASSERT_DBM_OPEN();
-	int size;
-	char* data = dpget(mpDepot, (const char *)&InodeRef, sizeof(InodeRef),
-		0, -1, &size);
-	if(data == NULL)
+	ASSERT_MAP_OPEN();
+
+	if(!mReadOnly)
 	{
-		// key not in file
-		return false;
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"Inode database can't be read while it's being "
+			"written: " << mFilename);
 	}
 
-	// Free data automatically when the guard goes out of scope.
-	MemoryBlockGuard<char *> guard(data);
-	MemBlockStream stream(data, size);
-	Archive arc(stream, IOStream::TimeOutInfinite);
+	uint64_t inodeRef = box_hton64((uint64_t)InodeRef);
+	std::string buffer;
+	int64_t recordOffset = 0;
 
-	// Return data
-	try
+	for(int64_t slot = InodeMapHash(InodeRef) >> mHashShift;
+		slot < mNumSlotsInFile; ++slot)
 	{
-		arc.Read(rObjectIDOut);
-		arc.Read(rInDirectoryOut);
-		if(pLocalPathOut)
+		inode_map_slot entry;
+		memcpy(&entry, GetData(mTableOffset +
+			slot * sizeof(inode_map_slot), sizeof(entry), buffer),
+			sizeof(entry));
+
+		if(entry.mRecordOffset == 0)
 		{
-			arc.Read(*pLocalPathOut);
+			// key not in file
+			return false;
 		}
-	}
-	catch(CommonException &e)
-	{
-		if(e.GetSubType() == CommonException::ArchiveBlockIncompleteRead)
+
+		if(entry.mInodeRef == inodeRef)
 		{
-			THROW_FILE_ERROR("Failed to lookup record in inode database: "
-				<< InodeRef << ": not enough data in record", mFilename,
-				BackupStoreException, BerkelyDBFailure);
-			// Need to throw precisely that exception to ensure that the
-			// invalid database is deleted, so that we don't hit the same
-			// error next time.
+			recordOffset = box_ntoh64(entry.mRecordOffset);
+			break;
 		}
+	}
 
-		throw;
+	if(recordOffset == 0)
+	{
+		return false;
+	}
+
+	if(recordOffset + (int64_t)sizeof(inode_map_record) > mTableOffset)
+	{
+		THROW_MAP_ERROR("Corrupt inode database: record for " <<
+			InodeRef << " is past the end of the records");
+	}
+
+	inode_map_record record;
+	memcpy(&record, GetData(recordOffset, sizeof(record), buffer),
+		sizeof(record));
+	int32_t pathLength = ntohl(record.mLocalPathLength);
+
+	if(record.mInodeRef != inodeRef || pathLength < 0 ||
+		recordOffset + (int64_t)sizeof(record) + pathLength >
+			mTableOffset)
+	{
+		THROW_MAP_ERROR("Corrupt inode database: bad record for " <<
+			InodeRef);
+	}
+
+	// Return data
+	rObjectIDOut = box_ntoh64(record.mObjectID);
+	rInDirectoryOut = box_ntoh64(record.mInDirectory);
+	if(pLocalPathOut)
+	{
+		const uint8_t *pPath = GetData(recordOffset + sizeof(record),
+			pathLength, buffer);
+		pLocalPathOut->assign((const char *)pPath, pathLength);
 	}
 
 	// Found
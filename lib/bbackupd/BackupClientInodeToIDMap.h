@@ -13,18 +13,40 @@
 #include <sys/types.h>
 
 #include <map>
+#include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
-// avoid having to include the DB files when not necessary
-#ifndef BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
-	class DEPOT;
-#endif
+class FileStream;
+class MemoryMappedFile;
+
+// Size of the buffer in which records are collected before they're written
+#define BACKUPCLIENTINODETOIDMAP_WRITE_BUFFER_SIZE	(64*1024)
+
+// The hash table is built in this many parts (as a power of two), one at a
+// time, so only that fraction of it is ever in memory
+#define BACKUPCLIENTINODETOIDMAP_TABLE_PARTS_BITS	6
+
+// Size of the blocks in which the entries for each part are spilled to disc
+#define BACKUPCLIENTINODETOIDMAP_SPILL_BLOCK_SIZE	(4*1024)
 
 // --------------------------------------------------------------------------
 //
 // Class
 //		Name:    BackupClientInodeToIDMap
-//		Purpose: Map of inode numbers to file IDs on the store
+//		Purpose: Map of inode numbers to file IDs on the store. Kept
+//			 in a file which is written once, by appending
+//			 records to it, each with its local path after it,
+//			 followed by a hash table of the inode numbers, which
+//			 is built when it's closed. It's then only read,
+//			 mapped into memory where possible, so looking up an
+//			 inode only touches a slot in the table and the
+//			 record it points to. While it's written, the table
+//			 entries are spilled to a temporary file, by the part
+//			 of the table they go in, and the table is then built
+//			 one part at a time. Maps in the old QDBM format are
+//			 converted when they're opened.
 //		Created: 11/11/03
 //
 // --------------------------------------------------------------------------
@@ -48,12 +70,37 @@ public:
 	void Close();
 
 private:
+	void OpenForReading();
+	void ConvertDepot();
+	void FlushWriteBuffer();
+	void FlushSpillBuffer(int Part);
+	void WriteHashTable();
+	void ReadFromFile(int64_t Offset, void *pBuffer, int Length) const;
+	const uint8_t *GetData(int64_t Offset, int Length,
+		std::string &rBuffer) const;
+
 	bool mReadOnly;
 	bool mEmpty;
 	std::string mFilename;
-	DEPOT *mpDepot;
+	std::auto_ptr<FileStream> mapFile;
+
+	// Reading
+	std::auto_ptr<MemoryMappedFile> mapMapping;
+	int64_t mFileSize;
+	int64_t mTableOffset;
+	int64_t mNumSlots;
+	int64_t mNumSlotsInFile;	// including any after the last part
+	int mHashShift;
+
+	// Writing: the inode and file offset of each record written are
+	// spilled, in blocks for each part of the table
+	std::auto_ptr<FileStream> mapSpillFile;
+	std::vector<std::string> mSpillBuffers;
+	std::vector<std::vector<std::pair<int64_t, int> > > mSpillBlocks;
+	int64_t mNumRecordsAdded;
+	std::string mWriteBuffer;
+	int64_t mWriteOffset;
 };
 
 #endif // BACKUPCLIENTINODETOIDMAP_H
 
-
@@ -0,0 +1,425 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientUploadHelpers.cpp
+//		Purpose: Extra connections to the store, to send new files on
+//			 while the sync carries on with the main one
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <algorithm>
+
+#include "autogen_BackupProtocol.h"
+#include "BackupClientContext.h"
+#include "BackupClientUploadHelpers.h"
+#include "BackupStoreFile.h"
+#include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFilenameClear.h"
+#include "BoxTime.h"
+#include "BufferedStream.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientUploadHelpers::Upload
+//		Purpose: A file to be sent on a helper connection
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientUploadHelpers::Upload
+{
+public:
+	enum
+	{
+		State_Queued = 0,
+		State_Sending,
+		State_Done
+	};
+
+	Upload()
+	: mState(State_Queued),
+	  mStagedID(0)
+	{
+	}
+
+	std::auto_ptr<BackupStoreFileEncodeStream> mapStream;
+	int mState;
+	int64_t mStagedID;	// 0 if it wasn't staged
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientUploadHelpers::Helper
+//		Purpose: A helper connection, and the thread which sends
+//			 files on it
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientUploadHelpers::Helper : public Thread
+{
+public:
+	Helper(BackupClientUploadHelpers &rHelpers,
+		std::auto_ptr<BackupProtocolCallable> apConnection)
+	: mrHelpers(rHelpers),
+	  mapConnection(apConnection),
+	  mFailed(false)
+	{
+	}
+
+	~Helper()
+	{
+		Join();
+	}
+
+	BackupClientUploadHelpers &mrHelpers;
+	std::auto_ptr<BackupProtocolCallable> mapConnection;
+	bool mFailed;	// protected by the helpers' mutex
+
+protected:
+	virtual void Run()
+	{
+		mrHelpers.Serve(*this);
+	}
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::BackupClientUploadHelpers(
+//			 BackupClientContext &, int, RunStatusProvider &)
+//		Purpose: Constructor. The connections aren't opened until
+//			 there's something to send on them.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientUploadHelpers::BackupClientUploadHelpers(
+	BackupClientContext &rContext, int Helpers,
+	RunStatusProvider &rRunStatusProvider)
+: mrContext(rContext),
+  mHelpersWanted(Helpers),
+  mOpened(false),
+  mrRunStatusProvider(rRunStatusProvider),
+  mKeepAliveTime(0),
+  mHelpersServing(0),
+  mStopping(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::~BackupClientUploadHelpers()
+//		Purpose: Destructor. Closes the helper connections, which
+//			 must be done before the main one is closed, as that
+//			 deletes anything staged which wasn't stored.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientUploadHelpers::~BackupClientUploadHelpers()
+{
+	Close();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::Open()
+//		Purpose: Opens the helper connections and starts their
+//			 threads. Uses as many as could be opened, which may
+//			 be none, for example if the store is too old to
+//			 know about helper sessions.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadHelpers::Open()
+{
+	mOpened = true;
+	if(!Thread::IsSupported())
+	{
+		return;
+	}
+
+	mKeepAliveTime = mrContext.GetKeepAliveTime();
+
+	for(int h = 0; h < mHelpersWanted; ++h)
+	{
+		std::auto_ptr<BackupProtocolCallable> apConnection;
+		try
+		{
+			apConnection = mrContext.OpenHelperConnection();
+		}
+		catch(BoxException &e)
+		{
+			BOX_WARNING("Failed to open upload helper connection, "
+				"uploading on " << (mHelpers.size() + 1) <<
+				" connections: " << e.what());
+			break;
+		}
+
+		mHelpers.push_back(0);
+		mHelpers.back() = new Helper(*this, apConnection);
+	}
+
+	for(size_t h = 0; h < mHelpers.size(); ++h)
+	{
+		{
+			MutexLock lock(mMutex);
+			++mHelpersServing;
+		}
+
+		try
+		{
+			mHelpers[h]->Start();
+		}
+		catch(BoxException &e)
+		{
+			MutexLock lock(mMutex);
+			--mHelpersServing;
+			mHelpers[h]->mFailed = true;
+		}
+	}
+
+	BOX_TRACE("Opened " << mHelpers.size() << " upload helper "
+		"connections");
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::Close()
+//		Purpose: Stops the threads, once they've finished sending,
+//			 and closes the helper connections
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadHelpers::Close()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mWorkAvailable.Broadcast();
+	}
+
+	for(size_t h = 0; h < mHelpers.size(); ++h)
+	{
+		mHelpers[h]->Join();
+		if(!mHelpers[h]->mFailed)
+		{
+			try
+			{
+				mHelpers[h]->mapConnection->QueryFinished();
+			}
+			catch(BoxException &e)
+			{
+				BOX_WARNING("Failed to close upload helper "
+					"connection: " << e.what());
+			}
+		}
+		delete mHelpers[h];
+	}
+	mHelpers.clear();
+
+	for(std::set<Upload *>::iterator i = mUploads.begin();
+		i != mUploads.end(); ++i)
+	{
+		delete *i;
+	}
+	mUploads.clear();
+	mQueue.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::Start(const std::string &,
+//			 int64_t, const BackupStoreFilenameClear &)
+//		Purpose: Queues a new file to be sent on a helper
+//			 connection. Returns 0 if there aren't any, or the
+//			 file can't be read, in which case it should be
+//			 uploaded on the main connection as usual (which will
+//			 report any error). Otherwise returns the upload,
+//			 which must be passed to Finish() in the order they
+//			 were started.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+BackupClientUploadHelpers::Upload *BackupClientUploadHelpers::Start(
+	const std::string &rLocalPath, int64_t DirectoryObjectID,
+	const BackupStoreFilenameClear &rStoreFilename)
+{
+	if(!mOpened)
+	{
+		Open();
+	}
+
+	{
+		MutexLock lock(mMutex);
+		if(mHelpersServing == 0)
+		{
+			return 0;
+		}
+	}
+
+	// The stream is set up in this thread, as that reads the attributes
+	// of the file and encrypts the filenames. No logger or background
+	// task, as they'd be called in the helper's thread.
+	std::auto_ptr<Upload> apUpload(new Upload);
+	try
+	{
+		HideExceptionMessageGuard hide;
+		apUpload->mapStream = BackupStoreFile::EncodeFile(rLocalPath,
+			DirectoryObjectID, rStoreFilename,
+			NULL /* modification time */, NULL /* logger */, this,
+			NULL /* background task */);
+	}
+	catch(BoxException &e)
+	{
+		return 0;
+	}
+
+	MutexLock lock(mMutex);
+	mQueue.push_back(apUpload.get());
+	mUploads.insert(apUpload.get());
+	mWorkAvailable.Signal();
+	return apUpload.release();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::Finish(
+//			 BackupClientUploadHelpers::Upload *,
+//			 std::auto_ptr<BackupStoreFileEncodeStream> &)
+//		Purpose: Waits for a file being sent on a helper connection,
+//			 keeping the main connection alive. Returns the
+//			 staged ID to store it with, and the stream, which
+//			 knows how much was sent and the block index. If no
+//			 helper had started sending it yet, returns 0 and
+//			 the unread stream, to be sent on the main connection
+//			 rather than waiting. If it couldn't be sent, returns
+//			 0 and no stream, and it should be uploaded again.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int64_t BackupClientUploadHelpers::Finish(Upload *pUpload,
+	std::auto_ptr<BackupStoreFileEncodeStream> &rapStreamOut)
+{
+	MutexLock lock(mMutex);
+	ASSERT(mUploads.find(pUpload) != mUploads.end());
+
+	while(pUpload->mState == Upload::State_Sending)
+	{
+		// If this throws, the upload is deleted by Close()
+		mrContext.DoKeepAlive();
+		mUploaded.Wait(mMutex, BACKUPCLIENTUPLOADHELPERS_POLL_INTERVAL);
+	}
+
+	if(pUpload->mState == Upload::State_Queued)
+	{
+		mQueue.erase(std::find(mQueue.begin(), mQueue.end(), pUpload));
+		rapStreamOut = pUpload->mapStream;
+	}
+	else if(pUpload->mStagedID != 0)
+	{
+		rapStreamOut = pUpload->mapStream;
+	}
+
+	int64_t stagedID = pUpload->mStagedID;
+	mUploads.erase(pUpload);
+	delete pUpload;
+	return stagedID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadHelpers::Serve(
+//			 BackupClientUploadHelpers::Helper &)
+//		Purpose: Run by each helper's thread. Sends queued files on
+//			 its connection, keeping it alive while there's
+//			 nothing to send, until the helpers are closed or the
+//			 connection fails.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadHelpers::Serve(Helper &rHelper)
+{
+	box_time_t lastCommand = GetCurrentBoxTime();
+
+	while(true)
+	{
+		Upload *pUpload = 0;
+
+		{
+			MutexLock lock(mMutex);
+			while(!mStopping && mQueue.empty() &&
+				(mKeepAliveTime <= 0 ||
+				 GetCurrentBoxTime() - lastCommand <
+					SecondsToBoxTime(mKeepAliveTime)))
+			{
+				mWorkAvailable.Wait(mMutex,
+					BACKUPCLIENTUPLOADHELPERS_POLL_INTERVAL);
+			}
+
+			if(mStopping)
+			{
+				return;
+			}
+
+			if(!mQueue.empty())
+			{
+				pUpload = mQueue.front();
+				mQueue.pop_front();
+				pUpload->mState = Upload::State_Sending;
+			}
+		}
+
+		int64_t stagedID = 0;
+		bool sent = false;
+		try
+		{
+			if(pUpload != 0)
+			{
+				// Wrap the stream, so that the query doesn't
+				// delete it, as it's needed afterwards
+				std::auto_ptr<IOStream> apWrapped(
+					new BufferedStream(*pUpload->mapStream));
+				stagedID = rHelper.mapConnection->QueryStageFile(
+					apWrapped)->GetObjectID();
+			}
+			else
+			{
+				rHelper.mapConnection->QueryGetIsAlive();
+			}
+			sent = true;
+		}
+		catch(...)
+		{
+			// The file is sent again on the main connection.
+			// This one isn't used again, as the state of the
+			// conversation isn't known.
+		}
+		lastCommand = GetCurrentBoxTime();
+
+		MutexLock lock(mMutex);
+		if(pUpload != 0)
+		{
+			pUpload->mStagedID = stagedID;
+			pUpload->mState = Upload::State_Done;
+			mUploaded.Broadcast();
+		}
+
+		if(!sent)
+		{
+			rHelper.mFailed = true;
+			--mHelpersServing;
+			return;
+		}
+	}
+}
@@ -0,0 +1,108 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientUploadHelpers.h
+//		Purpose: Extra connections to the store, to send new files on
+//			 while the sync carries on with the main one
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTUPLOADHELPERS__H
+#define BACKUPCLIENTUPLOADHELPERS__H
+
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "RunStatusProvider.h"
+#include "Thread.h"
+
+class BackupClientContext;
+class BackupProtocolCallable;
+class BackupStoreFileEncodeStream;
+class BackupStoreFilenameClear;
+
+// Uploads started but not yet stored, for each helper connection
+#define BACKUPCLIENTUPLOADHELPERS_MAX_PENDING_PER_CONNECTION	2
+
+// How often threads waiting for each other check whether to give up
+#define BACKUPCLIENTUPLOADHELPERS_POLL_INTERVAL		1000
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientUploadHelpers
+//		Purpose: Helper connections to the store, each with a thread
+//			 which sends encoded files on it. Helper sessions may
+//			 only stage files on the store, which the main
+//			 connection then asks it to add to a directory, in the
+//			 order of the sync, so directories are only ever
+//			 changed by the main connection. Files are encoded as
+//			 they're sent, in the helper's thread, so the data of
+//			 several files is on the wire at once. The threads
+//			 may log, as Logging serialises messages. Each helper
+//			 connection counts as one of the UploadConnections,
+//			 along with the main one.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class BackupClientUploadHelpers : public RunStatusProvider
+{
+public:
+	BackupClientUploadHelpers(BackupClientContext &rContext,
+		int Helpers, RunStatusProvider &rRunStatusProvider);
+	virtual ~BackupClientUploadHelpers();
+private:
+	// no copying
+	BackupClientUploadHelpers(const BackupClientUploadHelpers &);
+	BackupClientUploadHelpers &operator=(const BackupClientUploadHelpers &);
+public:
+
+	class Upload;
+
+	Upload *Start(const std::string &rLocalPath, int64_t DirectoryObjectID,
+		const BackupStoreFilenameClear &rStoreFilename);
+	int64_t Finish(Upload *pUpload,
+		std::auto_ptr<BackupStoreFileEncodeStream> &rapStreamOut);
+
+	size_t GetMaxPending() const
+	{
+		return mHelpers.size() *
+			BACKUPCLIENTUPLOADHELPERS_MAX_PENDING_PER_CONNECTION;
+	}
+
+	// Stops the encoding of files being sent when the helpers are
+	// closed, as well as when the sync is stopped
+	virtual bool StopRun()
+	{
+		return mStopping || mrRunStatusProvider.StopRun();
+	}
+
+private:
+	class Helper;
+	friend class Helper;
+	void Open();
+	void Serve(Helper &rHelper);
+	void Close();
+
+	BackupClientContext &mrContext;
+	int mHelpersWanted;
+	bool mOpened;
+	RunStatusProvider &mrRunStatusProvider;
+	int mKeepAliveTime;		// seconds
+	std::vector<Helper *> mHelpers;
+
+	// Shared with the threads, protected by mMutex
+	Mutex mMutex;
+	Condition mWorkAvailable;
+	Condition mUploaded;
+	std::deque<Upload *> mQueue;
+	std::set<Upload *> mUploads;	// everything not yet finished
+	int mHelpersServing;
+	bool mStopping;
+};
+
+#endif // BACKUPCLIENTUPLOADHELPERS__H
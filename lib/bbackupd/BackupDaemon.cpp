@@ -56,9 +56,13 @@
 #include "autogen_CommonException.h"
 #include "autogen_ConversionException.h"
 #include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientContext.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientDirectoryRecord.h"
+#include "BackupClientDirectoryScanner.h"
+#include "BackupClientUploadHelpers.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupClientInodeToIDMap.h"
 #include "BackupClientMakeExcludeList.h"
@@ -71,6 +75,9 @@
 #include "BackupStoreFile.h"
 #include "BackupStoreFilenameClear.h"
 #include "BannerText.h"
+#include "BufferedStream.h"
+#include "CollectInBufferStream.h"
+#include "CompressCodec.h"
 #include "Conversion.h"
 #include "ExcludeList.h"
 #include "FileStream.h"
@@ -229,6 +236,8 @@ BackupDaemon::BackupDaemon()
 	  mCurrentSyncStartTime(0),
 	  mUpdateStoreInterval(0),
 	  mDeleteStoreObjectInfoFile(false),
+	  mStoreObjectInfoGeneration(0),
+	  mRewriteStoreObjectInfoFile(true),
 	  mDoSyncForcedByPreviousSyncError(false),
 	  mNumFilesUploaded(-1),
 	  mNumDirsCreated(-1),
@@ -403,6 +412,9 @@ void BackupDaemon::DeleteAllLocations()
 	
 	// And delete everything from the associated mount vector
 	mIDMapMounts.clear();
+
+	// What it knows about is only useful with the records
+	mapChangeJournal.reset();
 }
 
 #ifdef WIN32
@@ -616,8 +628,7 @@ void BackupDaemon::Run2()
 
 	// --------------------------------------------------------------------------------------------
  
-	mDeleteStoreObjectInfoFile = DeserializeStoreObjectInfo(mLastSyncTime,
-		mNextSyncTime);
+	LoadStoreObjectInfo();
  
 	// --------------------------------------------------------------------------------------------
 	
@@ -886,6 +897,23 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNowWithExceptionHandling
 	return mapClientContext; // releases mapClientContext
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupDaemon::LoadStoreObjectInfo()
+//		Purpose: Loads the state saved by the last backup, if there
+//			 is any which can be used, before the first backup.
+//			 Returns whether it was loaded.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupDaemon::LoadStoreObjectInfo()
+{
+	mDeleteStoreObjectInfoFile = DeserializeStoreObjectInfo(mLastSyncTime,
+		mNextSyncTime);
+	return mDeleteStoreObjectInfoFile;
+}
+
 void BackupDaemon::ResetCachedState()
 {
 	// Clear state data
@@ -1102,9 +1130,85 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 	mapClientContext->SetMaximumDiffingTime(maximumDiffingTime);
 	mapClientContext->SetKeepAliveTime(keepAliveTime);
 
+	// Threads to search each large file for unchanged blocks with
+	BackupStoreFile::SetDiffingThreads(conf.GetKeyValueInt("DiffingThreads"));
+	// Threads to compress, encrypt and checksum new data in each file with
+	BackupStoreFile::SetEncodingThreads(conf.GetKeyValueInt("EncodingThreads"));
+	BackupStoreFile::SetContentDefinedChunking(
+		conf.GetKeyValueBool("ContentDefinedChunking"));
+
+	// Threads to read directories ahead of the sync with. With only one,
+	// the sync reads each directory itself when it gets there.
+	std::auto_ptr<BackupClientDirectoryScanner> apDirectoryScanner;
+	{
+		int scanThreads = conf.GetKeyValueInt("DirectoryScanThreads");
+		if(scanThreads == 0)
+		{
+			scanThreads = Thread::GetProcessorCount();
+		}
+		if(scanThreads > 1 && Thread::IsSupported())
+		{
+			apDirectoryScanner.reset(
+				new BackupClientDirectoryScanner(scanThreads));
+			params.mpDirectoryScanner = apDirectoryScanner.get();
+		}
+	}
+
+	// Only read the directories which the change journal says have
+	// changed since the last backup. With a new journal, which includes
+	// after a restart or an error, they're all read once first.
+	if(conf.GetKeyValueBool("ChangeJournal"))
+	{
+		if(!mapChangeJournal.get())
+		{
+			mapChangeJournal.reset(new BackupClientChangeJournal);
+			mapChangeJournal->Start();
+		}
+		if(mapChangeJournal->IsStarted())
+		{
+			mapChangeJournal->StartSync();
+			params.mpChangeJournal = mapChangeJournal.get();
+		}
+	}
+	else
+	{
+		mapChangeJournal.reset();
+	}
+
+	// Extra connections to send new files to the store on, while the
+	// sync carries on with this one. Not used when the upload rate is
+	// limited, as the limit is for each connection. Destroyed before
+	// the main connection is closed, which they depend on.
+	std::auto_ptr<BackupClientUploadHelpers> apUploadHelpers;
+	{
+		int connections = conf.GetKeyValueInt("UploadConnections");
+		if(connections > 1 && Thread::IsSupported() &&
+			params.mMaxUploadRate <= 0)
+		{
+			apUploadHelpers.reset(new BackupClientUploadHelpers(
+				*mapClientContext, connections - 1,
+				*mpRunStatusProvider));
+			params.mpUploadHelpers = apUploadHelpers.get();
+		}
+	}
+
 	// Set store marker
 	mapClientContext->SetClientStoreMarker(mClientStoreMarker);
 
+	// Keep copies of the block indexes of uploaded files, to diff the
+	// next versions against. The context empties it if it has to set a
+	// new store marker.
+	if(conf.GetKeyValueBool("BlockIndexCache"))
+	{
+		if(!mapBlockIndexCache.get())
+		{
+			mapBlockIndexCache.reset(new BackupClientBlockIndexCache(
+				conf.GetKeyValue("DataDirectory") +
+				DIRECTORY_SEPARATOR "blockindex"));
+		}
+		mapClientContext->SetBlockIndexCache(mapBlockIndexCache.get());
+	}
+
 	// Set up the locations, if necessary -- need to do it here so we have
 	// a (potential) connection to use.
 	{
@@ -1145,6 +1249,9 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 			(*i)->mapExcludeFiles.get(),
 			(*i)->mapExcludeDirs.get());
 
+		BackupStoreFile::SetCompression((*i)->mCompressionType,
+			(*i)->mCompressionLevel);
+
 		// Sync the directory
 		std::string locationPath = (*i)->mPath;
 #ifdef ENABLE_VSS
@@ -1160,6 +1267,7 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 
 		// Unset exclude lists (just in case)
 		mapClientContext->SetExcludeLists(0, 0);
+		BackupStoreFile::SetCompression(CompressCodec::Zlib);
 	}
 
 	// Perform any deletions required -- these are
@@ -1167,6 +1275,17 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 	// happen neatly.
 	mapClientContext->PerformDeletions();
 
+	BOX_INFO("Metadata statistics: " << params.mDirectoryEntriesRead <<
+		" directory entries read with " <<
+		params.mMetadataSystemCalls << " system calls (" <<
+		std::setprecision(2) << std::fixed <<
+		(params.mDirectoryEntriesRead ?
+			((double)params.mMetadataSystemCalls /
+			params.mDirectoryEntriesRead) : 0.0) <<
+		" per entry), extended attributes read " <<
+		params.mExtendedAttributesRead << " times and skipped " <<
+		params.mExtendedAttributesSkipped << " times");
+
 #ifdef ENABLE_VSS
 	CleanupVssBackupComponents();
 #endif
@@ -1796,6 +1915,15 @@ void BackupDaemon::OnBackupFinish()
 			<< BackupStoreFile::msStats.mTotalFileStreamSize
 			<< ", " << mNumFilesUploaded << " files uploaded, "
 			<< mNumDirsCreated << " dirs created");
+		BOX_INFO("Compression statistics: bytes compressed "
+			<< BackupStoreFile::msStats.mBytesCompressed
+			<< " in " << BOX_FORMAT_MICROSECONDS(
+				BackupStoreFile::msStats.mCompressionTime)
+			<< ", bytes judged incompressible "
+			<< BackupStoreFile::msStats.mBytesNotCompressed
+			<< ", estimated time saved "
+			<< BOX_FORMAT_MICROSECONDS(
+				BackupStoreFile::EstimateCompressionTimeSaved()));
 
 		// Reset statistics again
 		BackupStoreFile::ResetStats();
@@ -2526,6 +2654,23 @@ void BackupDaemon::SetupLocations(BackupClientContext &rClientContext, const Con
 			pLoc->mapExcludeFiles.reset(BackupClientMakeExcludeList_Files(rConfig));
 			pLoc->mapExcludeDirs.reset(BackupClientMakeExcludeList_Dirs(rConfig));
 
+			// Which compression to use for new data in this
+			// location. Files must still be backed up if it's not
+			// available, so fall back to zlib.
+			std::string compression =
+				rConfig.GetKeyValue("Compression");
+			pLoc->mCompressionType =
+				CompressCodec::GetTypeFromName(compression);
+			pLoc->mCompressionLevel =
+				rConfig.GetKeyValueInt("CompressionLevel");
+			if(!CompressCodec::IsSupported(pLoc->mCompressionType))
+			{
+				BOX_WARNING("Compression '" << compression << "' "
+					"for location '" << pLoc->mName << "' is "
+					"not supported, using zlib instead");
+				pLoc->mCompressionType = CompressCodec::Zlib;
+			}
+
 			// Does this exist on the server?
 			// Remove from dir object early, so that if we fail
 			// to stat the local directory, we still don't
@@ -3295,17 +3440,32 @@ BackupDaemon::CommandSocketInfo::~CommandSocketInfo()
 //			 box_time_t theNextSyncTime)
 //		Purpose: Serializes remote directory and file information
 //			 into a stream of bytes, using an Archive
-//			 abstraction.
+//			 abstraction. Only the directory records which
+//			 changed are written, to the changes file, unless
+//			 the changes have grown too big compared to the
+//			 whole file, or can't be written, in which case
+//			 the whole file is written again.
 //		Created: 2005/04/11
 //
 // --------------------------------------------------------------------------
 
 static const int STOREOBJECTINFO_MAGIC_ID_VALUE = 0x7777525F;
 static const std::string STOREOBJECTINFO_MAGIC_ID_STRING = "BBACKUPD-STATE";
-static const int STOREOBJECTINFO_VERSION = 2;
+static const int STOREOBJECTINFO_VERSION = 3;
+// Without a generation, and so never followed by a changes file
+static const int STOREOBJECTINFO_VERSION_WITHOUT_CHANGES = 2;
+
+static const int STOREOBJECTINFO_CHANGES_MAGIC_ID_VALUE = 0x7777435F;
+static const std::string STOREOBJECTINFO_CHANGES_MAGIC_ID_STRING =
+	"BBACKUPD-STATE-CHANGES";
+static const int64_t STOREOBJECTINFO_CHANGES_SYNC_STARTED = 0x5359535F;
+static const int64_t STOREOBJECTINFO_CHANGES_SYNC_FINISHED = 0x5346465F;
+// How big the changes file can grow, as a percentage of the size of the
+// whole file, before the whole file is written again
+static const int STOREOBJECTINFO_CHANGES_MAX_PERCENT = 50;
 
 bool BackupDaemon::SerializeStoreObjectInfo(box_time_t theLastSyncTime,
-	box_time_t theNextSyncTime) const
+	box_time_t theNextSyncTime)
 {
 	if(!GetConfiguration().KeyExists("StoreObjectInfoFile"))
 	{
@@ -3320,6 +3480,18 @@ bool BackupDaemon::SerializeStoreObjectInfo(box_time_t theLastSyncTime,
 		return false;
 	}
 
+	std::string changesFile = StoreObjectInfoFile + ".changes";
+	int64_t fileSize = 0, changesSize = 0;
+	if(!mRewriteStoreObjectInfoFile && !StoreObjectInfoLocationsChanged() &&
+		FileExists(StoreObjectInfoFile, &fileSize) &&
+		FileExists(changesFile, &changesSize) &&
+		changesSize * 100 <= fileSize * STOREOBJECTINFO_CHANGES_MAX_PERCENT &&
+		SerializeStoreObjectInfoChanges(changesFile, theLastSyncTime,
+			theNextSyncTime))
+	{
+		return true;
+	}
+
 	bool created = false;
 
 	try
@@ -3328,11 +3500,17 @@ bool BackupDaemon::SerializeStoreObjectInfo(box_time_t theLastSyncTime,
 			O_WRONLY | O_CREAT | O_TRUNC);
 		created = true;
 
+		// The changes file is only used with this generation of
+		// the whole file, so if writing it fails, or it's left
+		// over from before, it's ignored
+		mStoreObjectInfoGeneration = GetCurrentBoxTime();
+
 		Archive anArchive(aFile, 0);
 
 		anArchive.Write(STOREOBJECTINFO_MAGIC_ID_VALUE);
 		anArchive.Write(STOREOBJECTINFO_MAGIC_ID_STRING); 
 		anArchive.Write(STOREOBJECTINFO_VERSION);
+		anArchive.Write(mStoreObjectInfoGeneration);
 		anArchive.Write(GetLoadedConfigModifiedTime());
 		anArchive.Write(mClientStoreMarker);
 		anArchive.Write(theLastSyncTime);
@@ -3384,6 +3562,17 @@ bool BackupDaemon::SerializeStoreObjectInfo(box_time_t theLastSyncTime,
 		BOX_INFO("Saved store object info file version " <<
 			STOREOBJECTINFO_VERSION << " (" <<
 			StoreObjectInfoFile << ")");
+
+		// Start a new changes file to follow it
+		FileStream changes(changesFile, O_WRONLY | O_CREAT | O_TRUNC);
+		Archive changesArchive(changes, 0);
+		changesArchive.Write(STOREOBJECTINFO_CHANGES_MAGIC_ID_VALUE);
+		changesArchive.Write(STOREOBJECTINFO_CHANGES_MAGIC_ID_STRING);
+		changesArchive.Write(mStoreObjectInfoGeneration);
+		changes.Close();
+
+		SetStoreObjectInfoSaved();
+		mRewriteStoreObjectInfoFile = false;
 	}
 	catch(std::exception &e)
 	{
@@ -3399,6 +3588,163 @@ bool BackupDaemon::SerializeStoreObjectInfo(box_time_t theLastSyncTime,
 	return created;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupDaemon::SerializeStoreObjectInfoChanges(
+//			 const std::string &, box_time_t, box_time_t)
+//		Purpose: Adds the directory records which changed since
+//			 they were last saved to the changes file, with
+//			 everything else about the daemon's state, which is
+//			 small. Returns false if it fails, in which case the
+//			 whole file must be written again.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupDaemon::SerializeStoreObjectInfoChanges(
+	const std::string &rChangesFile, box_time_t theLastSyncTime,
+	box_time_t theNextSyncTime)
+{
+	try
+	{
+		// Collected first, to be added with one write
+		CollectInBufferStream buffer;
+		Archive anArchive(buffer, 0);
+
+		anArchive.Write(STOREOBJECTINFO_CHANGES_SYNC_FINISHED);
+		anArchive.Write(mClientStoreMarker);
+		anArchive.Write(theLastSyncTime);
+		anArchive.Write(theNextSyncTime);
+
+		int64_t iCount = mIDMapMounts.size();
+		anArchive.Write(iCount);
+
+		for(int v = 0; v < iCount; v++)
+			anArchive.Write(mIDMapMounts[v]);
+
+		iCount = mUnusedRootDirEntries.size();
+		anArchive.Write(iCount);
+
+		for(int v = 0; v < iCount; v++)
+		{
+			anArchive.Write(mUnusedRootDirEntries[v].first);
+			anArchive.Write(mUnusedRootDirEntries[v].second);
+		}
+
+		if (iCount > 0)
+		{
+			anArchive.Write(mDeleteUnusedRootDirEntriesAfter);
+		}
+
+		// The locations are the same as in the whole file, but the
+		// ID maps they use can move if mount points change
+		for(Locations::const_iterator i = mLocations.begin();
+			i != mLocations.end(); i++)
+		{
+			anArchive.Write((*i)->mIDMapIndex);
+		}
+
+		int64_t numChanged = 0;
+		for(Locations::const_iterator i = mLocations.begin();
+			i != mLocations.end(); i++)
+		{
+			if((*i)->mapDirectoryRecord.get())
+			{
+				std::vector<std::string> path;
+				(*i)->mapDirectoryRecord->SerializeChanges(
+					anArchive, (*i)->mName, path,
+					numChanged);
+			}
+		}
+
+		int64_t aMagicMarker = ARCHIVE_MAGIC_VALUE_NOOP;
+		anArchive.Write(aMagicMarker);
+
+		FileStream changes(rChangesFile, O_WRONLY | O_APPEND);
+		changes.Write(buffer.GetBuffer(), buffer.GetSize());
+		changes.Close();
+
+		BOX_INFO("Saved " << numChanged << " changed directory "
+			"records to store object info changes file (" <<
+			rChangesFile << ")");
+		return true;
+	}
+	catch(std::exception &e)
+	{
+		BOX_ERROR("Failed to write store object info changes file: " <<
+			rChangesFile << ": " << e.what());
+	}
+	catch(...)
+	{
+		BOX_ERROR("Failed to write store object info changes file: " <<
+			rChangesFile << ": unknown error");
+	}
+
+	// Records may have been marked as saved without being written
+	mRewriteStoreObjectInfoFile = true;
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupDaemon::SetStoreObjectInfoSaved()
+//		Purpose: Records that the state of all the locations has
+//			 been saved, or loaded, as it is now, so that the
+//			 next save only needs to add what changes.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void BackupDaemon::SetStoreObjectInfoSaved()
+{
+	mStoreObjectInfoLocations.clear();
+
+	for(Locations::const_iterator i = mLocations.begin();
+		i != mLocations.end(); i++)
+	{
+		BackupClientDirectoryRecord *pRecord =
+			(*i)->mapDirectoryRecord.get();
+		if(pRecord)
+		{
+			pRecord->SetStateSaved();
+		}
+		mStoreObjectInfoLocations.push_back(
+			std::pair<std::string, BackupClientDirectoryRecord *>(
+				(*i)->mName, pRecord));
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupDaemon::StoreObjectInfoLocationsChanged()
+//		Purpose: Whether locations have been added, removed or
+//			 replaced since the state was last saved, which the
+//			 changes file can't record.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupDaemon::StoreObjectInfoLocationsChanged() const
+{
+	if(mLocations.size() != mStoreObjectInfoLocations.size())
+	{
+		return true;
+	}
+
+	Locations::const_iterator i = mLocations.begin();
+	for(size_t l = 0; l < mStoreObjectInfoLocations.size(); l++, i++)
+	{
+		if((*i)->mName != mStoreObjectInfoLocations[l].first ||
+			(*i)->mapDirectoryRecord.get() !=
+			mStoreObjectInfoLocations[l].second)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -3448,7 +3794,8 @@ bool BackupDaemon::DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 		try
 		{
 			FileStream aFile(StoreObjectInfoFile, O_RDONLY);
-			Archive anArchive(aFile, 0);
+			BufferedStream buffered(aFile);
+			Archive anArchive(buffered, 0);
 
 			//
 			// see if the content looks like a valid serialised archive
@@ -3485,7 +3832,8 @@ bool BackupDaemon::DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 			int iVersion = 0;
 			anArchive.Read(iVersion);
 
-			if(iVersion != STOREOBJECTINFO_VERSION)
+			if(iVersion != STOREOBJECTINFO_VERSION &&
+				iVersion != STOREOBJECTINFO_VERSION_WITHOUT_CHANGES)
 			{
 				BOX_WARNING(BOX_FILE_MESSAGE(StoreObjectInfoFile,
 					"Store object info file version " <<
@@ -3493,6 +3841,12 @@ bool BackupDaemon::DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 				return false;
 			}
 
+			int64_t generation = 0;
+			if(iVersion == STOREOBJECTINFO_VERSION)
+			{
+				anArchive.Read(generation);
+			}
+
 			//
 			// check if this state file is even valid 
 			// for the loaded bbackupd.conf file
@@ -3572,9 +3926,21 @@ bool BackupDaemon::DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 			//
 			aFile.Close();
 
-			BOX_INFO(BOX_FILE_MESSAGE(StoreObjectInfoFile,
-				"Loaded store object info file version " << iVersion));
-			return true;
+			//
+			// and then what changed since it was written
+			//
+			mStoreObjectInfoGeneration = generation;
+			mRewriteStoreObjectInfoFile = false;
+			if(DeserializeStoreObjectInfoChanges(
+				StoreObjectInfoFile + ".changes", generation,
+				theLastSyncTime, theNextSyncTime))
+			{
+				BOX_INFO(BOX_FILE_MESSAGE(StoreObjectInfoFile,
+					"Loaded store object info file version " <<
+					iVersion));
+				SetStoreObjectInfoSaved();
+				return true;
+			}
 		} 
 		catch(std::exception &e)
 		{
@@ -3598,16 +3964,229 @@ bool BackupDaemon::DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 	mClientStoreMarker = BackupClientContext::ClientStoreMarker_NotKnown;
 	theLastSyncTime = 0;
 	theNextSyncTime = 0;
+	mRewriteStoreObjectInfoFile = true;
 
 	return false;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupDaemon::DeserializeStoreObjectInfoChanges(
+//			 const std::string &, int64_t,
+//			 box_time_t &, box_time_t &)
+//		Purpose: Applies the changes saved after the whole file was
+//			 written, to the state read from it. Returns false if
+//			 the state can't be used, because a backup started
+//			 after the last changes were saved and didn't finish.
+//			 If the changes file doesn't belong to the whole file,
+//			 it's ignored and the whole file is written again
+//			 next time.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool BackupDaemon::DeserializeStoreObjectInfoChanges(
+	const std::string &rChangesFile, int64_t Generation,
+	box_time_t &theLastSyncTime, box_time_t &theNextSyncTime)
+{
+	int64_t fileSize;
+	if(Generation == 0 || !FileExists(rChangesFile, &fileSize))
+	{
+		// Nothing to add, but a new changes file has to be started
+		mRewriteStoreObjectInfoFile = true;
+		return true;
+	}
+
+	FileStream aFile(rChangesFile, O_RDONLY);
+	BufferedStream buffered(aFile);
+	Archive anArchive(buffered, 0);
+
+	int iMagicValue = 0;
+	anArchive.Read(iMagicValue);
+	std::string strMagicValue;
+	anArchive.Read(strMagicValue);
+
+	if(iMagicValue != STOREOBJECTINFO_CHANGES_MAGIC_ID_VALUE ||
+		strMagicValue != STOREOBJECTINFO_CHANGES_MAGIC_ID_STRING)
+	{
+		BOX_WARNING(BOX_FILE_MESSAGE(rChangesFile,
+			"Store object info changes file is not a valid "
+			"or compatible serialised archive"));
+		return false;
+	}
+
+	int64_t changesGeneration = 0;
+	anArchive.Read(changesGeneration);
+	if(changesGeneration != Generation)
+	{
+		BOX_INFO(BOX_FILE_MESSAGE(rChangesFile, "Ignoring store object "
+			"info changes file from an older store object info "
+			"file"));
+		mRewriteStoreObjectInfoFile = true;
+		return true;
+	}
+
+	bool syncStarted = false;
+	int64_t numSyncs = 0;
+
+	while(buffered.GetPosition() < fileSize)
+	{
+		int64_t marker = 0;
+		anArchive.Read(marker);
+
+		if(marker == STOREOBJECTINFO_CHANGES_SYNC_STARTED)
+		{
+			syncStarted = true;
+			continue;
+		}
+		else if(marker != STOREOBJECTINFO_CHANGES_SYNC_FINISHED)
+		{
+			THROW_EXCEPTION_MESSAGE(ClientException,
+				CorruptStoreObjectInfoFile, "Unknown marker " <<
+				marker << " in store object info changes file");
+		}
+
+		syncStarted = false;
+		numSyncs++;
+
+		anArchive.Read(mClientStoreMarker);
+		anArchive.Read(theLastSyncTime);
+		anArchive.Read(theNextSyncTime);
+
+		int64_t iCount = 0;
+		anArchive.Read(iCount);
+		mIDMapMounts.clear();
+
+		for(int v = 0; v < iCount; v++)
+		{
+			std::string strItem;
+			anArchive.Read(strItem);
+			mIDMapMounts.push_back(strItem);
+		}
+
+		iCount = 0;
+		anArchive.Read(iCount);
+		mUnusedRootDirEntries.clear();
+
+		for(int v = 0; v < iCount; v++)
+		{
+			int64_t anId;
+			anArchive.Read(anId);
+			std::string aName;
+			anArchive.Read(aName);
+			mUnusedRootDirEntries.push_back(
+				std::pair<int64_t, std::string>(anId, aName));
+		}
+
+		if (iCount > 0)
+			anArchive.Read(mDeleteUnusedRootDirEntriesAfter);
+
+		for(Locations::iterator i = mLocations.begin();
+			i != mLocations.end(); i++)
+		{
+			anArchive.Read((*i)->mIDMapIndex);
+		}
+
+		// Then each directory record which changed, after the
+		// names of the directories leading to it
+		while(true)
+		{
+			int64_t aMagicMarker = 0;
+			anArchive.Read(aMagicMarker);
+
+			if(aMagicMarker == ARCHIVE_MAGIC_VALUE_NOOP)
+			{
+				break;
+			}
+			else if(aMagicMarker != ARCHIVE_MAGIC_VALUE_RECURSE)
+			{
+				THROW_EXCEPTION_MESSAGE(ClientException,
+					CorruptStoreObjectInfoFile, "Unknown "
+					"record marker " << aMagicMarker <<
+					" in store object info changes file");
+			}
+
+			std::string locationName;
+			anArchive.Read(locationName);
+
+			Location *pLocation = NULL;
+			for(Locations::iterator i = mLocations.begin();
+				i != mLocations.end(); i++)
+			{
+				if((*i)->mName == locationName)
+				{
+					pLocation = *i;
+					break;
+				}
+			}
+
+			if(!pLocation)
+			{
+				THROW_EXCEPTION_MESSAGE(ClientException,
+					CorruptStoreObjectInfoFile, "Unknown "
+					"location " << locationName << " in "
+					"store object info changes file");
+			}
+
+			if(!pLocation->mapDirectoryRecord.get())
+			{
+				pLocation->mapDirectoryRecord.reset(
+					new BackupClientDirectoryRecord(0, ""));
+			}
+
+			BackupClientDirectoryRecord *pRecord =
+				pLocation->mapDirectoryRecord.get();
+
+			int64_t depth = 0;
+			anArchive.Read(depth);
+
+			for(int64_t d = 0; d < depth; d++)
+			{
+				std::string name;
+				anArchive.Read(name);
+
+				if(pRecord)
+				{
+					pRecord = pRecord->GetSubDirectory(name);
+				}
+			}
+
+			if(!pRecord)
+			{
+				THROW_EXCEPTION_MESSAGE(ClientException,
+					CorruptStoreObjectInfoFile, "Changed "
+					"directory record in store object info "
+					"changes file has no parent");
+			}
+
+			pRecord->DeserializeChange(anArchive);
+		}
+	}
+
+	aFile.Close();
+
+	if(syncStarted)
+	{
+		BOX_WARNING(BOX_FILE_MESSAGE(rChangesFile, "Store object info "
+			"file is from an unfinished backup"));
+		return false;
+	}
+
+	BOX_INFO(BOX_FILE_MESSAGE(rChangesFile, "Loaded changes from " <<
+		numSyncs << " backups from store object info changes file"));
+	return true;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
 //		Name:    BackupDaemon::DeleteStoreObjectInfo()
 //		Purpose: Deletes the serialised state file, to prevent us
 //			 from using it again if a backup is interrupted.
+//			 If there's a changes file which follows it, marks
+//			 the start of the backup in that instead, which does
+//			 the same thing until the end of the backup is added
+//			 after it.
 //
 //		Created: 2006/02/12
 //
@@ -3621,6 +4200,34 @@ bool BackupDaemon::DeleteStoreObjectInfo() const
 	}
 
 	std::string storeObjectInfoFile(GetConfiguration().GetKeyValue("StoreObjectInfoFile"));
+	std::string changesFile(storeObjectInfoFile + ".changes");
+
+	// It's only known to follow the whole file if that was loaded or
+	// written with it
+	if(!mRewriteStoreObjectInfoFile && FileExists(changesFile))
+	{
+		try
+		{
+			FileStream changes(changesFile, O_WRONLY | O_APPEND);
+			Archive anArchive(changes, 0);
+			anArchive.Write(STOREOBJECTINFO_CHANGES_SYNC_STARTED);
+			changes.Close();
+			return true;
+		}
+		catch(std::exception &e)
+		{
+			BOX_ERROR("Failed to write store object info changes "
+				"file: " << changesFile << ": " << e.what());
+		}
+
+		// Without it, the whole file can't be used either
+		if(::unlink(changesFile.c_str()) != 0)
+		{
+			BOX_LOG_SYS_ERROR("Failed to delete the old "
+				"store object info changes file: " <<
+				changesFile);
+		}
+	}
 
 	// Check to see if the file exists
 	if(!FileExists(storeObjectInfoFile.c_str()))
@@ -43,6 +43,8 @@
 
 class BackupClientDirectoryRecord;
 class BackupClientContext;
+class BackupClientBlockIndexCache;
+class BackupClientChangeJournal;
 class Configuration;
 class BackupClientInodeToIDMap;
 class ExcludeList;
@@ -68,10 +70,17 @@ private:
 	// methods below do partial (specialized) serialization of 
 	// client state only
 	bool SerializeStoreObjectInfo(box_time_t theLastSyncTime,
-		box_time_t theNextSyncTime) const;
+		box_time_t theNextSyncTime);
+	bool SerializeStoreObjectInfoChanges(const std::string &rChangesFile,
+		box_time_t theLastSyncTime, box_time_t theNextSyncTime);
 	bool DeserializeStoreObjectInfo(box_time_t & theLastSyncTime,
 		box_time_t & theNextSyncTime);
+	bool DeserializeStoreObjectInfoChanges(const std::string &rChangesFile,
+		int64_t Generation, box_time_t & theLastSyncTime,
+		box_time_t & theNextSyncTime);
 	bool DeleteStoreObjectInfo() const;
+	void SetStoreObjectInfoSaved();
+	bool StoreObjectInfoLocationsChanged() const;
 	BackupDaemon(const BackupDaemon &);
 
 public:
@@ -139,6 +148,7 @@ public:
 	void InitCrypto();
 	std::auto_ptr<BackupClientContext> RunSyncNowWithExceptionHandling();
 	std::auto_ptr<BackupClientContext> RunSyncNow();
+	bool LoadStoreObjectInfo();
 	void ResetCachedState();
 	void OnBackupStart();
 	void OnBackupFinish();
@@ -247,6 +257,13 @@ private:
 		  mBackupErrorDelay;
 	TLSContext mTlsContext;
 	bool mDeleteStoreObjectInfoFile;
+	// The store object info file is written in full now and then, and
+	// in between only the records which changed are added to the
+	// changes file, which must have the same generation
+	int64_t mStoreObjectInfoGeneration;
+	bool mRewriteStoreObjectInfoFile;
+	std::vector<std::pair<std::string, BackupClientDirectoryRecord *> >
+		mStoreObjectInfoLocations;
 	bool mDoSyncForcedByPreviousSyncError;
 	int64_t mNumFilesUploaded, mNumDirsCreated;
 	int mMaxBandwidthFromSyncAllowScript;
@@ -278,6 +295,8 @@ private:
 	SysadminNotifier* mpSysadminNotifier;
 	std::auto_ptr<Timer> mapCommandSocketPollTimer;
 	std::auto_ptr<BackupClientContext> mapClientContext;
+	std::auto_ptr<BackupClientBlockIndexCache> mapBlockIndexCache;
+	std::auto_ptr<BackupClientChangeJournal> mapChangeJournal;
 
 	/* ProgressNotifier implementation */
 public:
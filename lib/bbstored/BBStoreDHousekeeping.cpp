@@ -132,6 +132,8 @@ void BackupStoreDaemon::RunHousekeepingIfNeeded()
 			// Do housekeeping on this account
 			HousekeepStoreAccount housekeeping(*i, rootDir,
 				discSet, this);
+			housekeeping.SetMaxBundledFileSize(
+				rconfig.GetKeyValueInt("MaxBundledFileSize"));
 			housekeeping.DoHousekeeping();
 		}
 		catch(BoxException &e)
@@ -0,0 +1,108 @@
+// Auto-generated by CMake. Do not edit.
+/* #undef HAVE_STRUCT_STAT_ST_FLAGS */
+/* #undef HAVE_STRUCT_STAT_ST_ATIM */
+/* #undef HAVE_STRUCT_STAT_ST_ATIMESPEC */
+/* #undef HAVE_STRUCT_STAT_ST_ATIM_TV_NSEC */
+/* #undef HAVE_STRUCT_STAT_ST_ATIMENSEC */
+/* #undef HAVE_DIR_DD_FD */
+/* #undef HAVE_STRUCT_TCP_INFO_TCPI_RTT */
+#define HAVE_DECL_O_BINARY 0
+#define HAVE_DECL_ENOTSUP 1
+#define HAVE_DECL_INFTIM 0
+#define HAVE_DECL_SO_PEERCRED 1
+#define HAVE_DECL_SOL_TCP 1
+#define HAVE_DECL_TCP_INFO 1
+#define HAVE_DECL_SO_SNDBUF 1
+#define HAVE_DECL_SO_SNDBUF 1
+#define HAVE_DECL_SO_SNDBUF 1
+#define HAVE_DECL_OPTRESET 0
+/* #undef HAVE_STRUCT_DIRENT_D_INO */
+#define HAVE_DECL_XATTR_NOFOLLOW 0
+#define HAVE_DECL_O_EXLOCK 0
+#define HAVE_DECL_F_SETLK 1
+#define HAVE_STRUCT_MNTENT_MNT_DIR
+#define HAVE_ZLIB_H
+/* #undef HAVE_ZSTD_H */
+/* #undef HAVE_CXXABI_H */
+#define HAVE_DIRENT_H
+#define HAVE_DLFCN_H
+#define HAVE_FCNTL_H
+#define HAVE_GETOPT_H
+#define HAVE_NETDB_H
+/* #undef HAVE_PROCESS_H */
+#define HAVE_PWD_H
+#define HAVE_SIGNAL_H
+#define HAVE_SYSLOG_H
+#define HAVE_TIME_H
+#define HAVE_UNISTD_H
+#define HAVE_NETINET_IN_H
+#define HAVE_NETINET_TCP_H
+#define HAVE_SYS_FILE_H
+#define HAVE_SYS_PARAM_H
+#define HAVE_SYS_POLL_H
+#define HAVE_SYS_SOCKET_H
+#define HAVE_SYS_STAT_H
+#define HAVE_SYS_TIME_H
+#define HAVE_SYS_TYPES_H
+#define HAVE_SYS_UIO_H
+#define HAVE_SYS_UN_H
+#define HAVE_SYS_WAIT_H
+#define HAVE_SYS_XATTR_H
+#define HAVE_SYS_MMAN_H
+#define HAVE_SYS_RESOURCE_H
+#define HAVE_SYS_INOTIFY_H
+#define HAVE_PTHREAD_H
+/* #undef HAVE_BSD_UNISTD_H */
+#define HAVE_SYS_SOCKET_H
+#define HAVE_EXECINFO_H
+#define HAVE_REGEX_H
+#define HAVE_PCREPOSIX_H
+/* #undef HAVE_UCRED_H */
+#define HAVE_SYS_PARAM_H
+#define HAVE_SYS_SYSCALL_H
+#define HAVE_UNISTD_H
+#define HAVE_MNTENT_H
+/* #undef HAVE_SYS_MNTTAB_H */
+#define HAVE_SYS_MOUNT_H
+#define HAVE_SYS_PARAM_H
+#define HAVE_REGEX_SUPPORT
+/* #undef HAVE_RL_FILENAME_COMPLETION_FUNCTION */
+#define HAVE_DLSYM
+#define HAVE_DLADDR
+/* #undef HAVE_GETPEERUCRED */
+#define HAVE_FTRUNCATE
+/* #undef HAVE_GETPEEREID */
+#define HAVE_GETPEERNAME
+#define HAVE_GETPID
+#define HAVE_GETTIMEOFDAY
+#define HAVE_LCHOWN
+/* #undef HAVE_SETPROCTITLE */
+#define HAVE_UTIMENSAT
+#define HAVE_MMAP
+#define HAVE_MADVISE
+#define HAVE_POSIX_FADVISE
+#define HAVE_STATX
+/* #undef HAVE_KQUEUE */
+#define HAVE_LISTXATTR
+#define HAVE_LLISTXATTR
+#define HAVE_GETXATTR
+#define HAVE_LGETXATTR
+#define HAVE_SETXATTR
+#define HAVE_LSETXATTR
+#define HAVE_FLOCK
+#define HAVE_FCNTL
+#define HAVE_GETMNTENT
+#define HAVE_STATFS
+#define HAVE_SYSCALL
+/* #undef HAVE___SYSCALL */
+#define HAVE_DECL_DIRFD 1
+/* #undef HAVE_STRUCT_STATFS_F_MNTONNAME */
+/* #undef HAVE_STRUCT_STATVFS_F_MNTONNAME */
+#define HAVE_MOUNTS
+#define RANDOM_DEVICE "/dev/urandom"
+#define HAVE_RANDOM_DEVICE
+#define HAVE___SYSCALL_NEED_DEFN
+#define HAVE_STRUCT_UCRED_UID
+/* #undef HAVE_STRUCT_UCRED_CR_UID */
+/* #undef HAVE_LSEEK_DUMMY_PARAM */
+#define HAVE_LSEEK_64_BIT
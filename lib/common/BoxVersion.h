@@ -0,0 +1 @@
+#define BOX_VERSION "git_a2319616d00c9c850b504c665d5342cf7bda2f4b"
@@ -28,6 +28,11 @@
 #	include <unistd.h>
 #endif
 
+#if defined(HAVE_PTHREAD_H) && !defined(WIN32)
+#	include <pthread.h>
+#	define MEMLEAKFINDER_THREADS
+#endif
+
 #include <cstdlib> // for std::atexit
 #include <map>
 #include <set>
@@ -126,7 +131,42 @@ MemLeakSuppressionGuard::~MemLeakSuppressionGuard()
 	memleakfinder_global_enable = true;
 }
 
+#ifdef MEMLEAKFINDER_THREADS
+// The tracking data is shared by all threads, so only one may use it at a
+// time. The lock is recursive, as the tracking allocates memory itself.
+static pthread_once_t sTrackingLockOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sTrackingLock;
+
+static void init_tracking_lock()
+{
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&sTrackingLock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+}
+#endif
+
+class TrackingLock
+{
+	public:
+	TrackingLock()
+	{
+#ifdef MEMLEAKFINDER_THREADS
+		pthread_once(&sTrackingLockOnce, init_tracking_lock);
+		pthread_mutex_lock(&sTrackingLock);
+#endif
+	}
+	~TrackingLock()
+	{
+#ifdef MEMLEAKFINDER_THREADS
+		pthread_mutex_unlock(&sTrackingLock);
+#endif
+	}
+};
+
 // these functions may well allocate memory, which we don't want to track.
+// Only the thread holding the lock can be inside them.
 static int sInternalAllocDepth = 0;
 
 class InternalAllocGuard
@@ -134,6 +174,8 @@ class InternalAllocGuard
 	public:
 	InternalAllocGuard () { sInternalAllocDepth++; }
 	~InternalAllocGuard() { sInternalAllocDepth--; }
+	private:
+	TrackingLock mLock;
 };
 
 void memleakfinder_malloc_add_block(void *b, size_t size, const char *file, int line)
@@ -671,7 +713,8 @@ static void *internal_new(size_t size, const char *file, int line)
 		InternalAllocGuard guard;
 		r = std::malloc(size);
 	}
-	
+
+	TrackingLock lock;
 	if (sInternalAllocDepth == 0)
 	{
 		InternalAllocGuard guard;
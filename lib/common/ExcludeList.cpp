@@ -35,7 +35,11 @@
 //
 // --------------------------------------------------------------------------
 ExcludeList::ExcludeList()
-	: mpAlwaysInclude(0)
+	:
+#ifdef HAVE_REGEX_SUPPORT
+	  mpCombinedRegex(0),
+#endif
+	  mpAlwaysInclude(0)
 {
 }
 
@@ -51,15 +55,7 @@ ExcludeList::ExcludeList()
 ExcludeList::~ExcludeList()
 {
 #ifdef HAVE_REGEX_SUPPORT
-	// free regex memory
-	while(mRegex.size() > 0)
-	{
-		regex_t *pregex = mRegex.back();
-		mRegex.pop_back();
-		// Free regex storage, and the structure itself
-		::regfree(pregex);
-		delete pregex;
-	}
+	FreeRegex();
 #endif
 
 	// Clean up exceptions list
@@ -171,14 +167,11 @@ void ExcludeList::AddRegexEntries(const std::string &rEntries)
 	SplitString(rEntries, Configuration::MultiValueSeparator, ens);
 	
 	// Create and add new regular expressions
-	for(std::vector<std::string>::const_iterator i(ens.begin()); i != ens.end(); ++i)
+	try
 	{
-		if(i->size() > 0)
+		for(std::vector<std::string>::const_iterator i(ens.begin()); i != ens.end(); ++i)
 		{
-			// Allocate memory
-			regex_t *pregex = new regex_t;
-			
-			try
+			if(i->size() > 0)
 			{
 				std::string entry = *i;
 				int flags = REG_EXTENDED | REG_NOSUB;
@@ -191,37 +184,240 @@ void ExcludeList::AddRegexEntries(const std::string &rEntries)
 				flags |= REG_ICASE; // Windows convention
 				#endif
 
-				// Compile
-				int errcode = ::regcomp(pregex, entry.c_str(),
-					flags);
+				AddRegex(entry, flags);
+			}
+		}
+	}
+	catch(...)
+	{
+		// Keep the ones which were added
+		CombineRegex();
+		throw;
+	}
+
+	CombineRegex();
+
+#else
+	THROW_EXCEPTION(CommonException, RegexNotSupportedOnThisPlatform)
+#endif
+}
+
+
+#ifdef HAVE_REGEX_SUPPORT
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ExcludeList::AddRegex(const std::string &, int)
+//		Purpose: Private. Compiles a regular expression with the
+//			 given flags and adds it to the list. CombineRegex()
+//			 must be called after adding them.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ExcludeList::AddRegex(const std::string &rEntry, int Flags)
+{
+	// Allocate memory
+	regex_t *pregex = new regex_t;
+
+	try
+	{
+		// Compile
+		int errcode = ::regcomp(pregex, rEntry.c_str(), Flags);
 
-				if (errcode != 0)
+		if (errcode != 0)
+		{
+			char buf[1024];
+			regerror(errcode, pregex, buf, sizeof(buf));
+			THROW_EXCEPTION_MESSAGE(CommonException, BadRegularExpression,
+				"Invalid regular expression: " <<
+				rEntry << ": " << buf);
+		}
+	}
+	catch(...)
+	{
+		delete pregex;
+		throw;
+	}
+
+	// Store in list of regular expressions
+	mRegex.push_back(pregex);
+	// Store in list of regular expression string for Serialize
+	mRegexStr.push_back(rEntry);
+	mRegexFlags.push_back(Flags);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ExcludeList::FreeRegex()
+//		Purpose: Private. Frees all the regular expressions.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ExcludeList::FreeRegex()
+{
+	if(mpCombinedRegex != 0)
+	{
+		::regfree(mpCombinedRegex);
+		delete mpCombinedRegex;
+		mpCombinedRegex = 0;
+	}
+	mUncombinedRegex.clear();
+
+	// free regex memory
+	while(mRegex.size() > 0)
+	{
+		regex_t *pregex = mRegex.back();
+		mRegex.pop_back();
+		// Free regex storage, and the structure itself
+		::regfree(pregex);
+		delete pregex;
+	}
+
+	mRegexStr.clear();
+	mRegexFlags.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ExcludeList::CanCombineRegex(const std::string &)
+//		Purpose: Private. Static. Whether a regular expression
+//			 (which compiles) means the same as an alternative
+//			 in a bigger one. Back references would refer to the
+//			 wrong group, and unbalanced parentheses, which some
+//			 libraries accept as literals, would match the wrong
+//			 ones.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool ExcludeList::CanCombineRegex(const std::string &rEntry)
+{
+	int depth = 0;
+
+	for(std::string::size_type i = 0; i < rEntry.size(); i++)
+	{
+		char c = rEntry[i];
+		if(c == '\\')
+		{
+			if(i + 1 < rEntry.size() &&
+				rEntry[i + 1] >= '1' && rEntry[i + 1] <= '9')
+			{
+				return false;
+			}
+			i++;
+		}
+		else if(c == '[')
+		{
+			// Skip the bracket expression, in which ] is a literal
+			// if it's first, and so is everything else except the
+			// end of [: :], [. .] and [= =]
+			i++;
+			if(i < rEntry.size() && rEntry[i] == '^') i++;
+			if(i < rEntry.size() && rEntry[i] == ']') i++;
+			while(i < rEntry.size() && rEntry[i] != ']')
+			{
+				if(rEntry[i] == '[' && i + 1 < rEntry.size() &&
+					(rEntry[i + 1] == ':' ||
+					 rEntry[i + 1] == '.' ||
+					 rEntry[i + 1] == '='))
 				{
-					char buf[1024];
-					regerror(errcode, pregex, buf, sizeof(buf));
-					THROW_EXCEPTION_MESSAGE(CommonException, BadRegularExpression,
-						"Invalid regular expression: " <<
-						entry << ": " << buf);
+					std::string end(1, rEntry[i + 1]);
+					end += ']';
+					std::string::size_type e =
+						rEntry.find(end, i + 2);
+					if(e == std::string::npos)
+					{
+						return false;
+					}
+					i = e + 1;
 				}
-				
-				// Store in list of regular expressions
-				mRegex.push_back(pregex);
-				// Store in list of regular expression string for Serialize
-				mRegexStr.push_back(entry.c_str());
+				i++;
 			}
-			catch(...)
+			if(i >= rEntry.size())
 			{
-				delete pregex;
-				throw;
+				return false;
+			}
+		}
+		else if(c == '(')
+		{
+			depth++;
+		}
+		else if(c == ')')
+		{
+			if(--depth < 0)
+			{
+				return false;
 			}
 		}
 	}
 
-#else
-	THROW_EXCEPTION(CommonException, RegexNotSupportedOnThisPlatform)
-#endif
+	return depth == 0;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ExcludeList::CombineRegex()
+//		Purpose: Private. Compiles one regular expression with all
+//			 the others which can be combined as alternatives, so
+//			 that IsExcluded() runs the matcher once for them.
+//			 Those which can't, or were compiled with other
+//			 flags, are still tested one at a time. If the
+//			 combined expression doesn't compile, they all are.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ExcludeList::CombineRegex()
+{
+	if(mpCombinedRegex != 0)
+	{
+		::regfree(mpCombinedRegex);
+		delete mpCombinedRegex;
+		mpCombinedRegex = 0;
+	}
+	mUncombinedRegex.clear();
+
+	std::string combined;
+	int combinedCount = 0;
+	for(size_t i = 0; i < mRegex.size(); i++)
+	{
+		if(mRegexFlags[i] == mRegexFlags[0] &&
+			CanCombineRegex(mRegexStr[i]))
+		{
+			if(combinedCount > 0)
+			{
+				combined += "|";
+			}
+			combined += "(" + mRegexStr[i] + ")";
+			combinedCount++;
+		}
+		else
+		{
+			mUncombinedRegex.push_back(mRegex[i]);
+		}
+	}
+
+	if(combinedCount < 2)
+	{
+		// Nothing to gain
+		mUncombinedRegex.clear();
+		return;
+	}
+
+	regex_t *pregex = new regex_t;
+	if(::regcomp(pregex, combined.c_str(), mRegexFlags[0]) != 0)
+	{
+		BOX_WARNING("Failed to combine regular expressions in "
+			"exclude list, testing them one at a time");
+		delete pregex;
+		mUncombinedRegex.clear();
+		return;
+	}
+
+	mpCombinedRegex = pregex;
+}
+#endif // HAVE_REGEX_SUPPORT
 
 // --------------------------------------------------------------------------
 //
@@ -233,11 +429,11 @@ void ExcludeList::AddRegexEntries(const std::string &rEntries)
 // --------------------------------------------------------------------------
 bool ExcludeList::IsExcluded(const std::string &rTest) const
 {
-	std::string test = rTest;
-
 	#ifdef WIN32
 	// converts to lower case as well
-	test = ReplaceSlashesDefinite(test);
+	std::string test = ReplaceSlashesDefinite(rTest);
+	#else
+	const std::string &test(rTest);
 	#endif
 
 	// Check against the always include list
@@ -257,9 +453,18 @@ bool ExcludeList::IsExcluded(const std::string &rTest) const
 		return true;
 	}
 	
-	// Check against regular expressions
+	// Check against regular expressions, all those which could be
+	// combined at once, and then the others
 #ifdef HAVE_REGEX_SUPPORT
-	for(std::vector<regex_t *>::const_iterator i(mRegex.begin()); i != mRegex.end(); ++i)
+	if(mpCombinedRegex != 0 &&
+		regexec(mpCombinedRegex, test.c_str(), 0, 0, 0) == 0)
+	{
+		return true;
+	}
+
+	const std::vector<regex_t *> &rRegex(mpCombinedRegex ?
+		mUncombinedRegex : mRegex);
+	for(std::vector<regex_t *>::const_iterator i(rRegex.begin()); i != rRegex.end(); ++i)
 	{
 		// Test against this expression
 		if(regexec(*i, test.c_str(), 0, 0 /* no match information required */, 0 /* no flags */) == 0)
@@ -315,17 +520,7 @@ void ExcludeList::Deserialize(Archive & rArchive)
 	mDefinite.clear();
 
 #ifdef HAVE_REGEX_SUPPORT
-	// free regex memory
-	while(mRegex.size() > 0)
-	{
-		regex_t *pregex = mRegex.back();
-		mRegex.pop_back();
-		// Free regex storage, and the structure itself
-		::regfree(pregex);
-		delete pregex;
-	}
-
-	mRegexStr.clear();
+	FreeRegex();
 #endif
 
 	// Clean up exceptions list
@@ -364,34 +559,11 @@ void ExcludeList::Deserialize(Archive & rArchive)
 		{
 			std::string strItem;
 			rArchive.Read(strItem);
-
-			// Allocate memory
-			regex_t* pregex = new regex_t;
-			
-			try
-			{
-				// Compile
-				if(::regcomp(pregex, strItem.c_str(), 
-					REG_EXTENDED | REG_NOSUB) != 0)
-				{
-					THROW_EXCEPTION(CommonException, 
-						BadRegularExpression)
-				}
-				
-				// Store in list of regular expressions
-				mRegex.push_back(pregex);
-
-				// Store in list of regular expression strings
-				// for Serialize
-				mRegexStr.push_back(strItem);
-			}
-			catch(...)
-			{
-				delete pregex;
-				throw;
-			}
+			AddRegex(strItem, REG_EXTENDED | REG_NOSUB);
 		}
 	}
+
+	CombineRegex();
 #endif // HAVE_REGEX_SUPPORT
 
 	//
@@ -25,7 +25,10 @@ class Archive;
 //
 // Class
 //		Name:    ExcludeList
-//		Purpose: General purpose exclusion list
+//		Purpose: General purpose exclusion list. The regular
+//			 expressions are combined into one where possible,
+//			 so that testing a name runs the matcher once rather
+//			 than once for every expression.
 //		Created: 28/1/04
 //
 // --------------------------------------------------------------------------
@@ -55,12 +58,29 @@ public:
 #else
 		{return 0;}
 #endif
+	unsigned int SizeOfUncombinedRegexList() const
+#ifdef HAVE_REGEX_SUPPORT
+		{return mpCombinedRegex ? mUncombinedRegex.size() : mRegex.size();}
+#else
+		{return 0;}
+#endif
 
 private:
 	std::set<std::string> mDefinite;
 #ifdef HAVE_REGEX_SUPPORT
 	std::vector<regex_t *> mRegex;
 	std::vector<std::string> mRegexStr;	// save original regular expression string-based source for Serialize
+	std::vector<int> mRegexFlags;		// which each was compiled with
+
+	// All the expressions which can be, as one, and the rest (which
+	// are also in mRegex) to be tested one at a time
+	regex_t *mpCombinedRegex;
+	std::vector<regex_t *> mUncombinedRegex;
+
+	void AddRegex(const std::string &rEntry, int Flags);
+	void FreeRegex();
+	void CombineRegex();
+	static bool CanCombineRegex(const std::string &rEntry);
 #endif
 
 #ifdef WIN32
@@ -31,6 +31,18 @@
 
 #include "BoxTime.h"
 #include "Logging.h"
+#include "Thread.h"
+
+// Held while logging, or changing the loggers, as worker threads log too.
+// Recursive, as a logger may log (or throw an exception, which logs).
+// Created on first use, which is before any threads are started, and
+// never destroyed, as loggers may be added and removed by other static
+// objects.
+static Mutex &GetLoggingMutex()
+{
+	static Mutex *spMutex = new Mutex(true);
+	return *spMutex;
+}
 
 bool Logging::sLogToSyslog  = false;
 bool Logging::sLogToConsole = false;
@@ -112,6 +124,7 @@ void Logging::FilterSyslog(Log::Level level)
 
 void Logging::Add(Logger* pNewLogger)
 {
+	MutexLock lock(GetLoggingMutex());
 	for (std::vector<Logger*>::iterator i = sLoggers.begin();
 		i != sLoggers.end(); i++)
 	{
@@ -126,6 +139,7 @@ void Logging::Add(Logger* pNewLogger)
 
 void Logging::Remove(Logger* pOldLogger)
 {
+	MutexLock lock(GetLoggingMutex());
 	for (std::vector<Logger*>::iterator i = sLoggers.begin();
 		i != sLoggers.end(); i++)
 	{
@@ -141,6 +155,7 @@ void Logging::Log(Log::Level level, const std::string& file, int line,
 	const std::string& function, const Log::Category& category,
 	const std::string& message)
 {
+	MutexLock lock(GetLoggingMutex());
 	std::string newMessage;
 	
 	if (sContextSet)
@@ -166,6 +181,7 @@ void Logging::LogToSyslog(Log::Level level, const std::string& rFile, int line,
 	const std::string& function, const Log::Category& category,
 	const std::string& message)
 {
+	MutexLock lock(GetLoggingMutex());
 	if (!sLogToSyslog)
 	{
 		return;
@@ -185,6 +201,7 @@ void Logging::LogToSyslog(Log::Level level, const std::string& rFile, int line,
 
 void Logging::SetContext(std::string context)
 {
+	MutexLock lock(GetLoggingMutex());
 	sContext = context;
 	sContextSet = true;
 }
@@ -208,6 +225,7 @@ Log::Level Logging::GetNamedLevel(const std::string& rName)
 
 void Logging::ClearContext()
 {
+	MutexLock lock(GetLoggingMutex());
 	sContextSet = false;
 }
 
@@ -0,0 +1,449 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    MemoryMappedFile.cpp
+//		Purpose: Read-only windowed memory mapping of an open file
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SIGNAL_H
+	#include <signal.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && !defined(WIN32)
+	#include <sys/mman.h>
+
+	// Faults in truncated files must be caught, which needs to know
+	// where they happened, and anonymous memory to put there instead
+	#if defined(SA_SIGINFO) && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+		#define MEMORYMAPPEDFILE_SUPPORTED
+		#ifndef MAP_ANONYMOUS
+			#define MAP_ANONYMOUS MAP_ANON
+		#endif
+	#endif
+#endif
+
+#include "CommonException.h"
+#include "FileModificationTime.h"
+#include "FileStream.h"
+#include "Logging.h"
+#include "MemoryMappedFile.h"
+#include "Thread.h"
+
+#include "MemLeakFindOn.h"
+
+bool MemoryMappedFile::msEnabled = true;
+
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	// The windows which are mapped, so that the fault handler can tell
+	// whether a fault is in one of them. Only changed with
+	// sWindowsMutex locked, and only read by the handler, which can't
+	// lock anything.
+	typedef struct
+	{
+		char * volatile mpStart;
+		volatile size_t mLength;
+		volatile sig_atomic_t mFaulted;
+	} MappedWindow;
+	static MappedWindow sWindows[MEMORYMAPPEDFILE_MAX_WINDOWS];
+	static Mutex sWindowsMutex;
+	static bool sFaultHandlerInstalled = false;
+	static struct sigaction sPreviousFaultAction;
+	static size_t sPageSize = 0;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static MemoryMappedFileFaultHandler(int, siginfo_t *,
+//			 void *)
+//		Purpose: SIGBUS handler. If the fault is in a mapped window,
+//			 the file has been truncated under it, so replace the
+//			 rest of the window with zeros, which lets the access
+//			 carry on, and flag it so that the owner knows the data
+//			 is wrong. Any other fault is passed on to whatever
+//			 handled it before.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static void MemoryMappedFileFaultHandler(int Signal, siginfo_t *pInfo,
+	void *pContext)
+{
+	// Only faults have an address, not signals sent by kill()
+	char *paddress = (pInfo->si_code > 0) ? (char *)pInfo->si_addr : 0;
+	for(int w = 0; paddress != 0 && w < MEMORYMAPPEDFILE_MAX_WINDOWS; ++w)
+	{
+		char *pstart = sWindows[w].mpStart;
+		if(pstart == 0 || paddress < pstart ||
+			paddress >= pstart + sWindows[w].mLength)
+		{
+			continue;
+		}
+
+		char *ppage = pstart + (((paddress - pstart) / sPageSize) *
+			sPageSize);
+		size_t length = (pstart + sWindows[w].mLength) - ppage;
+		if(::mmap(ppage, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS |
+			MAP_FIXED, -1, 0) != MAP_FAILED)
+		{
+			sWindows[w].mFaulted = 1;
+			return;
+		}
+		break;
+	}
+
+	// Not ours, so pass it on to the handler which was there before,
+	// leaving this one installed for the next fault which is ours
+	if(sPreviousFaultAction.sa_flags & SA_SIGINFO)
+	{
+		if(sPreviousFaultAction.sa_sigaction != 0)
+		{
+			sPreviousFaultAction.sa_sigaction(Signal, pInfo,
+				pContext);
+			return;
+		}
+	}
+	else if(sPreviousFaultAction.sa_handler != SIG_DFL &&
+		sPreviousFaultAction.sa_handler != SIG_IGN)
+	{
+		sPreviousFaultAction.sa_handler(Signal);
+		return;
+	}
+
+	// The default action, which is also what happens to an ignored fault,
+	// is to die. The signal is blocked while this runs, so unblock it to
+	// die now, rather than after returning to the faulting access.
+	::signal(SIGBUS, SIG_DFL);
+	sigset_t bus;
+	sigemptyset(&bus);
+	sigaddset(&bus, SIGBUS);
+	::pthread_sigmask(SIG_UNBLOCK, &bus, 0);
+	::raise(SIGBUS);
+	::abort();
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::MemoryMappedFile(FileStream &, int64_t,
+//			 bool)
+//		Purpose: Constructor. Records the size and modification time of
+//			 the file, but doesn't map anything yet. The FileStream
+//			 must outlive this object. Sequential should be false if
+//			 the data will be read in no particular order.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+MemoryMappedFile::MemoryMappedFile(FileStream &rFile, int64_t WindowSize,
+	bool Sequential)
+: mHandle(rFile.GetOSFileHandle()),
+  mCanMap(false),
+  mFileSize(0),
+  mModificationTime(0),
+  mWindowSize(WindowSize),
+  mSequential(Sequential),
+  mpMapping(0),
+  mMappingOffset(0),
+  mMappingLength(0),
+  mWindowSlot(-1),
+  mFaulted(false)
+{
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	if(!msEnabled)
+	{
+		return;
+	}
+
+	EMU_STRUCT_STAT st;
+	if(EMU_FSTAT(mHandle, &st) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to stat " << rFile.GetFileName() <<
+			" to map it, reading it instead");
+		return;
+	}
+
+	// Only regular files can be relied on to be the size they say
+	if(!S_ISREG(st.st_mode) || st.st_size <= 0)
+	{
+		return;
+	}
+
+	mFileSize = st.st_size;
+	mModificationTime = FileModificationTime(st);
+
+	// Round the window size to whole pages
+	int64_t pageSize = ::sysconf(_SC_PAGESIZE);
+	if(pageSize <= 0)
+	{
+		return;
+	}
+	mWindowSize = ((mWindowSize + pageSize - 1) / pageSize) * pageSize;
+
+	mCanMap = true;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::~MemoryMappedFile()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+MemoryMappedFile::~MemoryMappedFile()
+{
+	Unmap();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::IsSupported()
+//		Purpose: Static. Whether files can be mapped on this platform.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool MemoryMappedFile::IsSupported()
+{
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::GetData(int64_t, int64_t)
+//		Purpose: Returns a pointer to Length bytes of the file at
+//			 Offset, mapping a new window if the current one doesn't
+//			 cover them. Returns 0 if the file has changed or the map
+//			 failed, after which IsMapped() returns false. The pointer
+//			 is only valid until the next call.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const uint8_t *MemoryMappedFile::GetData(int64_t Offset, int64_t Length)
+{
+	if(!mCanMap)
+	{
+		return 0;
+	}
+
+	ASSERT(Offset >= 0 && Length >= 0);
+	if(Offset + Length > mFileSize)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+
+	if(CheckFault())
+	{
+		return 0;
+	}
+
+	if(mpMapping != 0 && Offset >= mMappingOffset &&
+		(Offset + Length) <= (mMappingOffset + mMappingLength))
+	{
+		return mpMapping + (Offset - mMappingOffset);
+	}
+
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	Unmap();
+
+	// Accessing a mapping beyond the end of a file which has been
+	// truncated faults, so check the file every time the window moves,
+	// and give up on mapping it at the first sign of change. A file
+	// truncated after that is caught by the fault handler.
+	if(HasChanged())
+	{
+		BOX_TRACE("File changed while mapped, reading it instead");
+		mCanMap = false;
+		return 0;
+	}
+
+	// Start on a page boundary, and map a whole window, unless
+	// the caller wants more than that
+	int64_t pageSize = ::sysconf(_SC_PAGESIZE);
+	int64_t start = (Offset / pageSize) * pageSize;
+	int64_t length = mWindowSize;
+	if(length < (Offset + Length) - start)
+	{
+		length = (Offset + Length) - start;
+	}
+	if(start + length > mFileSize)
+	{
+		length = mFileSize - start;
+	}
+
+	void *pmap = ::mmap(0, length, PROT_READ, MAP_SHARED, mHandle, start);
+	if(pmap == MAP_FAILED)
+	{
+		BOX_TRACE(BOX_SYS_ERROR_MESSAGE("Failed to map " << length <<
+			" bytes of file at offset " << start << ", reading it instead"));
+		mCanMap = false;
+		return 0;
+	}
+
+	// Register the window with the fault handler, installing it first
+	// if this is the first window
+	{
+		MutexLock lock(sWindowsMutex);
+
+		if(!sFaultHandlerInstalled)
+		{
+			sPageSize = pageSize;
+			struct sigaction newact;
+			newact.sa_sigaction = MemoryMappedFileFaultHandler;
+			newact.sa_flags = SA_SIGINFO;
+			sigemptyset(&newact.sa_mask);
+			if(::sigaction(SIGBUS, &newact, &sPreviousFaultAction) != 0)
+			{
+				BOX_LOG_SYS_WARNING("Failed to install the "
+					"handler for faults in mapped files, "
+					"reading them instead");
+				::munmap(pmap, length);
+				mCanMap = false;
+				return 0;
+			}
+			sFaultHandlerInstalled = true;
+		}
+
+		for(int w = 0; w < MEMORYMAPPEDFILE_MAX_WINDOWS; ++w)
+		{
+			if(sWindows[w].mpStart == 0)
+			{
+				sWindows[w].mLength = length;
+				sWindows[w].mFaulted = 0;
+				sWindows[w].mpStart = (char *)pmap;
+				mWindowSlot = w;
+				break;
+			}
+		}
+	}
+
+	if(mWindowSlot == -1)
+	{
+		BOX_TRACE("Too many files mapped, reading it instead");
+		::munmap(pmap, length);
+		mCanMap = false;
+		return 0;
+	}
+
+#ifdef HAVE_MADVISE
+	// Tell the kernel to read ahead aggressively and drop pages behind,
+	// or not to bother reading ahead for random access
+	::madvise(pmap, length, mSequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+#endif
+
+	mpMapping = (uint8_t *)pmap;
+	mMappingOffset = start;
+	mMappingLength = length;
+
+	return mpMapping + (Offset - mMappingOffset);
+#else
+	return 0;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::Unmap()
+//		Purpose: Unmaps the current window, if there is one.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void MemoryMappedFile::Unmap()
+{
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	if(mpMapping != 0)
+	{
+		// Remember whether it faulted, and stop the handler looking
+		// at it before it goes
+		CheckFault();
+		{
+			MutexLock lock(sWindowsMutex);
+			sWindows[mWindowSlot].mpStart = 0;
+			mWindowSlot = -1;
+		}
+
+		::munmap(mpMapping, mMappingLength);
+		mpMapping = 0;
+		mMappingOffset = 0;
+		mMappingLength = 0;
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::HasFaulted()
+//		Purpose: Has the file been truncated under a mapped window,
+//			 so that some of the data returned by GetData() was
+//			 zeros instead of the file's contents? If so, the file
+//			 isn't mapped any more.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool MemoryMappedFile::HasFaulted()
+{
+	CheckFault();
+	return mFaulted;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::CheckFault()
+//		Purpose: Private. Notices if the current window has faulted,
+//			 and stops mapping the file if so. Returns mFaulted.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool MemoryMappedFile::CheckFault()
+{
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	if(!mFaulted && mWindowSlot != -1 && sWindows[mWindowSlot].mFaulted)
+	{
+		BOX_TRACE("File truncated while mapped, reading it instead");
+		mFaulted = true;
+		mCanMap = false;
+	}
+#endif
+	return mFaulted;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MemoryMappedFile::HasChanged()
+//		Purpose: Private. Has the file's size or modification time
+//			 changed since it was opened?
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool MemoryMappedFile::HasChanged()
+{
+#ifdef MEMORYMAPPEDFILE_SUPPORTED
+	EMU_STRUCT_STAT st;
+	if(EMU_FSTAT(mHandle, &st) != 0)
+	{
+		return true;
+	}
+
+	return (st.st_size != mFileSize ||
+		FileModificationTime(st) != mModificationTime);
+#else
+	return true;
+#endif
+}
@@ -0,0 +1,86 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    MemoryMappedFile.h
+//		Purpose: Read-only windowed memory mapping of an open file
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef MEMORYMAPPEDFILE__H
+#define MEMORYMAPPEDFILE__H
+
+#include "BoxTime.h"
+
+class FileStream;
+
+// Largest window of a file to map at once, to stay within the address
+// space budget on 32 bit systems
+#define MEMORYMAPPEDFILE_DEFAULT_WINDOW_SIZE \
+	((sizeof(void *) >= 8)?(256*1024*1024):(32*1024*1024))
+
+// How many windows can be mapped at once, by all threads. Files are read
+// instead when there are no more.
+#define MEMORYMAPPEDFILE_MAX_WINDOWS	64
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    MemoryMappedFile
+//		Purpose: Maps windows of a regular file into memory, so that its
+//			 data can be used directly from the page cache rather than
+//			 copied into a buffer. If the file can't be mapped, or is
+//			 seen to change while it's mapped, IsMapped() returns false
+//			 and the caller should read the file through the stream.
+//			 If the file is truncated while a window is mapped,
+//			 touching the part which has gone raises SIGBUS, which
+//			 is caught, and the rest of the window is replaced with
+//			 zeros. HasFaulted() then returns true, and the caller
+//			 must not use anything it got from the mapping.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class MemoryMappedFile
+{
+public:
+	MemoryMappedFile(FileStream &rFile,
+		int64_t WindowSize = MEMORYMAPPEDFILE_DEFAULT_WINDOW_SIZE,
+		bool Sequential = true);
+	~MemoryMappedFile();
+private:
+	// no copying
+	MemoryMappedFile(const MemoryMappedFile &);
+	MemoryMappedFile &operator=(const MemoryMappedFile &);
+public:
+
+	bool IsMapped() const {return mCanMap;}
+	bool HasFaulted();
+	int64_t GetFileSize() const {return mFileSize;}
+	int64_t GetWindowSize() const {return mWindowSize;}
+
+	const uint8_t *GetData(int64_t Offset, int64_t Length);
+	void Unmap();
+
+	static bool IsSupported();
+	static void SetEnabled(bool Enabled) {msEnabled = Enabled;}
+
+private:
+	bool HasChanged();
+	bool CheckFault();
+
+	tOSFileHandle mHandle;
+	bool mCanMap;
+	int64_t mFileSize;
+	box_time_t mModificationTime;
+	int64_t mWindowSize;
+	bool mSequential;
+	uint8_t *mpMapping;
+	int64_t mMappingOffset;
+	int64_t mMappingLength;
+	int mWindowSlot;
+	bool mFaulted;
+
+	static bool msEnabled;
+};
+
+#endif // MEMORYMAPPEDFILE__H
@@ -0,0 +1,556 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ReadAheadStream.cpp
+//		Purpose: Reads a file ahead of its reader, in another thread
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_FCNTL_H
+	#include <fcntl.h>
+#endif
+
+#include <memory>
+#include <new>
+#include <sstream>
+
+#include "CommonException.h"
+#include "FileStream.h"
+#include "Logging.h"
+#include "ReadAheadStream.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ReadAheadThread
+//		Purpose: Thread which fills the buffers of a ReadAheadStream
+//			 until it's stopped or reaches the end of the file
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ReadAheadThread : public Thread
+{
+public:
+	ReadAheadThread(ReadAheadStream &rStream)
+	: mrStream(rStream)
+	{
+	}
+
+	~ReadAheadThread()
+	{
+		Join();
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrStream.ReadAhead();
+	}
+
+private:
+	ReadAheadStream &mrStream;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::ReadAheadStream(FileStream &, int, int)
+//		Purpose: Constructor. The reader thread isn't started until
+//			 the first Read().
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+ReadAheadStream::ReadAheadStream(FileStream &rSource, int BufferSize,
+	int Buffers)
+: mrSource(rSource),
+  mBufferSize(BufferSize),
+  mpReader(0),
+  mReadDirectly(!Thread::IsSupported()),
+  mPosition(rSource.GetPosition()),
+  mOffsetInFirst(0),
+  mFirst(0),
+  mFilled(0),
+  mEndOfFile(false),
+  mReaderFailed(false),
+  mStopping(false)
+{
+	ASSERT(BufferSize > 0);
+	ASSERT(Buffers > 0);
+
+	if(!mReadDirectly)
+	{
+		try
+		{
+			for(int b = 0; b < Buffers; ++b)
+			{
+				mBuffers.push_back((uint8_t *)::malloc(BufferSize));
+				if(mBuffers.back() == 0)
+				{
+					throw std::bad_alloc();
+				}
+			}
+		}
+		catch(...)
+		{
+			for(size_t b = 0; b < mBuffers.size(); ++b)
+			{
+				::free(mBuffers[b]);
+			}
+			throw;
+		}
+		mBufferFill.resize(Buffers, 0);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::~ReadAheadStream()
+//		Purpose: Destructor. Stops the reader thread, and leaves the
+//			 file at the position of the reader of this stream.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+ReadAheadStream::~ReadAheadStream()
+{
+	try
+	{
+		StopReader();
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to stop reading ahead in " << ToString() <<
+			": " << e.what());
+	}
+
+	for(size_t b = 0; b < mBuffers.size(); ++b)
+	{
+		::free(mBuffers[b]);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::ToString()
+//		Purpose: Describes the stream, for log messages
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::string ReadAheadStream::ToString() const
+{
+	std::ostringstream buf;
+	buf << "read ahead of " << mrSource.ToString();
+	return buf.str();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::AdviseWillNeed(tOSFileHandle,
+//			 int64_t, int64_t)
+//		Purpose: Static. Tells the kernel that part of a file will be
+//			 read soon, so it can start reading it now. Does
+//			 nothing where that isn't supported.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadAheadStream::AdviseWillNeed(tOSFileHandle Handle, int64_t Offset,
+	int64_t Length)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	// Only a hint, so failures don't matter
+	::posix_fadvise(Handle, Offset, Length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::StartReader()
+//		Purpose: Starts the reader thread from the current position.
+//			 Returns false if it can't be started.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool ReadAheadStream::StartReader()
+{
+	ASSERT(mpReader == 0);
+	AdviseWillNeed(mrSource.GetOSFileHandle(), mPosition,
+		(int64_t)mBufferSize * mBuffers.size());
+
+	try
+	{
+		std::auto_ptr<ReadAheadThread> apreader(
+			new ReadAheadThread(*this));
+		apreader->Start();
+		mpReader = apreader.release();
+	}
+	catch(CommonException &e)
+	{
+		if(e.GetSubType() != CommonException::ThreadCreateFailed)
+		{
+			throw;
+		}
+		BOX_WARNING("Failed to start a thread to read ahead in " <<
+			mrSource.ToString() << ", reading it directly: " <<
+			e.GetMessage());
+		return false;
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::StopReader()
+//		Purpose: Stops the reader thread if it's running, throws away
+//			 the data read ahead, and moves the file back to the
+//			 position of the reader of this stream
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadAheadStream::StopReader()
+{
+	if(mpReader == 0)
+	{
+		return;
+	}
+
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mBufferEmptied.Broadcast();
+	}
+
+	// Joins the thread
+	delete mpReader;
+	mpReader = 0;
+
+	mFirst = 0;
+	mFilled = 0;
+	mOffsetInFirst = 0;
+	mEndOfFile = false;
+	mReaderFailed = false;
+	mStopping = false;
+
+	mrSource.Seek(mPosition, IOStream::SeekType_Absolute);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::ReadAhead()
+//		Purpose: Run by the reader thread. Fills free buffers in turn
+//			 until stopped or the end of the file is reached,
+//			 asking the kernel to fetch the data which will be
+//			 wanted after the buffers are full.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadAheadStream::ReadAhead()
+{
+	int64_t windowSize = (int64_t)mBufferSize * mBuffers.size();
+	pos_type position = mrSource.GetPosition();
+
+	try
+	{
+		while(true)
+		{
+			size_t index;
+			{
+				MutexLock lock(mMutex);
+				while(!mStopping && mFilled == mBuffers.size())
+				{
+					mBufferEmptied.Wait(mMutex,
+						READAHEADSTREAM_POLL_INTERVAL);
+				}
+				if(mStopping)
+				{
+					return;
+				}
+				index = (mFirst + mFilled) % mBuffers.size();
+			}
+
+			// The buffer isn't used by anyone else until it's
+			// counted as filled, so no lock is needed to fill it.
+			AdviseWillNeed(mrSource.GetOSFileHandle(),
+				position + windowSize, mBufferSize);
+			int bytes = 0;
+			bool full = mrSource.ReadFullBuffer(mBuffers[index],
+				mBufferSize, &bytes);
+			position += bytes;
+
+			MutexLock lock(mMutex);
+			mBufferFill[index] = bytes;
+			if(bytes > 0)
+			{
+				mFilled++;
+			}
+			if(!full)
+			{
+				mEndOfFile = true;
+			}
+			mBufferFilled.Signal();
+
+			if(mEndOfFile)
+			{
+				return;
+			}
+		}
+	}
+	catch(...)
+	{
+		// The reader of this stream goes back to reading the file
+		// itself, which will throw again if it's still a problem
+		MutexLock lock(mMutex);
+		mReaderFailed = true;
+		mBufferFilled.Signal();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::UseBuffered(void *, int, bool)
+//		Purpose: Copies up to NBytes of the data read ahead into
+//			 the buffer, or skips them if it's null. If Wait is
+//			 set and nothing is buffered, waits for the reader to
+//			 fill a buffer or stop. Returns the number of bytes
+//			 used, or -1 if the reader failed.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int ReadAheadStream::UseBuffered(void *pBuffer, int NBytes, bool Wait)
+{
+	size_t filled;
+	{
+		MutexLock lock(mMutex);
+		while(Wait && mFilled == 0 && !mEndOfFile && !mReaderFailed)
+		{
+			mBufferFilled.Wait(mMutex, READAHEADSTREAM_POLL_INTERVAL);
+		}
+		if(mFilled == 0 && mReaderFailed)
+		{
+			return -1;
+		}
+		filled = mFilled;
+	}
+
+	// Only this thread moves mFirst on, and the reader doesn't touch
+	// buffers which are filled, so they can be used without the lock.
+	int used = 0;
+	size_t emptied = 0;
+	while(used < NBytes && emptied < filled)
+	{
+		size_t index = (mFirst + emptied) % mBuffers.size();
+		int bytes = mBufferFill[index] - mOffsetInFirst;
+		if(bytes > NBytes - used)
+		{
+			bytes = NBytes - used;
+		}
+
+		if(pBuffer != 0)
+		{
+			::memcpy((uint8_t *)pBuffer + used,
+				mBuffers[index] + mOffsetInFirst, bytes);
+		}
+		used += bytes;
+		mOffsetInFirst += bytes;
+
+		if(mOffsetInFirst == mBufferFill[index])
+		{
+			mOffsetInFirst = 0;
+			emptied++;
+		}
+	}
+
+	if(emptied > 0)
+	{
+		MutexLock lock(mMutex);
+		mFirst = (mFirst + emptied) % mBuffers.size();
+		mFilled -= emptied;
+		mBufferEmptied.Signal();
+	}
+
+	mPosition += used;
+	return used;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::Read(void *, int, int)
+//		Purpose: Reads bytes from the data read ahead, starting the
+//			 reader thread on the first call
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int ReadAheadStream::Read(void *pBuffer, int NBytes, int Timeout)
+{
+	if(!mReadDirectly && mpReader == 0 && !StartReader())
+	{
+		mReadDirectly = true;
+	}
+
+	if(!mReadDirectly)
+	{
+		int bytes = UseBuffered(pBuffer, NBytes, true);
+		if(bytes >= 0)
+		{
+			return bytes;
+		}
+
+		BOX_WARNING("Failed to read ahead in " << mrSource.ToString() <<
+			", reading it directly");
+		StopReader();
+		mReadDirectly = true;
+	}
+
+	int bytes = mrSource.Read(pBuffer, NBytes, Timeout);
+	mPosition += bytes;
+	return bytes;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::BytesLeftToRead()
+//		Purpose: Returns the number of bytes after the current
+//			 position, according to the size of the file now
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+IOStream::pos_type ReadAheadStream::BytesLeftToRead()
+{
+	if(mpReader == 0)
+	{
+		return mrSource.BytesLeftToRead();
+	}
+
+	// The file's own position belongs to the reader thread
+	EMU_STRUCT_STAT st;
+	if(EMU_FSTAT(mrSource.GetOSFileHandle(), &st) != 0)
+	{
+		BOX_LOG_SYS_ERROR(BOX_FILE_MESSAGE("Failed to stat file",
+			mrSource.GetFileName()));
+		THROW_EXCEPTION(CommonException, OSFileError)
+	}
+
+	return (st.st_size > mPosition) ? (st.st_size - mPosition) : 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::Write(void *, int, int)
+//		Purpose: Not supported, this stream is only for reading
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadAheadStream::Write(const void *pBuffer, int NBytes, int Timeout)
+{
+	THROW_EXCEPTION(CommonException, NotSupported)
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::GetPosition()
+//		Purpose: Returns the position of the reader of this stream,
+//			 not of the reader thread
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+IOStream::pos_type ReadAheadStream::GetPosition() const
+{
+	return mPosition;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::Seek(pos_type, int)
+//		Purpose: Seeks within the file. Short seeks forwards skip
+//			 over data already read ahead, others throw it away
+//			 and start reading ahead again on the next Read().
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadAheadStream::Seek(pos_type Offset, int SeekType)
+{
+	if(SeekType == IOStream::SeekType_End)
+	{
+		StopReader();
+		mrSource.Seek(Offset, SeekType);
+		mPosition = mrSource.GetPosition();
+		return;
+	}
+
+	pos_type target = (SeekType == IOStream::SeekType_Relative)
+		? (mPosition + Offset) : Offset;
+
+	if(mpReader != 0 && target >= mPosition)
+	{
+		while(mPosition < target)
+		{
+			pos_type wanted = target - mPosition;
+			int bytes = UseBuffered(0, (wanted > mBufferSize)
+				? mBufferSize : (int)wanted, false);
+			if(bytes <= 0)
+			{
+				break;
+			}
+		}
+		if(mPosition == target)
+		{
+			return;
+		}
+	}
+
+	StopReader();
+	mrSource.Seek(target, IOStream::SeekType_Absolute);
+	mPosition = target;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::StreamDataLeft()
+//		Purpose: Is there any more data to read?
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool ReadAheadStream::StreamDataLeft()
+{
+	if(mpReader == 0)
+	{
+		return mrSource.StreamDataLeft();
+	}
+
+	MutexLock lock(mMutex);
+	return mFilled > 0 || !mEndOfFile;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadAheadStream::StreamClosed()
+//		Purpose: Is the stream closed?
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool ReadAheadStream::StreamClosed()
+{
+	return mrSource.StreamClosed();
+}
@@ -0,0 +1,98 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ReadAheadStream.h
+//		Purpose: Reads a file ahead of its reader, in another thread
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef READAHEADSTREAM__H
+#define READAHEADSTREAM__H
+
+#include <string>
+#include <vector>
+
+#include "IOStream.h"
+#include "Thread.h"
+
+class FileStream;
+class ReadAheadThread;
+
+// Size and number of buffers which are read ahead
+#define READAHEADSTREAM_DEFAULT_BUFFER_SIZE		(1024*1024)
+#define READAHEADSTREAM_DEFAULT_BUFFERS			3
+
+// How often threads waiting for each other check whether to give up
+#define READAHEADSTREAM_POLL_INTERVAL			1000
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ReadAheadStream
+//		Purpose: Reads a file sequentially, with a thread filling the
+//			 next few buffers while the data already read is being
+//			 used, and the kernel told to fetch the data after
+//			 that. Seeking outside the data read ahead throws it
+//			 away and starts again. The FileStream must outlive
+//			 this object, and must not be used while it exists.
+//			 Without threads, it reads the file directly.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ReadAheadStream : public IOStream
+{
+public:
+	ReadAheadStream(FileStream &rSource,
+		int BufferSize = READAHEADSTREAM_DEFAULT_BUFFER_SIZE,
+		int Buffers = READAHEADSTREAM_DEFAULT_BUFFERS);
+	virtual ~ReadAheadStream();
+private:
+	// no copying
+	ReadAheadStream(const ReadAheadStream &);
+	ReadAheadStream &operator=(const ReadAheadStream &);
+public:
+
+	virtual int Read(void *pBuffer, int NBytes,
+		int Timeout = IOStream::TimeOutInfinite);
+	virtual pos_type BytesLeftToRead();
+	virtual void Write(const void *pBuffer, int NBytes,
+		int Timeout = IOStream::TimeOutInfinite);
+	virtual pos_type GetPosition() const;
+	virtual void Seek(pos_type Offset, int SeekType);
+	virtual bool StreamDataLeft();
+	virtual bool StreamClosed();
+
+	std::string ToString() const;
+
+	static void AdviseWillNeed(tOSFileHandle Handle, int64_t Offset,
+		int64_t Length);
+
+private:
+	friend class ReadAheadThread;
+	void ReadAhead();
+	bool StartReader();
+	void StopReader();
+	int UseBuffered(void *pBuffer, int NBytes, bool Wait);
+
+	FileStream &mrSource;
+	int mBufferSize;
+	std::vector<uint8_t *> mBuffers;	// used as a ring
+	std::vector<int> mBufferFill;		// bytes in each buffer
+	ReadAheadThread *mpReader;
+	bool mReadDirectly;					// no reader, use the file
+	pos_type mPosition;					// of the reader of this stream
+	int mOffsetInFirst;					// bytes used in the first buffer
+
+	// Shared with the reader thread, protected by mMutex
+	Mutex mMutex;
+	Condition mBufferFilled;
+	Condition mBufferEmptied;
+	size_t mFirst;						// oldest buffer filled
+	size_t mFilled;						// buffers filled and not used up
+	bool mEndOfFile;					// the reader has reached it
+	bool mReaderFailed;
+	bool mStopping;
+};
+
+#endif // READAHEADSTREAM__H
@@ -46,7 +46,39 @@ ReadLoggingStream::ReadLoggingStream(IOStream& rSource, Logger& rLogger)
 int ReadLoggingStream::Read(void *pBuffer, int NBytes, int Timeout)
 {
 	int numBytesRead = mrSource.Read(pBuffer, NBytes, Timeout);
+	LogRead(numBytesRead);
+	return numBytesRead;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadLoggingStream::SkipRead(int)
+//		Purpose: Moves past bytes which the caller has read from the
+//			 source by other means (eg a memory mapping), logging
+//			 them as if they had been read through this stream.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void ReadLoggingStream::SkipRead(int NBytes)
+{
+	mrSource.Seek(NBytes, IOStream::SeekType_Relative);
+	LogRead(NBytes);
+}
+
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ReadLoggingStream::LogRead(int)
+//		Purpose: Private. Updates the position and logs progress
+//			 after reading some bytes.
+//		Created: 2007/01/16
+//
+// --------------------------------------------------------------------------
+void ReadLoggingStream::LogRead(int numBytesRead)
+{
 	if (numBytesRead > 0)
 	{
 		mTotalRead += numBytesRead;
@@ -69,8 +101,6 @@ int ReadLoggingStream::Read(void *pBuffer, int NBytes, int Timeout)
 		// box_time_t remain  = finish - elapsed;
 		mrLogger.Log(numBytesRead, mOffset, mLength, elapsed, finish);
 	}
-	
-	return numBytesRead;
 }
 
 
@@ -38,6 +38,7 @@ public:
 	ReadLoggingStream(IOStream& rSource, Logger& rLogger);
 	
 	virtual int Read(void *pBuffer, int NBytes, int Timeout = IOStream::TimeOutInfinite);
+	void SkipRead(int NBytes);
 	virtual pos_type BytesLeftToRead();
 	virtual void Write(const void *pBuffer, int NBytes,
 		int Timeout = IOStream::TimeOutInfinite);
@@ -49,6 +50,7 @@ public:
 	virtual bool StreamClosed();
 
 private:
+	void LogRead(int numBytesRead);
 	ReadLoggingStream(const ReadLoggingStream &rToCopy)
 	: mrSource(rToCopy.mrSource), mrLogger(rToCopy.mrLogger)
 	{ /* do not call */ }
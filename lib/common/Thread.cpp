@@ -0,0 +1,451 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.cpp
+//		Purpose: Minimal worker threads and mutexes
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SIGNAL_H
+	#include <signal.h>
+#endif
+
+#ifdef HAVE_TIME_H
+	#include <time.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+	#include <sys/time.h>
+#endif
+
+#include "BoxException.h"
+#include "CommonException.h"
+#include "Thread.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Mutex(bool)
+//		Purpose: Constructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Mutex::Mutex(bool Recursive)
+{
+#ifdef BOX_THREADS_SUPPORTED
+	pthread_mutexattr_t attributes;
+	if(::pthread_mutexattr_init(&attributes) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+	int result = ::pthread_mutexattr_settype(&attributes,
+		Recursive ? PTHREAD_MUTEX_RECURSIVE : PTHREAD_MUTEX_DEFAULT);
+	if(result == 0)
+	{
+		result = ::pthread_mutex_init(&mMutex, &attributes);
+	}
+	::pthread_mutexattr_destroy(&attributes);
+	if(result != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::~Mutex()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Mutex::~Mutex()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_mutex_destroy(&mMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Lock()
+//		Purpose: Waits for and takes the lock
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Mutex::Lock()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	if(::pthread_mutex_lock(&mMutex) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Unlock()
+//		Purpose: Releases the lock
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Mutex::Unlock()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_mutex_unlock(&mMutex);
+#endif
+}
+
+#ifdef BOX_THREADS_SUPPORTED
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static GetTimeoutTime(int, struct timespec &)
+//		Purpose: Works out the absolute time to wait until, for a
+//			 timeout starting now.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static void GetTimeoutTime(int TimeoutMilliseconds, struct timespec &rUntil)
+{
+	struct timeval now;
+	::gettimeofday(&now, NULL);
+	int64_t nanoseconds = ((int64_t)now.tv_usec * 1000) +
+		((int64_t)TimeoutMilliseconds * 1000000);
+	rUntil.tv_sec = now.tv_sec + (nanoseconds / 1000000000);
+	rUntil.tv_nsec = nanoseconds % 1000000000;
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Condition::Condition()
+//		Purpose: Constructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Condition::Condition()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	if(::pthread_cond_init(&mCondition, NULL) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Condition::~Condition()
+//		Purpose: Destructor
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Condition::~Condition()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_cond_destroy(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Condition::Wait(Mutex &, int)
+//		Purpose: Releases the mutex, which must be locked, and waits
+//			 up to the given time to be woken by Signal() or
+//			 Broadcast(), then locks it again. Returns false if
+//			 the time ran out. Callers must check what they were
+//			 waiting for themselves, as waits can end early.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool Condition::Wait(Mutex &rMutex, int TimeoutMilliseconds)
+{
+#ifdef BOX_THREADS_SUPPORTED
+	struct timespec until;
+	GetTimeoutTime(TimeoutMilliseconds, until);
+	return ::pthread_cond_timedwait(&mCondition, &rMutex.mMutex,
+		&until) != ETIMEDOUT;
+#else
+	return true;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Condition::Signal()
+//		Purpose: Wakes one waiting thread
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Condition::Signal()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_cond_signal(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Condition::Broadcast()
+//		Purpose: Wakes all waiting threads
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Condition::Broadcast()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_cond_broadcast(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Thread()
+//		Purpose: Constructor. The thread isn't started until Start()
+//			 is called.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Thread::Thread()
+: mStarted(false),
+  mFinished(false),
+  mFailed(false)
+{
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_mutex_init(&mFinishedMutex, NULL);
+	::pthread_cond_init(&mFinishedCondition, NULL);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::~Thread()
+//		Purpose: Destructor. By now the derived class has gone, so
+//			 the thread must already have been joined.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+Thread::~Thread()
+{
+#ifndef BOX_RELEASE_BUILD
+	// ASSERT would throw, which a destructor can't do
+	if(mStarted)
+	{
+		BoxDebugAssertFailed("!mStarted", __FILE__, __LINE__);
+		::abort();
+	}
+#endif
+#ifdef BOX_THREADS_SUPPORTED
+	::pthread_cond_destroy(&mFinishedCondition);
+	::pthread_mutex_destroy(&mFinishedMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::IsSupported()
+//		Purpose: Static. Can threads be started on this platform? If
+//			 not, Start() runs Run() before it returns.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool Thread::IsSupported()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::GetProcessorCount()
+//		Purpose: Static. Returns the number of processors online, or
+//			 1 if that can't be found out.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int Thread::GetProcessorCount()
+{
+#if defined(BOX_THREADS_SUPPORTED) && defined(_SC_NPROCESSORS_ONLN)
+	long processors = ::sysconf(_SC_NPROCESSORS_ONLN);
+	if(processors > 0)
+	{
+		return (int)processors;
+	}
+#endif
+	return 1;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Start()
+//		Purpose: Starts the thread running. Throws an exception if it
+//			 can't be created.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Thread::Start()
+{
+	ASSERT(!mStarted);
+	mFinished = false;
+	mFailed = false;
+	mErrorMessage.clear();
+
+#ifdef BOX_THREADS_SUPPORTED
+	// The new thread inherits the signal mask, so block everything
+	// while it's created, to leave signals to the other threads.
+	sigset_t allSignals, oldSignals;
+	sigfillset(&allSignals);
+	::pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	int result = ::pthread_create(&mThread, NULL, ThreadFunction, this);
+	::pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if(result != 0)
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, ThreadCreateFailed,
+			strerror(result))
+	}
+	mStarted = true;
+#else
+	RunAndCatch();
+	mFinished = true;
+#endif
+}
+
+#ifdef BOX_THREADS_SUPPORTED
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::ThreadFunction(void *)
+//		Purpose: Static. Entry point of the new thread.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void *Thread::ThreadFunction(void *pThread)
+{
+	Thread *pthis = (Thread *)pThread;
+	pthis->RunAndCatch();
+
+	::pthread_mutex_lock(&pthis->mFinishedMutex);
+	pthis->mFinished = true;
+	::pthread_cond_broadcast(&pthis->mFinishedCondition);
+	::pthread_mutex_unlock(&pthis->mFinishedMutex);
+
+	return NULL;
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::RunAndCatch()
+//		Purpose: Private. Calls Run(), recording any exception it
+//			 throws, as there's nothing to pass it on to.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Thread::RunAndCatch()
+{
+	try
+	{
+		Run();
+	}
+	catch(BoxException &e)
+	{
+		mFailed = true;
+		mErrorMessage = e.GetMessage().empty() ? std::string(e.what())
+			: e.GetMessage();
+	}
+	catch(std::exception &e)
+	{
+		mFailed = true;
+		mErrorMessage = e.what();
+	}
+	catch(...)
+	{
+		mFailed = true;
+		mErrorMessage = "unknown exception";
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::WaitForFinish(int)
+//		Purpose: Waits up to the given time for Run() to return.
+//			 Returns true if it has. Join() must still be called.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool Thread::WaitForFinish(int TimeoutMilliseconds)
+{
+#ifdef BOX_THREADS_SUPPORTED
+	if(!mStarted)
+	{
+		return true;
+	}
+
+	struct timespec until;
+	GetTimeoutTime(TimeoutMilliseconds, until);
+
+	::pthread_mutex_lock(&mFinishedMutex);
+	while(!mFinished)
+	{
+		if(::pthread_cond_timedwait(&mFinishedCondition,
+			&mFinishedMutex, &until) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	bool finished = mFinished;
+	::pthread_mutex_unlock(&mFinishedMutex);
+	return finished;
+#else
+	return true;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Join()
+//		Purpose: Waits for the thread to finish, if it was started
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void Thread::Join()
+{
+#ifdef BOX_THREADS_SUPPORTED
+	if(mStarted)
+	{
+		::pthread_join(mThread, NULL);
+		mStarted = false;
+	}
+#endif
+}
@@ -0,0 +1,237 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.h
+//		Purpose: Minimal worker threads and mutexes
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef THREAD__H
+#define THREAD__H
+
+#include <string>
+
+#include "CommonException.h"
+
+#if defined(HAVE_PTHREAD_H) && !defined(WIN32)
+	#define BOX_THREADS_SUPPORTED
+	#include <pthread.h>
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Mutex
+//		Purpose: Mutual exclusion lock. A recursive one may be
+//			 locked again by the thread which holds it. Does
+//			 nothing on platforms without thread support.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class Mutex
+{
+public:
+	Mutex(bool Recursive = false);
+	~Mutex();
+private:
+	// no copying
+	Mutex(const Mutex &);
+	Mutex &operator=(const Mutex &);
+public:
+	void Lock();
+	void Unlock();
+
+private:
+	friend class Condition;
+#ifdef BOX_THREADS_SUPPORTED
+	pthread_mutex_t mMutex;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    MutexLock
+//		Purpose: Holds a Mutex locked for the lifetime of the object
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class MutexLock
+{
+public:
+	MutexLock(Mutex &rMutex)
+	: mrMutex(rMutex)
+	{
+		mrMutex.Lock();
+	}
+	~MutexLock()
+	{
+		mrMutex.Unlock();
+	}
+private:
+	// no copying
+	MutexLock(const MutexLock &);
+	MutexLock &operator=(const MutexLock &);
+
+	Mutex &mrMutex;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Condition
+//		Purpose: Condition variable, for threads to wait for something
+//			 protected by a Mutex to change. Does nothing on
+//			 platforms without thread support.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class Condition
+{
+public:
+	Condition();
+	~Condition();
+private:
+	// no copying
+	Condition(const Condition &);
+	Condition &operator=(const Condition &);
+public:
+	bool Wait(Mutex &rMutex, int TimeoutMilliseconds);
+	void Signal();
+	void Broadcast();
+
+private:
+#ifdef BOX_THREADS_SUPPORTED
+	pthread_cond_t mCondition;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Thread
+//		Purpose: Runs Run() in a new thread. Derived classes must call
+//			 Join() before they are destroyed. Exceptions thrown by
+//			 Run() are caught, and reported by HasFailed(). All
+//			 signals are blocked in the new thread, so that they are
+//			 still handled by the main thread.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class Thread
+{
+public:
+	Thread();
+	virtual ~Thread();
+private:
+	// no copying
+	Thread(const Thread &);
+	Thread &operator=(const Thread &);
+public:
+	void Start();
+	bool WaitForFinish(int TimeoutMilliseconds);
+	void Join();
+
+	bool HasFailed() const {return mFailed;}
+	const std::string &GetErrorMessage() const {return mErrorMessage;}
+
+	static bool IsSupported();
+	static int GetProcessorCount();
+
+protected:
+	virtual void Run() = 0;
+
+private:
+	void RunAndCatch();
+
+	bool mStarted;
+	bool mFinished;
+	bool mFailed;
+	std::string mErrorMessage;
+#ifdef BOX_THREADS_SUPPORTED
+	static void *ThreadFunction(void *pThread);
+
+	pthread_t mThread;
+	pthread_mutex_t mFinishedMutex;
+	pthread_cond_t mFinishedCondition;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ThreadLocal
+//		Purpose: Holds a separate T for each thread which asks for one,
+//			 created with its default constructor on first use and
+//			 deleted when the thread exits. Meant to be static: as
+//			 other static objects may already be gone when it's
+//			 destroyed, the main thread's T is left to the OS.
+//			 On platforms without thread support, there's only one.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+template<typename T>
+class ThreadLocal
+{
+public:
+	ThreadLocal()
+#ifndef BOX_THREADS_SUPPORTED
+	: mpValue(0)
+#endif
+	{
+#ifdef BOX_THREADS_SUPPORTED
+		if(::pthread_key_create(&mKey, Destroy) != 0)
+		{
+			THROW_EXCEPTION(CommonException, Internal)
+		}
+#endif
+	}
+	~ThreadLocal()
+	{
+#ifdef BOX_THREADS_SUPPORTED
+		::pthread_key_delete(mKey);
+#endif
+	}
+private:
+	// no copying
+	ThreadLocal(const ThreadLocal &);
+	ThreadLocal &operator=(const ThreadLocal &);
+public:
+	T &Get()
+	{
+#ifdef BOX_THREADS_SUPPORTED
+		T *pvalue = (T *)::pthread_getspecific(mKey);
+		if(pvalue == 0)
+		{
+			pvalue = new T;
+			if(::pthread_setspecific(mKey, pvalue) != 0)
+			{
+				delete pvalue;
+				THROW_EXCEPTION(CommonException, Internal)
+			}
+		}
+		return *pvalue;
+#else
+		if(mpValue == 0)
+		{
+			mpValue = new T;
+		}
+		return *mpValue;
+#endif
+	}
+
+private:
+#ifdef BOX_THREADS_SUPPORTED
+	static void Destroy(void *pValue)
+	{
+		delete (T *)pValue;
+	}
+
+	pthread_key_t mKey;
+#else
+	T *mpValue;
+#endif
+};
+
+#endif // THREAD__H
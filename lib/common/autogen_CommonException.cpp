@@ -0,0 +1,84 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+#include "autogen_CommonException.h"
+
+#include "MemLeakFindOn.h"
+
+unsigned int CommonException::GetType() const throw()
+{
+	return CommonException::ExceptionType;
+}
+
+unsigned int CommonException::GetSubType() const throw()
+{
+	return mSubType;
+}
+
+const char * CommonException::what() const throw()
+{
+	return mWhat.c_str();
+}
+
+const char * CommonException::GetMessage(int SubType)
+{
+	switch(SubType)
+	{
+		case Internal: return "Internal";
+		case AssertFailed: return "AssertFailed";
+		case OSFileOpenError: return "OSFileOpenError";
+		case OSFileCloseError: return "OSFileCloseError";
+		case FileAlreadyClosed: return "FileAlreadyClosed";
+		case BadArguments: return "BadArguments";
+		case ConfigNoKey: return "ConfigNoKey";
+		case ConfigNoSubConfig: return "ConfigNoSubConfig";
+		case GetLineNoHandle: return "GetLineNoHandle";
+		case OSFileError: return "OSFileError";
+		case GetLineEOF: return "GetLineEOF";
+		case ConfigBadIntValue: return "ConfigBadIntValue";
+		case GetLineTooLarge: return "GetLineTooLarge";
+		case NotSupported: return "NotSupported";
+		case OSFileReadError: return "OSFileReadError";
+		case OSFileWriteError: return "OSFileWriteError";
+		case FileClosed: return "FileClosed";
+		case IOStreamBadSeekType: return "IOStreamBadSeekType";
+		case CantWriteToPartialReadStream: return "CantWriteToPartialReadStream";
+		case CollectInBufferStreamNotInCorrectPhase: return "CollectInBufferStreamNotInCorrectPhase";
+		case NamedLockAlreadyLockingSomething: return "NamedLockAlreadyLockingSomething";
+		case NamedLockNotHeld: return "NamedLockNotHeld";
+		case StreamableMemBlockIncompleteRead: return "StreamableMemBlockIncompleteRead";
+		case MemBlockStreamNotSupported: return "MemBlockStreamNotSupported";
+		case StreamDoesntHaveRequiredProperty: return "StreamDoesntHaveRequiredProperty";
+		case CannotWriteToReadGatherStream: return "CannotWriteToReadGatherStream";
+		case ReadGatherStreamAddingBadBlock: return "ReadGatherStreamAddingBadBlock";
+		case CouldNotLookUpUsername: return "CouldNotLookUpUsername";
+		case CouldNotRestoreProcessUser: return "CouldNotRestoreProcessUser";
+		case CouldNotChangeProcessUser: return "CouldNotChangeProcessUser";
+		case RegexNotSupportedOnThisPlatform: return "RegexNotSupportedOnThisPlatform";
+		case BadRegularExpression: return "BadRegularExpression";
+		case CouldNotCreateKQueue: return "CouldNotCreateKQueue";
+		case KEventErrorAdd: return "KEventErrorAdd";
+		case KEventErrorWait: return "KEventErrorWait";
+		case KEventErrorRemove: return "KEventErrorRemove";
+		case KQueueNotSupportedOnThisPlatform: return "KQueueNotSupportedOnThisPlatform";
+		case IOStreamGetLineNotEnoughDataToIgnore: return "IOStreamGetLineNotEnoughDataToIgnore";
+		case TempDirPathTooLong: return "TempDirPathTooLong";
+		case ArchiveBlockIncompleteRead: return "ArchiveBlockIncompleteRead";
+		case AccessDenied: return "AccessDenied";
+		case DatabaseOpenFailed: return "DatabaseOpenFailed";
+		case DatabaseReadFailed: return "DatabaseReadFailed";
+		case DatabaseWriteFailed: return "DatabaseWriteFailed";
+		case DatabaseDeleteFailed: return "DatabaseDeleteFailed";
+		case DatabaseCloseFailed: return "DatabaseCloseFailed";
+		case DatabaseRecordNotFound: return "DatabaseRecordNotFound";
+		case DatabaseRecordAlreadyExists: return "DatabaseRecordAlreadyExists";
+		case DatabaseRecordBadSize: return "DatabaseRecordBadSize";
+		case DatabaseIterateFailed: return "DatabaseIterateFailed";
+		case ReferenceNotFound: return "ReferenceNotFound";
+		case TimersNotInitialised: return "TimersNotInitialised";
+		case InvalidConfiguration: return "InvalidConfiguration";
+		case ThreadCreateFailed: return "ThreadCreateFailed";
+		default: return "Unknown";
+	}
+}
@@ -0,0 +1,35 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+#include "autogen_ConversionException.h"
+
+#include "MemLeakFindOn.h"
+
+unsigned int ConversionException::GetType() const throw()
+{
+	return ConversionException::ExceptionType;
+}
+
+unsigned int ConversionException::GetSubType() const throw()
+{
+	return mSubType;
+}
+
+const char * ConversionException::what() const throw()
+{
+	return mWhat.c_str();
+}
+
+const char * ConversionException::GetMessage(int SubType)
+{
+	switch(SubType)
+	{
+		case Internal: return "Internal";
+		case CannotConvertEmptyStringToInt: return "CannotConvertEmptyStringToInt";
+		case BadStringRepresentationOfInt: return "BadStringRepresentationOfInt";
+		case IntOverflowInConvertFromString: return "IntOverflowInConvertFromString";
+		case BadIntSize: return "BadIntSize";
+		default: return "Unknown";
+	}
+}
@@ -66,6 +66,30 @@ public:
 		}
 	}
 		
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    Compress<Function>::Reset()
+	//		Purpose: Make ready to start again on new data, keeping the
+	//				 allocated state. The output is the same as that of a
+	//				 newly constructed object.
+	//		Created: 16/10/26
+	//
+	// --------------------------------------------------------------------------
+	void Reset()
+	{
+		if(((Compressing)?(deflateReset(&mStream))
+			:(inflateReset(&mStream))) != Z_OK)
+		{
+			THROW_EXCEPTION(CompressException, ResetFailed)
+		}
+
+		mStream.avail_in = 0;
+		mStream.data_type = Z_BINARY;
+		mFinished = false;
+		mFlush = Z_NO_FLUSH;
+	}
+
 	// --------------------------------------------------------------------------
 	//
 	// Function
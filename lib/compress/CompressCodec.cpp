@@ -0,0 +1,324 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.cpp
+//		Purpose: Compression of whole buffers in one go, with a
+//			 choice of algorithms
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#ifdef HAVE_ZSTD
+	#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+	#include <lz4.h>
+#endif
+
+#include "Compress.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ZlibCodec
+//		Purpose: zlib, at its default level, using Compress
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ZlibCodec : public CompressCodec
+{
+public:
+	virtual int GetType() const
+	{
+		return Zlib;
+	}
+
+	virtual int MaxCompressedSize(int InputSize) const
+	{
+		return Compress_MaxSizeForCompressedData(InputSize);
+	}
+
+	virtual int Compress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize, int Level)
+	{
+		mCompress.Reset();
+		mCompress.Input(pInput, InputSize);
+		mCompress.FinishInput();
+		return Finish(mCompress, (uint8_t *)pOutput, OutputSize);
+	}
+
+	virtual int Decompress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize)
+	{
+		mDecompress.Reset();
+		mDecompress.Input(pInput, InputSize);
+		mDecompress.FinishInput();
+		return Finish(mDecompress, (uint8_t *)pOutput, OutputSize);
+	}
+
+private:
+	template<bool Compressing>
+	int Finish(::Compress<Compressing> &rCompress, uint8_t *pOutput,
+		int OutputSize)
+	{
+		int outputSize = 0;
+		while(!rCompress.OutputHasFinished())
+		{
+			if(outputSize >= OutputSize && Compressing)
+			{
+				THROW_EXCEPTION(CompressException,
+					OutputBufferTooSmall)
+			}
+			else if(outputSize >= OutputSize)
+			{
+				// As with the other codecs, running out of
+				// space looks the same as corrupt input
+				THROW_EXCEPTION(CompressException,
+					TransformFailed)
+			}
+			outputSize += rCompress.Output(pOutput + outputSize,
+				OutputSize - outputSize);
+		}
+		return outputSize;
+	}
+
+	::Compress<true> mCompress;
+	::Compress<false> mDecompress;
+};
+
+#ifdef HAVE_ZSTD
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ZstdCodec
+//		Purpose: Zstandard, which has levels from 1 to 22
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class ZstdCodec : public CompressCodec
+{
+public:
+	ZstdCodec()
+	: mpCompress(ZSTD_createCCtx()),
+	  mpDecompress(ZSTD_createDCtx())
+	{
+		if(mpCompress == 0 || mpDecompress == 0)
+		{
+			ZSTD_freeCCtx(mpCompress);
+			ZSTD_freeDCtx(mpDecompress);
+			THROW_EXCEPTION(CompressException, InitFailed)
+		}
+	}
+
+	~ZstdCodec()
+	{
+		ZSTD_freeCCtx(mpCompress);
+		ZSTD_freeDCtx(mpDecompress);
+	}
+
+	virtual int GetType() const
+	{
+		return Zstd;
+	}
+
+	virtual int MaxCompressedSize(int InputSize) const
+	{
+		return (int)ZSTD_compressBound(InputSize);
+	}
+
+	virtual int Compress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize, int Level)
+	{
+		size_t result = ZSTD_compressCCtx(mpCompress, pOutput,
+			OutputSize, pInput, InputSize,
+			(Level == 0) ? ZSTD_CLEVEL_DEFAULT : Level);
+		return CheckResult(result);
+	}
+
+	virtual int Decompress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize)
+	{
+		size_t result = ZSTD_decompressDCtx(mpDecompress, pOutput,
+			OutputSize, pInput, InputSize);
+		return CheckResult(result);
+	}
+
+private:
+	int CheckResult(size_t Result)
+	{
+		if(ZSTD_isError(Result))
+		{
+			THROW_EXCEPTION_MESSAGE(CompressException,
+				TransformFailed, "zstd: " <<
+				ZSTD_getErrorName(Result))
+		}
+		return (int)Result;
+	}
+
+	ZSTD_CCtx *mpCompress;
+	ZSTD_DCtx *mpDecompress;
+};
+#endif // HAVE_ZSTD
+
+#ifdef HAVE_LZ4
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    LZ4Codec
+//		Purpose: LZ4, which is fast but doesn't have levels
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class LZ4Codec : public CompressCodec
+{
+public:
+	virtual int GetType() const
+	{
+		return LZ4;
+	}
+
+	virtual int MaxCompressedSize(int InputSize) const
+	{
+		return LZ4_compressBound(InputSize);
+	}
+
+	virtual int Compress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize, int Level)
+	{
+		int result = LZ4_compress_default((const char *)pInput,
+			(char *)pOutput, InputSize, OutputSize);
+		if(result <= 0)
+		{
+			THROW_EXCEPTION(CompressException, OutputBufferTooSmall)
+		}
+		return result;
+	}
+
+	virtual int Decompress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize)
+	{
+		int result = LZ4_decompress_safe((const char *)pInput,
+			(char *)pOutput, InputSize, OutputSize);
+		if(result < 0)
+		{
+			THROW_EXCEPTION_MESSAGE(CompressException,
+				TransformFailed, "lz4: corrupt input, or "
+				"output buffer too small")
+		}
+		return result;
+	}
+};
+#endif // HAVE_LZ4
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::IsSupported(int)
+//		Purpose: Static. Was support for this type of compression
+//			 included when the software was built?
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::IsSupported(int Type)
+{
+	switch(Type)
+	{
+	case Zlib:
+		return true;
+#ifdef HAVE_ZSTD
+	case Zstd:
+		return true;
+#endif
+#ifdef HAVE_LZ4
+	case LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::Create(int)
+//		Purpose: Static. Creates a codec of the given type. Throws
+//			 an exception if the type isn't supported.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<CompressCodec> CompressCodec::Create(int Type)
+{
+	std::auto_ptr<CompressCodec> codec;
+
+	switch(Type)
+	{
+	case Zlib:
+		codec.reset(new ZlibCodec);
+		break;
+#ifdef HAVE_ZSTD
+	case Zstd:
+		codec.reset(new ZstdCodec);
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case LZ4:
+		codec.reset(new LZ4Codec);
+		break;
+#endif
+	default:
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotSupported,
+			"Compression type " << Type << " (" <<
+			GetName(Type) << ") is not supported")
+	}
+
+	return codec;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetTypeFromName(const std::string &)
+//		Purpose: Static. Returns the type with the given name, as
+//			 used in configuration files, or -1 if there's no such
+//			 type. The type may still not be supported.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+int CompressCodec::GetTypeFromName(const std::string &rName)
+{
+	for(int type = 0; type < NumberOfTypes; type++)
+	{
+		if(rName == GetName(type))
+		{
+			return type;
+		}
+	}
+	return -1;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetName(int)
+//		Purpose: Static. Returns the name of a type of compression.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+std::string CompressCodec::GetName(int Type)
+{
+	switch(Type)
+	{
+	case Zlib:	return "zlib";
+	case Zstd:	return "zstd";
+	case LZ4:	return "lz4";
+	default:	return "unknown";
+	}
+}
@@ -0,0 +1,65 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.h
+//		Purpose: Compression of whole buffers in one go, with a
+//			 choice of algorithms
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef COMPRESSCODEC__H
+#define COMPRESSCODEC__H
+
+#include <memory>
+#include <string>
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    CompressCodec
+//		Purpose: Compresses and decompresses whole buffers. Each
+//			 object keeps its library state between calls, so
+//			 reusing one is cheaper than creating new ones, but it
+//			 must only be used by one thread at a time. Use
+//			 Create() to make one of the type required.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class CompressCodec
+{
+public:
+	// Types are stored in encoded files, so the values must never change
+	enum
+	{
+		Zlib = 0,
+		Zstd = 1,
+		LZ4 = 2,
+
+		NumberOfTypes = 3
+	};
+
+	CompressCodec() {}
+	virtual ~CompressCodec() {}
+private:
+	// no copying
+	CompressCodec(const CompressCodec &);
+	CompressCodec &operator=(const CompressCodec &);
+public:
+	virtual int GetType() const = 0;
+	virtual int MaxCompressedSize(int InputSize) const = 0;
+
+	// Level 0 means the default for the codec. Codecs without levels
+	// ignore it.
+	virtual int Compress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize, int Level = 0) = 0;
+	virtual int Decompress(const void *pInput, int InputSize,
+		void *pOutput, int OutputSize) = 0;
+
+	static bool IsSupported(int Type);
+	static std::auto_ptr<CompressCodec> Create(int Type);
+	static int GetTypeFromName(const std::string &rName);
+	static std::string GetName(int Type);
+};
+
+#endif // COMPRESSCODEC__H
@@ -30,6 +30,7 @@ CipherContext::CipherContext()
 : mInitialised(false),
   mWithinTransform(false),
   mPaddingOn(true),
+  mIVLength(0),
   mFunction(None)
 #ifdef HAVE_OLD_SSL
 , mpDescription(0)
@@ -140,6 +141,7 @@ void CipherContext::Init(CipherContext::CipherFunction Function, const CipherDes
 		MEMLEAKFINDER_NOT_A_LEAK(mpDescription);
 #endif
 		mpDescription->SetupParameters(BOX_OPENSSL_CTX(ctx));
+		mIVLength = EVP_CIPHER_CTX_iv_length(BOX_OPENSSL_CTX(ctx));
 	}
 	catch(...)
 	{
@@ -213,6 +215,73 @@ void CipherContext::Begin()
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::Begin(const void *)
+//		Purpose: Begin a transformation with a new IV (must be correctly
+//				 sized, use GetIVLength), keeping the key. Does the same
+//				 as SetIV() then Begin(), but sets up the cipher once
+//				 rather than twice. Any unfinished transformation is
+//				 abandoned.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void CipherContext::Begin(const void *pIV)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised);
+	}
+
+#ifdef HAVE_OLD_SSL
+	mWithinTransform = false;
+	SetIV(pIV);
+	Begin();
+#else
+	if(EVP_CipherInit_ex(BOX_OPENSSL_CTX(ctx), NULL, NULL, NULL,
+		(unsigned char *)pIV, -1) != 1)
+	{
+		mWithinTransform = false;
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+			"Failed to set IV for " << mCipherName << ": " << LogError(GetFunction()));
+	}
+
+	// Mark as being within a transform
+	mWithinTransform = true;
+#endif
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::BeginWithRandomIV(int &)
+//		Purpose: As Begin(const void *), with a random IV. Returns a
+//				 pointer to the IV used, and its length in rLengthOut.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const void *CipherContext::BeginWithRandomIV(int &rLengthOut)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+
+	if(mIVLength > (int)sizeof(mGeneratedIV))
+	{
+		THROW_EXCEPTION(CipherException, IVSizeImplementationLimitExceeded)
+	}
+
+	Random::Generate(mGeneratedIV, mIVLength);
+	Begin(mGeneratedIV);
+
+	rLengthOut = mIVLength;
+	return mGeneratedIV;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -530,7 +599,7 @@ int CipherContext::GetIVLength()
 		THROW_EXCEPTION(CipherException, NotInitialised)
 	}
 	
-	return EVP_CIPHER_CTX_iv_length(BOX_OPENSSL_CTX(ctx));
+	return mIVLength;
 }
 
 
@@ -597,7 +666,7 @@ const void *CipherContext::SetRandomIV(int &rLengthOut)
 	}
 
 	// Get length of IV
-	unsigned int ivLen = EVP_CIPHER_CTX_iv_length(BOX_OPENSSL_CTX(ctx));
+	unsigned int ivLen = mIVLength;
 	if(ivLen > sizeof(mGeneratedIV))
 	{
 		THROW_EXCEPTION(CipherException, IVSizeImplementationLimitExceeded)
@@ -66,6 +66,8 @@ public:
 	void Reset();
 	
 	void Begin();
+	void Begin(const void *pIV);
+	const void *BeginWithRandomIV(int &rLengthOut);
 	int Transform(void *pOutBuffer, int OutLength, const void *pInBuffer, int InLength);
 	int Final(void *pOutBuffer, int OutLength);
 	int InSizeForOutBufferSize(int OutLength);
@@ -94,6 +96,7 @@ private:
 	bool mInitialised;
 	bool mWithinTransform;
 	bool mPaddingOn;
+	int mIVLength;
 	uint8_t mGeneratedIV[CIPHERCONTEXT_MAX_GENERATED_IV_LENGTH];
 	CipherFunction mFunction;
 	std::string mCipherName;
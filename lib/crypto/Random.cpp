@@ -11,12 +11,72 @@
 
 #include <openssl/rand.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
 
 #include "Random.h"
 #include "CipherException.h"
+#include "Thread.h"
 
 #include "MemLeakFindOn.h"
 
+// Small requests are served from a buffer of random data, refilled this
+// many bytes at a time, rather than calling OpenSSL for each one.
+#define RANDOM_POOL_SIZE			4096
+#define RANDOM_POOL_MAX_REQUEST		256
+
+static void GenerateUnbuffered(void *pOutput, int Length);
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    RandomPool
+//		Purpose: A thread's buffer of random data. Bytes are wiped as
+//			 they're handed out, and the buffer is thrown away in a
+//			 child process, so that it doesn't hand out the same
+//			 bytes as its parent.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class RandomPool
+{
+public:
+	RandomPool()
+	: mAvailable(0),
+	  mFilledByProcess(0)
+	{
+	}
+	~RandomPool()
+	{
+		::memset(mPool, 0, sizeof(mPool));
+	}
+
+	void Take(void *pOutput, int Length)
+	{
+		ASSERT(Length >= 0 && Length <= (int)sizeof(mPool));
+		if(Length > mAvailable || mFilledByProcess != ::getpid())
+		{
+			GenerateUnbuffered(mPool, sizeof(mPool));
+			mAvailable = sizeof(mPool);
+			mFilledByProcess = ::getpid();
+		}
+		uint8_t *pbytes = mPool + (sizeof(mPool) - mAvailable);
+		::memcpy(pOutput, pbytes, Length);
+		::memset(pbytes, 0, Length);
+		mAvailable -= Length;
+	}
+
+private:
+	uint8_t mPool[RANDOM_POOL_SIZE];
+	int mAvailable;
+	pid_t mFilledByProcess;
+};
+
+static ThreadLocal<RandomPool> sPools;
+
 
 // --------------------------------------------------------------------------
 //
@@ -44,13 +104,36 @@ void Random::Initialise()
 //
 // Function
 //		Name:    Random::Generate(void *, int)
-//		Purpose: Generate Length bytes of random data
+//		Purpose: Generate Length bytes of random data. Short
+//				 lengths, such as IVs, come from this thread's pool.
 //		Created: 31/12/03
 //
 // --------------------------------------------------------------------------
 void Random::Generate(void *pOutput, int Length)
 {
-	if(RAND_bytes((uint8_t*)pOutput, Length) == -1)
+	if(Length <= RANDOM_POOL_MAX_REQUEST)
+	{
+		sPools.Get().Take(pOutput, Length);
+	}
+	else
+	{
+		GenerateUnbuffered(pOutput, Length);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static GenerateUnbuffered(void *, int)
+//		Purpose: Generate Length bytes of random data straight from
+//				 OpenSSL
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+static void GenerateUnbuffered(void *pOutput, int Length)
+{
+	if(RAND_bytes((uint8_t*)pOutput, Length) != 1)
 	{
 		THROW_EXCEPTION(CipherException, PseudoRandNotAvailable)
 	}
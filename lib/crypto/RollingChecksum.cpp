@@ -10,8 +10,386 @@
 #include "Box.h"
 #include "RollingChecksum.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define ROLLINGCHECKSUM_SSE2
+	#include <emmintrin.h>
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+		&& (defined(__clang__) || __GNUC__ >= 5)
+		// Compiled with a function attribute, chosen at runtime
+		#define ROLLINGCHECKSUM_AVX2
+		#include <immintrin.h>
+	#endif
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	#define ROLLINGCHECKSUM_NEON
+	#include <arm_neon.h>
+#endif
+
 #include "MemLeakFindOn.h"
 
+// Below this number of bytes, the vector kernels aren't worth setting up
+#define ROLLINGCHECKSUM_VECTOR_THRESHOLD	32
+
+// Calculates, mod 2^32, the sum of the bytes and the sum of the bytes
+// weighted by their distance from the end of the data, ie
+//		rSum = p[0] + p[1] + ... + p[n-1]
+//		rWeightedSum = n*p[0] + (n-1)*p[1] + ... + 1*p[n-1]
+typedef void (*SumsFunction)(const uint8_t *pData, unsigned int Length,
+	uint32_t &rSum, uint32_t &rWeightedSum);
+
+// Writes the hashing component and/or the full checksum for Count
+// consecutive positions of the checksum starting with (a, b), without
+// changing the checksum. Either output may be null.
+typedef void (*HashesFunction)(uint16_t a, uint16_t b,
+	const uint8_t *pStartOfThisBlock, const uint8_t *pLastOfNextBlock,
+	unsigned int Length, unsigned int Count, uint16_t *pHashes,
+	uint32_t *pChecksums);
+
+static void SumsScalar(const uint8_t *pData, unsigned int Length,
+	uint32_t &rSum, uint32_t &rWeightedSum)
+{
+	uint32_t sum = 0, weighted = 0;
+	for(unsigned int x = Length; x >= 1; --x)
+	{
+		sum += *pData;
+		weighted += x * (*pData);
+		++pData;
+	}
+	rSum = sum;
+	rWeightedSum = weighted;
+}
+
+static void HashesScalar(uint16_t a, uint16_t b,
+	const uint8_t *pStartOfThisBlock, const uint8_t *pLastOfNextBlock,
+	unsigned int Length, unsigned int Count, uint16_t *pHashes,
+	uint32_t *pChecksums)
+{
+	for(unsigned int i = 0; i < Count; ++i)
+	{
+		if(pHashes != 0)
+		{
+			pHashes[i] = b;
+		}
+		if(pChecksums != 0)
+		{
+			pChecksums[i] = ((uint32_t)a) | (((uint32_t)b) << 16);
+		}
+		a -= pStartOfThisBlock[i];
+		a += pLastOfNextBlock[i];
+		b -= Length * pStartOfThisBlock[i];
+		b += a;
+	}
+}
+
+#ifdef ROLLINGCHECKSUM_SSE2
+static inline uint32_t HorizontalSumSSE2(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static void SumsSSE2(const uint8_t *pData, unsigned int Length,
+	uint32_t &rSum, uint32_t &rWeightedSum)
+{
+	// Work on 16 bytes at a time. Within a block, the weights are
+	// 16..1, and everything summed in earlier blocks gets another
+	// 16 added to its weight for each block after it.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weightsLow = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i weightsHigh = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	__m128i sum = zero;
+	__m128i previousSums = zero;
+	__m128i weighted = zero;
+
+	unsigned int blocks = Length / 16;
+	for(unsigned int l = 0; l < blocks; ++l)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)pData);
+		previousSums = _mm_add_epi32(previousSums, sum);
+		sum = _mm_add_epi32(sum, _mm_sad_epu8(v, zero));
+		weighted = _mm_add_epi32(weighted,
+			_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weightsLow));
+		weighted = _mm_add_epi32(weighted,
+			_mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weightsHigh));
+		pData += 16;
+	}
+
+	uint32_t s = HorizontalSumSSE2(sum);
+	uint32_t w = (16 * HorizontalSumSSE2(previousSums)) + HorizontalSumSSE2(weighted);
+
+	// Each remaining byte adds another count of everything before it
+	for(unsigned int l = blocks * 16; l < Length; ++l)
+	{
+		s += *(pData++);
+		w += s;
+	}
+
+	rSum = s;
+	rWeightedSum = w;
+}
+
+// Prefix sum across the eight 16 bit lanes
+static inline __m128i PrefixSum16SSE2(__m128i v)
+{
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+	return v;
+}
+
+static void HashesSSE2(uint16_t a, uint16_t b,
+	const uint8_t *pStartOfThisBlock, const uint8_t *pLastOfNextBlock,
+	unsigned int Length, unsigned int Count, uint16_t *pHashes,
+	uint32_t *pChecksums)
+{
+	// Eight positions at a time, in 16 bit lanes so the arithmetic is
+	// mod 2^16 just like the scalar version. With j and k the bytes
+	// leaving and entering the block,
+	//		a[t+1] = a + (k[0]-j[0]) + ... + (k[t]-j[t])
+	//		b[t+1] = b + e[0] + ... + e[t], where e[t] = a[t+1] - Length*j[t]
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i length = _mm_set1_epi16((short)Length);
+	unsigned int i = 0;
+	for(; i + 8 <= Count; i += 8)
+	{
+		__m128i j = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pStartOfThisBlock + i)), zero);
+		__m128i k = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pLastOfNextBlock + i)), zero);
+		__m128i deltaA = PrefixSum16SSE2(_mm_sub_epi16(k, j));
+		__m128i e = _mm_sub_epi16(_mm_add_epi16(deltaA, _mm_set1_epi16((short)a)),
+			_mm_mullo_epi16(j, length));
+		__m128i deltaB = PrefixSum16SSE2(e);
+
+		// Position t gets the a and b from before the t'th roll
+		__m128i vb = _mm_add_epi16(_mm_set1_epi16((short)b), _mm_slli_si128(deltaB, 2));
+		if(pHashes != 0)
+		{
+			_mm_storeu_si128((__m128i *)(pHashes + i), vb);
+		}
+		if(pChecksums != 0)
+		{
+			__m128i va = _mm_add_epi16(_mm_set1_epi16((short)a), _mm_slli_si128(deltaA, 2));
+			_mm_storeu_si128((__m128i *)(pChecksums + i), _mm_unpacklo_epi16(va, vb));
+			_mm_storeu_si128((__m128i *)(pChecksums + i + 4), _mm_unpackhi_epi16(va, vb));
+		}
+
+		a += (uint16_t)_mm_extract_epi16(deltaA, 7);
+		b += (uint16_t)_mm_extract_epi16(deltaB, 7);
+	}
+
+	HashesScalar(a, b, pStartOfThisBlock + i, pLastOfNextBlock + i,
+		Length, Count - i, (pHashes != 0)?(pHashes + i):0,
+		(pChecksums != 0)?(pChecksums + i):0);
+}
+#endif // ROLLINGCHECKSUM_SSE2
+
+#ifdef ROLLINGCHECKSUM_AVX2
+__attribute__((target("avx2")))
+static void SumsAVX2(const uint8_t *pData, unsigned int Length,
+	uint32_t &rSum, uint32_t &rWeightedSum)
+{
+	// As SumsSSE2, but on 32 bytes at a time. The weights 32..1 fit
+	// in signed bytes, so maddubs does the multiply and first add.
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i weights = _mm256_setr_epi8(
+		32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+		16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	__m256i sum = zero;
+	__m256i previousSums = zero;
+	__m256i weighted = zero;
+
+	unsigned int blocks = Length / 32;
+	for(unsigned int l = 0; l < blocks; ++l)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)pData);
+		previousSums = _mm256_add_epi32(previousSums, sum);
+		sum = _mm256_add_epi32(sum, _mm256_sad_epu8(v, zero));
+		weighted = _mm256_add_epi32(weighted,
+			_mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+		pData += 32;
+	}
+
+	__m128i s128 = _mm_add_epi32(_mm256_castsi256_si128(sum),
+		_mm256_extracti128_si256(sum, 1));
+	__m128i p128 = _mm_add_epi32(_mm256_castsi256_si128(previousSums),
+		_mm256_extracti128_si256(previousSums, 1));
+	__m128i w128 = _mm_add_epi32(_mm256_castsi256_si128(weighted),
+		_mm256_extracti128_si256(weighted, 1));
+
+	uint32_t s = HorizontalSumSSE2(s128);
+	uint32_t w = (32 * HorizontalSumSSE2(p128)) + HorizontalSumSSE2(w128);
+
+	for(unsigned int l = blocks * 32; l < Length; ++l)
+	{
+		s += *(pData++);
+		w += s;
+	}
+
+	rSum = s;
+	rWeightedSum = w;
+}
+#endif // ROLLINGCHECKSUM_AVX2
+
+#ifdef ROLLINGCHECKSUM_NEON
+static void SumsNEON(const uint8_t *pData, unsigned int Length,
+	uint32_t &rSum, uint32_t &rWeightedSum)
+{
+	// As SumsSSE2
+	static const uint16_t weightsLowData[8] = {16, 15, 14, 13, 12, 11, 10, 9};
+	static const uint16_t weightsHighData[8] = {8, 7, 6, 5, 4, 3, 2, 1};
+	const uint16x8_t weightsLow = vld1q_u16(weightsLowData);
+	const uint16x8_t weightsHigh = vld1q_u16(weightsHighData);
+	uint32x4_t sum = vdupq_n_u32(0);
+	uint32x4_t previousSums = vdupq_n_u32(0);
+	uint32x4_t weighted = vdupq_n_u32(0);
+
+	unsigned int blocks = Length / 16;
+	for(unsigned int l = 0; l < blocks; ++l)
+	{
+		uint8x16_t v = vld1q_u8(pData);
+		previousSums = vaddq_u32(previousSums, sum);
+		sum = vpadalq_u16(sum, vpaddlq_u8(v));
+		uint16x8_t low = vmovl_u8(vget_low_u8(v));
+		uint16x8_t high = vmovl_u8(vget_high_u8(v));
+		weighted = vmlal_u16(weighted, vget_low_u16(low), vget_low_u16(weightsLow));
+		weighted = vmlal_u16(weighted, vget_high_u16(low), vget_high_u16(weightsLow));
+		weighted = vmlal_u16(weighted, vget_low_u16(high), vget_low_u16(weightsHigh));
+		weighted = vmlal_u16(weighted, vget_high_u16(high), vget_high_u16(weightsHigh));
+		pData += 16;
+	}
+
+	uint32_t s = vaddvq_u32(sum);
+	uint32_t w = (16 * vaddvq_u32(previousSums)) + vaddvq_u32(weighted);
+
+	for(unsigned int l = blocks * 16; l < Length; ++l)
+	{
+		s += *(pData++);
+		w += s;
+	}
+
+	rSum = s;
+	rWeightedSum = w;
+}
+
+static inline uint16x8_t PrefixSum16NEON(uint16x8_t v)
+{
+	const uint16x8_t zero = vdupq_n_u16(0);
+	v = vaddq_u16(v, vextq_u16(zero, v, 7));
+	v = vaddq_u16(v, vextq_u16(zero, v, 6));
+	v = vaddq_u16(v, vextq_u16(zero, v, 4));
+	return v;
+}
+
+static void HashesNEON(uint16_t a, uint16_t b,
+	const uint8_t *pStartOfThisBlock, const uint8_t *pLastOfNextBlock,
+	unsigned int Length, unsigned int Count, uint16_t *pHashes,
+	uint32_t *pChecksums)
+{
+	// As HashesSSE2
+	const uint16x8_t zero = vdupq_n_u16(0);
+	const uint16x8_t length = vdupq_n_u16((uint16_t)Length);
+	unsigned int i = 0;
+	for(; i + 8 <= Count; i += 8)
+	{
+		uint16x8_t j = vmovl_u8(vld1_u8(pStartOfThisBlock + i));
+		uint16x8_t k = vmovl_u8(vld1_u8(pLastOfNextBlock + i));
+		uint16x8_t deltaA = PrefixSum16NEON(vsubq_u16(k, j));
+		uint16x8_t e = vsubq_u16(vaddq_u16(deltaA, vdupq_n_u16(a)),
+			vmulq_u16(j, length));
+		uint16x8_t deltaB = PrefixSum16NEON(e);
+
+		uint16x8_t vb = vaddq_u16(vdupq_n_u16(b), vextq_u16(zero, deltaB, 7));
+		if(pHashes != 0)
+		{
+			vst1q_u16(pHashes + i, vb);
+		}
+		if(pChecksums != 0)
+		{
+			uint16x8x2_t ab;
+			ab.val[0] = vaddq_u16(vdupq_n_u16(a), vextq_u16(zero, deltaA, 7));
+			ab.val[1] = vb;
+			vst2q_u16((uint16_t *)(pChecksums + i), ab);
+		}
+
+		a += vgetq_lane_u16(deltaA, 7);
+		b += vgetq_lane_u16(deltaB, 7);
+	}
+
+	HashesScalar(a, b, pStartOfThisBlock + i, pLastOfNextBlock + i,
+		Length, Count - i, (pHashes != 0)?(pHashes + i):0,
+		(pChecksums != 0)?(pChecksums + i):0);
+}
+#endif // ROLLINGCHECKSUM_NEON
+
+static SumsFunction sSums = SumsScalar;
+static HashesFunction sHashes = HashesScalar;
+static const char *sImplementationName = "scalar";
+
+// Choose the kernels once at startup
+static bool sImplementationChosen = RollingChecksum::SetUseVectorInstructions(true);
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RollingChecksum::SetUseVectorInstructions(bool)
+//		Purpose: Static. Choose between the best vector implementation
+//				 the CPU supports and the plain scalar code. Returns
+//				 true if a vector implementation is in use. Not thread
+//				 safe; intended for startup and for tests.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+bool RollingChecksum::SetUseVectorInstructions(bool UseVector)
+{
+	sSums = SumsScalar;
+	sHashes = HashesScalar;
+	sImplementationName = "scalar";
+
+	if(!UseVector)
+	{
+		return false;
+	}
+
+#ifdef ROLLINGCHECKSUM_SSE2
+	sSums = SumsSSE2;
+	sHashes = HashesSSE2;
+	sImplementationName = "SSE2";
+	#ifdef ROLLINGCHECKSUM_AVX2
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+		{
+			sSums = SumsAVX2;
+			sImplementationName = "AVX2";
+		}
+	#endif
+	return true;
+#elif defined(ROLLINGCHECKSUM_NEON)
+	sSums = SumsNEON;
+	sHashes = HashesNEON;
+	sImplementationName = "NEON";
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RollingChecksum::GetImplementationName()
+//		Purpose: Static. Name of the implementation in use, for logging
+//				 and benchmarks.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+const char *RollingChecksum::GetImplementationName()
+{
+	(void)sImplementationChosen;
+	return sImplementationName;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -24,14 +402,10 @@ RollingChecksum::RollingChecksum(const void * const data, const unsigned int Len
 	: a(0),
 	  b(0)
 {
-	const uint8_t *block = (const uint8_t *)data;
-	for(unsigned int x = Length; x >= 1; --x)
-	{
-		a += (*block);
-		b += x * (*block);
-		
-		++block;
-	}
+	uint32_t sum, weighted;
+	(*sSums)((const uint8_t *)data, Length, sum, weighted);
+	a = (uint16_t)sum;
+	b = (uint16_t)weighted;
 }
 
 // --------------------------------------------------------------------------
@@ -46,17 +420,62 @@ RollingChecksum::RollingChecksum(const void * const data, const unsigned int Len
 void RollingChecksum::RollForwardSeveral(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Skip)
 {
 	// IMPLEMENTATION NOTE: Everything is implicitly mod 2^16 -- uint16_t's will overflow nicely.
-	unsigned int i;
-	uint16_t sumBegin=0, j,k;
-
-	for(i=0; i < Skip; i++)
+	if(Skip < ROLLINGCHECKSUM_VECTOR_THRESHOLD)
 	{
-		j = StartOfThisBlock[i];
-		k = LastOfNextBlock[i];
-		sumBegin += j;
-		a += (k - j);
-		b += a;
+		unsigned int i;
+		uint16_t sumBegin=0, j,k;
+
+		for(i=0; i < Skip; i++)
+		{
+			j = StartOfThisBlock[i];
+			k = LastOfNextBlock[i];
+			sumBegin += j;
+			a += (k - j);
+			b += a;
+		}
+
+		b -= Length * sumBegin;
+		return;
 	}
 
-	b -= Length * sumBegin;
+	// Closed form of the loop above, in terms of the plain and weighted
+	// sums of the bytes leaving (j) and entering (k) the block:
+	//		a += sum(k) - sum(j)
+	//		b += Skip*a + weighted(k) - weighted(j) - Length*sum(j)
+	uint32_t sumBegin, weightedBegin, sumEnd, weightedEnd;
+	(*sSums)(StartOfThisBlock, Skip, sumBegin, weightedBegin);
+	(*sSums)(LastOfNextBlock, Skip, sumEnd, weightedEnd);
+
+	b += (uint16_t)(Skip * a + weightedEnd - weightedBegin - Length * sumBegin);
+	a += (uint16_t)(sumEnd - sumBegin);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RollingChecksum::GetHashingComponents(const uint8_t *, const uint8_t *, unsigned int, unsigned int, uint16_t *)
+//		Purpose: Write the hashing component (as GetComponentForHashing()) for
+//				 this position and the following Count-1 positions to pHashes,
+//				 without moving the checksum. The pointers are as for
+//				 RollForwardSeveral(), and Count bytes must be readable from both.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void RollingChecksum::GetHashingComponents(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Count, uint16_t *pHashes) const
+{
+	(*sHashes)(a, b, StartOfThisBlock, LastOfNextBlock, Length, Count, pHashes, 0);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RollingChecksum::GetChecksums(const uint8_t *, const uint8_t *, unsigned int, unsigned int, uint32_t *)
+//		Purpose: As GetHashingComponents(), but writes the full checksum
+//				 (as GetChecksum()) for each position.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void RollingChecksum::GetChecksums(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Count, uint32_t *pChecksums) const
+{
+	(*sHashes)(a, b, StartOfThisBlock, LastOfNextBlock, Length, Count, 0, pChecksums);
 }
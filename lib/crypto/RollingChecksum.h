@@ -55,6 +55,19 @@ public:
 	// --------------------------------------------------------------------------
 	void RollForwardSeveral(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Skip);
 
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    RollingChecksum::GetHashingComponents(const uint8_t *, const uint8_t *, unsigned int, unsigned int, uint16_t *)
+	//		Purpose: Calculate the hashing component (or with GetChecksums(), the full checksum)
+	//				 for this and the following Count-1 positions in one go, without moving
+	//				 the checksum. Pointers as RollForwardSeveral().
+	//		Created: 16/10/26
+	//
+	// --------------------------------------------------------------------------
+	void GetHashingComponents(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Count, uint16_t *pHashes) const;
+	void GetChecksums(const uint8_t * const StartOfThisBlock, const uint8_t * const LastOfNextBlock, const unsigned int Length, const unsigned int Count, uint32_t *pChecksums) const;
+
 	// --------------------------------------------------------------------------
 	//
 	// Function
@@ -98,6 +111,10 @@ public:
 		return Checksum >> 16;
 	}
 	
+	// Runtime selection of SSE2/AVX2/NEON or scalar code
+	static bool SetUseVectorInstructions(bool UseVector);
+	static const char *GetImplementationName();
+
 private:
 	uint16_t a;
 	uint16_t b;
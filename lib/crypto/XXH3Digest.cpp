@@ -0,0 +1,107 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    XXH3Digest.cpp
+//		Purpose: Simple interface for creating 128 bit XXH3 digests
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+
+#include "Box.h"
+
+#include <new>
+
+#include "XXH3Digest.h"
+
+// Build the parts of xxHash which are used into this file only
+#define XXH_INLINE_ALL
+#include "xxhash/xxhash.h"
+
+#include "MemLeakFindOn.h"
+
+
+XXH3Digest::XXH3Digest()
+: mpState(XXH3_createState())
+{
+	if(mpState == 0)
+	{
+		throw std::bad_alloc();
+	}
+	XXH3_128bits_reset((XXH3_state_t *)mpState);
+	for(unsigned int l = 0; l < sizeof(mDigest); ++l)
+	{
+		mDigest[l] = 0;
+	}
+}
+
+XXH3Digest::~XXH3Digest()
+{
+	XXH3_freeState((XXH3_state_t *)mpState);
+}
+
+void XXH3Digest::Add(const std::string &rString)
+{
+	XXH3_128bits_update((XXH3_state_t *)mpState, rString.c_str(),
+		rString.size());
+}
+
+void XXH3Digest::Add(const void *pData, int Length)
+{
+	XXH3_128bits_update((XXH3_state_t *)mpState, pData, Length);
+}
+
+void XXH3Digest::Finish()
+{
+	// Store in the canonical (big endian) form, so that digests are
+	// the same on every platform
+	XXH128_hash_t hash = XXH3_128bits_digest((XXH3_state_t *)mpState);
+	XXH128_canonical_t canonical;
+	XXH128_canonicalFromHash(&canonical, hash);
+	ASSERT(sizeof(canonical.digest) == sizeof(mDigest));
+	::memcpy(mDigest, canonical.digest, sizeof(mDigest));
+}
+
+void XXH3Digest::Digest(const void *pData, int Length, uint8_t *pDigestOut)
+{
+	XXH128_hash_t hash = XXH3_128bits(pData, Length);
+	XXH128_canonical_t canonical;
+	XXH128_canonicalFromHash(&canonical, hash);
+	::memcpy(pDigestOut, canonical.digest, DigestLength);
+}
+
+std::string XXH3Digest::DigestAsString()
+{
+	std::string r;
+
+	static const char *hex = "0123456789abcdef";
+
+	for(unsigned int l = 0; l < sizeof(mDigest); ++l)
+	{
+		r += hex[(mDigest[l] & 0xf0) >> 4];
+		r += hex[(mDigest[l] & 0x0f)];
+	}
+
+	return r;
+}
+
+int XXH3Digest::CopyDigestTo(uint8_t *to)
+{
+	for(int l = 0; l < DigestLength; ++l)
+	{
+		to[l] = mDigest[l];
+	}
+
+	return DigestLength;
+}
+
+bool XXH3Digest::DigestMatches(const uint8_t *pCompareWith) const
+{
+	for(int l = 0; l < DigestLength; ++l)
+	{
+		if(pCompareWith[l] != mDigest[l])
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,67 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    XXH3Digest.h
+//		Purpose: Simple interface for creating 128 bit XXH3 digests
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#ifndef XXH3DIGEST_H
+#define XXH3DIGEST_H
+
+#include <string>
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    XXH3Digest
+//		Purpose: Simple interface for creating 128 bit XXH3 digests,
+//			 in the same way as MD5Digest. XXH3 isn't a
+//			 cryptographic hash, but it's many times faster than
+//			 MD5, and just as good at telling blocks of data apart
+//			 when nobody is choosing the data to collide.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+class XXH3Digest
+{
+public:
+	XXH3Digest();
+	virtual ~XXH3Digest();
+private:
+	// no copying
+	XXH3Digest(const XXH3Digest &);
+	XXH3Digest &operator=(const XXH3Digest &);
+public:
+
+	void Add(const std::string &rString);
+	void Add(const void *pData, int Length);
+
+	void Finish();
+
+	std::string DigestAsString();
+	uint8_t *DigestAsData(int *pLength = 0)
+	{
+		if(pLength) *pLength = sizeof(mDigest);
+		return mDigest;
+	}
+
+	enum
+	{
+		DigestLength = 16
+	};
+
+	int CopyDigestTo(uint8_t *to);
+
+	bool DigestMatches(const uint8_t *pCompareWith) const;
+
+	// Digest a single block of data, without any setup
+	static void Digest(const void *pData, int Length, uint8_t *pDigestOut);
+
+private:
+	void *mpState;
+	uint8_t mDigest[DigestLength];
+};
+
+#endif // XXH3DIGEST_H
@@ -0,0 +1,45 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+#include "autogen_HTTPException.h"
+
+#include "MemLeakFindOn.h"
+
+unsigned int HTTPException::GetType() const throw()
+{
+	return HTTPException::ExceptionType;
+}
+
+unsigned int HTTPException::GetSubType() const throw()
+{
+	return mSubType;
+}
+
+const char * HTTPException::what() const throw()
+{
+	return mWhat.c_str();
+}
+
+const char * HTTPException::GetMessage(int SubType)
+{
+	switch(SubType)
+	{
+		case Internal: return "Internal";
+		case RequestReadFailed: return "RequestReadFailed";
+		case RequestAlreadyBeenRead: return "RequestAlreadyBeenRead";
+		case BadRequest: return "BadRequest";
+		case UnknownResponseCodeUsed: return "UnknownResponseCodeUsed";
+		case NoContentTypeSet: return "NoContentTypeSet";
+		case POSTContentTooLong: return "POSTContentTooLong";
+		case CannotSetRedirectIfReponseHasData: return "CannotSetRedirectIfReponseHasData";
+		case CannotSetNotFoundIfReponseHasData: return "CannotSetNotFoundIfReponseHasData";
+		case NotImplemented: return "NotImplemented";
+		case RequestNotInitialised: return "RequestNotInitialised";
+		case BadResponse: return "BadResponse";
+		case ResponseReadFailed: return "ResponseReadFailed";
+		case NoStreamConfigured: return "NoStreamConfigured";
+		case RequestFailedUnexpectedly: return "RequestFailedUnexpectedly";
+		default: return "Unknown";
+	}
+}
@@ -0,0 +1,74 @@
+
+// Auto-generated file -- do not edit
+
+#ifndef AUTOGEN_HTTPEXCEPTION_H
+#define AUTOGEN_HTTPEXCEPTION_H
+
+#include "BoxException.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    HTTPException
+//		Purpose: Exception
+//		Created: autogen
+//
+// --------------------------------------------------------------------------
+class HTTPException : public BoxException
+{
+public:
+	HTTPException(unsigned int SubType,
+		const std::string& rMessage = "")
+	: mSubType(SubType), mMessage(rMessage),
+	  mWhat(GetMessage(SubType) + std::string(rMessage.empty() ? "" : ": ") + rMessage)
+	{
+	}
+	
+	HTTPException(const HTTPException &rToCopy)
+	: mSubType(rToCopy.mSubType), mMessage(rToCopy.mMessage), mWhat(rToCopy.mWhat)
+	{
+	}
+	
+	~HTTPException() throw ()
+	{
+	}
+	
+	enum
+	{
+		ExceptionType = 10
+	};
+
+	enum
+	{
+		Internal = 0,
+		RequestReadFailed = 1,
+		RequestAlreadyBeenRead = 2,
+		BadRequest = 3,
+		UnknownResponseCodeUsed = 4,
+		NoContentTypeSet = 5,
+		POSTContentTooLong = 6,
+		CannotSetRedirectIfReponseHasData = 7,
+		CannotSetNotFoundIfReponseHasData = 8,
+		NotImplemented = 9,
+		RequestNotInitialised = 10,
+		BadResponse = 11,
+		ResponseReadFailed = 12,
+		NoStreamConfigured = 13,
+		RequestFailedUnexpectedly = 14
+	};
+	
+	virtual unsigned int GetType() const throw();
+	virtual unsigned int GetSubType() const throw();
+	virtual const char *what() const throw();
+	virtual const std::string& GetMessage() const
+	{
+		return mMessage;
+	}
+	static const char* GetMessage(int SubType);
+private:
+	unsigned int mSubType;
+	std::string mMessage;
+	std::string mWhat;
+};
+
+#endif // AUTOGEN_HTTPEXCEPTION_H
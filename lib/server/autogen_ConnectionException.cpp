@@ -0,0 +1,54 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+#include "autogen_ConnectionException.h"
+
+#include "MemLeakFindOn.h"
+
+unsigned int ConnectionException::GetType() const throw()
+{
+	return ConnectionException::ExceptionType;
+}
+
+unsigned int ConnectionException::GetSubType() const throw()
+{
+	return mSubType;
+}
+
+const char * ConnectionException::what() const throw()
+{
+	return mWhat.c_str();
+}
+
+const char * ConnectionException::GetMessage(int SubType)
+{
+	switch(SubType)
+	{
+		case SocketWriteError: return "SocketWriteError";
+		case SocketReadError: return "SocketReadError";
+		case SocketNameLookupError: return "SocketNameLookupError";
+		case SocketShutdownError: return "SocketShutdownError";
+		case SocketConnectError: return "SocketConnectError";
+		case TLSHandshakeFailed: return "TLSHandshakeFailed";
+		case TLSShutdownFailed: return "TLSShutdownFailed";
+		case TLSWriteFailed: return "TLSWriteFailed";
+		case TLSReadFailed: return "TLSReadFailed";
+		case TLSNoPeerCertificate: return "TLSNoPeerCertificate";
+		case TLSPeerCertificateInvalid: return "TLSPeerCertificateInvalid";
+		case TLSClosedWhenWriting: return "TLSClosedWhenWriting";
+		case TLSHandshakeTimedOut: return "TLSHandshakeTimedOut";
+		case Protocol_Timeout: return "Protocol_Timeout";
+		case Protocol_ObjTooBig: return "Protocol_ObjTooBig";
+		case Protocol_BadCommandRecieved: return "Protocol_BadCommandRecieved";
+		case Protocol_UnknownCommandRecieved: return "Protocol_UnknownCommandRecieved";
+		case Protocol_TriedToExecuteReplyCommand: return "Protocol_TriedToExecuteReplyCommand";
+		case Protocol_UnexpectedReply: return "Protocol_UnexpectedReply";
+		case Protocol_HandshakeFailed: return "Protocol_HandshakeFailed";
+		case Protocol_StreamWhenObjExpected: return "Protocol_StreamWhenObjExpected";
+		case Protocol_ObjWhenStreamExpected: return "Protocol_ObjWhenStreamExpected";
+		case Protocol_TimeOutWhenSendingStream: return "Protocol_TimeOutWhenSendingStream";
+		case Protocol_StreamsNotConsumed: return "Protocol_StreamsNotConsumed";
+		default: return "Unknown";
+	}
+}
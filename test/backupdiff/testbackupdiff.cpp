@@ -12,6 +12,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "Test.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupStoreFile.h"
@@ -23,6 +28,9 @@
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreException.h"
 #include "CollectInBufferStream.h"
+#include "ContentDefinedChunker.h"
+#include "MemoryMappedFile.h"
+#include "Utils.h"
 
 #include "MemLeakFindOn.h"
 
@@ -386,6 +394,434 @@ void test_combined_diffs()
 	}
 }
 
+void count_blocks_in_index(const char *filename, int64_t &rNew, int64_t &rOld)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
+	rNew = 0;
+	rOld = 0;
+	for(int64_t b = 0; b < nblocks; ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		if((int64_t)box_ntoh64(en.mEncodedSize) > 0)
+		{
+			rNew++;
+		}
+		else
+		{
+			rOld++;
+		}
+	}
+}
+
+void make_random_file(const char *filename, int size, uint32_t seed,
+	int insert_at = -1, int insert_size = 0)
+{
+	FileStream out(filename, O_WRONLY | O_CREAT | O_EXCL);
+	uint8_t *data = (uint8_t *)::malloc(size);
+	uint32_t r = seed;
+	for(int i = 0; i < size; ++i)
+	{
+		r = (r * 1103515245) + 12345;
+		data[i] = (uint8_t)(r >> 16);
+	}
+	if(insert_at < 0)
+	{
+		out.Write(data, size);
+	}
+	else
+	{
+		out.Write(data, insert_at);
+		uint8_t *extra = (uint8_t *)::malloc(insert_size);
+		::memset(extra, 0x5a, insert_size);
+		out.Write(extra, insert_size);
+		::free(extra);
+		out.Write(data + insert_at, size - insert_at);
+	}
+	::free(data);
+}
+
+// Cuts the file into chunks of the given average size, returning the size
+// and putting the sizes of the chunks in an index, and their data in a set
+int32_t cut_file(const char *filename, int32_t average,
+	std::vector<BackupStoreFileCreation::BlocksAvailableEntry> &rIndex,
+	std::set<std::string> *pChunks = NULL)
+{
+	rIndex.clear();
+	FileStream file(filename);
+	ContentDefinedChunker chunker(file, file.BytesLeftToRead(), average);
+	const uint8_t *data;
+	int32_t size;
+	while(chunker.NextChunk(data, size))
+	{
+		BackupStoreFileCreation::BlocksAvailableEntry entry = {};
+		entry.mSize = size;
+		rIndex.push_back(entry);
+		if(pChunks)
+		{
+			pChunks->insert(std::string((const char *)data, size));
+		}
+	}
+	return average;
+}
+
+void test_content_defined_chunking()
+{
+	// A file, and the same file with some data inserted near the start
+	make_random_file("testfiles/cdc.0", 1024*1024, 42);
+	make_random_file("testfiles/cdc.1", 1024*1024, 42, 3000, 77);
+
+	// Check the chunks cover the file, within the size limits
+	{
+		FileStream file("testfiles/cdc.0");
+		int32_t average = ContentDefinedChunker::AverageSizeForFile(
+			file.BytesLeftToRead());
+		TEST_EQUAL(4096, average);
+		ContentDefinedChunker chunker(file, file.BytesLeftToRead(),
+			average);
+		int64_t total = 0, chunks = 0;
+		bool all_same_size = true;
+		const uint8_t *data;
+		int32_t size, first_size = 0;
+		while(chunker.NextChunk(data, size))
+		{
+			TEST_THAT(data != 0);
+			TEST_THAT(size <= chunker.GetMaximumSize());
+			if(total + size < 1024*1024)
+			{
+				TEST_THAT(size >= chunker.GetMinimumSize());
+			}
+			if(chunks == 0)
+			{
+				first_size = size;
+			}
+			else if(size != first_size)
+			{
+				all_same_size = false;
+			}
+			total += size;
+			++chunks;
+		}
+		TEST_EQUAL(1024*1024, total);
+		TEST_THAT(!all_same_size);
+		// Around the average size
+		TEST_THAT(chunks > (1024*1024) / (average * 2));
+		TEST_THAT(chunks < (1024*1024) / (average / 2));
+	}
+
+	// Chunks found in a mapping of the file are the same as those read
+	// from it, starting part way through, and carrying on from the same
+	// place if the mapping stops working
+	if(MemoryMappedFile::IsSupported())
+	{
+		make_random_file("testfiles/cdc.mapped", 1024*1024, 42);
+		std::vector<int32_t> sizes[3];
+		for(int pass = 0; pass < 3; ++pass)
+		{
+			FileStream file("testfiles/cdc.mapped");
+			file.Seek(1000, IOStream::SeekType_Absolute);
+			MemoryMappedFile mapping(file, 64*1024);
+			TEST_THAT(mapping.IsMapped());
+			ContentDefinedChunker chunker(file, 1024*1024 - 1000,
+				4096, (pass == 0) ? 0 : &mapping);
+			const uint8_t *data;
+			int32_t size;
+			while(chunker.NextChunk(data, size))
+			{
+				TEST_THAT(data != 0);
+				sizes[pass].push_back(size);
+				if(pass == 2 && sizes[pass].size() == 20)
+				{
+					FileStream out("testfiles/cdc.mapped",
+						O_WRONLY | O_APPEND);
+					out.Write("x", 1);
+				}
+			}
+			TEST_EQUAL((pass != 2), mapping.IsMapped());
+		}
+		TEST_THAT(sizes[0] == sizes[1]);
+		TEST_THAT(sizes[0] == sizes[2]);
+	}
+
+	// The chunk size a previous version was cut with is found from its
+	// block sizes, whether it was cut by content or into fixed blocks
+	{
+		std::vector<BackupStoreFileCreation::BlocksAvailableEntry> index;
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeForDiff(
+			NULL, 0, 1024*1024));
+		TEST_EQUAL(4096, cut_file("testfiles/cdc.0", 4096, index));
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+		TEST_EQUAL(8192, cut_file("testfiles/cdc.0", 8192, index));
+		TEST_EQUAL(8192, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+
+		index.resize(100);
+		for(int b = 0; b < 100; ++b)
+		{
+			index[b].mSize = 16384;
+		}
+		index[99].mSize = 200;
+		TEST_EQUAL(16384, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+
+		// A new version keeps it, unless its size has changed a lot
+		TEST_EQUAL(16384, ContentDefinedChunker::AverageSizeForDiff(
+			&index[0], index.size(), 32*1024*1024));
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeForDiff(
+			&index[0], index.size(), 1024*1024));
+
+		// With only a few blocks, it's worked out from the size
+		index.resize(3);
+		TEST_EQUAL(4096, ContentDefinedChunker::AverageSizeOfIndex(
+			&index[0], index.size()));
+	}
+
+	// So it's the same for each of several versions, after the first
+	// one grows past a block size boundary, and most of the chunks in
+	// each version are found in the one before
+	{
+		TEST_EQUAL(8192, ContentDefinedChunker::AverageSizeForFile(
+			16*1024*1024 + 100));
+		make_random_file("testfiles/cdc3.0", 16*1024*1024 - 1000, 7);
+		make_random_file("testfiles/cdc3.1", 16*1024*1024 - 1000, 7,
+			1024*1024, 2000);
+		{
+			FileStream in("testfiles/cdc3.1");
+			FileStream out("testfiles/cdc3.2",
+				O_WRONLY | O_CREAT | O_EXCL);
+			in.CopyStreamTo(out);
+			uint8_t extra[3000];
+			::memset(extra, 0xa5, sizeof(extra));
+			out.Write(extra, sizeof(extra));
+		}
+
+		std::vector<BackupStoreFileCreation::BlocksAvailableEntry>
+			index[3];
+		std::set<std::string> chunks[3];
+		TEST_EQUAL(4096, cut_file("testfiles/cdc3.0",
+			ContentDefinedChunker::AverageSizeForDiff(NULL, 0,
+				16*1024*1024 - 1000), index[0], &chunks[0]));
+		for(int v = 1; v < 3; ++v)
+		{
+			std::ostringstream filename;
+			filename << "testfiles/cdc3." << v;
+			int64_t size = 16*1024*1024 - 1000 + 2000;
+			if(v == 2) size += 3000;
+			TEST_EQUAL_LINE(4096, cut_file(filename.str().c_str(),
+				ContentDefinedChunker::AverageSizeForDiff(
+					&index[v - 1][0], index[v - 1].size(),
+					size), index[v], &chunks[v]),
+				"version " << v);
+
+			int found = 0;
+			for(std::set<std::string>::iterator
+				i = chunks[v].begin(); i != chunks[v].end(); ++i)
+			{
+				if(chunks[v - 1].count(*i)) found++;
+			}
+			TEST_LINE(found > (int)(chunks[v].size() * 99 / 100),
+				"version " << v << ": only " << found << " of " <<
+				chunks[v].size() << " chunks found");
+		}
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(true);
+
+	int64_t nnew, nold;
+	{
+		BackupStoreFilenameClear name("cdc.0");
+		FileStream out("testfiles/cdc.0.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile("testfiles/cdc.0", 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+	count_blocks_in_index("testfiles/cdc.0.encoded", nnew, nold);
+	TEST_EQUAL(0, nold);
+	int64_t blocks_in_original = nnew;
+	{
+		FileStream enc("testfiles/cdc.0.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/cdc.0.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/cdc.0", "testfiles/cdc.0.testdec"));
+	}
+
+	// Diff the changed file. All but the chunk with the insertion, and
+	// perhaps its neighbours, should be found without a rolling search
+	{
+		FileStream blockindex("testfiles/cdc.0.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		BackupStoreFilenameClear name("cdc.1");
+		FileStream out("testfiles/cdc.1.diff", O_WRONLY | O_CREAT | O_EXCL);
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff("testfiles/cdc.1",
+				1 /* dir ID */, name, 3000 /* diffing from */,
+				blockindex, IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0, &completelyDifferent));
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	count_blocks_in_index("testfiles/cdc.1.diff", nnew, nold);
+	TEST_THAT(nnew >= 1 && nnew <= 3);
+	TEST_THAT(nold >= blocks_in_original - 3);
+	{
+		FileStream diff("testfiles/cdc.1.diff");
+		FileStream diff2("testfiles/cdc.1.diff");
+		FileStream from("testfiles/cdc.0.encoded");
+		FileStream out("testfiles/cdc.1.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	{
+		FileStream enc("testfiles/cdc.1.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/cdc.1.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/cdc.1", "testfiles/cdc.1.testdec"));
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(false);
+}
+
+int32_t get_block_index_magic(const char *filename)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	return ntohl(hdr.mMagicValue);
+}
+
+std::auto_ptr<IOStream> encode_diff(const char *to_orig,
+	const char *from_encoded, bool &rCompletelyDifferent)
+{
+	FileStream blockindex(from_encoded);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+	BackupStoreFilenameClear name("filename");
+	std::auto_ptr<IOStream> encoded(
+		BackupStoreFile::EncodeFileDiff(to_orig, 1 /* dir ID */, name,
+			4000 /* diffing from */, blockindex,
+			IOStream::TimeOutInfinite,
+			NULL, // DiffTimer interface
+			0, &rCompletelyDifferent));
+	return encoded;
+}
+
+void test_fast_block_checksums()
+{
+	BackupStoreFile::SetFastBlockChecksums(true);
+
+	// Diff against a file with an MD5 index. The blocks are found in the
+	// same way, but the new index has XXH3 checksums for all of them.
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f2",
+			"testfiles/f1.encoded", completelyDifferent));
+		FileStream out("testfiles/f2.xxh3.diff", O_WRONLY | O_CREAT | O_EXCL);
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.xxh3.diff"));
+	int64_t nnew, nold;
+	count_blocks_in_index("testfiles/f2.xxh3.diff", nnew, nold);
+	TEST_EQUAL(7, nnew);
+	TEST_EQUAL(32, nold);
+	{
+		FileStream diff("testfiles/f2.xxh3.diff");
+		FileStream diff2("testfiles/f2.xxh3.diff");
+		FileStream from("testfiles/f1.encoded");
+		FileStream out("testfiles/f2.xxh3.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.xxh3.encoded"));
+	{
+		FileStream enc("testfiles/f2.xxh3.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f2.xxh3.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f2", "testfiles/f2.xxh3.testdec"));
+	}
+	{
+		FileStream index("testfiles/f2.xxh3.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex("testfiles/f2", index, IOStream::TimeOutInfinite));
+	}
+
+	// The old version, rebuilt from a reverse diff, keeps its MD5 index
+	{
+		FileStream diff("testfiles/f2.xxh3.diff");
+		FileStream from("testfiles/f1.encoded");
+		FileStream from2("testfiles/f1.encoded");
+		FileStream reversed("testfiles/f2.xxh3.revdiff", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::ReverseDiffFile(diff, from, from2, reversed, 2);
+	}
+	{
+		FileStream diff("testfiles/f2.xxh3.revdiff");
+		FileStream diff2("testfiles/f2.xxh3.revdiff");
+		FileStream from("testfiles/f2.xxh3.encoded");
+		FileStream out("testfiles/f2.xxh3.rebuilt", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	TEST_THAT(files_identical("testfiles/f1.encoded", "testfiles/f2.xxh3.rebuilt"));
+
+	// Diff against the file with the XXH3 index
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f3",
+			"testfiles/f2.xxh3.encoded", completelyDifferent));
+		FileStream out("testfiles/f3.xxh3.diff", O_WRONLY | O_CREAT | O_EXCL);
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	count_blocks_in_index("testfiles/f3.xxh3.diff", nnew, nold);
+	TEST_EQUAL(1, nnew);
+	TEST_EQUAL(29, nold);
+	{
+		FileStream diff("testfiles/f3.xxh3.diff");
+		FileStream diff2("testfiles/f3.xxh3.diff");
+		FileStream from("testfiles/f2.xxh3.encoded");
+		FileStream out("testfiles/f3.xxh3.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	{
+		FileStream enc("testfiles/f3.xxh3.encoded");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f3.xxh3.testdec", IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f3", "testfiles/f3.xxh3.testdec"));
+	}
+
+	// The checksums of reused blocks are calculated again from the data,
+	// so the upload must fail if it's no longer what was diffed.
+	{
+		FileStream copy("testfiles/f2.changing", O_WRONLY | O_CREAT | O_EXCL);
+		FileStream orig("testfiles/f2");
+		orig.CopyStreamTo(copy);
+	}
+	{
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(encode_diff("testfiles/f2.changing",
+			"testfiles/f1.encoded", completelyDifferent));
+		TEST_THAT(!completelyDifferent);
+
+		// Overwrite the data in place, keeping the same size
+		int64_t size = 0;
+		TEST_THAT(FileExists("testfiles/f2.changing", &size));
+		uint8_t *data = (uint8_t *)::malloc(size);
+		::memset(data, 0xa5, size);
+		{
+			FileStream rewrite("testfiles/f2.changing", O_WRONLY);
+			rewrite.Write(data, size);
+		}
+		::free(data);
+
+		CollectInBufferStream out;
+		TEST_CHECK_THROWS(encoded->CopyStreamTo(out),
+			BackupStoreException, SourceFileChangedWhileEncoding);
+	}
+
+	BackupStoreFile::SetFastBlockChecksums(false);
+}
+
 int test(int argc, const char *argv[])
 {
 	// Want to trace out all the details
@@ -440,12 +876,25 @@ int test(int argc, const char *argv[])
 	// delete a little data
 	test_diff(3, 4, 3, 25);
 
+	// Files are mapped into memory where possible. Check that reading
+	// them instead, as is done when they can't be, gives the same results.
+	MemoryMappedFile::SetEnabled(false);
+
+	// Encode the new blocks of the rest with several threads, which
+	// work ahead of the block being sent
+	BackupStoreFile::SetEncodingThreads(3);
+
 	// 1 byte insertion between two blocks
 	test_diff(4, 5, 1, 28);
 
 	// a file with some new content at the very beginning
 	// NOTE: You might expect the last numbers to be 2, 29, but the small 1 byte block isn't searched for
 	test_diff(5, 6, 3, 28);
+
+	MemoryMappedFile::SetEnabled(true);
+
+	// Split the files into small segments, searched by several threads
+	BackupStoreFile::SetDiffingThreads(4, 16*1024);
 	
 	// some new content at the very end
 	// NOTE: 1 byte block deleted, so number aren't what you'd initial expect.
@@ -456,6 +905,9 @@ int test(int argc, const char *argv[])
 	
 	// diff to zero sized file
 	test_diff(8, 9, 0, 0, true /* completely different expected */);
+
+	BackupStoreFile::SetDiffingThreads(1);
+	BackupStoreFile::SetEncodingThreads(1);
 	
 	// Test that combining diffs works
 	test_combined_diffs();
@@ -522,6 +974,12 @@ int test(int argc, const char *argv[])
 			0, 0), BackupStoreException, CannotDiffAnIncompleteStoreFile);
 	}
 
+	// Cut files into blocks by content, and diff them
+	test_content_defined_chunking();
+
+	// Write block indexes with XXH3 checksums, and diff between formats
+	test_fast_block_checksums();
+
 	// Found a nasty case where files of lots of the same thing 
 	// suck up lots of processor time -- because of lots of matches 
 	// found. Check this out!
@@ -12,12 +12,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_SYS_TIME_H
+	#include <sys/time.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
 #include "Archive.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupProtocol.h"
 #include "BackupStoreAccountDatabase.h"
 #include "BackupStoreAccounts.h"
+#include "BackupStoreBundle.h"
 #include "BackupStoreConfigVerify.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
@@ -29,7 +38,10 @@
 #include "BackupStoreObjectMagic.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "BoxPortsAndFiles.h"
+#include "BackupStoreFileWire.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
 #include "Configuration.h"
 #include "FileStream.h"
 #include "HousekeepStoreAccount.h"
@@ -38,6 +50,7 @@
 #include "RaidFileException.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
+#include "RunStatusProvider.h"
 #include "SSLLib.h"
 #include "ServerControl.h"
 #include "Socket.h"
@@ -2472,6 +2485,309 @@ bool test_encoding()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+bool test_encoding_with_other_compression()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// Data which every codec can compress
+	int encfile[ENCFILE_SIZE];
+	for(int l = 0; l < ENCFILE_SIZE; ++l)
+	{
+		encfile[l] = (l % 97) * 173;
+	}
+
+	// Data which doesn't compress at all
+	int random[ENCFILE_SIZE];
+	uint32_t state = 12345;
+	for(int l = 0; l < ENCFILE_SIZE; ++l)
+	{
+		state = state * 1103515245 + 12345;
+		random[l] = state ^ (state >> 16);
+	}
+
+	for(int type = 0; type < CompressCodec::NumberOfTypes; ++type)
+	{
+		std::string name(CompressCodec::GetName(type));
+		if(!CompressCodec::IsSupported(type))
+		{
+			BOX_NOTICE("Not testing " << name << " compression, "
+				"as this build doesn't support it");
+			TEST_CHECK_THROWS(BackupStoreFile::SetCompression(type),
+				CompressException, CodecNotSupported);
+			continue;
+		}
+
+		BOX_INFO("Testing encoding with " << name << " compression");
+		BackupStoreFile::SetCompression(type);
+
+		// Compressible blocks are compressed with the chosen codec,
+		// which is recorded in the header
+		{
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(sizeof(encfile)));
+			int encSize = BackupStoreFile::EncodeChunk(encfile,
+				sizeof(encfile), encoded);
+			TEST_THAT(encSize < (int)sizeof(encfile));
+			uint8_t header = encoded.mpBuffer[0];
+			TEST_THAT((header & HEADER_CHUNK_IS_COMPRESSED) != 0);
+			TEST_EQUAL(type, ((header >> HEADER_COMPRESSION_SHIFT) &
+				HEADER_COMPRESSION_MASK));
+
+			int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(sizeof(encfile));
+			uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+			int decSize = BackupStoreFile::DecodeChunk(encoded.mpBuffer, encSize, decoded, decBlockSize);
+			TEST_EQUAL((int)sizeof(encfile), decSize);
+			TEST_THAT(::memcmp(encfile, decoded, sizeof(encfile)) == 0);
+			free(decoded);
+		}
+
+		// Blocks which don't get smaller are stored uncompressed
+		{
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(sizeof(random)));
+			int encSize = BackupStoreFile::EncodeChunk(random,
+				sizeof(random), encoded);
+			uint8_t header = encoded.mpBuffer[0];
+			TEST_EQUAL(0, (header & HEADER_CHUNK_IS_COMPRESSED));
+			TEST_EQUAL(0, (header >> HEADER_COMPRESSION_SHIFT));
+
+			int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(sizeof(random));
+			uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+			int decSize = BackupStoreFile::DecodeChunk(encoded.mpBuffer, encSize, decoded, decBlockSize);
+			TEST_EQUAL((int)sizeof(random), decSize);
+			TEST_THAT(::memcmp(random, decoded, sizeof(random)) == 0);
+			free(decoded);
+		}
+
+		// Whole files
+		{
+			std::string filename("testfiles/testenc_" + name);
+			{
+				FileStream f(filename, O_WRONLY | O_CREAT);
+				for(int l = 0; l < 16; ++l)
+				{
+					f.Write(encfile, sizeof(encfile));
+					f.Write(random, sizeof(random));
+				}
+			}
+
+			BackupStoreFilenameClear storeFilename(filename);
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFile(filename, 32,
+					storeFilename));
+			CollectInBufferStream e;
+			encoded->CopyStreamTo(e);
+			e.SetForReading();
+			TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(e));
+
+			e.Seek(0, IOStream::SeekType_Absolute);
+			std::string decodedFilename(filename + "_dec");
+			UNLINK_IF_EXISTS(decodedFilename.c_str());
+			BackupStoreFile::DecodeFile(e, decodedFilename.c_str(),
+				IOStream::TimeOutInfinite);
+			FileStream original(filename);
+			FileStream decoded(decodedFilename);
+			CollectInBufferStream originalData, decodedData;
+			original.CopyStreamTo(originalData);
+			decoded.CopyStreamTo(decodedData);
+			TEST_EQUAL(originalData.GetSize(), decodedData.GetSize());
+			TEST_THAT(::memcmp(originalData.GetBuffer(),
+				decodedData.GetBuffer(),
+				originalData.GetSize()) == 0);
+		}
+	}
+
+	BackupStoreFile::SetCompression(CompressCodec::Zlib);
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_incompressible_data()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	int encfile[ENCFILE_SIZE];
+	for(int l = 0; l < ENCFILE_SIZE; ++l)
+	{
+		encfile[l] = (l % 97) * 173;
+	}
+
+	int random[ENCFILE_SIZE];
+	uint32_t state = 54321;
+	for(int l = 0; l < ENCFILE_SIZE; ++l)
+	{
+		state = state * 1103515245 + 12345;
+		random[l] = state ^ (state >> 16);
+	}
+
+	TEST_THAT(BackupStoreFile::IsChunkCompressible(encfile, sizeof(encfile)));
+	TEST_THAT(!BackupStoreFile::IsChunkCompressible(random, sizeof(random)));
+	// Too small to tell, so it's worth trying
+	TEST_THAT(BackupStoreFile::IsChunkCompressible(random, 512));
+
+	// Incompressible chunks aren't given to the compressor at all, and
+	// are counted in the statistics
+	{
+		BackupStoreFile::ResetStats();
+		BackupStoreFile::EncodingBuffer encoded;
+		encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(sizeof(random)));
+		int encSize = BackupStoreFile::EncodeChunk(random,
+			sizeof(random), encoded);
+		TEST_EQUAL(0, (encoded.mpBuffer[0] & HEADER_CHUNK_IS_COMPRESSED));
+		TEST_EQUAL(0, BackupStoreFile::msStats.mBytesCompressed);
+		TEST_EQUAL((int64_t)sizeof(random),
+			BackupStoreFile::msStats.mBytesNotCompressed);
+
+		int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(sizeof(random));
+		uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+		int decSize = BackupStoreFile::DecodeChunk(encoded.mpBuffer, encSize, decoded, decBlockSize);
+		TEST_EQUAL((int)sizeof(random), decSize);
+		TEST_THAT(::memcmp(random, decoded, sizeof(random)) == 0);
+		free(decoded);
+
+		// Unless the caller says not to try
+		BackupStoreFile::ResetStats();
+		BackupStoreFile::EncodeChunk(encfile, sizeof(encfile), encoded,
+			false /* TryCompressing */);
+		TEST_EQUAL(0, (encoded.mpBuffer[0] & HEADER_CHUNK_IS_COMPRESSED));
+		TEST_EQUAL((int64_t)sizeof(encfile),
+			BackupStoreFile::msStats.mBytesNotCompressed);
+	}
+
+	// A file which starts with incompressible data
+	const int blockSize = 4096;
+	const char *filename = "testfiles/testenc_incompressible";
+	{
+		FileStream f(filename, O_WRONLY | O_CREAT | O_TRUNC);
+		for(int l = 0; l < 4; ++l)
+		{
+			f.Write(random, blockSize);
+		}
+		for(int l = 0; l < 4; ++l)
+		{
+			f.Write(encfile, blockSize);
+		}
+	}
+
+	BackupStoreFilenameClear storeFilename(filename);
+	int limit = BackupStoreFile::GetIncompressibleChunkLimit();
+
+	// Giving up after two blocks means the compressible ones are
+	// never compressed
+	{
+		BackupStoreFile::SetIncompressibleChunkLimit(2);
+		BackupStoreFile::ResetStats();
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFile(filename, 32, storeFilename));
+		CollectInBufferStream e;
+		encoded->CopyStreamTo(e);
+		TEST_EQUAL(0, BackupStoreFile::msStats.mBytesCompressed);
+		TEST_EQUAL(8 * blockSize,
+			BackupStoreFile::msStats.mBytesNotCompressed);
+	}
+
+	// Never giving up means they are, and the file can still be
+	// decoded
+	{
+		BackupStoreFile::SetIncompressibleChunkLimit(0);
+		BackupStoreFile::ResetStats();
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFile(filename, 32, storeFilename));
+		CollectInBufferStream e;
+		encoded->CopyStreamTo(e);
+		e.SetForReading();
+		TEST_EQUAL(4 * blockSize,
+			BackupStoreFile::msStats.mBytesCompressed);
+		TEST_EQUAL(4 * blockSize,
+			BackupStoreFile::msStats.mBytesNotCompressed);
+		TEST_THAT(BackupStoreFile::msStats.mCompressionTime >= 0);
+		TEST_THAT(BackupStoreFile::EstimateCompressionTimeSaved() >= 0);
+
+		std::string decodedFilename(std::string(filename) + "_dec");
+		UNLINK_IF_EXISTS(decodedFilename.c_str());
+		BackupStoreFile::DecodeFile(e, decodedFilename.c_str(),
+			IOStream::TimeOutInfinite);
+		FileStream original(filename);
+		FileStream decoded(decodedFilename);
+		TEST_THAT(original.CompareWith(decoded));
+	}
+
+	BackupStoreFile::SetIncompressibleChunkLimit(limit);
+	BackupStoreFile::ResetStats();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+class StopAfterReads : public RunStatusProvider
+{
+public:
+	StopAfterReads(int Reads) : mReads(Reads) { }
+	virtual bool StopRun() { return (mReads-- <= 0); }
+private:
+	int mReads;
+};
+
+bool test_encoding_with_threads()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// A file of many blocks, some compressible and some not
+	const char *filename = "testfiles/testenc_threads";
+	{
+		FileStream f(filename, O_WRONLY | O_CREAT | O_TRUNC);
+		uint32_t state = 9876;
+		int data[ENCFILE_SIZE];
+		for(int b = 0; b < 64; ++b)
+		{
+			for(int l = 0; l < ENCFILE_SIZE; ++l)
+			{
+				state = state * 1103515245 + 12345;
+				data[l] = (b % 3 == 0) ? (state ^ (state >> 16))
+					: (int)((l % 97) * 173 + b);
+			}
+			f.Write(data, sizeof(data));
+		}
+	}
+
+	BackupStoreFilenameClear storeFilename(filename);
+	BackupStoreFile::SetEncodingThreads(4);
+
+	// The blocks come out in order, so the file decodes as usual
+	{
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFile(filename, 32, storeFilename));
+		CollectInBufferStream e;
+		encoded->CopyStreamTo(e, IOStream::TimeOutInfinite, 1000);
+		e.SetForReading();
+		TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(e));
+
+		e.Seek(0, IOStream::SeekType_Absolute);
+		std::string decodedFilename(std::string(filename) + "_dec");
+		UNLINK_IF_EXISTS(decodedFilename.c_str());
+		BackupStoreFile::DecodeFile(e, decodedFilename.c_str(),
+			IOStream::TimeOutInfinite);
+		FileStream original(filename);
+		FileStream decoded(decodedFilename);
+		TEST_THAT(original.CompareWith(decoded));
+	}
+
+	// Stopping part way through doesn't leave threads running
+	{
+		StopAfterReads stop(20);
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFile(filename, 32, storeFilename,
+				NULL, NULL, &stop));
+		CollectInBufferStream e;
+		TEST_CHECK_THROWS(encoded->CopyStreamTo(e,
+			IOStream::TimeOutInfinite, 1000),
+			BackupStoreException, SignalReceived);
+	}
+
+	BackupStoreFile::SetEncodingThreads(1);
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_symlinks()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -2765,6 +3081,360 @@ bool test_housekeeping_deletes_files()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+#define BUNDLE_TEST_FILES	10
+
+int64_t run_housekeeping_with_bundles(int64_t MaxBundledFileSize)
+{
+	std::auto_ptr<BackupStoreAccountDatabase> apAccounts(
+		BackupStoreAccountDatabase::Read("testfiles/accounts.txt"));
+	BackupStoreAccountDatabase::Entry account =
+		apAccounts->GetEntry(0x1234567);
+	HousekeepStoreAccount housekeeping(account.GetID(),
+		BackupStoreAccounts::GetAccountRoot(account),
+		account.GetDiscSet(), NULL);
+	housekeeping.SetMaxBundledFileSize(MaxBundledFileSize);
+	TEST_THAT(housekeeping.DoHousekeeping(true /* keep trying forever */));
+	return housekeeping.GetErrorCount();
+}
+
+bool check_bundled_file(BackupProtocolCallable& protocol, int64_t ObjectID,
+	int Number)
+{
+	std::ostringstream original;
+	original << "testfiles/bundle" << Number;
+	std::string retrieved = original.str() + "_retrieved";
+
+	std::auto_ptr<BackupProtocolSuccess> getFile(protocol.QueryGetFile(
+		BACKUPSTORE_ROOT_DIRECTORY_ID, ObjectID));
+	TEST_EQUAL_OR(ObjectID, getFile->GetObjectID(), return false);
+	std::auto_ptr<IOStream> filestream(protocol.ReceiveStream());
+	UNLINK_IF_EXISTS(retrieved.c_str());
+	BackupStoreFile::DecodeFile(*filestream, retrieved.c_str(),
+		IOStream::TimeOutInfinite);
+
+	FileStream in1(original.str());
+	FileStream in2(retrieved);
+	TEST_THAT_OR(in1.CompareWith(in2), return false);
+
+	std::auto_ptr<BackupProtocolSuccess> getblockindex(
+		protocol.QueryGetBlockIndexByID(ObjectID));
+	TEST_EQUAL_OR(ObjectID, getblockindex->GetObjectID(), return false);
+	std::auto_ptr<IOStream> blockIndexStream(protocol.ReceiveStream());
+	CollectInBufferStream blockIndex;
+	blockIndexStream->CopyStreamTo(blockIndex);
+	return blockIndex.GetSize() > 0;
+}
+
+bool object_has_own_file(int64_t ObjectID)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID, "backup/01234567/", 0,
+		filename, false);
+	return RaidFileRead::FileExists(0, filename);
+}
+
+bool test_small_files_are_bundled()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	int64_t ids[BUNDLE_TEST_FILES];
+	{
+		BackupProtocolLocal2 protocol(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+
+		for(int f = 0; f < BUNDLE_TEST_FILES; ++f)
+		{
+			std::ostringstream filename, contents;
+			filename << "testfiles/bundle" << f;
+			contents << "small file number " << f;
+			{
+				FileStream out(filename.str(),
+					O_WRONLY | O_CREAT | O_TRUNC);
+				out.Write(contents.str().c_str(), contents.str().size());
+			}
+
+			BackupStoreFilenameClear storeFilename(filename.str());
+			int64_t modtime;
+			std::auto_ptr<IOStream> upload(BackupStoreFile::EncodeFile(
+				filename.str(), BACKUPSTORE_ROOT_DIRECTORY_ID,
+				storeFilename, &modtime));
+			ids[f] = protocol.QueryStoreFile(
+				BACKUPSTORE_ROOT_DIRECTORY_ID, modtime, modtime,
+				0 /* diff from ID */, storeFilename,
+				upload)->GetObjectID();
+			set_refcount(ids[f], 1);
+		}
+		protocol.QueryFinished();
+	}
+
+	// Without bundling turned on, nothing happens
+	TEST_EQUAL(0, run_housekeeping_with_bundles(0));
+	TEST_THAT(object_has_own_file(ids[0]));
+	TEST_THAT(!RaidFileRead::FileExists(0, "backup/01234567/bundles"));
+
+	// With it, the files are packed into one bundle, and the server
+	// still finds them
+	TEST_EQUAL(0, run_housekeeping_with_bundles(64*1024));
+	TEST_THAT(RaidFileRead::FileExists(0, "backup/01234567/bundles"));
+	for(int f = 0; f < BUNDLE_TEST_FILES; ++f)
+	{
+		TEST_THAT(!object_has_own_file(ids[f]));
+	}
+	TEST_THAT(check_account());
+
+	// Readers don't lock the account, so this one stays connected while
+	// housekeeping changes the bundles under it
+	BackupProtocolLocal2 reader(0x01234567, "test", "backup/01234567/", 0,
+		true); // read-only
+	for(int f = 0; f < BUNDLE_TEST_FILES; ++f)
+	{
+		TEST_THAT(check_bundled_file(reader, ids[f], f));
+	}
+
+	// Delete most of the files, and have housekeeping remove them, so
+	// that the bundle is rewritten with just the rest
+	int64_t oldBundleID = 0;
+	{
+		BackupProtocolLocal2 protocol(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+		for(int f = 3; f < BUNDLE_TEST_FILES; ++f)
+		{
+			std::ostringstream filename;
+			filename << "testfiles/bundle" << f;
+			protocol.QueryDeleteFile(BACKUPSTORE_ROOT_DIRECTORY_ID,
+				BackupStoreFilenameClear(filename.str()));
+		}
+		protocol.QueryFinished();
+
+		BackupStoreBundleIndex index("backup/01234567/", 0);
+		index.Load();
+		TEST_THAT_OR(index.Find(ids[0]) != 0, FAIL);
+		oldBundleID = index.Find(ids[0])->mBundleID;
+	}
+
+	TEST_THAT(change_account_limits("0B", "20000B"));
+	TEST_EQUAL(0, run_housekeeping_with_bundles(64*1024));
+	for(int f = 3; f < BUNDLE_TEST_FILES; ++f)
+	{
+		set_refcount(ids[f], 0);
+	}
+	// The refcount database still covers the deleted files
+	ExpectedRefCounts.resize(ids[BUNDLE_TEST_FILES - 1] + 1, 0);
+
+	// The old bundle is gone, but the reader which knew about it finds
+	// the files in the new one
+	TEST_THAT(!object_has_own_file(oldBundleID));
+	for(int f = 0; f < 3; ++f)
+	{
+		TEST_THAT(!object_has_own_file(ids[f]));
+		TEST_THAT(check_bundled_file(reader, ids[f], f));
+	}
+	reader.QueryFinished();
+
+	{
+		BackupProtocolLocal2 protocol(0x01234567, "test",
+			"backup/01234567/", 0, true); // read-only
+		for(int f = 0; f < 3; ++f)
+		{
+			TEST_THAT(check_bundled_file(protocol, ids[f], f));
+		}
+		for(int f = 3; f < BUNDLE_TEST_FILES; ++f)
+		{
+			TEST_COMMAND_RETURNS_ERROR(protocol,
+				QueryGetObject(ids[f]), Err_DoesNotExist);
+		}
+		protocol.QueryFinished();
+	}
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+std::string staged_filename(int64_t StagedID)
+{
+	std::string filename;
+	StoreStructure::MakeStagedFilename(StagedID, "backup/01234567/", 0,
+		filename);
+	return filename;
+}
+
+bool test_helper_sessions_stage_files()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	BackupProtocolLocal2 writer(0x01234567, "test", "backup/01234567/",
+		0, false); // Not read-only
+
+	// A helper session doesn't need the write lock, which the writer has
+	BackupStoreContext helperContext(0x01234567,
+		(HousekeepingInterface *)NULL, "helper");
+	helperContext.SetClientHasAccount("backup/01234567/", 0);
+	BackupProtocolLocal helper(helperContext);
+	helper.QueryVersion(BACKUP_STORE_SERVER_VERSION);
+	helper.QueryLogin(0x01234567, BackupProtocolLogin::Flags_Helper);
+	TEST_THAT(helperContext.SessionIsHelper());
+	TEST_THAT(helperContext.SessionIsReadOnly());
+
+	const char *filenames[] = {"testfiles/staged0", "testfiles/staged1"};
+	int64_t stagedIDs[2], modtimes[2];
+	for(int f = 0; f < 2; ++f)
+	{
+		{
+			FileStream out(filenames[f],
+				O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(filenames[f], strlen(filenames[f]));
+		}
+
+		BackupStoreFilenameClear storeFilename(filenames[f]);
+		std::auto_ptr<IOStream> upload(BackupStoreFile::EncodeFile(
+			filenames[f], BACKUPSTORE_ROOT_DIRECTORY_ID,
+			storeFilename, &modtimes[f]));
+		stagedIDs[f] = helper.QueryStageFile(upload)->GetObjectID();
+		TEST_THAT(stagedIDs[f] != 0);
+		TEST_THAT(TestFileExists(staged_filename(stagedIDs[f]).c_str()));
+	}
+
+	// But it can't change the store
+	TEST_COMMAND_RETURNS_ERROR(helper,
+		QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID, modtimes[0],
+			modtimes[0], stagedIDs[0],
+			BackupStoreFilenameClear(filenames[0])),
+		Err_SessionReadOnly);
+	helper.QueryFinished();
+
+	// The writer stores the file, and the staged copy goes away
+	int64_t id = writer.QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID,
+		modtimes[0], modtimes[0], stagedIDs[0],
+		BackupStoreFilenameClear(filenames[0]))->GetObjectID();
+	set_refcount(id, 1);
+	TEST_THAT(object_has_own_file(id));
+	TEST_THAT(!TestFileExists(staged_filename(stagedIDs[0]).c_str()));
+	TEST_COMMAND_RETURNS_ERROR(writer,
+		QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID, modtimes[0],
+			modtimes[0], stagedIDs[0],
+			BackupStoreFilenameClear(filenames[0])),
+		Err_DoesNotExist);
+
+	{
+		std::auto_ptr<BackupProtocolSuccess> getFile(writer.QueryGetFile(
+			BACKUPSTORE_ROOT_DIRECTORY_ID, id));
+		std::auto_ptr<IOStream> filestream(writer.ReceiveStream());
+		std::string retrieved("testfiles/staged0_retrieved");
+		BackupStoreFile::DecodeFile(*filestream, retrieved.c_str(),
+			IOStream::TimeOutInfinite);
+		FileStream in1(filenames[0]);
+		FileStream in2(retrieved);
+		TEST_THAT(in1.CompareWith(in2));
+	}
+
+	// Ordinary read-only sessions can't stage files
+	{
+		BackupProtocolLocal2 readOnly(0x01234567, "test",
+			"backup/01234567/", 0, true); // read-only
+		std::auto_ptr<IOStream> upload(new ZeroStream(1000));
+		TEST_COMMAND_RETURNS_ERROR(readOnly, QueryStageFile(upload),
+			Err_SessionReadOnly);
+		readOnly.QueryFinished();
+	}
+
+	// Files which were staged but not stored are deleted at the end of
+	// the writer session
+	writer.QueryFinished();
+	TEST_THAT(!TestFileExists(staged_filename(stagedIDs[1]).c_str()));
+	TEST_THAT(check_account());
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+int count_staged_files()
+{
+	int count = 0;
+	DIR *dir = ::opendir("testfiles/0_0/backup/01234567");
+	TEST_THAT_OR(dir != 0, return -1);
+	struct dirent *en = 0;
+	while((en = ::readdir(dir)) != 0)
+	{
+		if(::strncmp(en->d_name, STORE_STAGED_FILE_PREFIX,
+			strlen(STORE_STAGED_FILE_PREFIX)) == 0)
+		{
+			count++;
+		}
+	}
+	::closedir(dir);
+	return count;
+}
+
+bool test_staged_files_are_limited()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	BackupStoreContext helperContext(0x01234567,
+		(HousekeepingInterface *)NULL, "helper");
+	helperContext.SetClientHasAccount("backup/01234567/", 0);
+	BackupProtocolLocal helper(helperContext);
+	helper.QueryVersion(BACKUP_STORE_SERVER_VERSION);
+	helper.QueryLogin(0x01234567, BackupProtocolLogin::Flags_Helper);
+	helperContext.SetMaxStagedBytes(10000);
+
+	BackupStoreContext otherContext(0x01234567,
+		(HousekeepingInterface *)NULL, "other helper");
+	otherContext.SetClientHasAccount("backup/01234567/", 0);
+	BackupProtocolLocal other(otherContext);
+	other.QueryVersion(BACKUP_STORE_SERVER_VERSION);
+	other.QueryLogin(0x01234567, BackupProtocolLogin::Flags_Helper);
+	otherContext.SetMaxStagedBytes(10000);
+
+	// An account can't have more staged at once than it's allowed, by
+	// the same session or by another one
+	std::auto_ptr<IOStream> upload(new ZeroStream(6000));
+	int64_t stagedID = helper.QueryStageFile(upload)->GetObjectID();
+	upload.reset(new ZeroStream(6000));
+	TEST_COMMAND_RETURNS_ERROR(helper, QueryStageFile(upload),
+		Err_StorageLimitExceeded);
+	upload.reset(new ZeroStream(6000));
+	TEST_COMMAND_RETURNS_ERROR(other, QueryStageFile(upload),
+		Err_StorageLimitExceeded);
+	TEST_EQUAL(1, count_staged_files());
+
+	// But files which have been stored since don't count
+	TEST_THAT(::unlink(staged_filename(stagedID).c_str()) == 0);
+	upload.reset(new ZeroStream(6000));
+	int64_t otherStagedID = other.QueryStageFile(upload)->GetObjectID();
+	TEST_EQUAL(1, count_staged_files());
+	TEST_THAT(::unlink(staged_filename(otherStagedID).c_str()) == 0);
+	other.QueryFinished();
+
+	upload.reset(new ZeroStream(6000));
+	stagedID = helper.QueryStageFile(upload)->GetObjectID();
+	TEST_EQUAL(1, count_staged_files());
+
+	// Nothing can be staged when the account is over its hard limit,
+	// even if it went over after the session logged in
+	{
+		std::auto_ptr<BackupStoreInfo> info(BackupStoreInfo::Load(
+			0x01234567, "backup/01234567/", 0,
+			false /* read/write */));
+		info->ChangeLimits(0, 0);
+		info->Save();
+	}
+	upload.reset(new ZeroStream(10));
+	TEST_COMMAND_RETURNS_ERROR(helper, QueryStageFile(upload),
+		Err_StorageLimitExceeded);
+	TEST_EQUAL(1, count_staged_files());
+	helper.QueryFinished();
+
+	// No writer session finished, so housekeeping deletes the staged
+	// file, but only once it's old enough that nothing will store it
+	TEST_THAT(run_housekeeping_and_check_account());
+	TEST_EQUAL(1, count_staged_files());
+	struct timeval times[2] = {};
+	times[1].tv_sec = time(NULL) - STORE_STAGED_FILE_ORPHAN_AGE - 60;
+	TEST_THAT(::utimes(staged_filename(stagedID).c_str(), times) == 0);
+	TEST_THAT(run_housekeeping_and_check_account());
+	TEST_EQUAL(0, count_staged_files());
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_account_limits_respected()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -3296,6 +3966,9 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_directory_parent_entry_tracks_directory_size());
 	TEST_THAT(test_cannot_open_multiple_writable_connections());
 	TEST_THAT(test_encoding());
+	TEST_THAT(test_encoding_with_other_compression());
+	TEST_THAT(test_incompressible_data());
+	TEST_THAT(test_encoding_with_threads());
 	TEST_THAT(test_symlinks());
 	TEST_THAT(test_store_info());
 
@@ -3312,6 +3985,9 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_account_limits_respected());
 	TEST_THAT(test_multiple_uploads());
 	TEST_THAT(test_housekeeping_deletes_files());
+	TEST_THAT(test_small_files_are_bundled());
+	TEST_THAT(test_helper_sessions_stage_files());
+	TEST_THAT(test_staged_files_are_limited());
 	TEST_THAT(test_read_write_attr_streamformat());
 
 	return finish_test_suite();
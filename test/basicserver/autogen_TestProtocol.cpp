@@ -0,0 +1,1258 @@
+
+// Auto-generated file -- do not edit
+
+#include "Box.h"
+
+#include <sstream>
+
+#include "autogen_TestProtocol.h"
+#include "CollectInBufferStream.h"
+#include "MemBlockStream.h"
+#include "SelfFlushingStream.h"
+#include "SocketStream.h"
+#include "TestContext.h"
+#include "MemLeakFindOn.h"
+std::auto_ptr<TestProtocolMessage> TestProtocolMessage::DoCommand(TestProtocolReplyable &rProtocol,
+	TestContext &rContext) const
+{
+	THROW_EXCEPTION(ConnectionException, Protocol_TriedToExecuteReplyCommand)
+}
+
+std::auto_ptr<TestProtocolMessage> TestProtocolMessage::DoCommand(TestProtocolReplyable &rProtocol,
+	TestContext &rContext, IOStream& rDataStream) const
+{
+	THROW_EXCEPTION(ConnectionException, Protocol_TriedToExecuteReplyCommand)
+}
+TestProtocolError::TestProtocolError()
+	: mType(0),
+	  mSubType(0)
+{
+}
+TestProtocolError::TestProtocolError(const TestProtocolError &rToCopy)
+	: mType(rToCopy.mType),
+	  mSubType(rToCopy.mSubType)
+{
+}
+TestProtocolError::~TestProtocolError()
+{
+}
+int TestProtocolError::GetType() const
+{
+	return 0;
+}
+void TestProtocolError::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mType);
+	rProtocol.Read(mSubType);
+}
+TestProtocolError::TestProtocolError(int32_t Type, int32_t SubType)
+	: mType(Type),
+	  mSubType(SubType)
+{
+}
+void TestProtocolError::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mType);
+	rProtocol.Write(mSubType);
+}
+bool TestProtocolError::IsError(int &rTypeOut, int &rSubTypeOut) const
+{
+	rTypeOut = mType;
+	rSubTypeOut = mSubType;
+	return true;
+}
+std::string TestProtocolError::GetMessage(int subtype)
+{
+	switch(subtype)
+	{
+		default:
+			std::ostringstream out;
+			out << "Unknown subtype " << subtype;
+			return out.str();
+	}
+}
+std::string TestProtocolError::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Error(" << (mType == 0 ? "0x" : "") << std::hex << std::showbase << mType << std::dec << "," << (mSubType == 0 ? "0x" : "") << std::hex << std::showbase << mSubType << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolError::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Error(" << (mType == 0 ? "0x" : "") << std::hex << std::showbase << mType << std::dec << "," << (mSubType == 0 ? "0x" : "") << std::hex << std::showbase << mSubType << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolError::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolHello::TestProtocolHello()
+	: mNumber32(0),
+	  mNumber16(0),
+	  mNumber8(0)
+{
+}
+TestProtocolHello::TestProtocolHello(const TestProtocolHello &rToCopy)
+	: mNumber32(rToCopy.mNumber32),
+	  mNumber16(rToCopy.mNumber16),
+	  mNumber8(rToCopy.mNumber8),
+	  mText(rToCopy.mText)
+{
+}
+TestProtocolHello::~TestProtocolHello()
+{
+}
+int TestProtocolHello::GetType() const
+{
+	return 1;
+}
+void TestProtocolHello::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mNumber32);
+	rProtocol.Read(mNumber16);
+	rProtocol.Read(mNumber8);
+	rProtocol.Read(mText);
+}
+TestProtocolHello::TestProtocolHello(int32_t Number32, int16_t Number16, int8_t Number8, const std::string& Text)
+	: mNumber32(Number32),
+	  mNumber16(Number16),
+	  mNumber8(Number8),
+	  mText(Text)
+{
+}
+void TestProtocolHello::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mNumber32);
+	rProtocol.Write(mNumber16);
+	rProtocol.Write(mNumber8);
+	rProtocol.Write(mText);
+}
+std::string TestProtocolHello::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Hello(" << (mNumber32 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber32 << std::dec << "," << (mNumber16 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber16 << std::dec << "," << (mNumber8 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber8 << std::dec << "," << mText.c_str() << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolHello::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Hello(" << (mNumber32 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber32 << std::dec << "," << (mNumber16 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber16 << std::dec << "," << (mNumber8 == 0 ? "0x" : "") << std::hex << std::showbase << mNumber8 << std::dec << "," << mText.c_str() << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolHello::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolLists::TestProtocolLists()
+{
+}
+TestProtocolLists::TestProtocolLists(const TestProtocolLists &rToCopy)
+	: mLotsOfText(rToCopy.mLotsOfText)
+{
+}
+TestProtocolLists::~TestProtocolLists()
+{
+}
+int TestProtocolLists::GetType() const
+{
+	return 2;
+}
+void TestProtocolLists::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.ReadVector(mLotsOfText);
+}
+TestProtocolLists::TestProtocolLists(const std::vector<std::string>& LotsOfText)
+	: mLotsOfText(LotsOfText)
+{
+}
+void TestProtocolLists::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.WriteVector(mLotsOfText);
+}
+std::string TestProtocolLists::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Lists(" << "OPAQUE" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolLists::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Lists(" << "OPAQUE" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolLists::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolListsReply::TestProtocolListsReply()
+	: mNumberOfStrings(0)
+{
+}
+TestProtocolListsReply::TestProtocolListsReply(const TestProtocolListsReply &rToCopy)
+	: mNumberOfStrings(rToCopy.mNumberOfStrings)
+{
+}
+TestProtocolListsReply::~TestProtocolListsReply()
+{
+}
+int TestProtocolListsReply::GetType() const
+{
+	return 3;
+}
+void TestProtocolListsReply::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mNumberOfStrings);
+}
+TestProtocolListsReply::TestProtocolListsReply(int32_t NumberOfStrings)
+	: mNumberOfStrings(NumberOfStrings)
+{
+}
+void TestProtocolListsReply::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mNumberOfStrings);
+}
+std::string TestProtocolListsReply::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "ListsReply(" << (mNumberOfStrings == 0 ? "0x" : "") << std::hex << std::showbase << mNumberOfStrings << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolListsReply::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "ListsReply(" << (mNumberOfStrings == 0 ? "0x" : "") << std::hex << std::showbase << mNumberOfStrings << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolListsReply::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolQuit::TestProtocolQuit()
+{
+}
+TestProtocolQuit::TestProtocolQuit(const TestProtocolQuit &rToCopy)
+{
+}
+TestProtocolQuit::~TestProtocolQuit()
+{
+}
+int TestProtocolQuit::GetType() const
+{
+	return 4;
+}
+void TestProtocolQuit::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+}
+void TestProtocolQuit::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+}
+bool TestProtocolQuit::IsConversationEnd() const
+{
+	return true;
+}
+std::string TestProtocolQuit::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Quit(" << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolQuit::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Quit(" << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolQuit::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolSimple::TestProtocolSimple()
+	: mValue(0)
+{
+}
+TestProtocolSimple::TestProtocolSimple(const TestProtocolSimple &rToCopy)
+	: mValue(rToCopy.mValue)
+{
+}
+TestProtocolSimple::~TestProtocolSimple()
+{
+}
+int TestProtocolSimple::GetType() const
+{
+	return 5;
+}
+void TestProtocolSimple::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mValue);
+}
+TestProtocolSimple::TestProtocolSimple(int32_t Value)
+	: mValue(Value)
+{
+}
+void TestProtocolSimple::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mValue);
+}
+std::string TestProtocolSimple::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "Simple(" << (mValue == 0 ? "0x" : "") << std::hex << std::showbase << mValue << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolSimple::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "Simple(" << (mValue == 0 ? "0x" : "") << std::hex << std::showbase << mValue << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolSimple::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolSimpleReply::TestProtocolSimpleReply()
+	: mValuePlusOne(0)
+{
+}
+TestProtocolSimpleReply::TestProtocolSimpleReply(const TestProtocolSimpleReply &rToCopy)
+	: mValuePlusOne(rToCopy.mValuePlusOne)
+{
+}
+TestProtocolSimpleReply::~TestProtocolSimpleReply()
+{
+}
+int TestProtocolSimpleReply::GetType() const
+{
+	return 6;
+}
+void TestProtocolSimpleReply::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mValuePlusOne);
+}
+TestProtocolSimpleReply::TestProtocolSimpleReply(int32_t ValuePlusOne)
+	: mValuePlusOne(ValuePlusOne)
+{
+}
+void TestProtocolSimpleReply::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mValuePlusOne);
+}
+std::string TestProtocolSimpleReply::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "SimpleReply(" << (mValuePlusOne == 0 ? "0x" : "") << std::hex << std::showbase << mValuePlusOne << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolSimpleReply::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "SimpleReply(" << (mValuePlusOne == 0 ? "0x" : "") << std::hex << std::showbase << mValuePlusOne << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolSimpleReply::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolGetStream::TestProtocolGetStream()
+	: mStartingValue(0),
+	  mUncertainSize(0)
+{
+}
+TestProtocolGetStream::TestProtocolGetStream(const TestProtocolGetStream &rToCopy)
+	: mStartingValue(rToCopy.mStartingValue),
+	  mUncertainSize(rToCopy.mUncertainSize)
+{
+}
+TestProtocolGetStream::~TestProtocolGetStream()
+{
+}
+int TestProtocolGetStream::GetType() const
+{
+	return 7;
+}
+void TestProtocolGetStream::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mStartingValue);
+	rProtocol.Read(mUncertainSize);
+}
+TestProtocolGetStream::TestProtocolGetStream(int32_t StartingValue, bool UncertainSize)
+	: mStartingValue(StartingValue),
+	  mUncertainSize(UncertainSize)
+{
+}
+void TestProtocolGetStream::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mStartingValue);
+	rProtocol.Write(mUncertainSize);
+}
+std::string TestProtocolGetStream::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "GetStream(" << (mStartingValue == 0 ? "0x" : "") << std::hex << std::showbase << mStartingValue << std::dec << "," << ((mUncertainSize)?"true":"false") << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolGetStream::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "GetStream(" << (mStartingValue == 0 ? "0x" : "") << std::hex << std::showbase << mStartingValue << std::dec << "," << ((mUncertainSize)?"true":"false") << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolGetStream::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolSendStream::TestProtocolSendStream()
+	: mValue(0)
+{
+}
+TestProtocolSendStream::TestProtocolSendStream(const TestProtocolSendStream &rToCopy)
+	: mValue(rToCopy.mValue)
+{
+}
+TestProtocolSendStream::~TestProtocolSendStream()
+{
+}
+int TestProtocolSendStream::GetType() const
+{
+	return 8;
+}
+void TestProtocolSendStream::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mValue);
+}
+TestProtocolSendStream::TestProtocolSendStream(int64_t Value)
+	: mValue(Value)
+{
+}
+void TestProtocolSendStream::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mValue);
+}
+std::string TestProtocolSendStream::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "SendStream(" << (mValue == 0 ? "0x" : "") << std::hex << std::showbase << mValue << std::dec << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolSendStream::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "SendStream(" << (mValue == 0 ? "0x" : "") << std::hex << std::showbase << mValue << std::dec << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolSendStream::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolString::TestProtocolString()
+{
+}
+TestProtocolString::TestProtocolString(const TestProtocolString &rToCopy)
+	: mTest(rToCopy.mTest)
+{
+}
+TestProtocolString::~TestProtocolString()
+{
+}
+int TestProtocolString::GetType() const
+{
+	return 9;
+}
+void TestProtocolString::SetPropertiesFromStreamData(Protocol &rProtocol)
+{
+	rProtocol.Read(mTest);
+}
+TestProtocolString::TestProtocolString(const std::string& Test)
+	: mTest(Test)
+{
+}
+void TestProtocolString::WritePropertiesToStreamData(Protocol &rProtocol) const
+{
+	rProtocol.Write(mTest);
+}
+std::string TestProtocolString::ToString() const
+{
+	std::ostringstream oss;
+	try
+	{
+		oss << "String(" << mTest.c_str() << ")";
+	}
+	catch(std::exception &e)
+	{
+		oss << "Failed to log command: " << e.what();
+	}
+	return oss.str();
+}
+void TestProtocolString::LogSysLog(const char *Action) const
+{
+	try
+	{
+		BOX_TRACE(Action << " " << "String(" << mTest.c_str() << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_WARNING("Failed to log command: " << Action << ": " <<
+			e.what());
+	}
+}
+void TestProtocolString::LogFile(const char *Action, FILE *File) const
+{
+	::fprintf(File, "%s %s\n", Action, ToString().c_str());
+	::fflush(File);
+}
+TestProtocolClientServer::TestProtocolClientServer()
+: mLastErrorType(Protocol::NoError),
+  mLastErrorSubType(Protocol::NoError)
+{ }
+
+TestProtocolClientServer::~TestProtocolClientServer()
+{ }
+
+const char *TestProtocol::GetProtocolIdentString()
+{
+	return "Test-0.00";
+}
+
+std::auto_ptr<Message> TestProtocol::MakeMessage(int ObjType)
+{
+	switch(ObjType)
+	{
+	case 0:
+		return std::auto_ptr<Message>(new TestProtocolError());
+		break;
+	case 1:
+		return std::auto_ptr<Message>(new TestProtocolHello());
+		break;
+	case 2:
+		return std::auto_ptr<Message>(new TestProtocolLists());
+		break;
+	case 3:
+		return std::auto_ptr<Message>(new TestProtocolListsReply());
+		break;
+	case 4:
+		return std::auto_ptr<Message>(new TestProtocolQuit());
+		break;
+	case 5:
+		return std::auto_ptr<Message>(new TestProtocolSimple());
+		break;
+	case 6:
+		return std::auto_ptr<Message>(new TestProtocolSimpleReply());
+		break;
+	case 7:
+		return std::auto_ptr<Message>(new TestProtocolGetStream());
+		break;
+	case 8:
+		return std::auto_ptr<Message>(new TestProtocolSendStream());
+		break;
+	case 9:
+		return std::auto_ptr<Message>(new TestProtocolString());
+		break;
+	default:
+		THROW_EXCEPTION(ConnectionException, Protocol_UnknownCommandRecieved)
+	}
+}
+
+TestProtocolReplyable::~TestProtocolReplyable()
+{
+	// If there were any streams left over, there's no longer any way to
+	// access them, and we're responsible for them, so we'd better delete them.
+	DeleteStreamsToSend();
+}
+
+void TestProtocolReplyable::SendStreamAfterCommand(std::auto_ptr<IOStream> apStream)
+{
+	ASSERT(apStream.get() != NULL);
+	mStreamsToSend.push_back(apStream.release());
+}
+
+void TestProtocolReplyable::DeleteStreamsToSend()
+{
+	for(std::list<IOStream*>::iterator i(mStreamsToSend.begin()); i != mStreamsToSend.end(); ++i)
+	{
+		delete (*i);
+	}
+
+	mStreamsToSend.clear();
+}
+
+void TestProtocolCallable::CheckReply(const std::string& requestCommandName,
+	const TestProtocolMessage &rCommand, const TestProtocolMessage &rReply,
+	int expectedType)
+{
+	if(rReply.GetType() == expectedType)
+	{
+		// Correct response, do nothing
+		SetLastError(Protocol::NoError, Protocol::NoError);
+	}
+	else
+	{
+		// Set protocol error
+		int type, subType;
+		
+		if(rReply.IsError(type, subType))
+		{
+			SetLastError(type, subType);
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply,
+				requestCommandName << " command failed: "
+				"received error " <<
+				((TestProtocolError&)rReply).GetMessage());
+		}
+		else
+		{
+			SetLastError(Protocol::UnknownError, Protocol::UnknownError);
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply,
+				requestCommandName << " command failed: "
+				"received unexpected response type " <<
+				rReply.GetType());
+		}
+	}
+
+	// As a client, if we get an unexpected reply later, we'll want to know
+	// the last command that we executed, and the reply, to help debug the
+	// server.
+	mPreviousCommand = rCommand.ToString();
+	mPreviousReply = rReply.ToString();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Protocol::GetLastError(int &, int &)
+//		Purpose: Returns true if there was an error, and type and subtype if there was.
+//		Created: 2003/08/19
+//
+// --------------------------------------------------------------------------
+bool TestProtocolClientServer::GetLastError(int &rTypeOut, int &rSubTypeOut)
+{
+	if(mLastErrorType == Protocol::NoError)
+	{
+		// no error.
+		return false;
+	}
+	
+	// Return type and subtype in args
+	rTypeOut = mLastErrorType;
+	rSubTypeOut = mLastErrorSubType;
+	
+	// and unset them
+	mLastErrorType = Protocol::NoError;
+	mLastErrorSubType = Protocol::NoError;
+	
+	return true;
+}
+
+std::auto_ptr<IOStream> TestProtocolClient::ReceiveStream()
+{
+	try
+	{
+		return TestProtocol::ReceiveStream();
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_ObjWhenStreamExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_ObjWhenStreamExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+}
+TestProtocolClient::TestProtocolClient(std::auto_ptr<SocketStream> apConn)
+: TestProtocol(apConn)
+{ }
+TestProtocolClient::~TestProtocolClient()
+{
+}
+std::auto_ptr<TestProtocolMessage> TestProtocolClient::Receive()
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+
+	try
+	{
+		apReply = std::auto_ptr<TestProtocolMessage>(
+			static_cast<TestProtocolMessage *>
+			(TestProtocol::ReceiveInternal().release()));
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_StreamWhenObjExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_StreamWhenObjExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+
+	if(GetLogToSysLog())
+	{
+		apReply->LogSysLog("Receive");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		apReply->LogFile("Receive", GetLogToFile());
+	}
+
+	return apReply;
+}
+
+void TestProtocolClient::Send(const TestProtocolMessage &rObject)
+{
+	if(GetLogToSysLog())
+	{
+		rObject.LogSysLog("Send");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		rObject.LogFile("Send", GetLogToFile());
+	}
+
+	Protocol::SendInternal(rObject);
+}
+
+std::auto_ptr<TestProtocolHello> TestProtocolClient::Query(const TestProtocolHello &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("Hello", rQuery, *apReply, 1);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolHello>(
+		static_cast<TestProtocolHello *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolListsReply> TestProtocolClient::Query(const TestProtocolLists &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("Lists", rQuery, *apReply, 3);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolListsReply>(
+		static_cast<TestProtocolListsReply *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolQuit> TestProtocolClient::Query(const TestProtocolQuit &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("Quit", rQuery, *apReply, 4);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolQuit>(
+		static_cast<TestProtocolQuit *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolSimpleReply> TestProtocolClient::Query(const TestProtocolSimple &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("Simple", rQuery, *apReply, 6);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolSimpleReply>(
+		static_cast<TestProtocolSimpleReply *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolGetStream> TestProtocolClient::Query(const TestProtocolGetStream &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("GetStream", rQuery, *apReply, 7);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolGetStream>(
+		static_cast<TestProtocolGetStream *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolGetStream> TestProtocolClient::Query(const TestProtocolSendStream &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	// Send query
+	Send(rQuery);
+	// Send stream after the command
+	try
+	{
+		SendStream(*apDataStream);
+	}
+	catch (BoxException &e)
+	{
+		BOX_WARNING("Failed to send stream after command: " <<
+			rQuery.ToString() << ": " << e.what());
+		throw;
+	}
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("SendStream", rQuery, *apReply, 7);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolGetStream>(
+		static_cast<TestProtocolGetStream *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolString> TestProtocolClient::Query(const TestProtocolString &rQuery)
+{
+	// Send query
+	Send(rQuery);
+
+	
+	// Wait for the reply
+	std::auto_ptr<TestProtocolMessage> apReply = Receive();
+	CheckReply("String", rQuery, *apReply, 9);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolString>(
+		static_cast<TestProtocolString *>(apReply.release()));
+}
+std::auto_ptr<IOStream> TestProtocolServer::ReceiveStream()
+{
+	try
+	{
+		return TestProtocol::ReceiveStream();
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_ObjWhenStreamExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_ObjWhenStreamExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+}
+TestProtocolServer::TestProtocolServer(std::auto_ptr<SocketStream> apConn)
+: TestProtocol(apConn)
+{ }
+TestProtocolServer::~TestProtocolServer()
+{
+	DeleteStreamsToSend();
+}
+std::auto_ptr<TestProtocolMessage> TestProtocolServer::Receive()
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+
+	try
+	{
+		apReply = std::auto_ptr<TestProtocolMessage>(
+			static_cast<TestProtocolMessage *>
+			(TestProtocol::ReceiveInternal().release()));
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() == ConnectionException::Protocol_StreamWhenObjExpected)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_StreamWhenObjExpected,
+				"Last exchange was " << mPreviousCommand <<
+				" => " << mPreviousReply);
+		}
+		else
+		{
+			throw;
+		}
+	}
+
+	if(GetLogToSysLog())
+	{
+		apReply->LogSysLog("Receive");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		apReply->LogFile("Receive", GetLogToFile());
+	}
+
+	return apReply;
+}
+
+void TestProtocolServer::Send(const TestProtocolMessage &rObject)
+{
+	if(GetLogToSysLog())
+	{
+		rObject.LogSysLog("Send");
+	}
+
+	if(GetLogToFile() != 0)
+	{
+		rObject.LogFile("Send", GetLogToFile());
+	}
+
+	Protocol::SendInternal(rObject);
+}
+
+void TestProtocolServer::DoServer(TestContext &rContext)
+{
+	// Handshake with client
+	Handshake();
+
+	// Command processing loop
+	bool inProgress = true;
+	while(inProgress)
+	{
+		// Get an object from the conversation
+		std::auto_ptr<TestProtocolMessage> pobj = Receive();
+		std::auto_ptr<TestProtocolMessage> preply;
+
+		// Run the command
+		try
+		{
+			try
+			{
+				if(pobj->HasStreamWithCommand())
+				{
+					std::auto_ptr<IOStream> apDataStream = ReceiveStream();
+					SelfFlushingStream autoflush(*apDataStream);
+					preply = pobj->DoCommand(*this, rContext, *apDataStream);
+				}
+				else
+				{
+					preply = pobj->DoCommand(*this, rContext);
+				}
+			}
+			catch(BoxException &e)
+			{
+				// First try a the built-in exception handler
+				preply = HandleException(e);
+			}
+		}
+		catch (...)
+		{
+			// Fallback in case the exception isn't a BoxException
+			// or the exception handler fails as well. This path
+			// throws the exception upwards, killing the process
+			// that handles the current client.
+			Send(TestProtocolError(-1));
+			throw;
+		}
+
+		// Send the reply
+		Send(*preply);
+
+		// Send any streams
+		for(std::list<IOStream*>::iterator
+			i =  mStreamsToSend.begin();
+			i != mStreamsToSend.end(); ++i)
+		{
+			SendStream(**i);
+		}
+
+		// As a server, if we get an unexpected message later, we'll
+		// want to know the last command that we received, and the
+		// reply, to help debug our response to it.
+		mPreviousCommand = pobj->ToString();
+		std::ostringstream reply;
+		reply << preply->ToString() << " and " <<
+			mStreamsToSend.size() << " streams";
+		mPreviousReply = reply.str();
+
+		// Delete these streams
+		DeleteStreamsToSend();
+
+		// Does this end the conversation?
+		if(pobj->IsConversationEnd())
+		{
+			inProgress = false;
+		}
+	}
+}
+
+TestProtocolLocal::TestProtocolLocal(TestContext &rContext)
+: mrContext(rContext)
+{ }
+TestProtocolLocal::~TestProtocolLocal()
+{
+}
+std::auto_ptr<TestProtocolMessage> TestProtocolLocal::Receive()
+{
+	return mapLastReply;
+}
+void TestProtocolLocal::Send(const TestProtocolMessage &rObject)
+{
+	mapLastReply = rObject.DoCommand(*this, mrContext);
+}
+std::auto_ptr<TestProtocolHello> TestProtocolLocal::Query(const TestProtocolHello &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Hello", rQuery, *apReply, 1);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolHello>(
+		static_cast<TestProtocolHello *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolListsReply> TestProtocolLocal::Query(const TestProtocolLists &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Lists", rQuery, *apReply, 3);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolListsReply>(
+		static_cast<TestProtocolListsReply *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolQuit> TestProtocolLocal::Query(const TestProtocolQuit &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Quit", rQuery, *apReply, 4);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolQuit>(
+		static_cast<TestProtocolQuit *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolSimpleReply> TestProtocolLocal::Query(const TestProtocolSimple &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("Simple", rQuery, *apReply, 6);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolSimpleReply>(
+		static_cast<TestProtocolSimpleReply *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolGetStream> TestProtocolLocal::Query(const TestProtocolGetStream &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("GetStream", rQuery, *apReply, 7);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolGetStream>(
+		static_cast<TestProtocolGetStream *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolGetStream> TestProtocolLocal::Query(const TestProtocolSendStream &rQuery, std::auto_ptr<IOStream> apDataStream)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext, *apDataStream);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("SendStream", rQuery, *apReply, 7);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolGetStream>(
+		static_cast<TestProtocolGetStream *>(apReply.release()));
+}
+std::auto_ptr<TestProtocolString> TestProtocolLocal::Query(const TestProtocolString &rQuery)
+{
+	std::auto_ptr<TestProtocolMessage> apReply;
+	try
+	{
+		apReply = rQuery.DoCommand(*this, mrContext);
+	}
+	catch(BoxException &e)
+	{
+		// First try a the built-in exception handler
+		apReply = HandleException(e);
+	}
+	CheckReply("String", rQuery, *apReply, 9);
+
+	// Correct response, if no exception thrown by CheckReply
+	return std::auto_ptr<TestProtocolString>(
+		static_cast<TestProtocolString *>(apReply.release()));
+}
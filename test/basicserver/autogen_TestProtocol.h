@@ -0,0 +1,571 @@
+// Auto-generated file -- do not edit
+
+#ifndef AUTOGEN_TESTPROTOCOL_H
+#define AUTOGEN_TESTPROTOCOL_H
+
+#include <cstdio>
+#include <list>
+
+#ifndef WIN32
+#include <syslog.h>
+#endif
+
+#include "autogen_ConnectionException.h"
+#include "Protocol.h"
+#include "Message.h"
+#include "SocketStream.h"
+
+
+// need utils file for the server
+#include "Utils.h"
+
+class TestContext;
+
+class TestProtocol;
+class TestProtocolClientServer;
+class TestProtocolCallable;
+class TestProtocolReplyable;
+
+class TestProtocolMessage : public Message
+{
+public:
+	virtual std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext) const;
+	virtual std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const;
+	virtual bool HasStreamWithCommand() const = 0;
+};
+
+class TestProtocolReply
+{
+};
+
+class TestProtocolRequest
+{
+};
+
+class TestProtocolSendReceive {
+public:
+	virtual void Send(const TestProtocolMessage &rObject) = 0;
+	virtual std::auto_ptr<TestProtocolMessage> Receive() = 0;
+};
+
+class TestProtocol : public Protocol
+{
+public:
+	TestProtocol(std::auto_ptr<SocketStream> apConn)
+	: Protocol(apConn)
+	{ }
+	virtual ~TestProtocol() { }
+	virtual std::auto_ptr<Message> MakeMessage(int ObjType);
+	virtual const char *GetProtocolIdentString();
+
+private:
+	TestProtocol(const TestProtocol &rToCopy);
+};
+
+class TestProtocolError : public TestProtocolMessage, public TestProtocolReply
+{
+public:
+	TestProtocolError();
+	TestProtocolError(const TestProtocolError &rToCopy);
+	~TestProtocolError();
+	int GetType() const;
+	enum
+	{
+		TypeID = 0
+	};
+	TestProtocolError(int SubType) : mType(), mSubType(SubType) { }
+	bool IsError(int &rTypeOut, int &rSubTypeOut) const;
+	std::string GetMessage() const { return GetMessage(mSubType); };
+	static std::string GetMessage(int subtype);
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetType() {return mType;}
+	int32_t GetSubType() {return mSubType;}
+	TestProtocolError(int32_t Type, int32_t SubType);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetType(int32_t Type) {mType = Type;}
+	void SetSubType(int32_t SubType) {mSubType = SubType;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mType;
+	int32_t mSubType;
+};
+
+class TestProtocolHello : public TestProtocolMessage, public TestProtocolRequest, public TestProtocolReply
+{
+public:
+	TestProtocolHello();
+	TestProtocolHello(const TestProtocolHello &rToCopy);
+	~TestProtocolHello();
+	int GetType() const;
+	enum
+	{
+		TypeID = 1
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetNumber32() {return mNumber32;}
+	int16_t GetNumber16() {return mNumber16;}
+	int8_t GetNumber8() {return mNumber8;}
+	const std::string& GetText() {return mText;}
+	TestProtocolHello(int32_t Number32, int16_t Number16, int8_t Number8, const std::string& Text);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetNumber32(int32_t Number32) {mNumber32 = Number32;}
+	void SetNumber16(int16_t Number16) {mNumber16 = Number16;}
+	void SetNumber8(int8_t Number8) {mNumber8 = Number8;}
+	void SetText(const std::string& Text) {mText = Text;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mNumber32;
+	int16_t mNumber16;
+	int8_t mNumber8;
+	std::string mText;
+};
+
+class TestProtocolLists : public TestProtocolMessage, public TestProtocolRequest
+{
+public:
+	TestProtocolLists();
+	TestProtocolLists(const TestProtocolLists &rToCopy);
+	~TestProtocolLists();
+	int GetType() const;
+	enum
+	{
+		TypeID = 2
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	const std::vector<std::string>& GetLotsOfText() {return mLotsOfText;}
+	TestProtocolLists(const std::vector<std::string>& LotsOfText);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetLotsOfText(const std::vector<std::string>& LotsOfText) {mLotsOfText = LotsOfText;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	std::vector<std::string> mLotsOfText;
+};
+
+class TestProtocolListsReply : public TestProtocolMessage, public TestProtocolReply
+{
+public:
+	TestProtocolListsReply();
+	TestProtocolListsReply(const TestProtocolListsReply &rToCopy);
+	~TestProtocolListsReply();
+	int GetType() const;
+	enum
+	{
+		TypeID = 3
+	};
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetNumberOfStrings() {return mNumberOfStrings;}
+	TestProtocolListsReply(int32_t NumberOfStrings);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetNumberOfStrings(int32_t NumberOfStrings) {mNumberOfStrings = NumberOfStrings;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mNumberOfStrings;
+};
+
+class TestProtocolQuit : public TestProtocolMessage, public TestProtocolRequest, public TestProtocolReply
+{
+public:
+	TestProtocolQuit();
+	TestProtocolQuit(const TestProtocolQuit &rToCopy);
+	~TestProtocolQuit();
+	int GetType() const;
+	enum
+	{
+		TypeID = 4
+	};
+	bool IsConversationEnd() const;
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+};
+
+class TestProtocolSimple : public TestProtocolMessage, public TestProtocolRequest
+{
+public:
+	TestProtocolSimple();
+	TestProtocolSimple(const TestProtocolSimple &rToCopy);
+	~TestProtocolSimple();
+	int GetType() const;
+	enum
+	{
+		TypeID = 5
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetValue() {return mValue;}
+	TestProtocolSimple(int32_t Value);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetValue(int32_t Value) {mValue = Value;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mValue;
+};
+
+class TestProtocolSimpleReply : public TestProtocolMessage, public TestProtocolReply
+{
+public:
+	TestProtocolSimpleReply();
+	TestProtocolSimpleReply(const TestProtocolSimpleReply &rToCopy);
+	~TestProtocolSimpleReply();
+	int GetType() const;
+	enum
+	{
+		TypeID = 6
+	};
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetValuePlusOne() {return mValuePlusOne;}
+	TestProtocolSimpleReply(int32_t ValuePlusOne);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetValuePlusOne(int32_t ValuePlusOne) {mValuePlusOne = ValuePlusOne;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mValuePlusOne;
+};
+
+class TestProtocolGetStream : public TestProtocolMessage, public TestProtocolRequest, public TestProtocolReply
+{
+public:
+	TestProtocolGetStream();
+	TestProtocolGetStream(const TestProtocolGetStream &rToCopy);
+	~TestProtocolGetStream();
+	int GetType() const;
+	enum
+	{
+		TypeID = 7
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int32_t GetStartingValue() {return mStartingValue;}
+	bool GetUncertainSize() {return mUncertainSize;}
+	TestProtocolGetStream(int32_t StartingValue, bool UncertainSize);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetStartingValue(int32_t StartingValue) {mStartingValue = StartingValue;}
+	void SetUncertainSize(bool UncertainSize) {mUncertainSize = UncertainSize;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int32_t mStartingValue;
+	bool mUncertainSize;
+};
+
+class TestProtocolSendStream : public TestProtocolMessage, public TestProtocolRequest
+{
+public:
+	TestProtocolSendStream();
+	TestProtocolSendStream(const TestProtocolSendStream &rToCopy);
+	~TestProtocolSendStream();
+	int GetType() const;
+	enum
+	{
+		TypeID = 8
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext, IOStream& rDataStream) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, Internal,
+			"This command requires a stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 1; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	int64_t GetValue() {return mValue;}
+	TestProtocolSendStream(int64_t Value);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetValue(int64_t Value) {mValue = Value;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	int64_t mValue;
+};
+
+class TestProtocolString : public TestProtocolMessage, public TestProtocolRequest, public TestProtocolReply
+{
+public:
+	TestProtocolString();
+	TestProtocolString(const TestProtocolString &rToCopy);
+	~TestProtocolString();
+	int GetType() const;
+	enum
+	{
+		TypeID = 9
+	};
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol, 
+		TestContext &rContext) const; // IMPLEMENT THIS
+
+	std::auto_ptr<TestProtocolMessage> DoCommand(TestProtocolReplyable &rProtocol,
+		TestContext &rContext, IOStream& rDataStream) const
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+			"This command requires no stream parameter");
+	}
+	bool HasStreamWithCommand() const { return 0; }
+	void SetPropertiesFromStreamData(Protocol &rProtocol);
+	const std::string& GetTest() {return mTest;}
+	TestProtocolString(const std::string& Test);
+	void WritePropertiesToStreamData(Protocol &rProtocol) const;
+	void SetTest(const std::string& Test) {mTest = Test;}
+	virtual void LogSysLog(const char *Action) const;
+	virtual void LogFile(const char *Action, FILE *file) const;
+	virtual std::string ToString() const;
+private:
+	std::string mTest;
+};
+
+
+class TestProtocolClientServer
+{
+public:
+	TestProtocolClientServer();
+	virtual ~TestProtocolClientServer();
+	virtual std::auto_ptr<IOStream> ReceiveStream() = 0;
+	bool GetLastError(int &rTypeOut, int &rSubTypeOut);
+	int GetLastErrorType() { return mLastErrorSubType; }
+
+protected:
+	void SetLastError(int Type, int SubType)
+	{
+		mLastErrorType = Type;
+		mLastErrorSubType = SubType;
+	}
+	std::string mPreviousCommand;
+	std::string mPreviousReply;
+
+private:
+	TestProtocolClientServer(const TestProtocolClientServer &rToCopy); /* do not call */
+	int mLastErrorType;
+	int mLastErrorSubType;
+};
+
+class TestProtocolReplyable : public virtual TestProtocolClientServer
+{
+public:
+	TestProtocolReplyable() { }
+	virtual ~TestProtocolReplyable();
+
+	virtual int GetTimeout() = 0;
+	void SendStreamAfterCommand(std::auto_ptr<IOStream> apStream);
+
+protected:
+	std::list<IOStream*> mStreamsToSend;
+	void DeleteStreamsToSend();
+	virtual std::auto_ptr<TestProtocolMessage> HandleException(BoxException& e) const;
+
+private:
+	TestProtocolReplyable(const TestProtocolReplyable &rToCopy); /* do not call */
+};
+
+class TestProtocolCallable : public virtual TestProtocolClientServer,
+	public TestProtocolSendReceive
+{
+public:
+	virtual int GetTimeout() = 0;
+
+protected:
+	void CheckReply(const std::string& requestCommandName,
+		const TestProtocolMessage &rCommand, 
+		const TestProtocolMessage &rReply, int expectedType);
+
+public:
+	virtual std::auto_ptr<TestProtocolHello> Query(const TestProtocolHello &rQuery) = 0;
+	virtual std::auto_ptr<TestProtocolListsReply> Query(const TestProtocolLists &rQuery) = 0;
+	virtual std::auto_ptr<TestProtocolQuit> Query(const TestProtocolQuit &rQuery) = 0;
+	virtual std::auto_ptr<TestProtocolSimpleReply> Query(const TestProtocolSimple &rQuery) = 0;
+	virtual std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolGetStream &rQuery) = 0;
+	virtual std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolSendStream &rQuery, std::auto_ptr<IOStream> apStream) = 0;
+	virtual std::auto_ptr<TestProtocolString> Query(const TestProtocolString &rQuery) = 0;
+
+	inline std::auto_ptr<TestProtocolHello> QueryHello(int32_t Number32, int16_t Number16, int8_t Number8, const std::string& Text)
+	{
+		TestProtocolHello send(Number32, Number16, Number8, Text);
+		return Query(send);
+	}
+	inline std::auto_ptr<TestProtocolListsReply> QueryLists(const std::vector<std::string>& LotsOfText)
+	{
+		TestProtocolLists send(LotsOfText);
+		return Query(send);
+	}
+	inline std::auto_ptr<TestProtocolQuit> QueryQuit()
+	{
+		TestProtocolQuit send;
+		return Query(send);
+	}
+	inline std::auto_ptr<TestProtocolSimpleReply> QuerySimple(int32_t Value)
+	{
+		TestProtocolSimple send(Value);
+		return Query(send);
+	}
+	inline std::auto_ptr<TestProtocolGetStream> QueryGetStream(int32_t StartingValue, bool UncertainSize)
+	{
+		TestProtocolGetStream send(StartingValue, UncertainSize);
+		return Query(send);
+	}
+	inline std::auto_ptr<TestProtocolGetStream> QuerySendStream(int64_t Value, std::auto_ptr<IOStream> apStream)
+	{
+		TestProtocolSendStream send(Value);
+		return Query(send, apStream);
+	}
+	inline std::auto_ptr<TestProtocolString> QueryString(const std::string& Test)
+	{
+		TestProtocolString send(Test);
+		return Query(send);
+	}
+
+};
+class TestProtocolClient : public TestProtocolCallable, public TestProtocol
+{
+public:
+	virtual ~TestProtocolClient();
+	TestProtocolClient(std::auto_ptr<SocketStream> apConn);
+	std::auto_ptr<TestProtocolMessage> Receive();
+	void Send(const TestProtocolMessage &rObject);
+	std::auto_ptr<TestProtocolHello> Query(const TestProtocolHello &rQuery);
+	std::auto_ptr<TestProtocolListsReply> Query(const TestProtocolLists &rQuery);
+	std::auto_ptr<TestProtocolQuit> Query(const TestProtocolQuit &rQuery);
+	std::auto_ptr<TestProtocolSimpleReply> Query(const TestProtocolSimple &rQuery);
+	std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolGetStream &rQuery);
+	std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolSendStream &rQuery, std::auto_ptr<IOStream> apStream);
+	std::auto_ptr<TestProtocolString> Query(const TestProtocolString &rQuery);
+	virtual std::auto_ptr<IOStream> ReceiveStream();
+	virtual int GetTimeout()
+	{
+		return TestProtocol::GetTimeout();
+	}
+
+private:
+	TestProtocolClient(const TestProtocolClient &rToCopy); /* no copies */
+};
+
+class TestProtocolServer : public TestProtocolReplyable, public TestProtocol
+{
+public:
+	virtual ~TestProtocolServer();
+	TestProtocolServer(std::auto_ptr<SocketStream> apConn);
+	std::auto_ptr<TestProtocolMessage> Receive();
+	void Send(const TestProtocolMessage &rObject);
+	void DoServer(TestContext &rContext);
+
+	virtual std::auto_ptr<IOStream> ReceiveStream();
+	virtual int GetTimeout()
+	{
+		return TestProtocol::GetTimeout();
+	}
+
+private:
+	TestProtocolServer(const TestProtocolServer &rToCopy); /* no copies */
+};
+
+class TestProtocolLocal : public TestProtocolReplyable, public TestProtocolCallable
+{
+public:
+	virtual ~TestProtocolLocal();
+	TestProtocolLocal(TestContext &rContext);
+	TestProtocolLocal(std::auto_ptr<SocketStream> apConn);
+	std::auto_ptr<TestProtocolMessage> Receive();
+	void Send(const TestProtocolMessage &rObject);
+	std::auto_ptr<TestProtocolHello> Query(const TestProtocolHello &rQuery);
+	std::auto_ptr<TestProtocolListsReply> Query(const TestProtocolLists &rQuery);
+	std::auto_ptr<TestProtocolQuit> Query(const TestProtocolQuit &rQuery);
+	std::auto_ptr<TestProtocolSimpleReply> Query(const TestProtocolSimple &rQuery);
+	std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolGetStream &rQuery);
+	std::auto_ptr<TestProtocolGetStream> Query(const TestProtocolSendStream &rQuery, std::auto_ptr<IOStream> apStream);
+	std::auto_ptr<TestProtocolString> Query(const TestProtocolString &rQuery);
+private:
+	TestContext &mrContext;
+	std::auto_ptr<TestProtocolMessage> mapLastReply;
+public:
+	virtual std::auto_ptr<IOStream> ReceiveStream()
+	{
+		if(mStreamsToSend.empty())
+		{
+			THROW_EXCEPTION_MESSAGE(CommonException, Internal,
+				"Tried to ReceiveStream when none was sent or "
+				"made available");
+		}
+
+		std::auto_ptr<IOStream> apStream(mStreamsToSend.front());
+		mStreamsToSend.pop_front();
+		return apStream;
+	}
+	virtual int GetTimeout()
+	{
+		return IOStream::TimeOutInfinite;
+	}
+
+private:
+	TestProtocolLocal(const TestProtocolLocal &rToCopy); /* no copies */
+};
+
+#endif // AUTOGEN_TESTPROTOCOL_H
+
@@ -45,8 +45,11 @@
 	#include <sys/syscall.h>
 #endif
 
+#include "Archive.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientContext.h"
+#include "BackupClientDirectoryScanner.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupClientInodeToIDMap.h"
 #include "BackupClientRestore.h"
@@ -68,6 +71,7 @@
 #include "CollectInBufferStream.h"
 #include "CommonException.h"
 #include "Configuration.h"
+#include "depot.h"
 #include "FileModificationTime.h"
 #include "FileStream.h"
 #include "intercept.h"
@@ -79,6 +83,7 @@
 #include "ServerControl.h"
 #include "Socket.h"
 #include "SocketStreamTLS.h"
+#include "StoreStructure.h"
 #include "StoreTestUtils.h"
 #include "TLSContext.h"
 #include "Test.h"
@@ -1177,6 +1182,146 @@ public:
 	}
 };
 
+bool test_inode_map()
+{
+	SETUP_TEST_BBACKUPD();
+
+	// Later records replace earlier ones for the same inode, and the
+	// map can be read once it's closed
+	{
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/test_map.db", false, true);
+		int64_t oid, dir;
+		for(int i = 1; i <= 1000; i++)
+		{
+			map.AddToMap(i * 7, i, 1000 + i, "path");
+		}
+		map.AddToMap(7, 42, 43, "testfiles/renamed");
+		map.AddToMap(0x123456789abcdefLL, 44, 45, "");
+		TEST_CHECK_THROWS(map.Lookup(7, oid, dir), CommonException,
+			NotSupported);
+		map.Close();
+	}
+
+	{
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/test_map.db", true, false);
+		int64_t oid, dir;
+		std::string path;
+		TEST_THAT(map.Lookup(7, oid, dir, &path));
+		TEST_EQUAL(42, oid);
+		TEST_EQUAL(43, dir);
+		TEST_EQUAL("testfiles/renamed", path);
+		TEST_THAT(map.Lookup(7 * 500, oid, dir, &path));
+		TEST_EQUAL(500, oid);
+		TEST_EQUAL(1500, dir);
+		TEST_EQUAL("path", path);
+		TEST_THAT(map.Lookup(0x123456789abcdefLL, oid, dir, &path));
+		TEST_EQUAL(44, oid);
+		TEST_EQUAL("", path);
+		TEST_THAT(!map.Lookup(8, oid, dir));
+		TEST_THAT(!map.Lookup(7 * 1001, oid, dir));
+		TEST_CHECK_THROWS(map.AddToMap(8, 1, 1, ""),
+			BackupStoreException, InodeMapIsReadOnly);
+	}
+
+	// The table is built in parts, and entries which don't fit in one
+	// go in the next, or after the last one. With so few, each part
+	// is one slot, and some of these maps have slots after the end.
+	int overflowed = 0;
+	for(int set = 1; set <= 20; set++)
+	{
+		{
+			BackupClientInodeToIDMap map;
+			map.Open("testfiles/test_map.db", false, true);
+			for(int i = 1; i <= 46; i++)
+			{
+				map.AddToMap(i * set, i, set, "");
+			}
+			map.AddToMap(set, 99, set, "");
+			map.Close();
+		}
+		TEST_THAT(!FileExists("testfiles/test_map.db.t"));
+
+		// Header, records and 64 slots
+		if(TestGetFileSize("testfiles/test_map.db") >
+			28 + (28 * 47) + (64 * 16))
+		{
+			overflowed++;
+		}
+
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/test_map.db", true, false);
+		int found = 0;
+		for(int i = 1; i <= 46; i++)
+		{
+			int64_t oid, dir;
+			if(map.Lookup(i * set, oid, dir) &&
+				oid == ((i == 1) ? 99 : i) && dir == set)
+			{
+				found++;
+			}
+		}
+		TEST_EQUAL(46, found);
+	}
+	TEST_THAT(overflowed > 0);
+
+	// One which wasn't finished is corrupt, so that the daemon deletes it
+	{
+		FileStream file("testfiles/test_map.db", O_WRONLY);
+		file.Write("XXXX", 4);
+	}
+	{
+		BackupClientInodeToIDMap map;
+		Logger::LevelGuard(Logging::GetConsole(), Log::FATAL);
+		TEST_CHECK_THROWS(map.Open("testfiles/test_map.db", true, false),
+			BackupStoreException, BerkelyDBFailure);
+	}
+
+	// Maps in the old QDBM format are converted when they're opened
+	{
+		TEST_THAT(::unlink("testfiles/test_map.db") == 0);
+		DEPOT *pDepot = dpopen("testfiles/test_map.db",
+			DP_OWRITER | DP_OCREAT, 0);
+		TEST_THAT_OR(pDepot != NULL, FAIL);
+
+		const char *versionKey = "BackupClientInodeToIDMap.Version";
+		int32_t version = 2;
+		TEST_THAT(dpput(pDepot, versionKey, strlen(versionKey),
+			(const char *)&version, sizeof(version), DP_DKEEP));
+
+		CollectInBufferStream buf;
+		Archive arc(buf, IOStream::TimeOutInfinite);
+		arc.WriteExact((uint64_t)12);
+		arc.WriteExact((uint64_t)34);
+		arc.Write(std::string("testfiles/old"));
+		buf.SetForReading();
+
+		InodeRefType inode = 56;
+		TEST_THAT(dpput(pDepot, (const char *)&inode, sizeof(inode),
+			(const char *)buf.GetBuffer(), buf.GetSize(), DP_DOVER));
+		TEST_THAT(dpclose(pDepot));
+
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/test_map.db", true, false);
+		int64_t oid, dir;
+		std::string path;
+		TEST_THAT(map.Lookup(56, oid, dir, &path));
+		TEST_EQUAL(12, oid);
+		TEST_EQUAL(34, dir);
+		TEST_EQUAL("testfiles/old", path);
+		TEST_THAT(!map.Lookup(57, oid, dir));
+		map.Close();
+
+		// And it's been replaced, so it can be opened again
+		map.Open("testfiles/test_map.db", true, false);
+		TEST_THAT(map.Lookup(56, oid, dir, &path));
+		TEST_THAT(!FileExists("testfiles/test_map.db.c"));
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
 bool test_readdirectory_on_nonexistent_dir()
 {
 	SETUP_WITH_BBSTORED();
@@ -1527,9 +1672,10 @@ bool test_ssl_keepalives()
 	TEST_EQUAL(2, NumBlocks);
 
 	// Now modify the file and run another backup. It's the only file that should be
-	// diffed, and DoKeepAlive() should be called for each block size in the original
-	// file, times the number of times that block size fits into the new file,
-	// i.e. 1 + (4269 / 256) = 18 times (plus the same 32 while scanning, as above).
+	// diffed. All the block sizes in the original file are scanned for in a single
+	// pass, which calls DoKeepAlive() when it starts and then after every buffer's
+	// worth of the new file. The file fits in one buffer, so that's once (plus the
+	// same 32 while scanning, as above).
 
 	{
 		int fd = open("testfiles/TestDir1/x1/dsfdsfs98.fd", O_WRONLY);
@@ -1548,8 +1694,573 @@ bool test_ssl_keepalives()
 
 	apContext = bbackupd.RunSyncNow();
 	pContext = (MockClientContext *)(apContext.get());
-	TEST_EQUAL(NUM_KEEPALIVES_BASE + (4269/4096) + (4269/173),
-		pContext->mNumKeepAlivesPolled);
+	TEST_EQUAL(NUM_KEEPALIVES_BASE + 1, pContext->mNumKeepAlivesPolled);
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+class BlockIndexCountingBackupProtocolLocal : public BackupProtocolLocal2
+{
+public:
+	int mNumBlockIndexQueries;
+
+public:
+	BlockIndexCountingBackupProtocolLocal(int32_t AccountNumber,
+		const std::string& ConnectionDetails,
+		const std::string& AccountRootDir, int DiscSetNumber,
+		bool ReadOnly)
+	: BackupProtocolLocal2(AccountNumber, ConnectionDetails, AccountRootDir,
+		DiscSetNumber, ReadOnly),
+	  mNumBlockIndexQueries(0)
+	{ }
+
+	std::auto_ptr<BackupProtocolSuccess> Query(
+		const BackupProtocolGetBlockIndexByName &rQuery)
+	{
+		mNumBlockIndexQueries++;
+		return BackupProtocolLocal::Query(rQuery);
+	}
+};
+
+bool test_block_index_cache()
+{
+	SETUP_TEST_BBACKUPD();
+
+	BlockIndexCountingBackupProtocolLocal connection(0x01234567, "test",
+		"backup/01234567/", 0, false);
+	MockBackupDaemon bbackupd(connection);
+	TEST_THAT_OR(setup_test_bbackupd(bbackupd), FAIL);
+
+	// Turn the cache on, by adding it to a copy of the usual config
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-blockindex.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string line("BlockIndexCache = yes\n");
+		out.Write(line.c_str(), line.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-blockindex.conf"), FAIL);
+
+	// The initial backup uploads everything in full, so nothing needs
+	// to be fetched, but the index of every large file is kept.
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, connection.mNumBlockIndexQueries);
+	TEST_THAT(TestDirExists("testfiles/bbackupd-data/blockindex"));
+
+	// Modifying a large file diffs it against the kept index, instead
+	// of asking the server for it.
+	int64_t fileSize;
+	TEST_THAT(FileExists("testfiles/TestDir1/x1/dsfdsfs98.fd", &fileSize));
+	TEST_THAT(fileSize > 1024);
+
+	char buffer[4000];
+	memset(buffer, 0, sizeof(buffer));
+	{
+		int fd = open("testfiles/TestDir1/x1/dsfdsfs98.fd", O_WRONLY);
+		TEST_THAT_OR(fd > 0, FAIL);
+		TEST_EQUAL_LINE(sizeof(buffer),
+			write(fd, buffer, sizeof(buffer)),
+			"Buffer write");
+		TEST_THAT(close(fd) == 0);
+		wait_for_operation(5, "modified file to be old enough");
+	}
+
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, connection.mNumBlockIndexQueries);
+	TEST_COMPARE(Compare_Same);
+
+	// The index of the new version replaced the old one, so modifying
+	// it again still needs nothing from the server.
+	{
+		int fd = open("testfiles/TestDir1/x1/dsfdsfs98.fd", O_WRONLY);
+		TEST_THAT_OR(fd > 0, FAIL);
+		TEST_THAT(lseek(fd, 1000, SEEK_SET) == 1000);
+		buffer[0] = 'x';
+		TEST_EQUAL_LINE(sizeof(buffer),
+			write(fd, buffer, sizeof(buffer)),
+			"Buffer write");
+		TEST_THAT(close(fd) == 0);
+		wait_for_operation(5, "modified file to be old enough");
+	}
+
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, connection.mNumBlockIndexQueries);
+	TEST_COMPARE(Compare_Same);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool check_scanned_directory(const std::string &rPath,
+	const BackupClientDirectoryScanner::Directory &rScanned)
+{
+	BackupClientDirectoryScanner::Directory expected;
+	BackupClientDirectoryScanner::Scan(rPath, expected);
+
+	TEST_EQUAL_OR(0, rScanned.mStatErrno, return false);
+	TEST_EQUAL_OR(0, rScanned.mOpenErrno, return false);
+	TEST_EQUAL(expected.mStat.st_ino, rScanned.mStat.st_ino);
+	TEST_EQUAL_OR(expected.mEntries.size(), rScanned.mEntries.size(),
+		return false);
+
+	for(size_t e = 0; e < expected.mEntries.size(); e++)
+	{
+		const BackupClientDirectoryScanner::Entry &rExpected(
+			expected.mEntries[e]);
+		const BackupClientDirectoryScanner::Entry &rActual(
+			rScanned.mEntries[e]);
+		TEST_EQUAL(rExpected.mName, rActual.mName);
+		TEST_EQUAL(rExpected.mStatErrno, rActual.mStatErrno);
+		TEST_EQUAL(rExpected.mStat.st_ino, rActual.mStat.st_ino);
+		TEST_EQUAL(rExpected.mStat.st_size, rActual.mStat.st_size);
+	}
+
+	return true;
+}
+
+bool test_directory_scan_threads()
+{
+	SETUP_WITH_BBSTORED();
+
+	// Directories scanned by the threads are the same as those scanned
+	// directly, whether they were taken in the order they were queued
+	// or not, and forgetting one doesn't stop the others being scanned.
+	{
+		BackupClientContext clientContext
+		(
+			bbackupd, // rLocationResolver
+			sTlsContext,
+			"localhost",
+			BOX_PORT_BBSTORED_TEST,
+			0x01234567,
+			false, // ExtendedLogging
+			false, // ExtendedLogFile
+			"", // extendedLogFile
+			bbackupd, // rProgressNotifier
+			false // TcpNice
+		);
+
+		BackupClientDirectoryScanner scanner(4);
+		std::vector<std::string> paths;
+		paths.push_back("testfiles/TestDir1/dir23");
+		paths.push_back("testfiles/TestDir1/x1");
+		paths.push_back("testfiles/TestDir1/x1/cxfxcv");
+		paths.push_back("testfiles/TestDir1/does-not-exist");
+		scanner.Queue(paths);
+
+		std::auto_ptr<BackupClientDirectoryScanner::Directory> apScanned(
+			scanner.Take(paths[2], clientContext, NULL));
+		TEST_THAT(check_scanned_directory(paths[2], *apScanned));
+
+		scanner.Forget(paths[1]);
+
+		apScanned = scanner.Take(paths[0], clientContext, NULL);
+		TEST_THAT(check_scanned_directory(paths[0], *apScanned));
+
+		apScanned = scanner.Take(paths[3], clientContext, NULL);
+		TEST_EQUAL(ENOENT, apScanned->mStatErrno);
+
+		// Never queued, so scanned by Take()
+		apScanned = scanner.Take("testfiles/TestDir1", clientContext,
+			NULL);
+		TEST_THAT(check_scanned_directory("testfiles/TestDir1",
+			*apScanned));
+	}
+
+	// Backing up with the directories read ahead gives the same result
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-scanthreads.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string line("DirectoryScanThreads = 4\n");
+		out.Write(line.c_str(), line.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-scanthreads.conf"), FAIL);
+
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	// And so does backing up changes
+	TEST_THAT(::unlink("testfiles/TestDir1/x1/dsfdsfs98.fd") == 0);
+	TEST_THAT(::mkdir("testfiles/TestDir1/dir23/newdir", 0755) == 0);
+	{
+		FileStream file("testfiles/TestDir1/dir23/newdir/newfile",
+			O_WRONLY | O_CREAT | O_EXCL);
+		file.Write("new", 3);
+	}
+	wait_for_operation(5, "new file to be old enough");
+
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_metadata_system_calls()
+{
+	SETUP_WITH_BBSTORED();
+
+	// The attributes from scanning a directory are the same as lstat()
+	// says, and getting them takes no more than a few system calls for
+	// the directory and two per entry, even reading them one at a time
+	{
+		BackupClientDirectoryScanner::Directory scanned;
+		BackupClientDirectoryScanner::Scan("testfiles/TestDir1",
+			scanned);
+		TEST_EQUAL_OR(0, scanned.mOpenErrno, FAIL);
+		TEST_THAT(scanned.mEntries.size() > 0);
+		TEST_THAT(scanned.mSystemCalls > (int64_t)scanned.mEntries.size());
+		TEST_THAT(scanned.mSystemCalls <=
+			(int64_t)scanned.mEntries.size() * 2 + 8);
+
+		for(size_t e = 0; e < scanned.mEntries.size(); e++)
+		{
+			const BackupClientDirectoryScanner::Entry &rEntry(
+				scanned.mEntries[e]);
+			EMU_STRUCT_STAT st;
+			TEST_THAT_OR(EMU_LSTAT(("testfiles/TestDir1/" +
+				rEntry.mName).c_str(), &st) == 0, continue);
+			TEST_EQUAL(0, rEntry.mStatErrno);
+			TEST_EQUAL(st.st_dev, rEntry.mStat.st_dev);
+			TEST_EQUAL(st.st_ino, rEntry.mStat.st_ino);
+			TEST_EQUAL(st.st_mode, rEntry.mStat.st_mode);
+			TEST_EQUAL(st.st_nlink, rEntry.mStat.st_nlink);
+			TEST_EQUAL(st.st_uid, rEntry.mStat.st_uid);
+			TEST_EQUAL(st.st_gid, rEntry.mStat.st_gid);
+			TEST_EQUAL(st.st_size, rEntry.mStat.st_size);
+			TEST_EQUAL(FileModificationTime(st),
+				FileModificationTime(rEntry.mStat));
+			TEST_EQUAL(FileAttrModificationTime(st),
+				FileAttrModificationTime(rEntry.mStat));
+		}
+	}
+
+	// Once the files are on the store, a backup which finds nothing
+	// changed doesn't read their extended attributes
+	bbackupd.RunSyncNow();
+	wait_for_operation(5, "files to be old enough");
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	{
+		Capture capture;
+		Logging::TempLoggerGuard guard(&capture);
+		bbackupd.RunSyncNow();
+
+		std::string stats;
+		std::vector<Capture::Message> messages = capture.GetMessages();
+		for(size_t i = 0; i < messages.size(); ++i)
+		{
+			if(StartsWith("Metadata statistics: ",
+				messages[i].message))
+			{
+				stats = messages[i].message;
+			}
+		}
+		TEST_THAT(StartsWith("Metadata statistics: ", stats));
+		TEST_THAT(stats.find(" system calls (") != std::string::npos);
+		TEST_THAT(!EndsWith(" skipped 0 times", stats));
+	}
+	TEST_COMPARE(Compare_Same);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_upload_connections()
+{
+	SETUP_WITH_BBSTORED();
+
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-uploadconnections.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string line("UploadConnections = 3\n");
+		out.Write(line.c_str(), line.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-uploadconnections.conf"), FAIL);
+
+	// Backing up new files on the helper connections gives the same
+	// result as backing them up on one connection
+	{
+		Capture capture;
+		Logging::TempLoggerGuard guard(&capture);
+		bbackupd.RunSyncNow();
+
+		bool opened = false;
+		std::vector<Capture::Message> messages = capture.GetMessages();
+		for(size_t i = 0; i < messages.size(); ++i)
+		{
+			if(messages[i].message ==
+				"Opened 2 upload helper connections")
+			{
+				opened = true;
+			}
+		}
+		TEST_THAT(opened);
+	}
+	TEST_COMPARE(Compare_Same);
+
+	// And so does backing up more new files, and changes to old ones,
+	// which are still uploaded on the main connection
+	TEST_THAT(::mkdir("testfiles/TestDir1/dir23/newdir", 0755) == 0);
+	for(int i = 0; i < 10; ++i)
+	{
+		std::ostringstream name;
+		name << "testfiles/TestDir1/dir23/newdir/newfile" << i;
+		FileStream file(name.str(), O_WRONLY | O_CREAT | O_EXCL);
+		std::string data(1000 * (i + 1), 'a' + i);
+		file.Write(data.c_str(), data.size());
+	}
+	{
+		FileStream file("testfiles/TestDir1/f1.dat", O_WRONLY | O_APPEND);
+		file.Write("changed", 7);
+	}
+	wait_for_operation(5, "new files to be old enough");
+
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	// Nothing staged was left behind on the store
+	{
+		DIR *dir = ::opendir("testfiles/0_0/backup/01234567");
+		TEST_THAT_OR(dir != NULL, FAIL);
+		struct dirent *en;
+		while((en = ::readdir(dir)) != NULL)
+		{
+			TEST_THAT(std::string(en->d_name).find(
+				STORE_STAGED_FILE_PREFIX) != 0);
+		}
+		::closedir(dir);
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_change_journal()
+{
+	SETUP_WITH_BBSTORED();
+
+	// The journal notices changes in the directories it watches, and
+	// only those
+	if(BackupClientChangeJournal::IsSupported())
+	{
+		BackupClientChangeJournal journal;
+		TEST_THAT_OR(journal.Start(), FAIL);
+		TEST_THAT(journal.Watch("testfiles/TestDir1/dir23"));
+		TEST_THAT(journal.Watch("testfiles/TestDir1/x1"));
+
+		journal.StartSync();
+		TEST_THAT(!journal.IsFullScan());
+		TEST_THAT(journal.IsUnchanged("testfiles/TestDir1/dir23"));
+		TEST_THAT(journal.IsUnchanged("testfiles/TestDir1/x1"));
+		TEST_THAT(!journal.IsUnchanged("testfiles/TestDir1"));
+
+		{
+			FileStream file("testfiles/TestDir1/dir23/journalled",
+				O_WRONLY | O_CREAT | O_EXCL);
+			file.Write("new", 3);
+		}
+
+		journal.StartSync();
+		TEST_THAT(!journal.IsUnchanged("testfiles/TestDir1/dir23"));
+		TEST_THAT(journal.IsUnchanged("testfiles/TestDir1/x1"));
+
+		// Nothing else happened since
+		journal.StartSync();
+		TEST_THAT(journal.IsUnchanged("testfiles/TestDir1/dir23"));
+		TEST_THAT(::unlink("testfiles/TestDir1/dir23/journalled") == 0);
+	}
+
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-changejournal.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string line("ChangeJournal = yes\n");
+		out.Write(line.c_str(), line.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-changejournal.conf"), FAIL);
+
+	// The first backup reads everything, and the next ones only the
+	// directories which changed, with the same result
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	wait_for_operation(5, "files to be old enough");
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	TEST_THAT(::unlink("testfiles/TestDir1/x1/dsfdsfs98.fd") == 0);
+	TEST_THAT(::mkdir("testfiles/TestDir1/dir23/newdir", 0755) == 0);
+	{
+		FileStream file("testfiles/TestDir1/dir23/newdir/newfile",
+			O_WRONLY | O_CREAT | O_EXCL);
+		file.Write("new", 3);
+	}
+	{
+		FileStream file("testfiles/TestDir1/f1.dat", O_WRONLY | O_APPEND);
+		file.Write("changed", 7);
+	}
+	wait_for_operation(5, "new file to be old enough");
+
+	{
+		Capture capture;
+		Logging::TempLoggerGuard guard(&capture);
+		bbackupd.RunSyncNow();
+
+		bool skippedUnchanged = false, skippedChanged = false;
+		std::vector<Capture::Message> messages = capture.GetMessages();
+		for(size_t i = 0; i < messages.size(); ++i)
+		{
+			if(messages[i].message == "Change journal: not reading "
+				"unchanged directory "
+				"'testfiles/TestDir1/x1/cxfxcv'")
+			{
+				skippedUnchanged = true;
+			}
+			else if(messages[i].message == "Change journal: not "
+				"reading unchanged directory "
+				"'testfiles/TestDir1/x1'")
+			{
+				skippedChanged = true;
+			}
+		}
+		TEST_THAT(skippedUnchanged);
+		TEST_THAT(!skippedChanged);
+	}
+	TEST_COMPARE(Compare_Same);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+// Returns how many changed directory records the last save wrote to the
+// changes file, or -1 if the whole file was written
+int64_t run_sync_and_count_saved_records(BackupDaemon& rBackupDaemon)
+{
+	Capture capture;
+	Logging::TempLoggerGuard guard(&capture);
+	rBackupDaemon.RunSyncNow();
+
+	int64_t saved = -1;
+	std::vector<Capture::Message> messages = capture.GetMessages();
+	for(size_t i = 0; i < messages.size(); ++i)
+	{
+		if(StartsWith("Saved ", messages[i].message) &&
+			messages[i].message.find(" changed directory records ")
+			!= std::string::npos)
+		{
+			saved = ::strtoll(messages[i].message.c_str() + 6,
+				NULL, 10);
+		}
+	}
+	return saved;
+}
+
+bool test_store_object_info_changes()
+{
+	SETUP_WITH_BBSTORED();
+
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-storeobjectinfo.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string line("StoreObjectInfoFile = "
+			"testfiles/bbackupd-data/bbackupd.state\n");
+		out.Write(line.c_str(), line.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-storeobjectinfo.conf"), FAIL);
+
+	// Enough directories for one of them to be a small part of the state
+	for(int i = 0; i < 20; i++)
+	{
+		std::ostringstream dir;
+		dir << "testfiles/TestDir1/state" << i;
+		TEST_THAT(::mkdir(dir.str().c_str(), 0755) == 0);
+	}
+
+	// The first backup writes the whole file, and starts the changes
+	// file which follows it
+	TEST_EQUAL(-1, run_sync_and_count_saved_records(bbackupd));
+	int64_t fileSize = 0, changesSize = 0;
+	TEST_THAT(FileExists("testfiles/bbackupd-data/bbackupd.state",
+		&fileSize));
+	TEST_THAT(FileExists("testfiles/bbackupd-data/bbackupd.state.changes",
+		&changesSize));
+	TEST_THAT(changesSize > 0);
+
+	// The next ones only add the directory records which changed
+	wait_for_operation(5, "files to be old enough");
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, run_sync_and_count_saved_records(bbackupd));
+
+	{
+		FileStream file("testfiles/TestDir1/x1/changed-state",
+			O_WRONLY | O_CREAT | O_EXCL);
+		file.Write("new", 3);
+	}
+	wait_for_operation(5, "new file to be old enough");
+	TEST_THAT(run_sync_and_count_saved_records(bbackupd) > 0);
+	TEST_COMPARE(Compare_Same);
+
+	int64_t newFileSize = 0, newChangesSize = 0;
+	TEST_THAT(FileExists("testfiles/bbackupd-data/bbackupd.state",
+		&newFileSize));
+	TEST_THAT(FileExists("testfiles/bbackupd-data/bbackupd.state.changes",
+		&newChangesSize));
+	TEST_EQUAL(fileSize, newFileSize);
+	TEST_THAT(newChangesSize > changesSize);
+
+	// The whole file with the changes applied is the same as the state
+	// which was saved, so nothing more changes in the next backup
+	{
+		BackupDaemon reloaded;
+		TEST_THAT_OR(configure_bbackupd(reloaded,
+			"testfiles/bbackupd-storeobjectinfo.conf"), FAIL);
+		TEST_THAT_OR(reloaded.LoadStoreObjectInfo(), FAIL);
+		TEST_EQUAL(0, run_sync_and_count_saved_records(reloaded));
+		TEST_COMPARE(Compare_Same);
+	}
+
+	// Once the changes file is too big compared to the whole file,
+	// the whole file is written again, and the changes file restarted
+	{
+		int64_t saved = 0;
+		for(int i = 0; i < 100 && saved != -1; i++)
+		{
+			saved = run_sync_and_count_saved_records(bbackupd);
+		}
+		TEST_EQUAL(-1, saved);
+		TEST_THAT(FileExists(
+			"testfiles/bbackupd-data/bbackupd.state.changes",
+			&newChangesSize));
+		TEST_EQUAL(changesSize, newChangesSize);
+	}
+
+	// A backup which doesn't finish leaves the state unusable
+	{
+		BackupDaemon interrupted;
+		TEST_THAT_OR(configure_bbackupd(interrupted,
+			"testfiles/bbackupd-storeobjectinfo.conf"), FAIL);
+		TEST_THAT_OR(interrupted.LoadStoreObjectInfo(), FAIL);
+		TEST_THAT(StopServer());
+		TEST_CHECK_THROWS(interrupted.RunSyncNow(), ServerException,
+			SocketOpenError);
+	}
+
+	{
+		BackupDaemon reloaded;
+		TEST_THAT_OR(configure_bbackupd(reloaded,
+			"testfiles/bbackupd-storeobjectinfo.conf"), FAIL);
+		TEST_THAT(!reloaded.LoadStoreObjectInfo());
+	}
+
 	TEARDOWN_TEST_BBACKUPD();
 }
 
@@ -4066,12 +4777,19 @@ int test(int argc, const char *argv[])
 			"testfiles/clientTrustedCAs.pem");
 
 	TEST_THAT(test_basics());
+	TEST_THAT(test_inode_map());
 	TEST_THAT(test_readdirectory_on_nonexistent_dir());
 	TEST_THAT(test_bbackupquery_parser_escape_slashes());
 	TEST_THAT(test_getobject_on_nonexistent_file());
 	// TEST_THAT(test_replace_zero_byte_file_with_nonzero_byte_file());
 	TEST_THAT(test_backup_disappearing_directory());
 	TEST_THAT(test_ssl_keepalives());
+	TEST_THAT(test_block_index_cache());
+	TEST_THAT(test_directory_scan_threads());
+	TEST_THAT(test_metadata_system_calls());
+	TEST_THAT(test_upload_connections());
+	TEST_THAT(test_change_journal());
+	TEST_THAT(test_store_object_info_changes());
 	TEST_THAT(test_backup_hardlinked_files());
 	TEST_THAT(test_backup_pauses_when_store_is_full());
 	TEST_THAT(test_bbackupd_exclusions());
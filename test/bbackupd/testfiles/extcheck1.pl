@@ -0,0 +1,61 @@
+#!/usr/bin/perl
+use strict;
+
+use File::Spec;
+
+my $flags = $ARGV[0] or "";
+my $bbackupquery = File::Spec->catfile('..', '..', 'bin', 'bbackupquery', 'bbackupquery');
+
+unless(open IN, "$bbackupquery -Wwarning " .
+	"-c testfiles/bbackupd.conf " .
+	"-l testfiles/query4.log " .
+	"\"compare -ac$flags\" quit 2>&1 |")
+{
+	print "FAIL: opening compare utility\n";
+	exit 2;
+}
+
+my $ret = 1;
+my $seen = 0;
+
+while(<IN>)
+{
+	next unless m/\S/;
+	print "READ: $_";
+
+	if (m/continousupdate/)
+	{
+		unless (/exists/)
+		{
+			print "FAIL: continousupdate line does not match\n";
+			$ret = 2;
+		}
+		$seen = 1;
+	}
+	elsif (m/^No entry for terminal type/ or
+		m/^using dumb terminal settings/)
+	{
+		# skip these lines, may happen in Debian buildd
+		# with no terminal.
+	}
+	else
+	{
+		unless (/\AWARNING/ or /\ADifferences/ or /might be reason/
+			or /probably due to file mod/)
+		{
+			print "FAIL: Summary line does not match\n";
+			$ret = 2;
+		}
+	}
+}
+
+close IN;
+
+unless ($seen)
+{
+	print "FAIL: missing line matching continousupdate\n";
+	$ret = 2;
+}
+
+exit $ret;
+
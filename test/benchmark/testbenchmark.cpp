@@ -0,0 +1,439 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    testbenchmark.cpp
+//		Purpose: Measure the speed of encoding, diffing, combining and
+//			 decoding files with typical patterns of change
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+	#include <sys/resource.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "Test.h"
+#include "BackupClientCryptoKeys.h"
+#include "BackupStoreFile.h"
+#include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreFilenameClear.h"
+#include "BoxTime.h"
+#include "CompressCodec.h"
+#include "FileStream.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+// Run with a small file by default, so that it doesn't slow down the test
+// suite. Pass the size in MB as the first argument for real measurements,
+// eg. "./t 512 cdc xxh3 zstd" in release/test/benchmark.
+#define DEFAULT_FILE_SIZE_MB	8
+
+#define PIECE_SIZE		(64*1024)
+#define COPY_BUFFER_SIZE	(64*1024)
+
+static std::string sOptions;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    write_random(IOStream &, int64_t, uint32_t &)
+//		Purpose: Write pseudo-random data, from a limited alphabet so
+//			 that it compresses about as well as typical files.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void write_random(IOStream &rOut, int64_t Length, uint32_t &rSeed)
+{
+	uint8_t buffer[COPY_BUFFER_SIZE];
+	while(Length > 0)
+	{
+		int size = (Length > (int64_t)sizeof(buffer))
+			? (int)sizeof(buffer) : (int)Length;
+		for(int i = 0; i < size; ++i)
+		{
+			// xorshift, which doesn't repeat within the size of
+			// any file likely to be tested
+			rSeed ^= rSeed << 13;
+			rSeed ^= rSeed >> 17;
+			rSeed ^= rSeed << 5;
+			buffer[i] = ' ' + ((rSeed >> 8) % 64);
+		}
+		rOut.Write(buffer, size);
+		Length -= size;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    copy_range(FileStream &, int64_t, int64_t, IOStream &)
+//		Purpose: Copy part of a file to another stream
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void copy_range(FileStream &rIn, int64_t Start, int64_t Length, IOStream &rOut)
+{
+	uint8_t buffer[COPY_BUFFER_SIZE];
+	rIn.Seek(Start, IOStream::SeekType_Absolute);
+	while(Length > 0)
+	{
+		int size = (Length > (int64_t)sizeof(buffer))
+			? (int)sizeof(buffer) : (int)Length;
+		TEST_THAT(rIn.ReadFullBuffer(buffer, size, 0));
+		rOut.Write(buffer, size);
+		Length -= size;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    make_changed_file(const std::string &, int64_t, const std::string &)
+//		Purpose: Write a changed version of the base file, with the
+//			 named pattern of changes.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void make_changed_file(const std::string &rPattern, int64_t BaseSize,
+	const std::string &rFilename)
+{
+	FileStream base("testfiles/base");
+	uint32_t seed = 7919;
+
+	{
+		FileStream out(rFilename, O_WRONLY | O_CREAT | O_TRUNC);
+
+		if(rPattern == "append")
+		{
+			// 1% new data at the end, like a log file
+			copy_range(base, 0, BaseSize, out);
+			write_random(out, BaseSize / 100 + 1, seed);
+		}
+		else if(rPattern == "insert")
+		{
+			// A few bytes and then a larger piece inserted, which
+			// moves everything after them off block boundaries
+			copy_range(base, 0, BaseSize / 3, out);
+			write_random(out, 7, seed);
+			copy_range(base, BaseSize / 3, BaseSize / 3, out);
+			write_random(out, PIECE_SIZE, seed);
+			copy_range(base, 2 * (BaseSize / 3),
+				BaseSize - 2 * (BaseSize / 3), out);
+		}
+		else if(rPattern == "scattered")
+		{
+			// Copied, and edited in place below
+			copy_range(base, 0, BaseSize, out);
+		}
+		else if(rPattern == "shuffle")
+		{
+			// The file cut into pieces, which are put back in a
+			// different order
+			int64_t pieces = (BaseSize + PIECE_SIZE - 1) / PIECE_SIZE;
+			std::vector<int64_t> order;
+			for(int64_t p = 0; p < pieces; ++p)
+			{
+				order.push_back(p);
+			}
+			for(int64_t p = pieces - 1; p > 0; --p)
+			{
+				seed = (seed * 1103515245) + 12345;
+				std::swap(order[p], order[(seed >> 8) % (p + 1)]);
+			}
+			for(int64_t p = 0; p < pieces; ++p)
+			{
+				int64_t start = order[p] * PIECE_SIZE;
+				int64_t length = BaseSize - start;
+				if(length > PIECE_SIZE) length = PIECE_SIZE;
+				copy_range(base, start, length, out);
+			}
+		}
+		else
+		{
+			TEST_FAIL_WITH_MESSAGE("Unknown pattern " << rPattern);
+		}
+	}
+
+	if(rPattern == "scattered")
+	{
+		// Small edits all over the file, like a database
+		FileStream out(rFilename, O_WRONLY);
+		for(int e = 0; e < 64; ++e)
+		{
+			seed = (seed * 1103515245) + 12345;
+			int64_t offset = (((int64_t)seed << 16) ^ (seed >> 4))
+				% (BaseSize - 4);
+			out.Seek(offset, IOStream::SeekType_Absolute);
+			write_random(out, 4, seed);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    count_blocks(const std::string &, int64_t &, int64_t &)
+//		Purpose: Count the new and reused blocks in an encoded file
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void count_blocks(const std::string &rFilename, int64_t &rNew, int64_t &rOld)
+{
+	FileStream enc(rFilename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
+	rNew = 0;
+	rOld = 0;
+	for(int64_t b = 0; b < nblocks; ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		if((int64_t)box_ntoh64(en.mEncodedSize) > 0)
+		{
+			rNew++;
+		}
+		else
+		{
+			rOld++;
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    peak_rss_kb()
+//		Purpose: The largest resident set size of the process so far,
+//			 in KB, or -1 if it isn't known.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+long peak_rss_kb()
+{
+#ifdef HAVE_SYS_RESOURCE_H
+	struct rusage usage;
+	if(::getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+	#ifdef __APPLE__
+		// reported in bytes
+		return usage.ru_maxrss / 1024;
+	#else
+		return usage.ru_maxrss;
+	#endif
+	}
+#endif
+	return -1;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    report(const std::string &, const char *, int64_t, box_time_t, int64_t, int64_t)
+//		Purpose: Print one measurement as a line of tab separated
+//			 name=value fields, which is easy to collect with
+//			 grep and split.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void report(const std::string &rPattern, const char *Operation,
+	int64_t Bytes, box_time_t Start, int64_t NewBlocks = -1,
+	int64_t OldBlocks = -1)
+{
+	box_time_t elapsed = GetCurrentBoxTime() - Start;
+	double seconds = (double)elapsed / MICRO_SEC_IN_SEC;
+	double mbPerSec = (elapsed > 0)
+		? ((double)Bytes / (1024.0 * 1024.0)) / seconds : 0;
+
+	printf("benchmark\tpattern=%s\toperation=%s\toptions=%s\t"
+		"bytes=%lld\tseconds=%.3f\tmb_per_sec=%.1f\t"
+		"blocks_new=%lld\tblocks_matched=%lld\tpeak_rss_kb=%ld\n",
+		rPattern.c_str(), Operation,
+		sOptions.empty() ? "none" : sOptions.c_str(),
+		(long long)Bytes, seconds, mbPerSec, (long long)NewBlocks,
+		(long long)OldBlocks, peak_rss_kb());
+	fflush(stdout);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    benchmark_pattern(const std::string &, int64_t)
+//		Purpose: Time diffing a changed file against the base file,
+//			 and the operations the server does with the diff.
+//		Created: 16/10/26
+//
+// --------------------------------------------------------------------------
+void benchmark_pattern(const std::string &rPattern, int64_t BaseSize)
+{
+	std::string changed("testfiles/" + rPattern);
+	std::string diffFile(changed + ".diff");
+	std::string encodedFile(changed + ".encoded");
+	std::string reverseFile(changed + ".revdiff");
+	std::string decodedFile(changed + ".decoded");
+
+	make_changed_file(rPattern, BaseSize, changed);
+	int64_t changedSize = 0;
+	TEST_THAT(FileExists(changed, &changedSize));
+
+	// Diff against the base file, as the client does
+	box_time_t start = GetCurrentBoxTime();
+	{
+		FileStream blockIndex("testfiles/base.encoded");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockIndex);
+		BackupStoreFilenameClear name(rPattern);
+		bool completelyDifferent = false;
+		std::auto_ptr<BackupStoreFileEncodeStream> encoded(
+			BackupStoreFile::EncodeFileDiff(changed, 1 /* dir ID */,
+				name, 1000 /* diffing from */, blockIndex,
+				IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0, &completelyDifferent));
+		FileStream out(diffFile, O_WRONLY | O_CREAT | O_TRUNC);
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+	int64_t newBlocks, oldBlocks;
+	count_blocks(diffFile, newBlocks, oldBlocks);
+	report(rPattern, "EncodeFileDiff", changedSize, start, newBlocks,
+		oldBlocks);
+
+	// Combine the diff with the base file, as the server does to
+	// make the new version complete
+	start = GetCurrentBoxTime();
+	{
+		FileStream diff(diffFile);
+		FileStream diff2(diffFile);
+		FileStream from("testfiles/base.encoded");
+		FileStream out(encodedFile, O_WRONLY | O_CREAT | O_TRUNC);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	report(rPattern, "CombineFile", changedSize, start);
+
+	// Make the base file into a diff from the new version
+	start = GetCurrentBoxTime();
+	{
+		FileStream diff(diffFile);
+		FileStream from("testfiles/base.encoded");
+		FileStream from2("testfiles/base.encoded");
+		FileStream out(reverseFile, O_WRONLY | O_CREAT | O_TRUNC);
+		BackupStoreFile::ReverseDiffFile(diff, from, from2, out,
+			1001 /* object ID of new version */);
+	}
+	report(rPattern, "ReverseDiffFile", BaseSize, start);
+
+	// Restore the new version
+	start = GetCurrentBoxTime();
+	{
+		FileStream enc(encodedFile);
+		BackupStoreFile::DecodeFile(enc, decodedFile.c_str(),
+			IOStream::TimeOutInfinite);
+	}
+	report(rPattern, "DecodeFile", changedSize, start);
+
+	// Only worth measuring if the results are right
+	{
+		FileStream original(changed);
+		FileStream decoded(decodedFile);
+		TEST_THAT(original.CompareWith(decoded));
+	}
+
+	// Leave room for the next pattern
+	TEST_EQUAL(0, ::unlink(changed.c_str()));
+	TEST_EQUAL(0, ::unlink(diffFile.c_str()));
+	TEST_EQUAL(0, ::unlink(encodedFile.c_str()));
+	TEST_EQUAL(0, ::unlink(reverseFile.c_str()));
+	TEST_EQUAL(0, ::unlink(decodedFile.c_str()));
+}
+
+int test(int argc, const char *argv[])
+{
+	int64_t sizeMB = DEFAULT_FILE_SIZE_MB;
+	if(argc >= 2)
+	{
+		sizeMB = ::strtoll(argv[1], NULL, 10);
+		TEST_THAT_OR(sizeMB > 0, return 1);
+	}
+
+	// Optional features to measure
+	for(int a = 2; a < argc; ++a)
+	{
+		std::string option(argv[a]);
+		if(option == "cdc")
+		{
+			BackupStoreFile::SetContentDefinedChunking(true);
+		}
+		else if(option == "xxh3")
+		{
+			BackupStoreFile::SetFastBlockChecksums(true);
+		}
+		else if(CompressCodec::GetTypeFromName(option) != -1)
+		{
+			BackupStoreFile::SetCompression(
+				CompressCodec::GetTypeFromName(option));
+		}
+		else
+		{
+			TEST_FAIL_WITH_MESSAGE("Unknown option " << option <<
+				", expected cdc, xxh3 or a compression type");
+			return 1;
+		}
+		sOptions += (sOptions.empty() ? "" : ",") + option;
+	}
+
+	// Setup the crypto
+	{
+		FileStream keys("testfiles/backup.keys", O_WRONLY | O_CREAT | O_TRUNC);
+		uint32_t seed = 237;
+		write_random(keys, 1024, seed);
+	}
+	BackupClientCryptoKeys_Setup("testfiles/backup.keys");
+
+	// The file which all the others are changed versions of
+	int64_t baseSize = sizeMB * 1024 * 1024;
+	{
+		FileStream base("testfiles/base", O_WRONLY | O_CREAT | O_TRUNC);
+		uint32_t seed = 20012;
+		write_random(base, baseSize, seed);
+	}
+
+	box_time_t start = GetCurrentBoxTime();
+	{
+		BackupStoreFilenameClear name("base");
+		std::auto_ptr<BackupStoreFileEncodeStream> encoded(
+			BackupStoreFile::EncodeFile("testfiles/base",
+				1 /* dir ID */, name));
+		FileStream out("testfiles/base.encoded",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		encoded->CopyStreamTo(out);
+	}
+	int64_t newBlocks, oldBlocks;
+	count_blocks("testfiles/base.encoded", newBlocks, oldBlocks);
+	report("base", "EncodeFile", baseSize, start, newBlocks, oldBlocks);
+
+	benchmark_pattern("append", baseSize);
+	benchmark_pattern("insert", baseSize);
+	benchmark_pattern("scattered", baseSize);
+	benchmark_pattern("shuffle", baseSize);
+
+	BackupStoreFile::SetContentDefinedChunking(false);
+	BackupStoreFile::SetFastBlockChecksums(false);
+
+	return 0;
+}
@@ -13,6 +13,10 @@
 #include <stdio.h>
 #include <time.h>
 
+#ifdef HAVE_SIGNAL_H
+	#include <signal.h>
+#endif
+
 #include "Test.h"
 #include "Configuration.h"
 #include "FdGetLine.h"
@@ -33,11 +37,21 @@
 #include "Logging.h"
 #include "ZeroStream.h"
 #include "PartialReadStream.h"
+#include "MemoryMappedFile.h"
+#include "ReadAheadStream.h"
 
 #include "MemLeakFindOn.h"
 
 using namespace BoxConvert;
 
+#ifdef SA_SIGINFO
+static volatile sig_atomic_t sOtherBusErrors = 0;
+static void OtherBusErrorHandler(int Signal, siginfo_t *pInfo, void *pContext)
+{
+	sOtherBusErrors++;
+}
+#endif
+
 void test_conversions()
 {
 	TEST_THAT((Convert<int32_t, const std::string &>(std::string("32"))) == 32);
@@ -854,6 +868,62 @@ int test(int argc, const char *argv[])
 			TEST_THAT(elist.IsExcluded(std::string("ExcludE")) == !CASE_SENSITIVE);
 		#endif
 
+		#ifdef HAVE_REGEX_SUPPORT
+		// The expressions are tested as one where they can be, with
+		// the same results as testing them one at a time
+		{
+			ExcludeList combined;
+			combined.AddRegexEntries(std::string("^/a/.*\\.tmp$"
+				"\x01" "cache" "\x01" "^(x|y)$"));
+			combined.AddRegexEntries(std::string("[(]open$" "\x01"
+				"[]a]z" "\x01" "[[:digit:]]{3}$"));
+			TEST_EQUAL(6, combined.SizeOfRegexList());
+			TEST_EQUAL(0, combined.SizeOfUncombinedRegexList());
+
+			TEST_THAT(combined.IsExcluded("/a/b.tmp"));
+			TEST_THAT(!combined.IsExcluded("/b/a/b.tmp"));
+			TEST_THAT(!combined.IsExcluded("/a/b.tmpx"));
+			TEST_THAT(combined.IsExcluded("/home/cache/f"));
+			TEST_THAT(combined.IsExcluded("x"));
+			TEST_THAT(!combined.IsExcluded("xy"));
+			TEST_THAT(combined.IsExcluded("(open"));
+			TEST_THAT(!combined.IsExcluded("(opened"));
+			TEST_THAT(combined.IsExcluded("]z"));
+			TEST_THAT(combined.IsExcluded("file123"));
+			TEST_THAT(!combined.IsExcluded("file12a"));
+
+			// Back references would refer to the wrong group
+			// in the combined expression, so this one isn't in it
+			combined.AddRegexEntries(std::string("^(ab)\\1$"));
+			TEST_EQUAL(1, combined.SizeOfUncombinedRegexList());
+			TEST_THAT(combined.IsExcluded("abab"));
+			TEST_THAT(!combined.IsExcluded("abac"));
+			TEST_THAT(combined.IsExcluded("x"));
+
+			// Exceptions still win, and serializing keeps the
+			// expressions separate and combines them again
+			ExcludeList *pAlwaysInclude = new ExcludeList;
+			pAlwaysInclude->AddRegexEntries(std::string("keep"));
+			combined.SetAlwaysIncludeList(pAlwaysInclude);
+			TEST_THAT(!combined.IsExcluded("/home/cache/keep"));
+
+			CollectInBufferStream buffer;
+			Archive archive(buffer, 0);
+			combined.Serialize(archive);
+			buffer.SetForReading();
+
+			ExcludeList restored;
+			Archive restoredArchive(buffer, 0);
+			restored.Deserialize(restoredArchive);
+			TEST_EQUAL(7, restored.SizeOfRegexList());
+			TEST_EQUAL(1, restored.SizeOfUncombinedRegexList());
+			TEST_THAT(restored.IsExcluded("/a/b.tmp"));
+			TEST_THAT(restored.IsExcluded("abab"));
+			TEST_THAT(!restored.IsExcluded("/home/cache/keep"));
+			TEST_THAT(!restored.IsExcluded("xy"));
+		}
+		#endif
+
 		#undef CASE_SENSITIVE
 
 		TestLogger logger(Log::WARNING);
@@ -878,6 +948,190 @@ int test(int argc, const char *argv[])
 
 	test_conversions();
 
+	// Test memory mapped files, with a small window so that it moves
+	{
+		const int windowSize = 64*1024;
+		const int fileSize = (windowSize * 3) + 100;
+		char data[fileSize];
+		for(int i = 0; i < fileSize; ++i)
+		{
+			data[i] = (char)(i * 7);
+		}
+		{
+			FileStream out("testfiles/mapped", O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, fileSize);
+		}
+
+#ifdef SA_SIGINFO
+		// Installed before anything is mapped, so the handler for
+		// mapped files should pass on anything else to this one
+		struct sigaction otherAction, defaultAction;
+		otherAction.sa_sigaction = OtherBusErrorHandler;
+		otherAction.sa_flags = SA_SIGINFO;
+		sigemptyset(&otherAction.sa_mask);
+		TEST_THAT(::sigaction(SIGBUS, &otherAction, &defaultAction) == 0);
+#endif
+
+		FileStream file("testfiles/mapped");
+		MemoryMappedFile mapping(file, windowSize);
+		TEST_EQUAL(MemoryMappedFile::IsSupported(), mapping.IsMapped());
+
+		if(mapping.IsMapped())
+		{
+			TEST_EQUAL(fileSize, mapping.GetFileSize());
+			const uint8_t *p = mapping.GetData(0, 100);
+			TEST_THAT(p != 0 && memcmp(p, data, 100) == 0);
+			// straddling the end of the first window
+			p = mapping.GetData(windowSize - 10, 20);
+			TEST_THAT(p != 0 && memcmp(p, data + windowSize - 10, 20) == 0);
+			// bigger than a window
+			p = mapping.GetData(1, windowSize * 2);
+			TEST_THAT(p != 0 && memcmp(p, data + 1, windowSize * 2) == 0);
+			p = mapping.GetData(fileSize - 10, 10);
+			TEST_THAT(p != 0 && memcmp(p, data + fileSize - 10, 10) == 0);
+			TEST_CHECK_THROWS(mapping.GetData(fileSize - 10, 11),
+				CommonException, Internal);
+
+			// A change to the file is noticed when the window
+			// moves, and stops it being mapped
+			{
+				FileStream out("testfiles/mapped", O_WRONLY | O_APPEND);
+				out.Write("x", 1);
+			}
+			TEST_THAT(mapping.GetData(0, 10) == 0);
+			TEST_THAT(!mapping.IsMapped());
+			TEST_THAT(mapping.GetData(0, 10) == 0);
+			TEST_THAT(!mapping.HasFaulted());
+		}
+
+#ifdef SA_SIGINFO
+		// Bus errors which aren't in mapped files go to the handler
+		// which was there before, every time
+		TEST_THAT(::raise(SIGBUS) == 0);
+		TEST_THAT(::raise(SIGBUS) == 0);
+		TEST_EQUAL(2, (int)sOtherBusErrors);
+#endif
+
+		// Truncating the file under a mapped window doesn't kill us,
+		// but the part which has gone reads as zeros, and the mapping
+		// says so
+		if(MemoryMappedFile::IsSupported())
+		{
+			{
+				FileStream out("testfiles/mapped",
+					O_WRONLY | O_CREAT | O_TRUNC);
+				out.Write(data, fileSize);
+			}
+			FileStream truncated("testfiles/mapped");
+			MemoryMappedFile truncatedMapping(truncated, windowSize * 4);
+			const uint8_t *p = truncatedMapping.GetData(0, fileSize);
+			TEST_THAT_OR(p != 0, FAIL);
+			TEST_THAT(!truncatedMapping.HasFaulted());
+
+			TEST_THAT(::truncate("testfiles/mapped", 100) == 0);
+			TEST_THAT(memcmp(p, data, 100) == 0);
+			TEST_EQUAL(0, (int)p[fileSize - 1]);
+			TEST_THAT(truncatedMapping.HasFaulted());
+			TEST_THAT(!truncatedMapping.IsMapped());
+			TEST_THAT(truncatedMapping.GetData(0, 10) == 0);
+		}
+
+#ifdef SA_SIGINFO
+		TEST_EQUAL(2, (int)sOtherBusErrors);
+		TEST_THAT(::sigaction(SIGBUS, &defaultAction, 0) == 0);
+#endif
+
+		// Mapping can be turned off
+		MemoryMappedFile::SetEnabled(false);
+		{
+			MemoryMappedFile notMapped(file);
+			TEST_THAT(!notMapped.IsMapped());
+		}
+		MemoryMappedFile::SetEnabled(true);
+
+		// Empty files aren't mapped
+		{
+			FileStream out("testfiles/mapped", O_WRONLY | O_CREAT | O_TRUNC);
+		}
+		FileStream empty("testfiles/mapped");
+		MemoryMappedFile emptyMapping(empty);
+		TEST_THAT(!emptyMapping.IsMapped());
+	}
+
+	// Test reading ahead, with small buffers so that they're reused
+	{
+		const int bufferSize = 1000;
+		const int fileSize = (bufferSize * 10) + 123;
+		char data[fileSize];
+		for(int i = 0; i < fileSize; ++i)
+		{
+			data[i] = (char)(i * 13);
+		}
+		{
+			FileStream out("testfiles/readahead", O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, fileSize);
+		}
+
+		FileStream file("testfiles/readahead");
+		char buf[fileSize];
+		{
+			ReadAheadStream ahead(file, bufferSize, 3);
+			TEST_EQUAL(fileSize, ahead.BytesLeftToRead());
+
+			// in pieces which straddle the buffers
+			int got = 0;
+			while(got < 2500)
+			{
+				int bytes = ahead.Read(buf + got, 700);
+				TEST_THAT(bytes > 0);
+				got += bytes;
+			}
+			TEST_EQUAL(got, ahead.GetPosition());
+			TEST_EQUAL(fileSize - got, ahead.BytesLeftToRead());
+			TEST_THAT(memcmp(buf, data, got) == 0);
+
+			// skip forwards a little, then backwards
+			ahead.Seek(10, IOStream::SeekType_Relative);
+			TEST_THAT(ahead.ReadFullBuffer(buf, 100, 0));
+			TEST_THAT(memcmp(buf, data + got + 10, 100) == 0);
+			ahead.Seek(5, IOStream::SeekType_Absolute);
+			TEST_EQUAL(5, ahead.GetPosition());
+			TEST_THAT(ahead.ReadFullBuffer(buf, 100, 0));
+			TEST_THAT(memcmp(buf, data + 5, 100) == 0);
+
+			// and forwards past everything read ahead
+			ahead.Seek(bufferSize * 8, IOStream::SeekType_Absolute);
+			TEST_EQUAL(bufferSize * 8, ahead.GetPosition());
+			int bytes = 0;
+			TEST_THAT(!ahead.ReadFullBuffer(buf, fileSize, &bytes));
+			TEST_EQUAL(fileSize - (bufferSize * 8), bytes);
+			TEST_THAT(memcmp(buf, data + (bufferSize * 8), bytes) == 0);
+			TEST_THAT(!ahead.StreamDataLeft());
+			TEST_EQUAL(0, ahead.Read(buf, 1));
+			TEST_EQUAL(0, ahead.BytesLeftToRead());
+
+			TEST_CHECK_THROWS(ahead.Write("x", 1), CommonException,
+				NotSupported);
+			ahead.Seek(100, IOStream::SeekType_Absolute);
+		}
+
+		// The file is left where the reader of the stream left off
+		TEST_EQUAL(100, file.GetPosition());
+
+		// A file which is exactly a whole number of buffers
+		{
+			FileStream out("testfiles/readahead", O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, bufferSize * 4);
+		}
+		FileStream whole("testfiles/readahead");
+		ReadAheadStream ahead(whole, bufferSize, 2);
+		int bytes = 0;
+		TEST_THAT(!ahead.ReadFullBuffer(buf, fileSize, &bytes));
+		TEST_EQUAL(bufferSize * 4, bytes);
+		TEST_THAT(memcmp(buf, data, bytes) == 0);
+		TEST_THAT(!ahead.StreamDataLeft());
+	}
+
 	// test that we can use Archive and CollectInBufferStream
 	// to read and write arbitrary types to a memory buffer
 
@@ -14,6 +14,7 @@
 
 #include "Test.h"
 #include "Compress.h"
+#include "CompressCodec.h"
 #include "CompressStream.h"
 #include "CollectInBufferStream.h"
 
@@ -167,6 +168,138 @@ int test_stream()
 	return 0;
 }
 
+// Compress all of the input in one go, as BackupStoreFile does
+int compress_all(Compress<true> &rCompress, const char *pData, int Size,
+	char *pOutput, int OutputSize)
+{
+	rCompress.Input(pData, Size);
+	rCompress.FinishInput();
+	int outputSize = 0;
+	while(!rCompress.OutputHasFinished())
+	{
+		TEST_THAT(outputSize < OutputSize);
+		outputSize += rCompress.Output(pOutput + outputSize,
+			OutputSize - outputSize);
+	}
+	return outputSize;
+}
+
+// Test that contexts give the same results after being reset
+int test_reset(const char *pData)
+{
+	int maxOutput = Compress_MaxSizeForCompressedData(DATA_SIZE);
+	char *expected = (char *)malloc(maxOutput);
+	char *compressed = (char *)malloc(maxOutput);
+	char *decompressed = (char *)malloc(DATA_SIZE * 2);
+
+	int expectedSize = 0;
+	{
+		Compress<true> compress;
+		expectedSize = compress_all(compress, pData, DATA_SIZE,
+			expected, maxOutput);
+	}
+
+	Compress<true> compress;
+
+	// Leave the first run unfinished
+	compress.Input(pData + 100, DATA_SIZE - 100);
+	compress.Output(compressed, 64);
+
+	for(int l = 0; l < 3; ++l)
+	{
+		compress.Reset();
+		TEST_THAT(!compress.OutputHasFinished());
+		int compressedSize = compress_all(compress, pData, DATA_SIZE,
+			compressed, maxOutput);
+		TEST_EQUAL(expectedSize, compressedSize);
+		TEST_THAT(::memcmp(expected, compressed, expectedSize) == 0);
+	}
+
+	Compress<false> decompress;
+
+	// Leave the first run unfinished here too
+	decompress.Input(expected + 200, expectedSize - 200);
+	try
+	{
+		decompress.Output(decompressed, DATA_SIZE * 2);
+	}
+	catch(CompressException &e)
+	{
+		// the data doesn't start with a header, so it's rejected
+	}
+
+	for(int l = 0; l < 3; ++l)
+	{
+		decompress.Reset();
+		decompress.Input(expected, expectedSize);
+		decompress.FinishInput();
+		int decompressedSize = 0;
+		while(!decompress.OutputHasFinished())
+		{
+			TEST_THAT(decompressedSize < DATA_SIZE * 2);
+			decompressedSize += decompress.Output(
+				decompressed + decompressedSize,
+				(DATA_SIZE * 2) - decompressedSize);
+		}
+		TEST_EQUAL(DATA_SIZE, decompressedSize);
+		TEST_THAT(::memcmp(pData, decompressed, DATA_SIZE) == 0);
+	}
+
+	::free(expected);
+	::free(compressed);
+	::free(decompressed);
+
+	return 0;
+}
+
+// Test whole buffer compression with each type of codec
+int test_codecs(const char *pData)
+{
+	char *decompressed = (char *)malloc(DATA_SIZE);
+
+	for(int type = 0; type < CompressCodec::NumberOfTypes; ++type)
+	{
+		std::string name(CompressCodec::GetName(type));
+		TEST_EQUAL(type, CompressCodec::GetTypeFromName(name));
+		if(!CompressCodec::IsSupported(type))
+		{
+			TEST_CHECK_THROWS(CompressCodec::Create(type),
+				CompressException, CodecNotSupported);
+			continue;
+		}
+
+		std::auto_ptr<CompressCodec> codec(CompressCodec::Create(type));
+		TEST_EQUAL(type, codec->GetType());
+		int maxOutput = codec->MaxCompressedSize(DATA_SIZE);
+		TEST_THAT(maxOutput >= DATA_SIZE);
+		char *compressed = (char *)malloc(maxOutput);
+
+		// Use each codec twice, to check that it can be reused
+		for(int l = 0; l < 2; ++l)
+		{
+			int compressedSize = codec->Compress(pData, DATA_SIZE,
+				compressed, maxOutput);
+			TEST_THAT(compressedSize < DATA_SIZE);
+			int decompressedSize = codec->Decompress(compressed,
+				compressedSize, decompressed, DATA_SIZE);
+			TEST_EQUAL(DATA_SIZE, decompressedSize);
+			TEST_THAT(::memcmp(pData, decompressed, DATA_SIZE) == 0);
+
+			// Not enough space for the output
+			TEST_CHECK_THROWS(codec->Decompress(compressed,
+				compressedSize, decompressed, DATA_SIZE / 2),
+				CompressException, TransformFailed);
+		}
+
+		::free(compressed);
+	}
+
+	TEST_EQUAL(-1, CompressCodec::GetTypeFromName("gzip"));
+
+	::free(decompressed);
+	return 0;
+}
+
 // Test basic interface
 int test(int argc, const char *argv[])
 {
@@ -254,6 +387,9 @@ int test(int argc, const char *argv[])
 	TEST_THAT(decomp_size == DATA_SIZE);
 	TEST_THAT(::memcmp(data, decompressed, DATA_SIZE) == 0);
 
+	test_reset(data);
+	test_codecs(data);
+
 	::free(data);
 	::free(compressed);
 	::free(decompressed);
@@ -10,8 +10,15 @@
 #include "Box.h"
 
 #include <string.h>
+#include <vector>
 #include <openssl/rand.h>
 
+#ifndef WIN32
+	#include <unistd.h>
+	#include <sys/wait.h>
+#endif
+
+#include "BoxTime.h"
 #include "CipherContext.h"
 #include "CipherBlowfish.h"
 #include "CipherAES.h"
@@ -21,6 +28,7 @@
 #include "RollingChecksum.h"
 #include "Random.h"
 #include "Test.h"
+#include "XXH3Digest.h"
 
 #include "MemLeakFindOn.h"
 
@@ -50,6 +58,150 @@ void check_random_int(uint32_t max)
 	}
 }
 
+// Check that random data handed out from the pool doesn't repeat, in this
+// process or in a child process which inherits the pool
+void check_random_pool()
+{
+	uint8_t a[16], b[16];
+	Random::Generate(a, sizeof(a));
+	for(int c = 0; c < 1024; ++c)
+	{
+		Random::Generate(b, sizeof(b));
+		TEST_THAT(memcmp(a, b, sizeof(a)) != 0);
+	}
+
+	// Longer than the pool hands out
+	std::vector<uint8_t> large1(8192), large2(8192);
+	Random::Generate(&large1[0], large1.size());
+	Random::Generate(&large2[0], large2.size());
+	TEST_THAT(large1 != large2);
+
+#ifndef WIN32
+	int fds[2];
+	TEST_THAT_OR(::pipe(fds) == 0, return);
+	pid_t pid = ::fork();
+	if(pid == 0)
+	{
+		Random::Generate(a, sizeof(a));
+		_exit((::write(fds[1], a, sizeof(a)) == sizeof(a)) ? 0 : 1);
+	}
+	TEST_THAT_OR(pid > 0, return);
+	Random::Generate(a, sizeof(a));
+	TEST_THAT(::read(fds[0], b, sizeof(b)) == sizeof(b));
+	TEST_THAT(memcmp(a, b, sizeof(a)) != 0);
+	int status = 0;
+	TEST_THAT(::waitpid(pid, &status, 0) == pid);
+	::close(fds[0]);
+	::close(fds[1]);
+#endif
+}
+
+// Check the vector rolling checksum code gives the same answers as the
+// scalar code, for lots of lengths and alignments
+void check_rolling_checksum_implementations(const uint8_t *pData, int DataSize)
+{
+	static const unsigned int lengths[] = {1, 7, 15, 16, 17, 31, 32, 33, 63,
+		100, 128, 1000, 4096, 4097, 65535, 65536, 65537, 0};
+	std::vector<uint16_t> hashesScalar(DataSize);
+	std::vector<uint16_t> hashesVector(DataSize);
+	std::vector<uint32_t> checksumsScalar(DataSize);
+	std::vector<uint32_t> checksumsVector(DataSize);
+
+	for(int l = 0; lengths[l] != 0; ++l)
+	{
+		unsigned int length = lengths[l];
+		for(unsigned int align = 0; align < 16; align += 3)
+		{
+			const uint8_t *p = pData + align;
+			unsigned int count = DataSize - align - length;
+			if(count > 300) count = 300;
+
+			RollingChecksum::SetUseVectorInstructions(false);
+			RollingChecksum scalar(p, length);
+			RollingChecksum scalarSeveral(scalar);
+			scalarSeveral.RollForwardSeveral(p, p + length, length, count);
+			scalar.GetHashingComponents(p, p + length, length, count, &hashesScalar[0]);
+			scalar.GetChecksums(p, p + length, length, count, &checksumsScalar[0]);
+
+			RollingChecksum::SetUseVectorInstructions(true);
+			RollingChecksum vector(p, length);
+			RollingChecksum vectorSeveral(vector);
+			vectorSeveral.RollForwardSeveral(p, p + length, length, count);
+			vector.GetHashingComponents(p, p + length, length, count, &hashesVector[0]);
+			vector.GetChecksums(p, p + length, length, count, &checksumsVector[0]);
+
+			TEST_EQUAL(scalar.GetChecksum(), vector.GetChecksum());
+			TEST_EQUAL(scalarSeveral.GetChecksum(), vectorSeveral.GetChecksum());
+			TEST_THAT(memcmp(&hashesScalar[0], &hashesVector[0], count * sizeof(uint16_t)) == 0);
+			TEST_THAT(memcmp(&checksumsScalar[0], &checksumsVector[0], count * sizeof(uint32_t)) == 0);
+
+			// And against rolling one byte at a time
+			RollingChecksum roll(p, length);
+			for(unsigned int c = 0; c < count; ++c)
+			{
+				TEST_EQUAL(roll.GetComponentForHashing(), hashesVector[c]);
+				TEST_EQUAL(roll.GetChecksum(), checksumsVector[c]);
+				roll.RollForward(p[c], p[c + length], length);
+			}
+			TEST_EQUAL(roll.GetChecksum(), vectorSeveral.GetChecksum());
+		}
+	}
+}
+
+// Print the speed of the scalar and vector rolling checksum code
+void benchmark_rolling_checksum(const uint8_t *pData, int DataSize)
+{
+	const int blockSize = 4096;
+	const int hashesPerCall = 256;
+	std::vector<uint16_t> hashes(hashesPerCall);
+
+	for(int v = 0; v < 2; ++v)
+	{
+		RollingChecksum::SetUseVectorInstructions(v != 0);
+
+		box_time_t start = GetCurrentBoxTime();
+		uint32_t total = 0;
+		int64_t bytes = 0;
+		for(int r = 0; r < 16; ++r)
+		{
+			for(int o = 0; o + blockSize <= DataSize; o += blockSize)
+			{
+				RollingChecksum c(pData + o, blockSize);
+				total += c.GetChecksum();
+			}
+			bytes += DataSize;
+		}
+		box_time_t checksumTime = GetCurrentBoxTime() - start;
+
+		start = GetCurrentBoxTime();
+		int64_t positions = 0;
+		RollingChecksum roll(pData, blockSize);
+		for(int r = 0; r < 16; ++r)
+		{
+			for(int o = 0; o + blockSize + hashesPerCall <= DataSize; o += hashesPerCall)
+			{
+				roll.GetHashingComponents(pData + o, pData + o + blockSize, blockSize,
+					hashesPerCall, &hashes[0]);
+				roll.RollForwardSeveral(pData + o, pData + o + blockSize, blockSize,
+					hashesPerCall);
+				total += hashes[hashesPerCall - 1];
+				positions += hashesPerCall;
+			}
+			roll = RollingChecksum(pData, blockSize);
+		}
+		box_time_t rollTime = GetCurrentBoxTime() - start;
+
+		::printf("Rolling checksum (%s): %.0f MB/s checksums, "
+			"%.0f M positions/s rolling (%08x)\n",
+			RollingChecksum::GetImplementationName(),
+			(double)bytes / (checksumTime ? checksumTime : 1),
+			(double)positions / (rollTime ? rollTime : 1),
+			total);
+	}
+
+	RollingChecksum::SetUseVectorInstructions(true);
+}
+
 #define ZERO_BUFFER(x) ::memset(x, 0, sizeof(x));
 
 template<typename CipherType, int BLOCKSIZE>
@@ -155,6 +307,38 @@ void test_cipher()
 		buf3_de_used = decrypt2.TransformBlock(buf3_de, sizeof(buf3_de), buf3, buf3_used);
 		TEST_THAT(buf3_de_used == sizeof(STRING2));
 		TEST_THAT(memcmp(STRING2, buf3_de, sizeof(STRING2)) != 0);		
+
+		// Beginning with a new IV gives the same as setting it first
+		encrypt2.SetIV(iv2);
+		encrypt2.Begin();
+		char buf5[256];
+		int buf5_used = encrypt2.Transform(buf5, sizeof(buf5), STRING2, sizeof(STRING2));
+		buf5_used += encrypt2.Final(buf5 + buf5_used, sizeof(buf5) - buf5_used);
+		TEST_THAT(buf5_used == (int)buf3_used);
+		TEST_THAT(memcmp(buf3, buf5, buf3_used) == 0);
+
+		// Even if the last transformation wasn't finished
+		encrypt2.Begin(iv3);
+		encrypt2.Transform(buf5, sizeof(buf5), STRING1, sizeof(STRING1));
+		encrypt2.Begin(iv2);
+		buf5_used = encrypt2.Transform(buf5, sizeof(buf5), STRING2, sizeof(STRING2));
+		buf5_used += encrypt2.Final(buf5 + buf5_used, sizeof(buf5) - buf5_used);
+		TEST_THAT(buf5_used == (int)buf3_used);
+		TEST_THAT(memcmp(buf3, buf5, buf3_used) == 0);
+
+		// And with a random IV, which decrypts with the IV returned
+		int ivLen4 = 0;
+		const void *ivGen4 = encrypt2.BeginWithRandomIV(ivLen4);
+		TEST_THAT(ivLen4 == BLOCKSIZE);
+		TEST_THAT(memcmp(ivGen4, iv2, BLOCKSIZE) != 0);
+		TEST_THAT(memcmp(ivGen4, iv3, BLOCKSIZE) != 0);
+		buf5_used = encrypt2.Transform(buf5, sizeof(buf5), STRING2, sizeof(STRING2));
+		buf5_used += encrypt2.Final(buf5 + buf5_used, sizeof(buf5) - buf5_used);
+		decrypt2.Begin(ivGen4);
+		int buf5_de_used = decrypt2.Transform(buf3_de, sizeof(buf3_de), buf5, buf5_used);
+		buf5_de_used += decrypt2.Final(buf3_de + buf5_de_used, sizeof(buf3_de) - buf5_de_used);
+		TEST_THAT(buf5_de_used == sizeof(STRING2));
+		TEST_THAT(memcmp(STRING2, buf3_de, sizeof(STRING2)) == 0);
 	}
 	
 	// Test with padding off.
@@ -369,14 +553,59 @@ int test(int argc, const char *argv[])
 			++checkdata;
 		}
 	}
+
+	// Vector implementations
+	checkdata = checkdata_blk;
+	check_rolling_checksum_implementations(checkdata, CHECKSUM_DATA_SIZE);
+	benchmark_rolling_checksum(checkdata, CHECKSUM_DATA_SIZE);
 	::free(checkdata_blk);
 
+	// XXH3 digests, against values from the reference implementation
+	{
+		XXH3Digest empty;
+		empty.Finish();
+		TEST_EQUAL("99aa06d3014798d86001c324468d497f",
+			empty.DigestAsString());
+
+		XXH3Digest hello;
+		hello.Add(std::string("Hello, "));
+		hello.Add("world!", 6);
+		hello.Finish();
+		TEST_EQUAL("ade2b2886b80787bbb5ca743b534f2fa",
+			hello.DigestAsString());
+
+		// Long enough to use the accumulator loop, added in pieces
+		// which don't line up with its stripes
+		const int size = 100000;
+		uint8_t *data = (uint8_t *)malloc(size);
+		for(int i = 0; i < size; ++i)
+		{
+			data[i] = (i * 7) + 3;
+		}
+		XXH3Digest pieces;
+		for(int i = 0; i < size; i += 4097)
+		{
+			pieces.Add(data + i, (size - i < 4097)?(size - i):4097);
+		}
+		pieces.Finish();
+		TEST_EQUAL("d9e155dd16e141d00c056f6fcc340974",
+			pieces.DigestAsString());
+
+		uint8_t oneShot[XXH3Digest::DigestLength];
+		XXH3Digest::Digest(data, size, oneShot);
+		TEST_THAT(pieces.DigestMatches(oneShot));
+		oneShot[0] ^= 1;
+		TEST_THAT(!pieces.DigestMatches(oneShot));
+		free(data);
+	}
+
 	// Random integers
 	check_random_int(0);
 	check_random_int(1);
 	check_random_int(5);
 	check_random_int(15);	// all 1's
 	check_random_int(1022);
+	check_random_pool();
 
 	return 0;
 }